@@ -240,7 +240,7 @@ def printUsage():
     print()
     print('Options:')
     print('  <sourceFolderPath> The path to the folder containing the model files')
-    print('  <weightsFloatType> The float type of the weights (e.g. "q40")')
+    print('  <weightsFloatType> The float type of the weights (e.g. "q40", "q4k", "q6k")')
     print('  <name>             The name of the model (e.g. "llama3")')
 
 if __name__ == '__main__':
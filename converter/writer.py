@@ -8,12 +8,16 @@ class FloatType:
     F16 = 1
     Q40 = 2
     Q80 = 3
+    Q4K = 4
+    Q6K = 5
 
 floatTypeMap = {
     'f32': FloatType.F32,
     'f16': FloatType.F16,
     'q40': FloatType.Q40,
     'q80': FloatType.Q80,
+    'q4k': FloatType.Q4K,
+    'q6k': FloatType.Q6K,
 }
 floatTypeNames = list(floatTypeMap.keys())
 
@@ -73,6 +77,86 @@ def writeQuantizedQ80Tensor(file, x):
         nBytes += len(buffer)
     return nBytes
 
+def nearestInt(x):
+    # Rounds half away from zero like lroundf in the C++ quantizers
+    return (np.sign(x) * np.floor(np.abs(x) + 0.5)).astype(np.int32)
+
+def safeDivide(a, b):
+    return np.divide(a, b, out=np.zeros(np.broadcast(a, b).shape, dtype=np.float32), where=b != 0)
+
+def writeQuantizedQ4KTensor(file, x):
+    # Layout of NnBlockQ4K, see quantizeF32toQ4K in src/nn/nn-quants.cpp
+    x = x.to(torch.float32).numpy().astype(np.float32)
+    blockSize = 256
+    assert(x.shape[0] % blockSize == 0)
+    groups = x.reshape(-1, 8, 32)
+    gmin = np.minimum(np.min(groups, axis=2), 0)
+    gmax = np.maximum(np.max(groups, axis=2), 0)
+    scales = (gmax - gmin) / np.float32(15)
+    mins = -gmin
+    d16 = (np.max(scales, axis=1) / np.float32(63)).astype(np.float16)
+    dmin16 = (np.max(mins, axis=1) / np.float32(63)).astype(np.float16)
+    d = d16.astype(np.float32)[:, np.newaxis]
+    dmin = dmin16.astype(np.float32)[:, np.newaxis]
+    ls = np.minimum(63, nearestInt(safeDivide(scales, d)))
+    lm = np.minimum(63, nearestInt(safeDivide(mins, dmin)))
+
+    packedScales = np.zeros((groups.shape[0], 12), dtype=np.int32)
+    packedScales[:, 0:4] = ls[:, 0:4] | ((ls[:, 4:8] >> 4) << 6)
+    packedScales[:, 4:8] = lm[:, 0:4] | ((lm[:, 4:8] >> 4) << 6)
+    packedScales[:, 8:12] = (ls[:, 4:8] & 0xF) | ((lm[:, 4:8] & 0xF) << 4)
+
+    ids = safeDivide(np.float32(1), (d * ls).astype(np.float32))
+    offsets = (dmin * lm).astype(np.float32)
+    q = nearestInt((groups + offsets[:, :, np.newaxis]) * ids[:, :, np.newaxis])
+    q = np.clip(q, 0, 15).reshape(-1, 4, 2, 32)
+    qs = (q[:, :, 0, :] | (q[:, :, 1, :] << 4)).reshape(-1, 128)
+
+    blocks = np.concatenate([
+        d16.astype('<f2').view(np.uint8).reshape(-1, 2),
+        dmin16.astype('<f2').view(np.uint8).reshape(-1, 2),
+        packedScales.astype(np.uint8),
+        qs.astype(np.uint8),
+    ], axis=1)
+    buffer = blocks.tobytes()
+    file.write(buffer)
+    return len(buffer)
+
+def writeQuantizedQ6KTensor(file, x):
+    # Layout of NnBlockQ6K, see quantizeF32toQ6K in src/nn/nn-quants.cpp
+    x = x.to(torch.float32).numpy().astype(np.float32)
+    blockSize = 256
+    assert(x.shape[0] % blockSize == 0)
+    groups = x.reshape(-1, 16, 16)
+    maxIndexes = np.argmax(np.abs(groups), axis=2)
+    gmax = np.take_along_axis(groups, maxIndexes[:, :, np.newaxis], axis=2)[:, :, 0]
+    scales = gmax / np.float32(-32)
+    maxScaleIndexes = np.argmax(np.abs(scales), axis=1)
+    maxScales = np.take_along_axis(scales, maxScaleIndexes[:, np.newaxis], axis=1)[:, 0]
+    d16 = (maxScales / np.float32(-128)).astype(np.float16)
+    d = d16.astype(np.float32)[:, np.newaxis]
+    ls = np.clip(nearestInt(safeDivide(scales, d)), -128, 127)
+
+    ids = safeDivide(np.float32(1), (d * ls).astype(np.float32))
+    q = nearestInt(groups * ids[:, :, np.newaxis])
+    q = (np.clip(q, -32, 31) + 32).reshape(-1, 2, 4, 32)
+    ql = np.concatenate([
+        (q[:, :, 0, :] & 0xF) | ((q[:, :, 2, :] & 0xF) << 4),
+        (q[:, :, 1, :] & 0xF) | ((q[:, :, 3, :] & 0xF) << 4),
+    ], axis=2).reshape(-1, 128)
+    qh = ((q[:, :, 0, :] >> 4) | ((q[:, :, 1, :] >> 4) << 2) |
+        ((q[:, :, 2, :] >> 4) << 4) | ((q[:, :, 3, :] >> 4) << 6)).reshape(-1, 64)
+
+    blocks = np.concatenate([
+        ql.astype(np.uint8),
+        qh.astype(np.uint8),
+        ls.astype(np.int8).view(np.uint8),
+        d16.astype('<f2').view(np.uint8).reshape(-1, 2),
+    ], axis=1)
+    buffer = blocks.tobytes()
+    file.write(buffer)
+    return len(buffer)
+
 def writeF32Tensor(file, d):
     chunkSize = 10000
     nBytes = 0
@@ -101,6 +185,10 @@ def writeTensor(file, tensor, floatType):
         nBytes = writeQuantizedQ40Tensor(file, d)
     elif (floatType == FloatType.Q80):
         nBytes = writeQuantizedQ80Tensor(file, d)
+    elif (floatType == FloatType.Q4K):
+        nBytes = writeQuantizedQ4KTensor(file, d)
+    elif (floatType == FloatType.Q6K):
+        nBytes = writeQuantizedQ6KTensor(file, d)
     else:
         raise Exception(f'Unknown float type')
     t1 = time.time()
@@ -106,6 +106,7 @@ struct InferenceParams {
     int max_tokens;
     float temperature;
     float top_p;
+    float min_p;
     std::vector<std::string> stop;
     bool stream;
     unsigned long long seed;
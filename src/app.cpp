@@ -1,11 +1,18 @@
 #include "app.hpp"
+#include "nn/nn-config-builder.hpp"
 #include <cassert>
 #include <cstring>
 #include <sstream>
 #include <numeric>
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include <stdexcept>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
 #if defined(DLLAMA_VULKAN)
     #include "nn/nn-vulkan.hpp"
 #endif
@@ -30,12 +37,23 @@ static inline void logRootControlSend(const LlmControlPacket& p) {
 #endif
 }
 
-static void writeBootstrapPacket(NnNetwork *network, NnUint socketIndex, const AppCliArgs *args) {
+// Bytes of every direction of a shared memory link
+#define NET_SHM_RING_SIZE (4 * 1024 * 1024)
+
+static void enableNetZeroCopy(NnNetwork *network) {
+    if (network->setZeroCopy(true))
+        printf("🚁 Network sends large buffers with MSG_ZEROCOPY\n");
+    else
+        printf("⚠️ MSG_ZEROCOPY is not supported, using regular sends\n");
+}
+
+// ratiosStr is the resolved plan (--ratios auto is replaced by the calibrated ratios)
+static void writeBootstrapPacket(NnNetwork *network, NnUint socketIndex, const AppCliArgs *args, const char *ratiosStr, NnUint flags = 0u) {
     LlmBootstrapPacket p;
     p.magic = LLM_BOOTSTRAP_MAGIC;
     p.version = LLM_BOOTSTRAP_VERSION;
-    p.flags = 0u;
-    p.benchmarkEnabled = args->benchmark ? 1u : 0u;
+    p.flags = flags;
+    p.benchmarkEnabled = (args->benchmark || args->tracePath != nullptr) ? 1u : 0u;
     p.maxSeqLen = args->maxSeqLen;
     p.syncType = (NnUint)args->syncType;
     p.modelPathLen = 0u;
@@ -45,14 +63,16 @@ static void writeBootstrapPacket(NnNetwork *network, NnUint socketIndex, const A
         p.flags |= LLM_BOOTSTRAP_HAS_MODEL_PATH;
         p.modelPathLen = (NnUint)std::strlen(args->modelPath) + 1u;
     }
-    if (args->ratiosStr != nullptr) {
+    if (ratiosStr != nullptr) {
         p.flags |= LLM_BOOTSTRAP_HAS_RATIOS;
-        p.ratiosLen = (NnUint)std::strlen(args->ratiosStr) + 1u;
+        p.ratiosLen = (NnUint)std::strlen(ratiosStr) + 1u;
     }
+    if (args->moeExpertParallel)
+        p.flags |= LLM_BOOTSTRAP_EXPERT_PARALLEL;
 
     network->write(socketIndex, &p, sizeof(p));
     if (p.modelPathLen > 0u) network->write(socketIndex, args->modelPath, p.modelPathLen);
-    if (p.ratiosLen > 0u) network->write(socketIndex, args->ratiosStr, p.ratiosLen);
+    if (p.ratiosLen > 0u) network->write(socketIndex, ratiosStr, p.ratiosLen);
 }
 
 static LlmBootstrapPacket readBootstrapPacket(NnNetwork *network, std::string &modelPath, std::string &ratiosStr) {
@@ -103,6 +123,7 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.modelPath = nullptr;
     args.tokenizerPath = nullptr;
     args.prompt = nullptr;
+    args.datasetPath = nullptr;
     args.syncType = F_32;
     args.nWorkers = 0;
     args.workerHosts = nullptr;
@@ -110,16 +131,41 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.port = 9990;
     args.temperature = 0.8f;
     args.topp = 0.9f;
+    args.minp = 0.0f;
     args.steps = 0;
     args.benchmark = false;
     args.seed = (unsigned long long)time(nullptr);
     args.chatTemplateType = TEMPLATE_UNKNOWN;
     args.maxSeqLen = 0;
     args.netTurbo = true;
+    args.netZeroCopy = false;
+    args.netShm = false;
+    args.netProbe = false;
     args.gpuIndex = -1;
     args.gpuSegmentFrom = -1;
     args.gpuSegmentTo = -1;
     args.ratiosStr = nullptr;
+    args.moeExpertParallel = false;
+    args.moeExpertCache = 0u;
+    args.opFusion = false;
+    args.weightRepack = false;
+    args.numa = false;
+    args.cpuAffinity = nullptr;
+    args.microBatchSize = 0;
+    args.nKvSlots = 1;
+    args.kvBlockSize = 0;
+    args.nKvBlocks = 0;
+    args.kvCacheType = F_32;
+    args.draftModelPath = nullptr;
+    args.nDraftTokens = 4;
+    args.logitsTopk = 0;
+    args.seqParallel = false;
+    args.kvSinks = 0;
+    args.ppSyncCodec = SYNC_CODEC_NONE;
+    args.shardPath = nullptr;
+    args.nShardNodes = 0;
+    args.tpSyncCodec = SYNC_CODEC_NONE;
+    args.tracePath = nullptr;
 
     int i = 1;
     if (requireMode && argc > 1) {
@@ -193,10 +239,24 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             args.tokenizerPath = value;
         } else if (std::strcmp(name, "--prompt") == 0) {
             args.prompt = value;
+        } else if (std::strcmp(name, "--dataset") == 0) {
+            args.datasetPath = value;
         } else if (std::strcmp(name, "--buffer-float-type") == 0) {
             args.syncType = parseFloatType(value);
+        } else if (std::strcmp(name, "--pp-sync-codec") == 0) {
+            args.ppSyncCodec = parseSyncCodec(value);
+        } else if (std::strcmp(name, "--tp-sync-codec") == 0) {
+            args.tpSyncCodec = parseSyncCodec(value);
+        } else if (std::strcmp(name, "--shard") == 0) {
+            args.shardPath = value;
+        } else if (std::strcmp(name, "--nodes") == 0) {
+            args.nShardNodes = (NnUint)atoi(value);
         } else if (std::strcmp(name, "--ratios") == 0) {
             args.ratiosStr = value;
+        } else if (std::strcmp(name, "--moe-expert-parallel") == 0) {
+            args.moeExpertParallel = atoi(value) == 1;
+        } else if (std::strcmp(name, "--moe-expert-cache") == 0) {
+            args.moeExpertCache = (NnUint)atoi(value);
         } else if (std::strcmp(name, "--port") == 0) {
             args.port = atoi(value);
         } else if (std::strcmp(name, "--nthreads") == 0) {
@@ -207,6 +267,8 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             args.temperature = atof(value);
         } else if (std::strcmp(name, "--topp") == 0) {
             args.topp = atof(value);
+        } else if (std::strcmp(name, "--min-p") == 0) {
+            args.minp = atof(value);
         } else if (std::strcmp(name, "--seed") == 0) {
             args.seed = atoll(value);
         } else if (std::strcmp(name, "--chat-template") == 0) {
@@ -223,6 +285,42 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             args.gpuSegmentTo = atoi(separator + 1);
         } else if (std::strcmp(name, "--net-turbo") == 0) {
             args.netTurbo = atoi(value) == 1;
+        } else if (std::strcmp(name, "--net-zerocopy") == 0) {
+            args.netZeroCopy = atoi(value) == 1;
+        } else if (std::strcmp(name, "--net-shm") == 0) {
+            args.netShm = atoi(value) == 1;
+        } else if (std::strcmp(name, "--net-probe") == 0) {
+            args.netProbe = atoi(value) == 1;
+        } else if (std::strcmp(name, "--op-fusion") == 0) {
+            args.opFusion = atoi(value) == 1;
+        } else if (std::strcmp(name, "--weight-repack") == 0) {
+            args.weightRepack = atoi(value) == 1;
+        } else if (std::strcmp(name, "--numa") == 0) {
+            args.numa = atoi(value) == 1;
+        } else if (std::strcmp(name, "--cpu-affinity") == 0) {
+            args.cpuAffinity = value;
+        } else if (std::strcmp(name, "--micro-batch") == 0) {
+            args.microBatchSize = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--kv-slots") == 0) {
+            args.nKvSlots = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--kv-block-size") == 0) {
+            args.kvBlockSize = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--kv-cache-blocks") == 0) {
+            args.nKvBlocks = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--kv-cache-type") == 0) {
+            args.kvCacheType = parseFloatType(value);
+        } else if (std::strcmp(name, "--draft-model") == 0) {
+            args.draftModelPath = value;
+        } else if (std::strcmp(name, "--draft-tokens") == 0) {
+            args.nDraftTokens = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--logits-topk") == 0) {
+            args.logitsTopk = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--seq-parallel") == 0) {
+            args.seqParallel = atoi(value) == 1;
+        } else if (std::strcmp(name, "--kv-sinks") == 0) {
+            args.kvSinks = (NnUint)atoi(value);
+        } else if (std::strcmp(name, "--trace") == 0) {
+            args.tracePath = value;
         } else {
             throw std::runtime_error("Unknown option: " + std::string(name));
         }
@@ -232,6 +330,42 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
 
     if (args.nThreads < 1)
         throw std::runtime_error("Number of threads must be at least 1");
+    if (args.minp < 0.0f || args.minp > 1.0f)
+        throw std::runtime_error("--min-p must be in [0, 1]");
+    if (args.nKvSlots < 1)
+        throw std::runtime_error("Number of KV cache slots must be at least 1");
+    if (args.nKvBlocks > 0 && args.kvBlockSize == 0)
+        throw std::runtime_error("--kv-cache-blocks requires --kv-block-size");
+    if (args.kvCacheType != F_32 && args.kvCacheType != F_16 && args.kvCacheType != F_Q80)
+        throw std::runtime_error("Unsupported KV cache type, use f32, f16 or q80");
+    if (args.tpSyncCodec != SYNC_CODEC_NONE && args.syncType != F_32)
+        throw std::runtime_error("--tp-sync-codec requires --buffer-float-type f32");
+    if (args.tpSyncCodec != SYNC_CODEC_NONE && args.ratiosStr != nullptr)
+        throw std::runtime_error("--tp-sync-codec is not supported with --ratios");
+    if (args.ratiosStr != nullptr && std::strcmp(args.ratiosStr, "auto") == 0 && args.shardPath != nullptr)
+        throw std::runtime_error("--ratios auto cannot load pre-sharded weights, the shards are made for fixed ratios");
+    if (args.seqParallel && args.ratiosStr != nullptr)
+        throw std::runtime_error("--seq-parallel is not supported with --ratios");
+    if (args.seqParallel && args.kvBlockSize > 0)
+        throw std::runtime_error("--seq-parallel is not supported with the paged KV cache");
+    if (args.seqParallel && args.gpuIndex >= 0)
+        throw std::runtime_error("--seq-parallel is not supported on GPU");
+    if (args.kvSinks > 0 && args.kvBlockSize > 0)
+        throw std::runtime_error("--kv-sinks is not supported with the paged KV cache");
+    if (args.kvSinks > 0 && args.kvCacheType != F_32)
+        throw std::runtime_error("--kv-sinks requires the f32 KV cache");
+    if (args.kvSinks > 0 && args.seqParallel)
+        throw std::runtime_error("--kv-sinks is not supported with --seq-parallel");
+    if (args.kvSinks > 0 && args.draftModelPath != nullptr)
+        throw std::runtime_error("--kv-sinks is not supported with --draft-model");
+    if (args.moeExpertParallel && args.ratiosStr == nullptr)
+        throw std::runtime_error("--moe-expert-parallel requires --ratios");
+    if (args.moeExpertParallel && args.gpuIndex >= 0)
+        throw std::runtime_error("--moe-expert-parallel is not supported on GPU");
+    if (args.moeExpertCache > 0u && args.gpuIndex >= 0)
+        throw std::runtime_error("--moe-expert-cache is not supported on GPU");
+    if (args.draftModelPath != nullptr && (args.nDraftTokens < 1 || args.nDraftTokens >= args.nBatches))
+        throw std::runtime_error("--draft-tokens must be at least 1 and less than the batch size");
     return args;
 }
 
@@ -547,6 +681,54 @@ static std::vector<NnStageDef> parseStageDefs(const char *ratiosStr, NnUint nNod
     }
 }
 
+// Experts placed whole on the nodes of a stage, 0 keeps every expert sliced across the stage
+static NnUint getPlanExperts(const LlmHeader &header, bool moeExpertParallel) {
+    if (!moeExpertParallel)
+        return 0u;
+    if (header.archType != QWEN3_MOE)
+        throw std::runtime_error("--moe-expert-parallel requires a MoE model");
+    return header.nExperts;
+}
+
+// The cache reads the experts from the mapped file, so the node must load whole experts from it
+static void checkExpertCache(AppCliArgs *args, NnUint nNodes, const NnUnevenPartitionPlan *plan, bool loadsFromFile) {
+    if (args->moeExpertCache == 0u)
+        return;
+    if (!loadsFromFile)
+        throw std::runtime_error("--moe-expert-cache requires the weights loaded from a local file (--ratios)");
+    if (nNodes > 1u && !isExpertParallelPlan(plan))
+        throw std::runtime_error("--moe-expert-cache requires a single node or --moe-expert-parallel 1");
+}
+
+static void printExpertCacheStats(std::vector<NnExecutorDevice> &devices) {
+    for (NnExecutorDevice &device : devices) {
+        NnCpuDevice *cpuDevice = dynamic_cast<NnCpuDevice *>(device.device.get());
+        if (cpuDevice == nullptr)
+            continue;
+        NnCpuExpertCacheStats stats;
+        cpuDevice->getExpertCacheStats(&stats);
+        if (stats.pagedBytes == 0u)
+            continue;
+        const NnSize nLookups = stats.nHits + stats.nMisses;
+        printf("🧠 Expert cache: %zu hits, %zu misses (%.1f%% hit rate), %zu promotions, %.1f/%.1f MB resident\n",
+            stats.nHits, stats.nMisses, nLookups > 0u ? 100.0 * stats.nHits / nLookups : 0.0, stats.nPromotions,
+            stats.residentBytes / (1024.0 * 1024.0), stats.pagedBytes / (1024.0 * 1024.0));
+    }
+}
+
+// After the weights are loaded, pages of the arena are backed only once they are touched
+static void printArenaStats(std::vector<NnExecutorDevice> &devices) {
+    for (NnExecutorDevice &device : devices) {
+        NnCpuDevice *cpuDevice = dynamic_cast<NnCpuDevice *>(device.device.get());
+        if (cpuDevice == nullptr)
+            continue;
+        NnCpuArenaStats stats;
+        cpuDevice->getArenaStats(&stats);
+        printf("🧱 Memory arena: %.1f MB, %.1f MB on huge pages (%s)\n",
+            stats.usedBytes / (1024.0 * 1024.0), stats.hugePageBytes / (1024.0 * 1024.0), stats.backing);
+    }
+}
+
 void printPartitionPlanDebug(const NnUnevenPartitionPlan* plan) {
     printf("\n🔍 [DEBUG] Pipeline Partition Plan Verification:\n");
     printf("===================================================\n");
@@ -580,13 +762,16 @@ void printPartitionPlanDebug(const NnUnevenPartitionPlan* plan) {
 
             printf("       • Node %u: Heads=%u, KV=%u, Dim=%u\n", 
                    globalNodeIdx, hLen, kLen, dLen);
+            if (isExpertParallelPlan(plan))
+                printf("         Experts=[%u, %u)\n", plan->expertSplit.starts[globalNodeIdx],
+                       plan->expertSplit.starts[globalNodeIdx] + plan->expertSplit.lengths[globalNodeIdx]);
         }
         printf("       ✅ Stage Sums: Heads=%u, KV=%u, Dim=%u\n", headSum, kvSum, dimSum);
     }
     printf("===================================================\n\n");
 }
 
-static std::vector<NnExecutorDevice> resolveDevices(AppCliArgs *args, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *plan = nullptr) {
+static std::vector<NnExecutorDevice> resolveDevices(AppCliArgs *args, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *plan = nullptr, const NnCpuPlacement *placement = nullptr) {
     std::vector<NnExecutorDevice> devices;
 
     if (args->gpuIndex >= 0) {
@@ -602,7 +787,7 @@ static std::vector<NnExecutorDevice> resolveDevices(AppCliArgs *args, NnNetConfi
     }
 
     if (args->gpuIndex < 0 || (args->gpuSegmentFrom >= 0 && args->gpuSegmentTo >= 0)) {
-        devices.push_back(NnExecutorDevice(new NnCpuDevice(netConfig, nodeConfig, netExecution, plan), -1, -1));
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(netConfig, nodeConfig, netExecution, plan, args->moeExpertCache, args->opFusion, args->weightRepack, placement), -1, -1));
     }
     return devices;
 }
@@ -618,31 +803,158 @@ static NnUint getStageIndexForNode(const NnUnevenPartitionPlan* plan, NnUint nod
     return 0;
 }
 
-RootLlmInference::RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnUnevenPartitionPlan* plan, bool profileEnabled) {
+LlmTraceWriter::LlmTraceWriter(const char *path, NnUint nNodes, const NnUnevenPartitionPlan *plan)
+    : path(path), hasBase(false), baseUs(0), nEvents(0)
+{
+    file = fopen(path, "w");
+    if (file == nullptr)
+        throw std::runtime_error("Cannot open the trace file: " + std::string(path));
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        const NnUint stageIndex = getStageIndexForNode(plan, nodeIndex);
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"node %u (stage %u)\"}},\n",
+            nodeIndex, nodeIndex, stageIndex);
+        fprintf(file, "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"sort_index\":%u}},\n", nodeIndex, nodeIndex);
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"forward\"}},\n", nodeIndex);
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":1,\"args\":{\"name\":\"ops\"}},\n", nodeIndex);
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":2,\"args\":{\"name\":\"sync\"}}%s\n", nodeIndex,
+            nodeIndex + 1 < nNodes ? "," : "");
+    }
+}
+
+LlmTraceWriter::~LlmTraceWriter() {
+    fprintf(file, "]}\n");
+    fclose(file);
+    printf("📈 Trace: %zu events written to %s\n", (size_t)nEvents, path);
+}
+
+void LlmTraceWriter::writeEvent(const char *name, const char *category, NnUint nodeIndex, NnUint threadIndex, long long startUs, long long durationUs, const std::string &args) {
+    fprintf(file, ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}\n",
+        name, category, nodeIndex, threadIndex, startUs, durationUs, args.c_str());
+    nEvents++;
+}
+
+void LlmTraceWriter::write(NnUint nodeIndex, NnUint position, const NnTraceEvent *events, NnUint nEvents, long long clockOffsetUs) {
+    if (nEvents == 0)
+        return;
+    if (!hasBase) {
+        // Small numbers are easier to read in the viewers
+        baseUs = (NnSize)((long long)events[0].startUs - clockOffsetUs);
+        hasBase = true;
+    }
+    const long long shift = clockOffsetUs + (long long)baseUs;
+    const long long forwardStart = (long long)events[0].startUs - shift;
+    const long long forwardEnd = (long long)events[nEvents - 1].endUs - shift;
+    std::ostringstream forwardArgs;
+    forwardArgs << "\"pos\":" << position << ",\"batch\":" << events[0].batchSize;
+    writeEvent("forward", "forward", nodeIndex, 0, forwardStart, forwardEnd - forwardStart, forwardArgs.str());
+
+    for (NnUint i = 0; i < nEvents; i++) {
+        const NnTraceEvent *e = &events[i];
+        std::ostringstream args;
+        args << "\"step\":" << e->stepIndex << ",\"layer\":" << e->layerIndex << ",\"batch\":" << e->batchSize;
+        const long long start = (long long)e->startUs - shift;
+        const long long duration = (long long)(e->endUs - e->startUs);
+        if (e->type == STEP_SYNC_NODES) {
+            args << ",\"sentBytes\":" << e->sentBytes << ",\"recvBytes\":" << e->recvBytes << ",\"peer\":" << e->peerNodeIndex;
+            writeEvent(e->name, "sync", nodeIndex, 2, start, duration, args.str());
+        } else {
+            if (e->nFusedOps > 1)
+                args << ",\"fusedOps\":" << e->nFusedOps;
+            writeEvent(e->name, "op", nodeIndex, 1, start, duration, args.str());
+        }
+    }
+}
+
+RootLlmInference::RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnUnevenPartitionPlan* plan, bool profileEnabled, NnNetworkNodeSynchronizer *synchronizer) {
     this->header = net->header;
     this->tokenPipe = (float *)execution->pipes[net->tokenPipeIndex];
     this->positionPipe = (float *)execution->pipes[net->positionPipeIndex];
+    this->slotPipe = (float *)execution->pipes[net->slotPipeIndex];
     this->logitsPipe = (float *)execution->pipes[net->logitsPipeIndex];
     this->execution = execution;
     this->executor = executor;
     this->network = network;
+    this->synchronizer = synchronizer;
     this->plan = plan;
     this->profileEnabled = profileEnabled;
     this->controlPacket.flags = profileEnabled ? LLM_CTRL_PROFILE : 0u;
+    this->controlPacket.slot = 0;
+    this->controlPacket.nBlockUpdates = 0;
+    this->controlPacket.nLogitsRows = 0;
+    this->rowPositions.resize(execution->nBatches * 2);
+    this->blockTablePipe = nullptr;
+    if (header->kvBlockSize > 0) {
+        this->blockTablePipe = (float *)execution->pipes[net->blockTablePipeIndex];
+        this->kvBlockTable.reset(new NnKvBlockTable(std::max(header->nKvSlots, 1u), getLlmKvBlocksPerSlot(header),
+            getLlmKvBlocks(header), header->kvBlockSize));
+    }
+    this->kvEvictPipe = nullptr;
+    if (header->nKvSinks > 0) {
+        this->kvEvictPipe = (float *)execution->pipes[net->kvEvictPipeIndex];
+        std::memset(kvEvictPipe, 0, 4 * sizeof(float));
+    }
+    this->nNodes = net->netConfig.nNodes;
+    this->logitsTopkPipe = nullptr;
+    if (header->logitsTopk > 0) {
+        this->logitsTopkPipe = (float *)execution->pipes[net->logitsTopkPipeIndex];
+        for (NnUint nodeIndex = 0; nodeIndex < net->netConfig.nNodes; nodeIndex++) {
+            if (plan == nullptr || plan->nStages == 0 || getStageIndexForNode(plan, nodeIndex) == plan->stages[plan->nStages - 1].stageIndex)
+                logitsNodes.push_back(nodeIndex);
+        }
+    }
 }
 
 void RootLlmInference::setBatchSize(NnUint batchSize) {
     execution->setBatchSize(batchSize);
     controlPacket.batchSize = batchSize;
+    nLogitsRows = 0;
+    isSkippingLogits = false;
 }
 
-void RootLlmInference::setPosition(NnUint position) {
+void RootLlmInference::setPosition(NnUint position, NnUint slot) {
     assert(position >= 0);
     assert(position + execution->batchSize - 1 < header->seqLen);
+    assert(slot < std::max(header->nKvSlots, 1u));
 
     controlPacket.position = position;
-    for (NnUint i = 0; i < execution->batchSize; i++)
+    controlPacket.slot = slot;
+    controlPacket.flags &= ~LLM_CTRL_ROW_POSITIONS;
+    for (NnUint i = 0; i < execution->batchSize; i++) {
         positionPipe[i] = (float)(position + i);
+        slotPipe[i] = (float)slot;
+    }
+}
+
+void RootLlmInference::setRowPosition(NnUint batchIndex, NnUint position, NnUint slot) {
+    assert(batchIndex < execution->batchSize);
+    assert(position < header->seqLen);
+    assert(slot < std::max(header->nKvSlots, 1u));
+
+    controlPacket.flags |= LLM_CTRL_ROW_POSITIONS;
+    if (batchIndex == 0) {
+        controlPacket.position = position;
+        controlPacket.slot = slot;
+    }
+    rowPositions[batchIndex * 2] = position;
+    rowPositions[batchIndex * 2 + 1] = slot;
+    positionPipe[batchIndex] = (float)position;
+    slotPipe[batchIndex] = (float)slot;
+}
+
+void RootLlmInference::evictKv(NnUint slot, NnUint start, NnUint nDiscard, NnUint nRows) {
+    assert(kvEvictPipe != nullptr);
+    assert(nDiscard > 0);
+    assert(start + nDiscard + nRows <= header->seqLen);
+    assert(slot < std::max(header->nKvSlots, 1u));
+
+    kvEviction[0] = slot;
+    kvEviction[1] = start;
+    kvEviction[2] = nDiscard;
+    kvEviction[3] = nRows;
+    for (NnUint i = 0; i < 4; i++)
+        kvEvictPipe[i] = (float)kvEviction[i];
+    controlPacket.flags |= LLM_CTRL_KV_EVICT;
 }
 
 void RootLlmInference::setToken(NnUint batchIndex, NnUint token) {
@@ -650,12 +962,188 @@ void RootLlmInference::setToken(NnUint batchIndex, NnUint token) {
     tokenPipe[batchIndex] = (float)token;
 }
 
+void RootLlmInference::setLogitsRows(NnUint nRows) {
+    assert(nRows <= execution->batchSize);
+    nLogitsRows = nRows == execution->batchSize ? 0u : nRows;
+}
+
+void RootLlmInference::skipLogits() {
+    isSkippingLogits = true;
+}
+
+void RootLlmInference::setMicroBatchSize(NnUint microBatchSize) {
+    this->microBatchSize = microBatchSize;
+}
+
+void RootLlmInference::setTraceWriter(LlmTraceWriter *traceWriter) {
+    assert(profileEnabled);
+    this->traceWriter = traceWriter;
+    executor->setTraceEnabled(traceWriter != nullptr);
+    if (traceWriter != nullptr)
+        controlPacket.flags |= LLM_CTRL_TRACE;
+    else
+        controlPacket.flags &= ~LLM_CTRL_TRACE;
+}
+
+// How many round trips are made to every node, the one with the lowest RTT sets the offset
+#define TRACE_CLOCK_PROBES 16
+
+void RootLlmInference::probeClockOffsets() {
+    // NTP-like: the node reads its clock between our two reads, so it's off by at most RTT / 2
+    clockOffsets.assign(nNodes, 0);
+    if (network == nullptr)
+        return;
+    LlmControlPacket probe;
+    std::memset(&probe, 0, sizeof(probe));
+    probe.batchSize = 1;
+    probe.flags = LLM_CTRL_CLOCK_PROBE;
+    for (NnUint nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        const NnUint socketIndex = (NnUint)network->getSocketIndexForNode(nodeIndex, 0);
+        NnSize bestRttUs = SIZE_MAX;
+        for (NnUint i = 0; i < TRACE_CLOCK_PROBES; i++) {
+            NnSize nodeUs;
+            const NnSize startUs = getTraceTimeUs();
+            network->write(socketIndex, &probe, sizeof(LlmControlPacket));
+            network->read(socketIndex, &nodeUs, sizeof(NnSize));
+            const NnSize endUs = getTraceTimeUs();
+            if (endUs - startUs < bestRttUs) {
+                bestRttUs = endUs - startUs;
+                clockOffsets[nodeIndex] = (long long)nodeUs - (long long)(startUs + (endUs - startUs) / 2);
+            }
+        }
+        printf("📈 Node %u clock offset: %lld us (rtt: %zu us)\n", nodeIndex, clockOffsets[nodeIndex], (size_t)bestRttUs);
+    }
+}
+
+void RootLlmInference::writeTrace() {
+    const std::vector<NnTraceEvent> &rootEvents = executor->getTrace();
+    traceWriter->write(0, controlPacket.position, rootEvents.data(), (NnUint)rootEvents.size(), 0);
+    for (NnUint socketIndex = 0; socketIndex < network->nSockets; socketIndex++) {
+        LlmTraceHeader traceHeader;
+        network->read(socketIndex, &traceHeader, sizeof(LlmTraceHeader));
+        traceEvents.resize(traceHeader.nEvents);
+        if (traceHeader.nEvents > 0)
+            network->read(socketIndex, traceEvents.data(), traceHeader.nEvents * sizeof(NnTraceEvent));
+        traceWriter->write(traceHeader.nodeIndex, controlPacket.position, traceEvents.data(), traceHeader.nEvents,
+            clockOffsets[traceHeader.nodeIndex]);
+    }
+}
+
 void RootLlmInference::forward() {
+    // Pipelined prefill only pays off when there are several PP stages to keep busy.
+    // Profiling needs a round-trip per forward, so it keeps the plain schedule.
+    // Only the last micro-batch has logits, the logits rows (0 = all rows) must fit in it.
+    const NnUint batchSize = execution->batchSize;
+    if (isSkippingLogits)
+        controlPacket.flags |= LLM_CTRL_SKIP_LOGITS;
+    if (microBatchSize > 0 && batchSize > microBatchSize &&
+        (isSkippingLogits || (nLogitsRows > 0 && nLogitsRows <= batchSize - (batchSize - 1) / microBatchSize * microBatchSize)) &&
+        (controlPacket.flags & LLM_CTRL_ROW_POSITIONS) == 0u &&
+        synchronizer != nullptr && plan != nullptr && plan->nStages > 1 && !profileEnabled) {
+        forwardMicroBatches();
+    } else {
+        forwardStep(nLogitsRows);
+    }
+    controlPacket.flags &= ~LLM_CTRL_SKIP_LOGITS;
+}
+
+void RootLlmInference::updateKvBlockTable() {
+    // The root owns the allocator, workers only apply the changed entries. The rows may be
+    // rotated (logits rows first), the table is written in the order of the positions.
+    kvBlockTable->writeRows(slotPipe, positionPipe, execution->batchSize);
+    kvBlockTable->takeChanges(blockUpdates);
+    for (NnUint i = 0; i < blockUpdates.size(); i += 2)
+        blockTablePipe[blockUpdates[i]] = (float)blockUpdates[i + 1];
+    controlPacket.nBlockUpdates = (NnUint)(blockUpdates.size() / 2);
+}
+
+void RootLlmInference::expandLogitsTopk() {
+    // Rebuilds the logits rows from the candidates of all nodes, the rest of the vocab is masked
+    // out, so the sampler keeps working on full rows and samples only from the merged set
+    const NnUint vocabSize = header->vocabSize;
+    const NnUint k = header->logitsTopk;
+    const NnUint rowSize = nNodes * 2 * k;
+    for (NnUint i = 0; i < execution->nLogitsRows; i++) {
+        float *logits = &logitsPipe[(size_t)i * vocabSize];
+        const float *candidates = &logitsTopkPipe[(size_t)i * rowSize];
+        std::fill(logits, logits + vocabSize, -INFINITY);
+        for (NnUint nodeIndex : logitsNodes) {
+            const float *values = &candidates[nodeIndex * 2 * k];
+            const float *indexes = &values[k];
+            for (NnUint j = 0; j < k; j++)
+                logits[(NnUint)indexes[j]] = values[j];
+        }
+    }
+}
+
+void RootLlmInference::rotateRows(NnUint middle) {
+    const NnUint batchSize = execution->batchSize;
+    std::rotate(tokenPipe, tokenPipe + middle, tokenPipe + batchSize);
+    std::rotate(positionPipe, positionPipe + middle, positionPipe + batchSize);
+    std::rotate(slotPipe, slotPipe + middle, slotPipe + batchSize);
+}
+
+void RootLlmInference::forwardStep(NnUint nRows) {
+    // The rows with logits must be the first rows of the batch on the nodes. Rows that are
+    // not in order go as independent rows, the attention reads the positions of the rows.
+    const NnUint batchSize = execution->batchSize;
+    const bool isRotated = nRows > 0 && nRows < batchSize &&
+        (controlPacket.flags & LLM_CTRL_SKIP_LOGITS) == 0u;
+    const NnUint baseFlags = controlPacket.flags;
+    if (isRotated) {
+        rotateRows(batchSize - nRows);
+        for (NnUint i = 0; i < batchSize; i++) {
+            rowPositions[i * 2] = (NnUint)positionPipe[i];
+            rowPositions[i * 2 + 1] = (NnUint)slotPipe[i];
+        }
+        controlPacket.flags |= LLM_CTRL_ROW_POSITIONS;
+        execution->setLogitsRows(nRows);
+    } else {
+        execution->setLogitsRows((controlPacket.flags & LLM_CTRL_SKIP_LOGITS) != 0u ? 0u : batchSize);
+    }
+    controlPacket.nLogitsRows = execution->nLogitsRows;
+
+    if (kvBlockTable)
+        updateKvBlockTable();
+    if (traceWriter != nullptr && clockOffsets.empty()) {
+        if (synchronizer != nullptr)
+            synchronizer->flushPpSends();
+        probeClockOffsets();
+    }
     if (network != nullptr) {
+        // The control packet shares the socket with the PP activations sent to the next stage
+        if (synchronizer != nullptr) {
+            synchronizer->flushPpSends();
+            synchronizer->setSkipLogitsSync((controlPacket.flags & LLM_CTRL_SKIP_LOGITS) != 0u);
+        }
         logRootControlSend(controlPacket);
         network->writeAll(&controlPacket, sizeof(LlmControlPacket));
+        if ((controlPacket.flags & LLM_CTRL_ROW_POSITIONS) != 0u)
+            network->writeAll(rowPositions.data(), controlPacket.batchSize * 2 * sizeof(NnUint));
+        if (controlPacket.nBlockUpdates > 0)
+            network->writeAll(blockUpdates.data(), controlPacket.nBlockUpdates * 2 * sizeof(NnUint));
+        if ((controlPacket.flags & LLM_CTRL_KV_EVICT) != 0u)
+            network->writeAll(kvEviction, sizeof(kvEviction));
     }
     executor->forward();
+    if (logitsTopkPipe != nullptr && (controlPacket.flags & LLM_CTRL_SKIP_LOGITS) == 0u)
+        expandLogitsTopk();
+    if (isRotated) {
+        // Logits of a row stay at the index of the row
+        const NnUint vocabSize = header->vocabSize;
+        std::memmove(&logitsPipe[(size_t)(batchSize - nRows) * vocabSize], logitsPipe, (size_t)nRows * vocabSize * sizeof(float));
+        rotateRows(nRows);
+        for (NnUint i = 0; i < batchSize; i++) {
+            rowPositions[i * 2] = (NnUint)positionPipe[i];
+            rowPositions[i * 2 + 1] = (NnUint)slotPipe[i];
+        }
+        controlPacket.flags = baseFlags;
+    }
+    if ((controlPacket.flags & LLM_CTRL_KV_EVICT) != 0u) {
+        // The rows are moved once, by the first forward after evictKv
+        controlPacket.flags &= ~LLM_CTRL_KV_EVICT;
+        kvEvictPipe[2] = 0.0f;
+    }
 
     if (!profileEnabled) return;
 
@@ -689,10 +1177,59 @@ void RootLlmInference::forward() {
         }
         network->readMany(nWorkers, &ios[0]);
     }
+
+    if (traceWriter != nullptr) {
+        if (network != nullptr)
+            writeTrace();
+        else
+            traceWriter->write(0, controlPacket.position, executor->getTrace().data(), (NnUint)executor->getTrace().size(), 0);
+    }
+}
+
+void RootLlmInference::forwardMicroBatches() {
+    // The batch is split into micro-batches that flow through the stages one after another.
+    // Without the logits gather the root doesn't wait for the last stage, so stage 0 starts
+    // the next micro-batch while the later stages still work on the previous ones.
+    const NnUint batchSize = execution->batchSize;
+    const NnUint position = controlPacket.position;
+    NnUint baseFlags = controlPacket.flags;
+
+    for (NnUint offset = 0; offset < batchSize; offset += microBatchSize) {
+        const NnUint n = std::min(microBatchSize, batchSize - offset);
+        const bool isLast = offset + n == batchSize;
+        if (offset > 0) {
+            // Rows of processed micro-batches are not needed anymore and don't overlap the source
+            std::memcpy(tokenPipe, &tokenPipe[offset], n * sizeof(float));
+        }
+        for (NnUint i = 0; i < n; i++)
+            positionPipe[i] = (float)(position + offset + i);
+
+        execution->setBatchSize(n);
+        controlPacket.batchSize = n;
+        controlPacket.position = position + offset;
+        controlPacket.flags = isLast ? baseFlags : (baseFlags | LLM_CTRL_SKIP_LOGITS);
+        const bool hasLogits = (controlPacket.flags & LLM_CTRL_SKIP_LOGITS) == 0u;
+        assert(!hasLogits || (nLogitsRows > 0 && nLogitsRows <= n));
+        forwardStep(isLast ? nLogitsRows : 0u);
+        baseFlags &= ~LLM_CTRL_KV_EVICT;
+
+        if (hasLogits && n != batchSize) {
+            // Keep the contract of forward(): logits of the last tokens are in the last rows
+            const NnUint vocabSize = header->vocabSize;
+            std::memmove(&logitsPipe[(size_t)(batchSize - nLogitsRows) * vocabSize], &logitsPipe[(size_t)(n - nLogitsRows) * vocabSize], (size_t)nLogitsRows * vocabSize * sizeof(float));
+        }
+    }
+
+    controlPacket.flags = baseFlags;
+    controlPacket.position = position;
+    controlPacket.batchSize = batchSize;
+    execution->setBatchSize(batchSize);
 }
 
 void RootLlmInference::finish() {
     if (network != nullptr) {
+        if (synchronizer != nullptr)
+            synchronizer->flushPpSends();
         controlPacket.batchSize = 0;
         // Stop packet: position is not meaningful when batchSize==0.
         // Set to 0 to avoid confusing logs / downstream checks.
@@ -702,11 +1239,196 @@ void RootLlmInference::finish() {
     }
 }
 
-WorkerLlmInference::WorkerLlmInference(NnNetExecution *execution, NnNetwork *network) {
+SpeculativeDecoder::SpeculativeDecoder(RootLlmInference *target, LlmHeader *targetHeader, RootLlmInference *draft, LlmHeader *draftHeader, NnUint nDraftTokens, NnUint nBatches)
+    : nProposed(0), nAccepted(0), draftTimeUs(0),
+      target(target), targetHeader(targetHeader), draft(draft), draftHeader(draftHeader),
+      nDraftTokens(nDraftTokens), nBatches(nBatches)
+{
+    if (draftHeader->vocabSize != targetHeader->vocabSize)
+        throw std::runtime_error("The draft model must have the same vocabulary as the target model");
+    assert(nDraftTokens < nBatches);
+    draftProbs.resize((size_t)nDraftTokens * targetHeader->vocabSize);
+    residual.resize(targetHeader->vocabSize);
+}
+
+void SpeculativeDecoder::start(const std::vector<int> &tokens) {
+    assert(!tokens.empty());
+    this->tokens = tokens;
+    // The draft cache keeps the common prefix with the previous sequence
+    size_t n = 0;
+    while (n < draftTokens.size() && n + 1 < tokens.size() && draftTokens[n] == tokens[n])
+        n++;
+    draftTokens.resize(n);
+}
+
+float *SpeculativeDecoder::forwardDraft(NnUint end) {
+    // Catches up the draft cache with the sequence and the proposal, the logits of the last token are returned
+    assert(draftTokens.size() < end);
+    assert(end <= draftHeader->seqLen);
+    NnUint batchSize = 0;
+    while (draftTokens.size() < end) {
+        const NnUint start = (NnUint)draftTokens.size();
+        batchSize = std::min(end - start, nBatches);
+        draft->setBatchSize(batchSize);
+        draft->setLogitsRows(1);
+        draft->setPosition(start);
+        for (NnUint i = 0; i < batchSize; i++) {
+            const NnUint p = start + i;
+            const int token = p < tokens.size() ? tokens[p] : proposal[p - tokens.size()];
+            draft->setToken(i, token);
+            draftTokens.push_back(token);
+        }
+        draft->forward();
+    }
+    return &draft->logitsPipe[(batchSize - 1) * draftHeader->vocabSize];
+}
+
+int SpeculativeDecoder::sampleToken(Sampler *sampler, float *logits, float *probs) {
+    if (sampler->isGreedy())
+        return sampler->sample(logits);
+    if (probs != logits)
+        std::memcpy(probs, logits, targetHeader->vocabSize * sizeof(float));
+    sampler->toProbabilities(probs);
+    return sampler->sampleProbabilities(probs);
+}
+
+void SpeculativeDecoder::step(Sampler *sampler, NnUint maxTokens, std::vector<int> &out) {
+    assert(maxTokens > 0);
+    const NnUint vocabSize = targetHeader->vocabSize;
+    const NnUint pos = (NnUint)tokens.size() - 1;
+    // The target verifies the positions [pos, pos + k], the draft proposes from [pos, pos + k)
+    NnUint k = std::min(nDraftTokens, maxTokens - 1);
+    k = std::min(k, targetHeader->seqLen - 1 - pos);
+    k = pos < draftHeader->seqLen ? std::min(k, draftHeader->seqLen - pos) : 0;
+    const bool isGreedy = sampler->isGreedy();
+
+    Timer draftTimer;
+    proposal.clear();
+    for (NnUint i = 0; i < k; i++) {
+        float *logits = forwardDraft(pos + 1 + i);
+        proposal.push_back(sampleToken(sampler, logits, &draftProbs[(size_t)i * vocabSize]));
+    }
+    draftTimeUs += draftTimer.elapsedMicroseconds();
+
+    // One forward of the target model for all proposed tokens
+    target->setBatchSize(k + 1);
+    target->setPosition(pos);
+    target->setToken(0, tokens[pos]);
+    for (NnUint i = 0; i < k; i++)
+        target->setToken(i + 1, proposal[i]);
+    // Every row is verified, the micro-batch schedule would skip the logits of all but the last micro-batch
+    const NnUint microBatchSize = target->getMicroBatchSize();
+    target->setMicroBatchSize(0);
+    target->forward();
+    target->setMicroBatchSize(microBatchSize);
+
+    const size_t outStart = out.size();
+    NnUint nAcceptedNow = 0;
+    int next = -1;
+    for (NnUint i = 0; i < k && next < 0; i++) {
+        float *p = &target->logitsPipe[(size_t)i * vocabSize];
+        const int x = proposal[i];
+        if (isGreedy) {
+            const int t = sampler->sample(p);
+            if (t != x)
+                next = t;
+        } else {
+            // Accepts x with the probability min(1, p(x) / q(x)), otherwise samples from max(0, p - q)
+            sampler->toProbabilities(p);
+            const float *q = &draftProbs[(size_t)i * vocabSize];
+            if (sampler->randomCoin() >= p[x] / q[x]) {
+                float sum = 0.0f;
+                for (NnUint j = 0; j < vocabSize; j++) {
+                    residual[j] = std::max(0.0f, p[j] - q[j]);
+                    sum += residual[j];
+                }
+                if (sum > 0.0f) {
+                    for (NnUint j = 0; j < vocabSize; j++)
+                        residual[j] /= sum;
+                    next = sampler->sampleProbabilities(residual.data());
+                } else {
+                    next = sampler->sampleProbabilities(p);
+                }
+            }
+        }
+        if (next < 0) {
+            out.push_back(x);
+            nAcceptedNow++;
+        }
+    }
+    if (next < 0) {
+        // All proposals are accepted, the last row gives one more token
+        float *p = &target->logitsPipe[(size_t)k * vocabSize];
+        next = sampleToken(sampler, p, p);
+    }
+    out.push_back(next);
+
+    nProposed += k;
+    nAccepted += nAcceptedNow;
+    tokens.insert(tokens.end(), out.begin() + outStart, out.end());
+    // The draft cache is valid up to the last accepted proposal
+    if (draftTokens.size() > pos + nAcceptedNow + 1)
+        draftTokens.resize(pos + nAcceptedNow + 1);
+}
+
+// A single node model on the root, the draft of the speculative decoding
+class LlmDraftModel {
+public:
+    LlmHeader header;
+    LlmNet net;
+    std::unique_ptr<NnNetExecution> execution;
+    NnFakeNodeSynchronizer synchronizer;
+    std::vector<NnExecutorDevice> devices;
+    std::unique_ptr<NnExecutor> executor;
+    std::unique_ptr<RootLlmInference> inference;
+
+    LlmDraftModel(AppCliArgs *args, NnUint maxSeqLen) {
+        header = loadLlmHeader(args->draftModelPath, maxSeqLen, F_32);
+        net = buildLlmNet(&header, 1, args->nBatches);
+        NnNodeConfig *nodeConfig = &net.nodeConfigs[0];
+        execution.reset(new NnNetExecution(args->nThreads, &net.netConfig));
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(&net.netConfig, nodeConfig, execution.get()), -1, -1));
+        executor.reset(new NnExecutor(&net.netConfig, nodeConfig, &devices, execution.get(), &synchronizer, false));
+
+        NnRootWeightLoader weightLoader(executor.get(), nullptr, 1);
+        loadLlmNetWeight(args->draftModelPath, &net, &weightLoader);
+        inference.reset(new RootLlmInference(&net, execution.get(), executor.get(), nullptr, nullptr, false));
+    }
+
+    ~LlmDraftModel() {
+        inference.reset();
+        executor.reset();
+        devices.clear();
+        execution.reset();
+        releaseLlmNet(&net);
+    }
+};
+
+WorkerLlmInference::WorkerLlmInference(NnNetExecution *execution, NnNetwork *network, NnNetConfig *netConfig) {
     this->isFinished = false;
     this->execution = execution;
     this->network = network;
     this->positionPipe = (float *)execution->pipes[0];
+    this->slotPipe = nullptr;
+    for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
+        if (std::strcmp(netConfig->pipes[pipeIndex].name, "SLOT") == 0)
+            this->slotPipe = (float *)execution->pipes[pipeIndex];
+    }
+    if (this->slotPipe == nullptr)
+        throw std::runtime_error("The net config does not have the SLOT pipe");
+    this->blockTablePipe = nullptr;
+    for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
+        if (std::strcmp(netConfig->pipes[pipeIndex].name, "KVPG") == 0)
+            this->blockTablePipe = (float *)execution->pipes[pipeIndex];
+    }
+    this->kvEvictPipe = nullptr;
+    for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
+        if (std::strcmp(netConfig->pipes[pipeIndex].name, "KVEV") == 0) {
+            this->kvEvictPipe = (float *)execution->pipes[pipeIndex];
+            std::memset(kvEvictPipe, 0, 4 * sizeof(float));
+        }
+    }
+    this->rowPositions.resize(execution->nBatches * 2);
 }
 
 bool WorkerLlmInference::tryReadControlPacket() {
@@ -719,18 +1441,236 @@ bool WorkerLlmInference::tryReadControlPacket() {
         isFinished = true;
         return true;
     }
+    if ((controlPacket.flags & LLM_CTRL_CLOCK_PROBE) != 0u) {
+        // Answered here, there is nothing to forward
+        const NnSize nowUs = getTraceTimeUs();
+        network->write(ROOT_SOCKET_INDEX, &nowUs, sizeof(NnSize));
+        return false;
+    }
     printf("📨 [Worker] Recv Control: Batch=%u, Pos=%u\n", controlPacket.batchSize, controlPacket.position);
-    for (NnUint i = 0; i < controlPacket.batchSize; i++)
-        positionPipe[i] = (float)(controlPacket.position + i);
+    if ((controlPacket.flags & LLM_CTRL_ROW_POSITIONS) != 0u) {
+        network->read(ROOT_SOCKET_INDEX, rowPositions.data(), controlPacket.batchSize * 2 * sizeof(NnUint));
+        for (NnUint i = 0; i < controlPacket.batchSize; i++) {
+            positionPipe[i] = (float)rowPositions[i * 2];
+            slotPipe[i] = (float)rowPositions[i * 2 + 1];
+        }
+    } else {
+        for (NnUint i = 0; i < controlPacket.batchSize; i++) {
+            positionPipe[i] = (float)(controlPacket.position + i);
+            slotPipe[i] = (float)controlPacket.slot;
+        }
+    }
+    if (controlPacket.nBlockUpdates > 0) {
+        if (blockTablePipe == nullptr)
+            throw std::runtime_error("The net config does not have the KVPG pipe");
+        blockUpdates.resize(controlPacket.nBlockUpdates * 2);
+        network->read(ROOT_SOCKET_INDEX, blockUpdates.data(), blockUpdates.size() * sizeof(NnUint));
+        for (NnUint i = 0; i < blockUpdates.size(); i += 2)
+            blockTablePipe[blockUpdates[i]] = (float)blockUpdates[i + 1];
+    }
+    if ((controlPacket.flags & LLM_CTRL_KV_EVICT) != 0u) {
+        if (kvEvictPipe == nullptr)
+            throw std::runtime_error("The net config does not have the KVEV pipe");
+        network->read(ROOT_SOCKET_INDEX, kvEviction, sizeof(kvEviction));
+        for (NnUint i = 0; i < 4; i++)
+            kvEvictPipe[i] = (float)kvEviction[i];
+    } else if (kvEvictPipe != nullptr) {
+        kvEvictPipe[2] = 0.0f;
+    }
     execution->setBatchSize(controlPacket.batchSize);
+    execution->setLogitsRows(controlPacket.nLogitsRows);
     return true;
 }
 
+// Bytes of the net the node can allocate
+static NnSize getAvailableMemory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return (NnSize)status.ullAvailPhys;
+#else
+#ifdef __linux__
+    FILE *file = fopen("/proc/meminfo", "r");
+    if (file != nullptr) {
+        char line[128];
+        unsigned long long kb = 0;
+        while (fgets(line, sizeof(line), file) != nullptr) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+                break;
+        }
+        fclose(file);
+        if (kb > 0)
+            return (NnSize)kb * 1024;
+    }
+#endif
+    const long nPages = sysconf(_SC_PHYS_PAGES);
+    const long pageSize = sysconf(_SC_PAGE_SIZE);
+    if (nPages > 0 && pageSize > 0)
+        return (NnSize)nPages * (NnSize)pageSize;
+#endif
+    throw std::runtime_error("Cannot read the available memory");
+}
+
+#define CALIBRATION_ITERATIONS 8
+#define CALIBRATION_MAX_SEQ_LEN 4096
+
+// Runs one matmul (dim -> hiddenDim) and the attention of one token in the middle of the context,
+// the throughput of both is read from the trace of the forwards
+static LlmNodeProfile measureNodeProfile(const LlmCalibrationPacket *packet, NnUint nThreads) {
+    const NnFloatType weightType = (NnFloatType)packet->weightType;
+    const NnFloatType inputType = weightType == F_32 ? F_32 : F_Q80;
+    const NnUint seqLen = std::min(packet->seqLen, (NnUint)CALIBRATION_MAX_SEQ_LEN);
+    const NnUint qDim = packet->nHeads * packet->headDim;
+    const NnUint kvDim = packet->nKvHeads * packet->headDim;
+    const NnUint position = seqLen / 2;
+
+    NnNetConfigBuilder netBuilder(1, 1);
+    const NnUint xPipeIndex = netBuilder.addPipe("X", size2D(inputType, 1, packet->dim));
+    const NnUint yPipeIndex = netBuilder.addPipe("Y", size2D(F_32, 1, packet->hiddenDim));
+    const NnUint positionPipeIndex = netBuilder.addPipe("POS", size2D(F_32, 1, 1));
+    const NnUint zPipeIndex = netBuilder.addPipe("Z", size2D(F_32, 1, qDim));
+    NnNodeConfigBuilder nodeBuilder(0);
+    const NnKvCacheSlice kvCacheSlice = sliceKvCache(kvDim, seqLen, 1);
+    const NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(packet->nHeads, seqLen, 1, 1);
+    const NnUint expertIndexesBufferIndex = nodeBuilder.addBuffer("act_exp_ix", size2D(F_32, 1, 1));
+    const NnUint qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, 1, qDim));
+    const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize);
+    const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize);
+    const NnUint attBufferIndex = nodeBuilder.addBuffer("att", multiHeadAttSlice.attSize);
+    NnSegmentConfigBuilder segmentBuilder;
+    const NnSize3D weightSize = size2D(weightType, packet->dim, packet->hiddenDim);
+    segmentBuilder.addOp(OP_MATMUL, "calibration_matmul", 0,
+        pointerBatchConfig(SRC_PIPE, xPipeIndex),
+        pointerBatchConfig(SRC_PIPE, yPipeIndex),
+        weightSize,
+        NnMatmulOpConfig{0, 0, expertIndexesBufferIndex});
+    segmentBuilder.addOp(OP_MULTIHEAD_ATT, "calibration_att", 0,
+        pointerBatchConfig(SRC_PIPE, zPipeIndex),
+        pointerBatchConfig(SRC_PIPE, zPipeIndex),
+        size0(),
+        NnMultiHeadAttOpConfig{
+            multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0,
+            packet->nKvHeads, packet->headDim, seqLen, qDim, kvCacheSlice.kvDim0,
+            positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
+            1u, 0u, 0u, 0u, F_32});
+    nodeBuilder.addSegment(segmentBuilder.build());
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+    std::unique_ptr<NnNetConfig, void(*)(NnNetConfig *)> netConfigPtr(&netConfig, releaseNetConfig);
+    std::unique_ptr<NnNodeConfig, void(*)(NnNodeConfig *)> nodeConfigPtr(&nodeConfig, releaseNodeConfig);
+
+    NnNetExecution execution(nThreads, &netConfig);
+    std::vector<NnExecutorDevice> devices;
+    devices.push_back(NnExecutorDevice(new NnCpuDevice(&netConfig, &nodeConfig, &execution), -1, -1));
+    NnFakeNodeSynchronizer synchronizer;
+    NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+    // Zeros run as fast as real weights and activations
+    std::vector<NnByte> weight(weightSize.nBytes, 0);
+    executor.loadWeight("calibration_matmul", 0u, 0u, weightSize.nBytes, weight.data());
+    ((float *)execution.pipes[positionPipeIndex])[0] = (float)position;
+    execution.setBatchSize(1);
+    executor.setTraceEnabled(true);
+
+    NnSize matmulUs = 0;
+    NnSize attUs = 0;
+    for (NnUint i = 0; i <= CALIBRATION_ITERATIONS; i++) {
+        executor.forward();
+        if (i == 0)
+            continue; // warm-up
+        for (const NnTraceEvent &event : executor.getTrace()) {
+            const NnSize us = std::max(event.endUs - event.startUs, (NnSize)1);
+            NnSize *best = std::strcmp(event.name, "calibration_matmul") == 0 ? &matmulUs
+                : std::strcmp(event.name, "calibration_att") == 0 ? &attUs : nullptr;
+            if (best != nullptr && (*best == 0 || us < *best))
+                *best = us;
+        }
+    }
+
+    LlmNodeProfile profile;
+    profile.matmulGbps = weightSize.nBytes / (matmulUs * 1e3f);
+    profile.attGbps = (2.0f * (position + 1) * kvDim * sizeof(float)) / (attUs * 1e3f);
+    profile.availableMemory = getAvailableMemory();
+    return profile;
+}
+
+static void runWorkerCalibration(NnNetwork *network, NnUint nThreads) {
+    LlmCalibrationPacket packet;
+    network->read(ROOT_SOCKET_INDEX, &packet, sizeof(packet));
+    printf("⏱️  Calibration...\n");
+    LlmNodeProfile profile = measureNodeProfile(&packet, nThreads);
+    network->write(ROOT_SOCKET_INDEX, &profile, sizeof(profile));
+}
+
+static void printLinkMatrix(const NnLinkMatrix *links) {
+    for (NnUint a = 0; a < links->nNodes; a++) {
+        for (NnUint b = a + 1; b < links->nNodes; b++) {
+            const NnLinkProfile &link = links->get(a, b);
+            printf("⏱️  Link %u-%u: %.1f us %.3f GB/s\n", a, b, link.latencyUs, link.gbps);
+        }
+    }
+}
+
+// --ratios auto: every node measures itself, then every pair of nodes probes its link
+static std::string calibrateRatios(AppCliArgs *args, LlmHeader *header, NnNetwork *network, NnUint nNodes) {
+    // Before the nodes spend time on the measurements
+    if (nNodes > LLM_PLAN_MAX_NODES)
+        throw std::runtime_error("--ratios auto supports up to " + std::to_string(LLM_PLAN_MAX_NODES) + " nodes, got " + std::to_string(nNodes));
+    LlmCalibrationPacket packet;
+    packet.dim = header->dim;
+    packet.hiddenDim = header->archType == QWEN3_MOE ? header->moeHiddenDim : header->hiddenDim;
+    packet.nHeads = header->nHeads;
+    packet.nKvHeads = header->nKvHeads;
+    packet.headDim = header->headDim;
+    packet.seqLen = header->seqLen;
+    packet.weightType = (NnUint)header->weightType;
+
+    printf("⏱️  Calibration...\n");
+    std::vector<LlmNodeProfile> profiles(nNodes);
+    profiles[0] = measureNodeProfile(&packet, args->nThreads);
+    // One worker at a time, so nodes sharing a host do not disturb each other
+    for (NnUint nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        const NnUint socketIndex = nodeIndex - 1;
+        network->write(socketIndex, &packet, sizeof(packet));
+        network->read(socketIndex, &profiles[nodeIndex], sizeof(LlmNodeProfile));
+    }
+    network->probeLinks();
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        const LlmNodeProfile &p = profiles[nodeIndex];
+        printf("⏱️  Node %u: matmul %.2f GB/s, attention %.2f GB/s, %zu MB free\n",
+            nodeIndex, p.matmulGbps, p.attGbps, (size_t)(p.availableMemory / (1024 * 1024)));
+    }
+    printLinkMatrix(network->getLinkMatrix());
+    return planLlmRatios(header, profiles, *network->getLinkMatrix(), args->nBatches,
+        getPlanExperts(*header, args->moeExpertParallel));
+}
+
+// Vulkan uploads go through one staging buffer, only CPU weights are copied in parallel
+static NnUint getLocalLoaderThreads(AppCliArgs *args) {
+    return args->gpuIndex >= 0 ? 1u : args->nThreads;
+}
+
 void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context)) {
     NnUint nNodes = args->nWorkers + 1;
     LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType);
-
-    if (nNodes > header.nKvHeads)
+    header.nKvSlots = args->nKvSlots;
+    header.kvBlockSize = args->kvBlockSize;
+    header.nKvBlocks = args->nKvBlocks;
+    header.kvCacheType = args->kvCacheType;
+    header.logitsTopk = args->logitsTopk;
+    header.ppSyncCodec = args->ppSyncCodec;
+    header.tpSyncCodec = args->tpSyncCodec;
+    if (args->seqParallel)
+        header.seqShardBlock = LLM_SEQ_SHARD_BLOCK;
+    header.nKvSinks = args->kvSinks;
+    if (header.nKvSinks > 0 && header.nKvSinks + args->nBatches >= header.seqLen)
+        throw std::runtime_error("--kv-sinks with the batch size must leave a part of the sequence length to the window");
+    if (header.kvCacheType == F_Q80 && header.headDim % Q80_BLOCK_SIZE != 0)
+        throw std::runtime_error("The Q80 KV cache requires the head dimension to be a multiple of 32");
+
+    if (args->seqParallel && header.nHeads % nNodes != 0)
+        throw std::runtime_error("--seq-parallel requires the number of heads to be divisible by the number of nodes");
+    if (!args->seqParallel && nNodes > header.nKvHeads)
         // TODO: https://github.com/b4rtaz/distributed-llama/issues/70
         throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model");
 
@@ -739,24 +1679,55 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
         printf("Tokenizer vocab size (%d) does not match the model vocab size (%d)\n", tokenizer.vocabSize, header.vocabSize);
 
     Sampler sampler(tokenizer.vocabSize, args->temperature, args->topp, args->seed);
+    sampler.setMinP(args->minp);
+    std::unique_ptr<NnNetwork> networkPtr(nullptr);
+    NnNetwork *network = nullptr;
+    if (nNodes > 1) {
+        networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts);
+        network = networkPtr.get();
+        network->negotiateTransports(args->netShm, NET_SHM_RING_SIZE);
+        if (args->netZeroCopy)
+            enableNetZeroCopy(network);
+    }
+
+    const char *ratiosStr = args->ratiosStr;
+    std::string calibratedRatios;
+    if (ratiosStr != nullptr && std::strcmp(ratiosStr, "auto") == 0) {
+        if (nNodes == 1) {
+            ratiosStr = nullptr;
+        } else {
+            for (NnUint nodeIndex = 1; nodeIndex < nNodes; ++nodeIndex)
+                writeBootstrapPacket(network, nodeIndex - 1, args, nullptr, LLM_BOOTSTRAP_CALIBRATE);
+            calibratedRatios = calibrateRatios(args, &header, network, nNodes);
+            ratiosStr = calibratedRatios.c_str();
+        }
+    } else if (args->netProbe && nNodes > 1) {
+        for (NnUint nodeIndex = 1; nodeIndex < nNodes; ++nodeIndex)
+            writeBootstrapPacket(network, nodeIndex - 1, args, nullptr, LLM_BOOTSTRAP_PROBE_LINKS);
+        printf("⏱️  Probing links...\n");
+        network->probeLinks();
+        printLinkMatrix(network->getLinkMatrix());
+    }
+
     LlmNet net;
     std::unique_ptr<NnUnevenPartitionPlan> planPtr;
     std::vector<float> ratios;
 
-    if(args->ratiosStr != nullptr){
+    if(ratiosStr != nullptr){
         printf("nNodes=%d\n", nNodes);
-        std::vector<NnStageDef> stageDefs = parseStageDefs(args->ratiosStr, nNodes, header.nLayers);
+        std::vector<NnStageDef> stageDefs = parseStageDefs(ratiosStr, nNodes, header.nLayers);
         NnUint ffDim = (header.archType == QWEN3_MOE) ? header.moeHiddenDim : header.hiddenDim;
 
         planPtr.reset(new NnUnevenPartitionPlan(
-            createPartitionPlan(stageDefs, header.nHeads, header.nKvHeads, header.vocabSize, ffDim, header.dim)
+            createPartitionPlan(stageDefs, header.nHeads, header.nKvHeads, header.vocabSize, ffDim, header.dim,
+                getPlanExperts(header, args->moeExpertParallel), getLlmFfnAlignSize(&header))
         ));
         
         // 使用 Uneven Builder (传入 planPtr)
         net = buildLlmNetUneven(&header, nNodes, args->nBatches, planPtr.get());
         
         if (args->info) {
-            printf("⚖️  Uneven partitioning strategy enabled: %s\n", args->ratiosStr);
+            printf("⚖️  Uneven partitioning strategy enabled: %s\n", ratiosStr);
             printPartitionPlanDebug(planPtr.get());
         }
     } else {
@@ -777,49 +1748,81 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     NnNetExecution execution(args->nThreads, &net.netConfig);
 
     std::unique_ptr<NnNodeSynchronizer> synchronizer(nullptr);
-    std::unique_ptr<NnNetwork> networkPtr(nullptr);
-    NnNetwork *network = nullptr;
+    NnNetworkNodeSynchronizer *networkSynchronizer = nullptr;
 
     if (nNodes == 1) {
         synchronizer.reset(new NnFakeNodeSynchronizer());
     } else {
-        networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts);
-        network = networkPtr.get();
-
         // Bootstrap: send modelPath/ratios/maxSeqLen/syncType to workers so they don't need CLI args.
         for (NnUint nodeIndex = 1; nodeIndex < nNodes; ++nodeIndex) {
             const NnUint socketIndex = nodeIndex - 1;
-            writeBootstrapPacket(network, socketIndex, args);
+            writeBootstrapPacket(network, socketIndex, args, ratiosStr);
         }
 
         // 初始化 Synchronizer (传入 Plan)
-        synchronizer.reset(new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig, planPtr.get()));
+        networkSynchronizer = new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig, planPtr.get());
+        synchronizer.reset(networkSynchronizer);
 
         NnRootConfigWriter configWriter(network);
         configWriter.writeToWorkers(&net.netConfig, net.nodeConfigs);
     }
 
-    std::vector<NnExecutorDevice> devices = resolveDevices(args, &net.netConfig, rootNodeConfig, &execution, planPtr.get());
-    const bool profileEnabled = args->benchmark;
+    checkExpertCache(args, nNodes, planPtr.get(), true);
+    LlmMappedFile mappedModel; // outlives the devices
+    const NnCpuPlacement placement = createCpuPlacement(args->nThreads, args->cpuAffinity, args->numa);
+    std::vector<NnExecutorDevice> devices = resolveDevices(args, &net.netConfig, rootNodeConfig, &execution, planPtr.get(), &placement);
+    const bool profileEnabled = args->benchmark || args->tracePath != nullptr;
     NnExecutor executor(&net.netConfig, rootNodeConfig, &devices, &execution, synchronizer.get(), profileEnabled);
+    executor.setThreadCpus(placement.threadCpus);
 
     // Load weights
-    if (args->ratiosStr != nullptr) {
+    if (ratiosStr != nullptr) {
         // [非均匀/PP 模式]：强制使用本地加载 (Local Loading)
         printf("🚀 Local Loading Mode (Root): Loading weights locally...\n");
         
-        NnLocalWeightLoader localLoader(&executor, 0); 
-        // 传入 0 作为 Root 的 nodeIndex
-        loadLlmNetWeightUneven(args->modelPath, &net, &localLoader, planPtr.get(), 0);
+        NnLocalWeightLoader localLoader(&executor, 0, getLocalLoaderThreads(args));
+        if (args->shardPath != nullptr) {
+            loadLlmNetWeightShard(args->shardPath, &net, &localLoader, 0, ratiosStr, args->moeExpertCache > 0u ? &mappedModel : nullptr);
+        } else {
+            // 传入 0 作为 Root 的 nodeIndex
+            loadLlmNetWeightUneven(args->modelPath, &net, &localLoader, planPtr.get(), 0, args->moeExpertCache > 0u ? &mappedModel : nullptr);
+        }
         printf("✅ Root: Weights loaded locally.\n");
 
     } else {
         // [均匀模式]：保持原有行为 (网络分发)
         NnRootWeightLoader weightLoader(&executor, network, nNodes);
-        loadLlmNetWeight(args->modelPath, &net, &weightLoader);
+        loadLlmNetWeight(args->modelPath, &net, &weightLoader, args->moeExpertCache > 0u ? &mappedModel : nullptr);
+        if (network != nullptr) {
+            NnSize sentBytes, recvBytes;
+            NnNetworkIoStats ioStats;
+            network->getStats(&sentBytes, &recvBytes, &ioStats);
+            printf("💿 Weights sent: %zu kB in %zu send calls, %zu kB zero-copy\n",
+                sentBytes / 1024, ioStats.nSendCalls, ioStats.zeroCopyBytes / 1024);
+        }
     }
 
-    RootLlmInference inference(&net, &execution, &executor, network, planPtr.get(), profileEnabled);
+    printArenaStats(devices);
+
+    RootLlmInference inference(&net, &execution, &executor, network, planPtr.get(), profileEnabled, networkSynchronizer);
+    inference.setMicroBatchSize(args->microBatchSize);
+    std::unique_ptr<LlmTraceWriter> traceWriter;
+    if (args->tracePath != nullptr) {
+        traceWriter.reset(new LlmTraceWriter(args->tracePath, nNodes, planPtr.get()));
+        inference.setTraceWriter(traceWriter.get());
+        printf("📈 Tracing every forward to %s\n", args->tracePath);
+    }
+
+    // The draft model runs on the root only, workers don't know about it
+    std::unique_ptr<LlmDraftModel> draftModel;
+    std::unique_ptr<SpeculativeDecoder> speculativeDecoder;
+    if (args->draftModelPath != nullptr) {
+        printf("🔮 Loading the draft model: %s\n", args->draftModelPath);
+        draftModel.reset(new LlmDraftModel(args, header.seqLen));
+        speculativeDecoder.reset(new SpeculativeDecoder(&inference, &header, draftModel->inference.get(), &draftModel->header,
+            args->nDraftTokens, args->nBatches));
+        printf("🔮 Speculative decoding: %u draft tokens\n", args->nDraftTokens);
+    }
 
     if (network != nullptr) {
         network->resetStats();
@@ -833,6 +1836,7 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     context.args = args;
     context.header = &header;
     context.inference = &inference;
+    context.speculativeDecoder = speculativeDecoder.get();
     context.sampler = &sampler;
     context.tokenizer = &tokenizer;
     context.network = network;
@@ -841,17 +1845,27 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     handler(&context);
 
     inference.finish();
+    printExpertCacheStats(devices);
 }
 
 void runWorkerApp(AppCliArgs *args) {
     while (true) {
         std::unique_ptr<NnNetwork> networkPtr = NnNetwork::serve(args->port);
         NnNetwork *network = networkPtr.get();
+        network->negotiateTransports(args->netShm, NET_SHM_RING_SIZE);
+        if (args->netZeroCopy)
+            enableNetZeroCopy(network);
 
         // Read bootstrap settings from root.
         std::string bootModelPath;
         std::string bootRatios;
         LlmBootstrapPacket boot = readBootstrapPacket(network, bootModelPath, bootRatios);
+        while ((boot.flags & (LLM_BOOTSTRAP_CALIBRATE | LLM_BOOTSTRAP_PROBE_LINKS)) != 0u) {
+            if ((boot.flags & LLM_BOOTSTRAP_CALIBRATE) != 0u)
+                runWorkerCalibration(network, args->nThreads);
+            network->probeLinks();
+            boot = readBootstrapPacket(network, bootModelPath, bootRatios);
+        }
 
         const bool hasBootModel = !bootModelPath.empty();
         const bool hasBootRatios = !bootRatios.empty();
@@ -859,6 +1873,8 @@ void runWorkerApp(AppCliArgs *args) {
         const NnUint bootMaxSeqLen = boot.maxSeqLen;
         const NnFloatType bootSyncType = (NnFloatType)boot.syncType;
         const bool bootBenchmarkEnabled = boot.benchmarkEnabled != 0u;
+        // A pre-sharded file replaces the model file of the root, it has the same header
+        const std::string localModelPath = args->shardPath != nullptr ? std::string(args->shardPath) : bootModelPath;
 
         NnWorkerConfigReader configReader(network);
         NnNetConfig netConfig = configReader.readNet();
@@ -876,10 +1892,10 @@ void runWorkerApp(AppCliArgs *args) {
         
            if (useLocalLoading) {
                // Worker 需要重新加载 Header 和 Plan 以确定加载逻辑和切分
-               LlmHeader header = loadLlmHeader((char*)bootModelPath.c_str(), bootMaxSeqLen, bootSyncType);
+               LlmHeader header = loadLlmHeader(localModelPath.c_str(), bootMaxSeqLen, bootSyncType);
              
              // [兼容性修复] 自动切换 Q80
-             if (header.weightType == F_Q40 && header.syncType != F_Q80) {
+             if ((header.weightType == F_Q40 || header.weightType == F_Q4K || header.weightType == F_Q6K) && header.syncType != F_Q80) {
                  header.syncType = F_Q80;
              }
 
@@ -888,11 +1904,15 @@ void runWorkerApp(AppCliArgs *args) {
              
 
              planPtr.reset(new NnUnevenPartitionPlan(
-                 createPartitionPlan(stageDefs, header.nHeads, header.nKvHeads, header.vocabSize, ffDim, header.dim)
+                 createPartitionPlan(stageDefs, header.nHeads, header.nKvHeads, header.vocabSize, ffDim, header.dim,
+                     getPlanExperts(header, (boot.flags & LLM_BOOTSTRAP_EXPERT_PARALLEL) != 0u), getLlmFfnAlignSize(&header))
              ));
         }
 
-        std::vector<NnExecutorDevice> devices = resolveDevices(args, &netConfig, &nodeConfig, &execution, planPtr.get());
+        checkExpertCache(args, netConfig.nNodes, planPtr.get(), useLocalLoading);
+        LlmMappedFile mappedModel; // outlives the devices
+        const NnCpuPlacement placement = createCpuPlacement(args->nThreads, args->cpuAffinity, args->numa);
+        std::vector<NnExecutorDevice> devices = resolveDevices(args, &netConfig, &nodeConfig, &execution, planPtr.get(), &placement);
         
         // Initialize Synchronizer with Plan
         NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig, planPtr.get());
@@ -901,13 +1921,14 @@ void runWorkerApp(AppCliArgs *args) {
         // Worker CLI --benchmark is no longer required.
         const bool profileEnabled = bootBenchmarkEnabled;
         NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, profileEnabled);
+        executor.setThreadCpus(placement.threadCpus);
 
         if (useLocalLoading) {
             // [Local Loading Mode]
-            printf("🚀 Worker %d: Local Loading Mode from %s\n", nodeConfig.nodeIndex, bootModelPath.c_str());
+            printf("🚀 Worker %d: Local Loading Mode from %s\n", nodeConfig.nodeIndex, localModelPath.c_str());
             
             // Reload header for temporary network construction
-            LlmHeader header = loadLlmHeader((char*)bootModelPath.c_str(), bootMaxSeqLen, bootSyncType);
+            LlmHeader header = loadLlmHeader(localModelPath.c_str(), bootMaxSeqLen, bootSyncType);
             
             // Build temporary Net for loading context
             // 这里我们需要构建一个临时的 LlmNet 结构，因为 loader 需要 net 指针
@@ -915,10 +1936,16 @@ void runWorkerApp(AppCliArgs *args) {
             LlmNet tempNet = buildLlmNetUneven(&header, netConfig.nNodes, 1, planPtr.get());
 
             // Execute local loading
-            NnLocalWeightLoader localLoader(&executor, nodeConfig.nodeIndex);
+            NnLocalWeightLoader localLoader(&executor, nodeConfig.nodeIndex, getLocalLoaderThreads(args));
             
-            // 使用新版 5 参数加载函数
-            loadLlmNetWeightUneven((char*)bootModelPath.c_str(), &tempNet, &localLoader, planPtr.get(), nodeConfig.nodeIndex);
+            if (args->shardPath != nullptr) {
+                loadLlmNetWeightShard(args->shardPath, &tempNet, &localLoader, nodeConfig.nodeIndex, bootRatios.c_str(),
+                    args->moeExpertCache > 0u ? &mappedModel : nullptr);
+            } else {
+                // 使用新版 5 参数加载函数
+                loadLlmNetWeightUneven(bootModelPath.c_str(), &tempNet, &localLoader, planPtr.get(), nodeConfig.nodeIndex,
+                    args->moeExpertCache > 0u ? &mappedModel : nullptr);
+            }
 
             releaseLlmNet(&tempNet);
             printf("✅ Worker %d: Weights loaded locally.\n", nodeConfig.nodeIndex);
@@ -929,8 +1956,9 @@ void runWorkerApp(AppCliArgs *args) {
             NnWorkerWeightReader weightReader(&executor, network);
             weightReader.read();
         }
+        printArenaStats(devices);
 
-        WorkerLlmInference inference(&execution, network);
+        WorkerLlmInference inference(&execution, network, &netConfig);
         bool isFirstAttempt = true;
         bool isTurboEnabled = false;
         clock_t startTime;
@@ -957,6 +1985,9 @@ void runWorkerApp(AppCliArgs *args) {
                     isTurboEnabled = true;
                     printf("🚁 Network is in non-blocking mode\n");
                 }
+                synchronizer.setSkipLogitsSync((inference.flags() & LLM_CTRL_SKIP_LOGITS) != 0u);
+                const bool isTraced = (inference.flags() & LLM_CTRL_TRACE) != 0u;
+                executor.setTraceEnabled(isTraced);
                 executor.forward();
 
                 // Send per-forward profile packet to root (optional)
@@ -972,6 +2003,18 @@ void runWorkerApp(AppCliArgs *args) {
                     p.execUs = executor.getTotalTime(STEP_EXECUTE_OP);
                     p.syncUs = executor.getTotalTime(STEP_SYNC_NODES);
                     network->write(ROOT_SOCKET_INDEX, &p, sizeof(LlmPerfPacket));
+                    if (isTraced) {
+                        const std::vector<NnTraceEvent> &events = executor.getTrace();
+                        LlmTraceHeader traceHeader;
+                        traceHeader.nodeIndex = nodeConfig.nodeIndex;
+                        traceHeader.stageIndex = p.stageIndex;
+                        traceHeader.nEvents = (NnUint)events.size();
+                        NnIoBuffer buffers[2] = {
+                            { &traceHeader, sizeof(LlmTraceHeader) },
+                            { events.data(), events.size() * sizeof(NnTraceEvent) },
+                        };
+                        network->writeGather(ROOT_SOCKET_INDEX, 2, buffers);
+                    }
                 }
                 isFirstAttempt = true;
             } catch (const NnTransferSocketException &e) {
@@ -982,5 +2025,24 @@ void runWorkerApp(AppCliArgs *args) {
                 break;
             }
         }
+        printExpertCacheStats(devices);
     }
-}
\ No newline at end of file
+}
+void runShardApp(AppCliArgs *args) {
+    if (args->modelPath == nullptr || args->ratiosStr == nullptr || args->shardPath == nullptr || args->nShardNodes < 1)
+        throw std::runtime_error("The shard mode requires --model, --ratios, --nodes and --shard <output prefix>");
+
+    const NnUint nNodes = args->nShardNodes;
+    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType);
+    std::vector<NnStageDef> stageDefs = parseStageDefs(args->ratiosStr, nNodes, header.nLayers);
+    NnUint ffDim = (header.archType == QWEN3_MOE) ? header.moeHiddenDim : header.hiddenDim;
+    NnUnevenPartitionPlan plan = createPartitionPlan(stageDefs, header.nHeads, header.nKvHeads, header.vocabSize, ffDim, header.dim,
+        getPlanExperts(header, args->moeExpertParallel), getLlmFfnAlignSize(&header));
+
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        const std::string shardPath = std::string(args->shardPath) + ".node" + std::to_string(nodeIndex);
+        LlmNet net = buildLlmNetUneven(&header, nNodes, 1, &plan);
+        std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
+        writeLlmNetShard(args->modelPath, shardPath.c_str(), &net, &plan, nodeIndex, args->ratiosStr);
+    }
+}
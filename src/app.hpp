@@ -23,23 +23,49 @@ public:
     char *modelPath;
     char *tokenizerPath;
     char *prompt;
+    char *datasetPath;   // perplexity: JSON Lines with the "text" field, one document per line
     NnFloatType syncType;
+    NnSyncCodec ppSyncCodec;
+    NnSyncCodec tpSyncCodec;
     NnUint nWorkers;
     char **workerHosts;
     NnUint *workerPorts;
     float temperature;
     float topp;
+    float minp;
     NnUint steps;
     bool benchmark;
     unsigned long long seed;
     ChatTemplateType chatTemplateType;
     NnUint maxSeqLen;
     bool netTurbo;
+    bool netZeroCopy;
+    bool netShm;
+    bool netProbe;
     int gpuIndex;
     int gpuSegmentFrom;
     int gpuSegmentTo;
 
     char *ratiosStr; 
+    bool moeExpertParallel; // whole MoE experts per node, requires --ratios
+    NnUint moeExpertCache;  // resident experts of every MoE matmul of this node, 0 keeps all of them
+    bool opFusion;          // CPU segments run fused chains of ops (getCpuOpFusion)
+    bool weightRepack;      // CPU: dense Q40 matmul weights interleaved at load time (NnBlockQ40x4)
+    bool numa;              // CPU: threads grouped by NUMA nodes, weights placed on the node of their threads
+    char *cpuAffinity;      // CPU list of the threads ("0-15,32-47"), nullptr = not pinned (unless numa)
+    char *shardPath;     // pre-sharded weights of this node, the output prefix in the shard mode
+    NnUint nShardNodes;  // shard mode
+    NnUint microBatchSize;
+    NnUint nKvSlots;
+    NnUint kvBlockSize;
+    NnUint nKvBlocks;
+    NnFloatType kvCacheType;
+    char *draftModelPath;
+    NnUint nDraftTokens;
+    NnUint logitsTopk;
+    bool seqParallel;    // KV cache split along the time axis, attention partials merged across nodes
+    NnUint kvSinks;      // dllama-api: first tokens kept in the KV cache when the window slides, 0 = no sliding
+    char *tracePath;     // Chrome trace JSON of all nodes, enables the per-forward profiling
 
     // worker
     NnUint port;
@@ -52,11 +78,24 @@ public:
 typedef struct {
     NnUint position;
     NnUint batchSize; // 0 = stop signal
-    NnUint flags;     // bit0: enable per-token profiling
+    NnUint flags;     // LlmControlFlags
+    NnUint slot;      // KV cache slot of the contiguous run (ignored with LLM_CTRL_ROW_POSITIONS)
+    NnUint nBlockUpdates; // (entry, block) pairs of the paged KV cache block table sent after the row positions
+    NnUint nLogitsRows;   // first rows of the batch that run the final norm, the vocab matmul and the logits sync, 0 with LLM_CTRL_SKIP_LOGITS
 } LlmControlPacket;
 
 enum LlmControlFlags : NnUint {
     LLM_CTRL_PROFILE = 1u << 0,
+    // No logits (prefill chunks, non-final micro-batches), nodes skip the final norm, the vocab matmul and the logits sync
+    LLM_CTRL_SKIP_LOGITS = 1u << 1,
+    // The packet is followed by batchSize (position, slot) pairs, rows are independent
+    LLM_CTRL_ROW_POSITIONS = 1u << 2,
+    // Nodes send LlmTraceHeader + NnTraceEvent[] after the LlmPerfPacket, requires LLM_CTRL_PROFILE
+    LLM_CTRL_TRACE = 1u << 3,
+    // No forward, the node answers with its getTraceTimeUs() right away
+    LLM_CTRL_CLOCK_PROBE = 1u << 4,
+    // The packet is followed by the eviction [slot, start, nDiscard, nRows] of OP_KV_EVICT, after the block updates
+    LLM_CTRL_KV_EVICT = 1u << 5,
 };
 
 typedef struct {
@@ -68,16 +107,44 @@ typedef struct {
     NnUint syncUs;
 } LlmPerfPacket;
 
+typedef struct {
+    NnUint nodeIndex;
+    NnUint stageIndex;
+    NnUint nEvents;
+} LlmTraceHeader;
+
+// Chrome trace JSON (chrome://tracing, Perfetto) of the traced forwards, one process per node.
+// Timestamps of other nodes are moved to the clock of the root by the measured offsets.
+class LlmTraceWriter {
+private:
+    FILE *file;
+    const char *path;
+    bool hasBase;
+    NnSize baseUs;
+    NnSize nEvents;
+    void writeEvent(const char *name, const char *category, NnUint nodeIndex, NnUint threadIndex, long long startUs, long long durationUs, const std::string &args);
+public:
+    LlmTraceWriter(const char *path, NnUint nNodes, const NnUnevenPartitionPlan *plan);
+    ~LlmTraceWriter();
+    // clockOffsetUs = clock of the node - clock of the root
+    void write(NnUint nodeIndex, NnUint position, const NnTraceEvent *events, NnUint nEvents, long long clockOffsetUs);
+};
+
 // Bootstrap settings sent from root to worker after socket connect and before
 // sending net/node configs. This removes the need for workers to pass --model/--ratios.
 enum LlmBootstrapFlags : NnUint {
     LLM_BOOTSTRAP_HAS_MODEL_PATH = 1u << 0,
     LLM_BOOTSTRAP_HAS_RATIOS     = 1u << 1,
+    LLM_BOOTSTRAP_EXPERT_PARALLEL = 1u << 2,
+    // --ratios auto: the worker runs the calibration, then it reads the final bootstrap packet
+    LLM_BOOTSTRAP_CALIBRATE = 1u << 3,
+    // --net-probe: the worker joins NnNetwork::probeLinks, then it reads the final bootstrap packet
+    LLM_BOOTSTRAP_PROBE_LINKS = 1u << 4,
 };
 
 typedef struct {
     NnUint magic;      // 'DLBM'
-    NnUint version;    // 2
+    NnUint version;    // LLM_BOOTSTRAP_VERSION
     NnUint flags;      // LlmBootstrapFlags
     NnUint benchmarkEnabled; // 0/1, enables executor timer on workers
     NnUint maxSeqLen;  // forwarded from root args
@@ -87,28 +154,83 @@ typedef struct {
 } LlmBootstrapPacket;
 
 static constexpr NnUint LLM_BOOTSTRAP_MAGIC = 0x4d424c44u; // 'DLBM' little-endian
-static constexpr NnUint LLM_BOOTSTRAP_VERSION = 2u;
+static constexpr NnUint LLM_BOOTSTRAP_VERSION = 10u;
+
+// Shapes of the calibration ops of --ratios auto, the worker answers with its LlmNodeProfile
+// and then joins NnNetwork::probeLinks
+typedef struct {
+    NnUint dim;
+    NnUint hiddenDim;
+    NnUint nHeads;
+    NnUint nKvHeads;
+    NnUint headDim;
+    NnUint seqLen;
+    NnUint weightType; // NnFloatType
+} LlmCalibrationPacket;
 
 class RootLlmInference {
 public:
     float *logitsPipe;
     const std::vector<LlmPerfPacket>& getLastPerf() const { return lastPerf; }
+    // nullptr if the KV cache is not paged
+    NnKvBlockTable *getKvBlockTable() { return kvBlockTable.get(); }
 private:
     float *tokenPipe;
     float *positionPipe;
+    float *slotPipe;
+    float *blockTablePipe;
+    float *kvEvictPipe;
     LlmHeader *header;
     NnNetExecution *execution;
     NnExecutor *executor;
     NnNetwork *network;
+    NnNetworkNodeSynchronizer *synchronizer;
     LlmControlPacket controlPacket;
     bool profileEnabled = false;
     const NnUnevenPartitionPlan* plan = nullptr;
     std::vector<LlmPerfPacket> lastPerf;
+    NnUint microBatchSize = 0;
+    NnUint nLogitsRows = 0; // last rows of the batch with logits, 0 = all rows
+    bool isSkippingLogits = false;
+    std::vector<NnUint> rowPositions; // (position, slot) per row
+    std::unique_ptr<NnKvBlockTable> kvBlockTable;
+    std::vector<NnUint> blockUpdates;
+    NnUint kvEviction[4];
+    NnUint nNodes;
+    float *logitsTopkPipe;
+    std::vector<NnUint> logitsNodes; // nodes writing a slot of the logits top-k pipe
+    void updateKvBlockTable();
+    void expandLogitsTopk();
+    LlmTraceWriter *traceWriter = nullptr;
+    std::vector<long long> clockOffsets; // per node, clock of the node - clock of the root
+    std::vector<NnTraceEvent> traceEvents;
+    void probeClockOffsets();
+    void writeTrace();
+    void rotateRows(NnUint middle);
+    void forwardStep(NnUint nRows); // nRows = last rows with logits, 0 = all rows
+    void forwardMicroBatches();
 public:
-    RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnUnevenPartitionPlan* plan, bool profileEnabled);
+    RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnUnevenPartitionPlan* plan, bool profileEnabled, NnNetworkNodeSynchronizer *synchronizer = nullptr);
     void setBatchSize(NnUint batchSize);
-    void setPosition(NnUint position);
+    // Contiguous run position, position + 1, ... in one KV cache slot
+    void setPosition(NnUint position, NnUint slot = 0);
+    // Independent rows, every row has its own position and KV cache slot
+    void setRowPosition(NnUint batchIndex, NnUint position, NnUint slot);
+    // Requires nKvSinks > 0. The next forward first moves the rows [start + nDiscard, start + nDiscard + nRows)
+    // of the slot to start on all nodes, keys are rotated back by nDiscard positions. The positions of the
+    // forward are the positions after the move.
+    void evictKv(NnUint slot, NnUint start, NnUint nDiscard, NnUint nRows);
     void setToken(NnUint batchIndex, NnUint token);
+    // Only the last nRows rows of the batch get logits, the final norm, the vocab matmul and the logits
+    // sync skip the other rows. Reset to all rows by setBatchSize.
+    void setLogitsRows(NnUint nRows);
+    // The next forward computes no logits at all, the logits pipe is not written. Reset by setBatchSize.
+    void skipLogits();
+    // 0 disables the pipelined prefill schedule
+    void setMicroBatchSize(NnUint microBatchSize);
+    NnUint getMicroBatchSize() const { return microBatchSize; }
+    // Requires the profiling, every next forward is traced on all nodes
+    void setTraceWriter(LlmTraceWriter *traceWriter);
     void forward();
     void finish();
 };
@@ -121,18 +243,54 @@ public:
     NnUint flags() const { return controlPacket.flags; }
 private:
     float *positionPipe;
+    float *slotPipe;
+    float *blockTablePipe;
+    float *kvEvictPipe;
     NnNetExecution *execution;
     NnNetwork *network;
     LlmControlPacket controlPacket;
+    std::vector<NnUint> rowPositions;
+    std::vector<NnUint> blockUpdates;
+    NnUint kvEviction[4];
 public:
-    WorkerLlmInference(NnNetExecution *execution, NnNetwork *network);
+    WorkerLlmInference(NnNetExecution *execution, NnNetwork *network, NnNetConfig *netConfig);
     bool tryReadControlPacket();
 };
 
+// Speculative decoding: a draft model on the root proposes tokens, the target model
+// verifies all of them in one forward, so k tokens cost one round trip to the workers
+class SpeculativeDecoder {
+public:
+    NnUint nProposed;
+    NnUint nAccepted;
+    NnUint draftTimeUs;
+private:
+    RootLlmInference *target;
+    LlmHeader *targetHeader;
+    RootLlmInference *draft;
+    LlmHeader *draftHeader;
+    NnUint nDraftTokens;
+    NnUint nBatches;
+    std::vector<int> tokens;      // the sequence, the last token is the next input of the target model
+    std::vector<int> draftTokens; // tokens in the KV cache of the draft model
+    std::vector<int> proposal;
+    std::vector<float> draftProbs; // [nDraftTokens * vocabSize], only for non-greedy sampling
+    std::vector<float> residual;
+    int sampleToken(Sampler *sampler, float *logits, float *probs);
+    float *forwardDraft(NnUint end);
+public:
+    SpeculativeDecoder(RootLlmInference *target, LlmHeader *targetHeader, RootLlmInference *draft, LlmHeader *draftHeader, NnUint nDraftTokens, NnUint nBatches);
+    // tokens[0, n - 1) are in the KV cache of the target model, tokens[n - 1] is the next input
+    void start(const std::vector<int> &tokens);
+    // Appends at least one and at most maxTokens tokens to out
+    void step(Sampler *sampler, NnUint maxTokens, std::vector<int> &out);
+};
+
 typedef struct {
     AppCliArgs *args;
     LlmHeader *header;
     RootLlmInference *inference;
+    SpeculativeDecoder *speculativeDecoder; // nullptr without --draft-model
     Tokenizer *tokenizer;
     Sampler *sampler;
     NnNetwork *network;
@@ -141,5 +299,7 @@ typedef struct {
 
 void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context));
 void runWorkerApp(AppCliArgs *args);
+// Writes <shard>.node<i> for every node of the --ratios plan
+void runShardApp(AppCliArgs *args);
 
 #endif
@@ -11,6 +11,15 @@
 #include <csignal>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -20,6 +29,13 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
 
 #include "tokenizer.hpp"
 #include "app.hpp"
@@ -40,49 +56,347 @@ enum class HttpMethod {
     METHOD_UNKNOWN = 5
 };
 
-class HttpRequest {
+// Poller of the HTTP front end: epoll on Linux, kqueue on macOS and BSD, poll elsewhere.
+// setInterest may be called from any thread.
+#if defined(__linux__)
+    #define HTTP_POLLER_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    #define HTTP_POLLER_KQUEUE 1
+#else
+    #define HTTP_POLLER_POLL 1
+#endif
+
+#define HTTP_MAX_EVENTS 64
+#define HTTP_READ_BUFFER_SIZE (1024 * 64)
+#define HTTP_MAX_HEADER_SIZE (1024 * 64)
+#define HTTP_MAX_BODY_SIZE (1024 * 1024 * 64)
+// The poll fallback can't be woken by other threads, armed writes wait at most this long
+#define HTTP_POLL_FALLBACK_TIMEOUT_MS 5
+
+struct HttpPollEvent {
+    int fd;
+    bool readable;
+    bool writable;
+};
+
+class HttpPoller {
+private:
+#if HTTP_POLLER_EPOLL || HTTP_POLLER_KQUEUE
+    int pollFd;
+#else
+    std::mutex mutex;
+    std::map<int, short> fds; // fd -> POLLIN | POLLOUT interest
+#endif
+
 public:
-    static HttpRequest read(int serverSocket) {
-        HttpRequest req(serverSocket);
+    HttpPoller() {
+#if HTTP_POLLER_EPOLL
+        pollFd = epoll_create1(0);
+        if (pollFd < 0)
+            throw std::runtime_error("Cannot create epoll: " + std::string(strerror(errno)));
+#elif HTTP_POLLER_KQUEUE
+        pollFd = kqueue();
+        if (pollFd < 0)
+            throw std::runtime_error("Cannot create kqueue: " + std::string(strerror(errno)));
+#endif
+    }
+
+    ~HttpPoller() {
+#if HTTP_POLLER_EPOLL || HTTP_POLLER_KQUEUE
+        close(pollFd);
+#endif
+    }
+
+    void add(int fd) {
+#if HTTP_POLLER_EPOLL
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(pollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+            throw std::runtime_error("Cannot add socket to epoll: " + std::string(strerror(errno)));
+#elif HTTP_POLLER_KQUEUE
+        struct kevent changes[2];
+        EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, nullptr);
+        EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, nullptr);
+        if (kevent(pollFd, changes, 2, nullptr, 0, nullptr) != 0)
+            throw std::runtime_error("Cannot add socket to kqueue: " + std::string(strerror(errno)));
+#else
+        std::lock_guard<std::mutex> lock(mutex);
+        fds[fd] = POLLIN;
+#endif
+    }
+
+    // Errors and hang-ups are reported without read interest too
+    void setInterest(int fd, bool readable, bool writable) {
+#if HTTP_POLLER_EPOLL
+        struct epoll_event event;
+        event.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+        event.data.fd = fd;
+        epoll_ctl(pollFd, EPOLL_CTL_MOD, fd, &event);
+#elif HTTP_POLLER_KQUEUE
+        struct kevent changes[2];
+        EV_SET(&changes[0], fd, EVFILT_READ, readable ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+        EV_SET(&changes[1], fd, EVFILT_WRITE, writable ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+        kevent(pollFd, changes, 2, nullptr, 0, nullptr);
+#else
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = fds.find(fd);
+        if (it != fds.end())
+            it->second = (readable ? POLLIN : 0) | (writable ? POLLOUT : 0);
+#endif
+    }
 
-        std::vector<char> httpRequest = req.readHttpRequest();
-        // Parse the HTTP request
-        std::string data = std::string(httpRequest.begin(), httpRequest.end());
+    // Must be called before the socket is closed
+    void remove(int fd) {
+#if HTTP_POLLER_EPOLL
+        epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, nullptr);
+#elif HTTP_POLLER_KQUEUE
+        struct kevent changes[2];
+        EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+        kevent(pollFd, changes, 2, nullptr, 0, nullptr);
+#else
+        std::lock_guard<std::mutex> lock(mutex);
+        fds.erase(fd);
+#endif
+    }
+
+    void wait(std::vector<HttpPollEvent> &events, int timeoutMs) {
+        events.clear();
+#if HTTP_POLLER_EPOLL
+        struct epoll_event items[HTTP_MAX_EVENTS];
+        int n = epoll_wait(pollFd, items, HTTP_MAX_EVENTS, timeoutMs);
+        for (int i = 0; i < n; i++) {
+            HttpPollEvent event;
+            event.fd = items[i].data.fd;
+            // Errors and hang-ups are reported by the next read
+            event.readable = (items[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+            event.writable = (items[i].events & EPOLLOUT) != 0;
+            events.push_back(event);
+        }
+#elif HTTP_POLLER_KQUEUE
+        struct kevent items[HTTP_MAX_EVENTS];
+        struct timespec timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        int n = kevent(pollFd, nullptr, 0, items, HTTP_MAX_EVENTS, &timeout);
+        for (int i = 0; i < n; i++) {
+            HttpPollEvent event;
+            event.fd = (int)items[i].ident;
+            event.readable = items[i].filter == EVFILT_READ || (items[i].flags & EV_ERROR) != 0;
+            event.writable = items[i].filter == EVFILT_WRITE;
+            events.push_back(event);
+        }
+#else
+        std::vector<struct pollfd> items;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &it : fds) {
+                struct pollfd item;
+                item.fd = it.first;
+                item.events = it.second;
+                item.revents = 0;
+                items.push_back(item);
+            }
+        }
+        #ifdef _WIN32
+        int n = WSAPoll(items.data(), (ULONG)items.size(), std::min(timeoutMs, HTTP_POLL_FALLBACK_TIMEOUT_MS));
+        #else
+        int n = poll(items.data(), (nfds_t)items.size(), std::min(timeoutMs, HTTP_POLL_FALLBACK_TIMEOUT_MS));
+        #endif
+        for (size_t i = 0; n > 0 && i < items.size(); i++) {
+            if (items[i].revents == 0)
+                continue;
+            HttpPollEvent event;
+            event.fd = (int)items[i].fd;
+            event.readable = (items[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+            event.writable = (items[i].revents & POLLOUT) != 0;
+            events.push_back(event);
+        }
+#endif
+    }
+};
+
+static bool isHttpWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// One client connection. Only the I/O thread reads, sends and closes the socket, other threads
+// append responses to the output buffer, so a slow reader never blocks the token generation.
+class HttpConnection {
+public:
+    const int fd;
+    std::string input;  // I/O thread only
+    bool isReadClosed;  // written by the I/O thread only, the client sent FIN
+private:
+    HttpPoller *poller;
+    std::mutex mutex;
+    std::string output;
+    size_t outputOffset;
+    bool isClosed;
+    bool isResponding;  // the response of the current request is not complete yet
+    bool keepAlive;
+
+public:
+    HttpConnection(int fd, HttpPoller *poller)
+        : fd(fd), isReadClosed(false), poller(poller), outputOffset(0), isClosed(false), isResponding(false), keepAlive(true) {}
+
+    // I/O thread, a request was parsed, the next one waits until it's answered
+    void begin(bool keepAlive) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->isResponding = true;
+        this->keepAlive = keepAlive;
+    }
+
+    void write(const std::string &data, bool isLast) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (isClosed)
+            throw NnTransferSocketException(0, "Connection closed");
+        const bool wasEmpty = outputOffset == output.size();
+        output.append(data);
+        if (isLast)
+            isResponding = false;
+        if (wasEmpty)
+            poller->setInterest(fd, !isReadClosed, true);
+    }
+
+    bool getIsClosed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isClosed;
+    }
+
+    // I/O thread, false if the connection should be closed now
+    bool flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (isClosed)
+            return false;
+        while (outputOffset < output.size()) {
+            const size_t size = output.size() - outputOffset;
+            const ssize_t n = send(fd, output.data() + outputOffset, size, 0);
+            if (n < 0) {
+                if (isHttpWouldBlock())
+                    return true;
+                return false;
+            }
+            outputOffset += (size_t)n;
+        }
+        output.clear();
+        outputOffset = 0;
+        poller->setInterest(fd, !isReadClosed, false);
+        if (isResponding)
+            return true;
+        // Requests sent before the FIN are still answered
+        return keepAlive && (!isReadClosed || !input.empty());
+    }
+
+    // I/O thread, true if the next request of the connection can be handled
+    bool isIdle() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !isClosed && !isResponding && keepAlive;
+    }
+
+    // I/O thread, the client sent FIN. The level-triggered read interest is dropped, else every
+    // wait would report the EOF again while the response of a request in flight is generated.
+    void closeRead() {
+        std::lock_guard<std::mutex> lock(mutex);
+        isReadClosed = true;
+        if (!isClosed)
+            poller->setInterest(fd, false, outputOffset < output.size());
+    }
+
+    bool hasPendingOutput() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isResponding || outputOffset < output.size();
+    }
+
+    // I/O thread
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (isClosed)
+            return;
+        // Under the lock, so no writer arms a reused descriptor
+        isClosed = true;
+        poller->remove(fd);
+        destroySocket(fd);
+    }
+};
+
+class HttpRequest {
+public:
+    // Parses one complete request from the front of the buffer and removes it,
+    // false if the request is not complete yet
+    static bool parse(std::string &input, HttpRequest &req) {
+        size_t headerEnd = input.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            if (input.size() > HTTP_MAX_HEADER_SIZE)
+                throw std::runtime_error("Too large HTTP headers");
+            return false;
+        }
 
         // Split request into lines
-        std::istringstream iss(data);
+        std::istringstream iss(input.substr(0, headerEnd + 2));
         std::string line;
         std::getline(iss, line);
 
         // Parse request line
         std::istringstream lineStream(line);
-        std::string methodStr, path;
-        lineStream >> methodStr >> path;
+        std::string methodStr, path, version;
+        lineStream >> methodStr >> path >> version;
         req.method = parseMethod(methodStr);
         req.path = path;
 
         // Parse headers
+        req.headers.clear();
         while (std::getline(iss, line) && line != "\r") {
             size_t pos = line.find(':');
             if (pos != std::string::npos) {
                 std::string key = line.substr(0, pos);
-                std::string value = line.substr(pos + 2); // Skip ': ' after key
+                std::string value = line.substr(pos + 1);
                 // Trim whitespace and non-printable characters from header value
                 value.erase(std::remove_if(value.begin(), value.end(), [](unsigned char c) {
                     return std::isspace(c) || !std::isprint(c);
                 }), value.end());
+                std::transform(key.begin(), key.end(), key.begin(), ::tolower);
                 req.headers[key] = value;
             }
         }
 
-        // Parse body
-        std::getline(iss, req.body, '\0');
+        size_t contentLength = 0;
+        auto length = req.headers.find("content-length");
+        if (length != req.headers.end()) {
+            try {
+                contentLength = std::stoul(length->second);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Bad Content-Length header - not a number");
+            }
+            if (contentLength > HTTP_MAX_BODY_SIZE)
+                throw std::runtime_error("Too large HTTP body");
+        }
+        const size_t bodyStart = headerEnd + 4;
+        if (input.size() < bodyStart + contentLength)
+            return false;
+
+        // HTTP/1.1 keeps the connection open unless the client says otherwise
+        std::string connection;
+        auto connectionHeader = req.headers.find("connection");
+        if (connectionHeader != req.headers.end()) {
+            connection = connectionHeader->second;
+            std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+        }
+        req.keepAlive = version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+        req.body = input.substr(bodyStart, contentLength);
+        input.erase(0, bodyStart + contentLength);
 
         if (req.body.size() > 0) {
             // printf("body: %s\n", req.body.c_str());
             req.parsedJson = json::parse(req.body);
         }
-        return req;
+        return true;
     }
 
     static HttpMethod parseMethod(const std::string& method) {
@@ -95,93 +409,20 @@ public:
     }
 
 private:
-    int serverSocket;
+    std::shared_ptr<HttpConnection> connection;
 public:
     std::string path;
-    std::unordered_map<std::string, std::string> headers;
+    std::unordered_map<std::string, std::string> headers; // lowercase keys
     std::string body;
     json parsedJson;
     HttpMethod method;
+    bool keepAlive;
 
-    HttpRequest(int serverSocket) {
-        this->serverSocket = serverSocket;
-    }
+    HttpRequest(std::shared_ptr<HttpConnection> connection)
+        : connection(connection), method(HttpMethod::METHOD_UNKNOWN), keepAlive(false) {}
 
-    std::vector<char> readHttpRequest() {
-        std::string httpRequest;
-        char buffer[1024 * 64];
-        ssize_t bytesRead;
-
-        // First, read all headers
-        std::string headerData;
-        size_t headerEnd;
-        bool headerDone = false;
-        std::string extraReadPastHeader;
-        while (!headerDone) {
-            bytesRead = recv(serverSocket, buffer, sizeof(buffer) - 1, 0);
-            if (bytesRead <= 0) {
-                throw std::runtime_error("Error while reading headers from socket");
-            }
-            buffer[bytesRead] = '\0';
-            headerData.append(buffer);
-
-            // Check for end of headers (http header says "\r\n\r\n")
-            headerEnd = headerData.find("\r\n\r\n");
-            if (headerEnd != std::string::npos) {
-                headerDone = true;
-                if (headerEnd < headerData.size()-4) {
-                    // We read something past the header
-                    extraReadPastHeader = headerData.substr(headerEnd+4);
-                }
-            }
-        }
-
-        httpRequest.append(headerData);
-
-        // Next, find Content-Length header for body length
-        std::istringstream headerStream(headerData);
-        std::string line;
-        ssize_t contentLength = 0;
-        while (std::getline(headerStream, line) && line != "\r") {
-            size_t pos = line.find(':');
-            if (pos != std::string::npos) {
-                std::string key = line.substr(0, pos);
-                std::string value = line.substr(pos + 2); // Skip ': ' after key
-                if (key == "Content-Length") {
-                    try {
-                      contentLength = std::stoi(value);  // stoi ignores any whitespace
-                    } catch (const std::invalid_argument& e) {
-                      throw std::runtime_error("Bad Content-Length header - not a number");
-                    }
-                    break;
-                }
-            }
-        }
-
-        // Now read the full content body
-        if (contentLength > 0) {
-            // If we read any extra past the header before, read that much less now
-            // But first, sanity check to make sure Content-Length isn't lying and there is actually more
-            if (extraReadPastHeader.size() > static_cast<size_t>(contentLength)) {
-                throw std::runtime_error("Received more body data than Content-Length header said");
-            }
-            contentLength -= extraReadPastHeader.size();
-
-            std::vector<char> body(contentLength);
-            ssize_t totalRead = 0;
-            while (totalRead < contentLength) {
-                bytesRead = recv(serverSocket, body.data() + totalRead, contentLength - totalRead, 0);
-                if (bytesRead <= 0) {
-                    throw std::runtime_error("Error while reading body from socket");
-                }
-                totalRead += bytesRead;
-            }
-            if (body.size() > 0) {
-              httpRequest.append(body.data(), contentLength);
-            }
-        }
-
-        return std::vector<char>(httpRequest.begin(), httpRequest.end());
+    bool isConnectionClosed() {
+        return connection->getIsClosed();
     }
 
     std::string getMethod() {
@@ -192,6 +433,10 @@ public:
         if (method == HttpMethod::METHOD_OPTIONS) return "OPTIONS";
         return "UNKNOWN";
     }
+
+    const char *getConnectionHeader() {
+        return keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    }
  
     void writeCors() {
         std::ostringstream buffer;
@@ -199,21 +444,32 @@ public:
             << "Access-Control-Allow-Origin: *\r\n"
             << "Access-Control-Allow-Methods: GET, POST, PUT, DELETE\r\n"
             << "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
-            << "Connection: close\r\n"
+            << getConnectionHeader()
             << "\r\n";
-        std::string data = buffer.str();
-        writeSocket(serverSocket, data.c_str(), data.size());
+        connection->write(buffer.str(), true);
     }
 
     void writeNotFound() {
         std::ostringstream buffer;
         buffer << "HTTP/1.1 404 Not Found\r\n"
-            << "Connection: close\r\n"
+            << getConnectionHeader()
             << "Content-Length: 9\r\n"
             << "\r\n"
             << "Not Found";
-        std::string data = buffer.str();
-        writeSocket(serverSocket, data.c_str(), data.size());
+        connection->write(buffer.str(), true);
+    }
+
+    // The connection is closed after the response
+    void writeBadRequest(const std::string &message) {
+        keepAlive = false;
+        connection->begin(false);
+        std::ostringstream buffer;
+        buffer << "HTTP/1.1 400 Bad Request\r\n"
+            << "Access-Control-Allow-Origin: *\r\n"
+            << "Content-Type: text/plain; charset=utf-8\r\n"
+            << getConnectionHeader()
+            << "Content-Length: " << message.length() << "\r\n\r\n" << message;
+        connection->write(buffer.str(), true);
     }
 
     void writeJson(std::string json) {
@@ -221,10 +477,19 @@ public:
         buffer << "HTTP/1.1 200 OK\r\n"
             << "Access-Control-Allow-Origin: *\r\n"
             << "Content-Type: application/json; charset=utf-8\r\n"
-            << "Connection: close\r\n"
+            << getConnectionHeader()
             << "Content-Length: " << json.length() << "\r\n\r\n" << json;
-        std::string data = buffer.str();
-        writeSocket(serverSocket, data.c_str(), data.size());
+        connection->write(buffer.str(), true);
+    }
+
+    void writeText(const std::string &contentType, const std::string &body) {
+        std::ostringstream buffer;
+        buffer << "HTTP/1.1 200 OK\r\n"
+            << "Access-Control-Allow-Origin: *\r\n"
+            << "Content-Type: " << contentType << "\r\n"
+            << getConnectionHeader()
+            << "Content-Length: " << body.length() << "\r\n\r\n" << body;
+        connection->write(buffer.str(), true);
     }
 
     void writeStreamStartChunk() {
@@ -232,22 +497,19 @@ public:
         buffer << "HTTP/1.1 200 OK\r\n"
             << "Access-Control-Allow-Origin: *\r\n"
             << "Content-Type: text/event-stream; charset=utf-8\r\n"
-            << "Connection: close\r\n"
+            << getConnectionHeader()
             << "Transfer-Encoding: chunked\r\n\r\n";
-        std::string data = buffer.str();
-        writeSocket(serverSocket, data.c_str(), data.size());
+        connection->write(buffer.str(), false);
     }
 
     void writeStreamChunk(const std::string data) {
         std::ostringstream buffer;
         buffer << std::hex << data.size() << "\r\n" << data << "\r\n";
-        std::string d = buffer.str();
-        writeSocket(serverSocket, d.c_str(), d.size());
+        connection->write(buffer.str(), false);
     }
 
     void writeStreamEndChunk() {
-        const char *endChunk = "0000\r\n\r\n";
-        writeSocket(serverSocket, endChunk, strlen(endChunk));
+        connection->write("0000\r\n\r\n", true);
     }
 };
 
@@ -293,50 +555,376 @@ void writeChatCompletionChunk(HttpRequest &request, const std::string &delta, co
     }
 }
 
-class NaiveCacheItem {
+static pos_t commonPrefixLength(const std::vector<int> &a, const std::vector<int> &b) {
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    return (pos_t)i;
+}
+
+// Radix tree of token ids with one node per full block of the paged KV cache. Every node holds a
+// reference to its block, so any later request with the same prefix maps the blocks to its slot
+// and skips their prefill. Workers receive only the block table changes, the blocks are shared
+// on all nodes at once.
+class PrefixCache {
+private:
+    struct Node {
+        std::vector<int> tokens; // tokens of the block
+        NnUint block;
+        Node *parent;
+        unsigned long long lastUsed;
+        std::map<std::vector<int>, std::unique_ptr<Node>> children;
+    };
+    NnKvBlockTable *table;
+    NnUint blockSize;
+    Node root;
+    unsigned long long clock;
+
+    Node *findEvictable(Node *node) {
+        Node *best = nullptr;
+        for (auto &it : node->children) {
+            Node *child = it.second.get();
+            Node *candidate = child->children.empty()
+                ? (table->refCount(child->block) == 1 ? child : nullptr)
+                : findEvictable(child);
+            if (candidate != nullptr && (best == nullptr || candidate->lastUsed < best->lastUsed))
+                best = candidate;
+        }
+        return best;
+    }
+
+public:
+    PrefixCache(NnKvBlockTable *table)
+        : table(table), blockSize(table->getBlockSize()), clock(0) {
+        root.parent = nullptr;
+        root.block = 0;
+        root.lastUsed = 0;
+    }
+
+    // Blocks of the longest cached prefix, at most maxBlocks
+    std::vector<NnUint> match(const std::vector<int> &tokens, NnUint maxBlocks) {
+        std::vector<NnUint> blocks;
+        Node *node = &root;
+        std::vector<int> key(blockSize);
+        while (blocks.size() < maxBlocks && (blocks.size() + 1) * blockSize <= tokens.size()) {
+            const size_t offset = blocks.size() * blockSize;
+            key.assign(tokens.begin() + offset, tokens.begin() + offset + blockSize);
+            auto it = node->children.find(key);
+            if (it == node->children.end())
+                break;
+            node = it->second.get();
+            node->lastUsed = ++clock;
+            blocks.push_back(node->block);
+        }
+        return blocks;
+    }
+
+    // Adds the full blocks of the slot that hold tokens[0, nTokens)
+    void insert(const std::vector<int> &tokens, pos_t nTokens, NnUint slot) {
+        const NnUint nBlocks = std::min((NnUint)(std::min((size_t)nTokens, tokens.size()) / blockSize), table->getBlocksPerSlot());
+        Node *node = &root;
+        std::vector<int> key(blockSize);
+        for (NnUint i = 0; i < nBlocks; i++) {
+            key.assign(tokens.begin() + i * blockSize, tokens.begin() + (i + 1) * blockSize);
+            auto it = node->children.find(key);
+            if (it == node->children.end()) {
+                const int block = table->getBlock(slot, i);
+                if (block < 0)
+                    return;
+                Node *child = new Node();
+                child->tokens = key;
+                child->block = (NnUint)block;
+                child->parent = node;
+                table->retainBlock(child->block);
+                it = node->children.emplace(key, std::unique_ptr<Node>(child)).first;
+            }
+            node = it->second.get();
+            node->lastUsed = ++clock;
+        }
+    }
+
+    // Drops least recently used blocks that no slot uses until nBlocks blocks are free
+    void reserve(NnUint nBlocks) {
+        while (table->nFreeBlocks() < nBlocks) {
+            Node *victim = findEvictable(&root);
+            if (victim == nullptr)
+                return;
+            table->releaseBlock(victim->block);
+            Node *parent = victim->parent;
+            parent->children.erase(parent->children.find(victim->tokens));
+        }
+    }
+};
+
+static NnSize getMetricsTimeUs() {
+    return (NnSize)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear (HDR-like) histogram of microseconds: values below 4 have their own bucket, every
+// next power of two is split into 4 buckets, so a bucket is at most 25% wide. Recording is one
+// relaxed atomic add per field, the exporter reads the buckets without stopping the writers.
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_MAX_MAGNITUDE 32 // 2^32 us, ~71 minutes
+#define METRICS_N_BUCKETS ((METRICS_MAX_MAGNITUDE - 1) * METRICS_SUB_BUCKETS)
+
+class LatencyHistogram {
+private:
+    std::atomic<unsigned long long> buckets[METRICS_N_BUCKETS];
+    std::atomic<unsigned long long> sumUs;
+
+    static NnUint getBucketIndex(NnSize us) {
+        if (us < METRICS_SUB_BUCKETS)
+            return (NnUint)us;
+        NnUint magnitude = 0;
+        while ((us >> (magnitude + 1)) != 0)
+            magnitude++;
+        if (magnitude >= METRICS_MAX_MAGNITUDE)
+            return METRICS_N_BUCKETS - 1;
+        const NnUint subBucket = (NnUint)((us >> (magnitude - 2)) & (METRICS_SUB_BUCKETS - 1));
+        return (magnitude - 1) * METRICS_SUB_BUCKETS + subBucket;
+    }
+
 public:
-    pos_t endPos;
-    ChatMessage message;
-    NaiveCacheItem(pos_t endPos, ChatMessage message) {
-        this->endPos = endPos;
-        this->message = message;
+    // The highest value of the bucket
+    static NnSize getBucketBoundUs(NnUint index) {
+        if (index < METRICS_SUB_BUCKETS)
+            return index;
+        const NnUint magnitude = index / METRICS_SUB_BUCKETS + 1;
+        const NnUint subBucket = index % METRICS_SUB_BUCKETS;
+        return (((NnSize)METRICS_SUB_BUCKETS + subBucket + 1) << (magnitude - 2)) - 1;
+    }
+
+    LatencyHistogram() : sumUs(0) {
+        for (NnUint i = 0; i < METRICS_N_BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    void record(NnSize us) {
+        buckets[getBucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+        sumUs.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    void write(std::ostringstream &out, const char *name, const char *help) const {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " histogram\n";
+        // The count is the sum of the buckets read here, so +Inf always matches it
+        unsigned long long count = 0;
+        for (NnUint i = 0; i < METRICS_N_BUCKETS - 1; i++) {
+            count += buckets[i].load(std::memory_order_relaxed);
+            out << name << "_bucket{le=\"" << (double)getBucketBoundUs(i) / 1e6 << "\"} " << count << "\n";
+        }
+        count += buckets[METRICS_N_BUCKETS - 1].load(std::memory_order_relaxed);
+        out << name << "_bucket{le=\"+Inf\"} " << count << "\n";
+        out << name << "_sum " << (double)sumUs.load(std::memory_order_relaxed) / 1e6 << "\n";
+        out << name << "_count " << count << "\n";
     }
 };
 
-class NaiveCache {
+typedef std::atomic<unsigned long long> MetricsCounter;
+
+// Metrics of the API server in the Prometheus text format. The scheduler thread records them,
+// the /metrics route on the I/O thread only reads atomics.
+class ApiMetrics {
 private:
-    std::vector<NaiveCacheItem> cache;
+    NnNetwork *network;
+    NnUint nNodes;
+    LatencyHistogram timeToFirstToken;
+    LatencyHistogram interTokenLatency;
+    LatencyHistogram prefillChunkTime;
+    MetricsCounter nRequests;
+    MetricsCounter nPromptTokens;
+    MetricsCounter nCachedPromptTokens;
+    MetricsCounter nPrefillTokens;
+    MetricsCounter prefillUs;
+    MetricsCounter nGeneratedTokens;
+    MetricsCounter nForwards;
+    std::atomic<NnUint> nPendingRequests;
+    std::atomic<NnUint> nActiveRequests;
+    std::atomic<NnUint> nBusySlots;
+    std::atomic<NnUint> nSlots;
+    std::atomic<NnUint> nUsedKvBlocks;
+    std::atomic<NnUint> nKvBlocks;
+    // [nNodes], the root has no socket to itself
+    std::unique_ptr<MetricsCounter[]> sentBytes;
+    std::unique_ptr<MetricsCounter[]> recvBytes;
+    std::unique_ptr<MetricsCounter[]> execUs;
+    std::unique_ptr<MetricsCounter[]> syncUs;
+    std::unique_ptr<std::atomic<NnUint>[]> stageIndexes;
+    std::vector<NnSize> lastSentBytes; // scheduler thread only
+    std::vector<NnSize> lastRecvBytes;
+
+    static void writeCounter(std::ostringstream &out, const char *name, const char *help, unsigned long long value) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " counter\n";
+        out << name << " " << value << "\n";
+    }
+
+    static void writeGauge(std::ostringstream &out, const char *name, const char *help, double value) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " gauge\n";
+        out << name << " " << value << "\n";
+    }
+
+    void writeNodeCounters(std::ostringstream &out, const char *name, const char *help, const MetricsCounter *values, double scale, bool skipRoot) const {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " counter\n";
+        for (NnUint nodeIndex = skipRoot ? 1u : 0u; nodeIndex < nNodes; nodeIndex++) {
+            out << name << "{node=\"" << nodeIndex << "\",stage=\"" << stageIndexes[nodeIndex].load(std::memory_order_relaxed) << "\"} "
+                << (double)values[nodeIndex].load(std::memory_order_relaxed) * scale << "\n";
+        }
+    }
+
+    static NnSize getDelta(NnSize value, NnSize &last) {
+        // The counters of the network go back to zero when someone resets them
+        const NnSize delta = value >= last ? value - last : value;
+        last = value;
+        return delta;
+    }
+
 public:
-    void push(NaiveCacheItem item) {
-        cache.push_back(item);
+    ApiMetrics(NnNetwork *network, NnUint nNodes)
+        : network(network), nNodes(nNodes), nRequests(0), nPromptTokens(0), nCachedPromptTokens(0),
+          nPrefillTokens(0), prefillUs(0), nGeneratedTokens(0), nForwards(0), nPendingRequests(0),
+          nActiveRequests(0), nBusySlots(0), nSlots(0), nUsedKvBlocks(0), nKvBlocks(0),
+          sentBytes(new MetricsCounter[nNodes]), recvBytes(new MetricsCounter[nNodes]),
+          execUs(new MetricsCounter[nNodes]), syncUs(new MetricsCounter[nNodes]),
+          stageIndexes(new std::atomic<NnUint>[nNodes]),
+          lastSentBytes(nNodes, 0), lastRecvBytes(nNodes, 0)
+    {
+        for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+            sentBytes[nodeIndex].store(0);
+            recvBytes[nodeIndex].store(0);
+            execUs[nodeIndex].store(0);
+            syncUs[nodeIndex].store(0);
+            stageIndexes[nodeIndex].store(0);
+        }
     }
 
-    void clear() {
-        cache.clear();
+    void recordRequest() {
+        nRequests.fetch_add(1, std::memory_order_relaxed);
     }
 
-    bool resolveDeltaPrompt(std::vector<ChatMessage>& messages, pos_t& startPos) {
-        size_t cacheSize = cache.size();
-        if (cacheSize == 0)
-            return false;
-        if (messages.size() > cacheSize) {
-            size_t i = 0;
-            while (i < cacheSize) {
-                if (
-                    cache[i].message.role != messages[i].role ||
-                    cache[i].message.content != messages[i].content
-                ) break;
-                i++;
-            }
-            if (i == cacheSize) {
-                startPos = cache[i - 1].endPos;
-                messages.erase(messages.begin(), messages.begin() + i);
-                printf("🐤 Found naive cache for %zu messages, pos=%d\n", i, startPos);
-                return true;
+    void recordPrompt(NnUint nTokens, NnUint nCachedTokens) {
+        nPromptTokens.fetch_add(nTokens, std::memory_order_relaxed);
+        nCachedPromptTokens.fetch_add(nCachedTokens, std::memory_order_relaxed);
+    }
+
+    void recordPrefillChunk(NnUint nTokens, NnSize us) {
+        nPrefillTokens.fetch_add(nTokens, std::memory_order_relaxed);
+        prefillUs.fetch_add(us, std::memory_order_relaxed);
+        prefillChunkTime.record(us);
+    }
+
+    void recordFirstToken(NnSize us) {
+        timeToFirstToken.record(us);
+        nGeneratedTokens.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordNextToken(NnSize us) {
+        interTokenLatency.record(us);
+        nGeneratedTokens.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void setQueue(NnUint nPending, NnUint nActive) {
+        nPendingRequests.store(nPending, std::memory_order_relaxed);
+        nActiveRequests.store(nActive, std::memory_order_relaxed);
+    }
+
+    void setKvCache(NnUint nBusySlots, NnUint nSlots, NnUint nUsedKvBlocks, NnUint nKvBlocks) {
+        this->nBusySlots.store(nBusySlots, std::memory_order_relaxed);
+        this->nSlots.store(nSlots, std::memory_order_relaxed);
+        this->nUsedKvBlocks.store(nUsedKvBlocks, std::memory_order_relaxed);
+        this->nKvBlocks.store(nKvBlocks, std::memory_order_relaxed);
+    }
+
+    // Scheduler thread, after every forward of the target model
+    void recordForward(const std::vector<LlmPerfPacket> &perf) {
+        nForwards.fetch_add(1, std::memory_order_relaxed);
+        if (network != nullptr) {
+            for (NnUint nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+                const int socketIndex = network->getSocketIndexForNode(nodeIndex, 0);
+                if (socketIndex < 0 || (NnUint)socketIndex >= network->nSockets)
+                    continue;
+                NnSize sent, recv;
+                network->getPeerStats((NnUint)socketIndex, &sent, &recv);
+                sentBytes[nodeIndex].fetch_add(getDelta(sent, lastSentBytes[nodeIndex]), std::memory_order_relaxed);
+                recvBytes[nodeIndex].fetch_add(getDelta(recv, lastRecvBytes[nodeIndex]), std::memory_order_relaxed);
             }
         }
-        cache.clear();
-        return false;
+        // Empty without --benchmark
+        for (const LlmPerfPacket &p : perf) {
+            if (p.nodeIndex >= nNodes)
+                continue;
+            execUs[p.nodeIndex].fetch_add(p.execUs, std::memory_order_relaxed);
+            syncUs[p.nodeIndex].fetch_add(p.syncUs, std::memory_order_relaxed);
+            stageIndexes[p.nodeIndex].store(p.stageIndex, std::memory_order_relaxed);
+        }
+    }
+
+    std::string write() const {
+        std::ostringstream out;
+        out.precision(12);
+        timeToFirstToken.write(out, "dllama_time_to_first_token_seconds", "Time from the arrival of a request to its first generated token.");
+        interTokenLatency.write(out, "dllama_inter_token_latency_seconds", "Time between two generated tokens of one request.");
+        prefillChunkTime.write(out, "dllama_prefill_chunk_seconds", "Time of one prompt chunk forward.");
+        writeCounter(out, "dllama_requests_total", "Chat completion requests.", nRequests.load(std::memory_order_relaxed));
+        writeCounter(out, "dllama_prompt_tokens_total", "Prompt tokens of the admitted requests.", nPromptTokens.load(std::memory_order_relaxed));
+        writeCounter(out, "dllama_prompt_cached_tokens_total", "Prompt tokens found in the KV cache, not prefilled.", nCachedPromptTokens.load(std::memory_order_relaxed));
+        writeCounter(out, "dllama_prefill_tokens_total", "Prompt tokens prefilled.", nPrefillTokens.load(std::memory_order_relaxed));
+        out << "# HELP dllama_prefill_seconds_total Time spent in prompt chunk forwards.\n";
+        out << "# TYPE dllama_prefill_seconds_total counter\n";
+        out << "dllama_prefill_seconds_total " << (double)prefillUs.load(std::memory_order_relaxed) / 1e6 << "\n";
+        writeCounter(out, "dllama_generated_tokens_total", "Generated tokens.", nGeneratedTokens.load(std::memory_order_relaxed));
+        writeCounter(out, "dllama_forwards_total", "Forwards of the target model.", nForwards.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_requests_pending", "Requests waiting for a KV cache slot.", nPendingRequests.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_requests_active", "Requests holding a KV cache slot.", nActiveRequests.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_kv_cache_slots_busy", "KV cache slots in use.", nBusySlots.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_kv_cache_slots", "KV cache slots.", nSlots.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_kv_cache_blocks_used", "Blocks of the paged KV cache in use, including the prefix cache.", nUsedKvBlocks.load(std::memory_order_relaxed));
+        writeGauge(out, "dllama_kv_cache_blocks", "Blocks of the paged KV cache, 0 if the cache is not paged.", nKvBlocks.load(std::memory_order_relaxed));
+        if (nNodes > 1) {
+            writeNodeCounters(out, "dllama_network_sent_bytes_total", "Bytes sent by the root to the node.", sentBytes.get(), 1.0, true);
+            writeNodeCounters(out, "dllama_network_received_bytes_total", "Bytes received by the root from the node.", recvBytes.get(), 1.0, true);
+        }
+        writeNodeCounters(out, "dllama_node_exec_seconds_total", "Op execution time of the node (requires --benchmark).", execUs.get(), 1e-6, false);
+        writeNodeCounters(out, "dllama_node_sync_seconds_total", "Sync time of the node (requires --benchmark).", syncUs.get(), 1e-6, false);
+        return out.str();
+    }
+};
+
+// One in-flight chat completion, it owns one KV cache slot until it's finished
+class ApiSequence {
+public:
+    HttpRequest request;
+    InferenceParams params;
+    NnUint slot;
+    std::vector<int> tokens; // prompt + generated tokens, the first pos tokens are in the KV cache (except evicted ones)
+    NnUint nPromptTokens;
+    std::string publicPrompt;
+    pos_t pos;
+    pos_t promptEndPos;
+    pos_t maxPredPos;
+    pos_t nEvicted; // tokens after the sinks that left the KV cache, the token pos is at the cache row pos - nEvicted
+    int token;
+    std::string buffer;
+    std::string decoderState;
+    std::unique_ptr<Sampler> sampler;
+    std::unique_ptr<EosDetector> eosDetector;
+    NnSize arrivalUs;
+    NnSize lastTokenUs; // 0 until the first token
+
+    ApiSequence(HttpRequest request)
+        : request(std::move(request)), slot(0), nPromptTokens(0),
+          pos(0), promptEndPos(0), maxPredPos(0), nEvicted(0), token(0), arrivalUs(getMetricsTimeUs()), lastTokenUs(0) {}
+
+    bool isPrefilling() const {
+        return pos < promptEndPos;
+    }
+
+    pos_t kvPos() const {
+        return pos - nEvicted;
     }
 };
 
@@ -344,152 +932,476 @@ class ApiServer {
 private:
     RootLlmInference *inference;
     Tokenizer *tokenizer;
-    Sampler *sampler;
     AppCliArgs *args;
     LlmHeader *header;
-    EosDetector *eosDetector;
+    TokenizerChatStops *stops;
     ChatTemplateGenerator *templateGenerator;
-    NaiveCache naiveCache;
+    NnUint nSlots;
+    std::vector<bool> isSlotBusy;              // [nSlots]
+    // Paged KV cache: prefixes are shared by all slots, otherwise each slot reuses its own history
+    NnKvBlockTable *kvBlockTable;
+    std::unique_ptr<PrefixCache> prefixCache;
+    std::vector<std::vector<int>> slotTokens;  // [nSlots], tokens in the KV cache of the slot
+    SpeculativeDecoder *speculativeDecoder;    // only with one slot
+    std::vector<int> stepTokens;
+    ApiMetrics *metrics;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::unique_ptr<ApiSequence>> pending;
+    std::vector<std::unique_ptr<ApiSequence>> active;
 
 public:
-    ApiServer(RootLlmInference *inference, Tokenizer *tokenizer, Sampler *sampler, AppCliArgs *args, LlmHeader *header, EosDetector *eosDetector, ChatTemplateGenerator *templateGenerator) {
+    ApiServer(RootLlmInference *inference, SpeculativeDecoder *speculativeDecoder, Tokenizer *tokenizer, AppCliArgs *args, LlmHeader *header, TokenizerChatStops *stops, ChatTemplateGenerator *templateGenerator, ApiMetrics *metrics) {
         this->inference = inference;
+        this->metrics = metrics;
         this->tokenizer = tokenizer;
-        this->sampler = sampler;
         this->args = args;
         this->header = header;
-        this->eosDetector = eosDetector;
+        this->stops = stops;
         this->templateGenerator = templateGenerator;
+        // Every decoding sequence takes one row of the batch
+        this->nSlots = std::min(std::max(header->nKvSlots, 1u), args->nBatches);
+        this->isSlotBusy.resize(nSlots, false);
+        this->slotTokens.resize(nSlots);
+        this->kvBlockTable = inference->getKvBlockTable();
+        if (kvBlockTable != nullptr) {
+            prefixCache.reset(new PrefixCache(kvBlockTable));
+            printf("🐤 Prefix cache: %u tokens per block\n", kvBlockTable->getBlockSize());
+        }
+        if (nSlots > 1)
+            printf("🧵 Continuous batching: %u slots\n", nSlots);
+        // Batched sequences already share one forward per token
+        this->speculativeDecoder = nSlots == 1 ? speculativeDecoder : nullptr;
+        if (speculativeDecoder != nullptr && nSlots > 1)
+            printf("🔮 Speculative decoding is disabled with more than one KV cache slot\n");
+        if (header->nKvSinks > 0)
+            printf("🪟 Sliding KV window: %u sink tokens + %u tokens\n", header->nKvSinks, header->seqLen - header->nKvSinks);
     }
 
-    void complete(HttpRequest& request) {
-        InferenceParams params = parseRequest(request);
+    // Called from the I/O thread, the request is parsed before it's queued
+    void submit(HttpRequest &request) {
+        std::unique_ptr<ApiSequence> seq(new ApiSequence(request));
+        seq->params = parseRequest(request);
+        metrics->recordRequest();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(seq));
+        }
+        cond.notify_one();
+    }
 
-        pos_t startPos = 0;
-        std::vector<ChatMessage> deltaPrompt = params.messages;
-        naiveCache.resolveDeltaPrompt(deltaPrompt, startPos);
+    // Scheduler loop, runs on the thread that owns the inference
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (pending.empty() && active.empty())
+                    cond.wait(lock);
+            }
+            dropDisconnected();
+            admit();
+            prefillStep();
+            decodeStep();
+            updateMetrics();
+        }
+    }
 
-        size_t nInputItems = deltaPrompt.size();
+private:
+    void updateMetrics() {
+        NnUint nPending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            nPending = (NnUint)pending.size();
+        }
+        metrics->setQueue(nPending, (NnUint)active.size());
+        NnUint nBusySlots = 0;
+        for (NnUint slot = 0; slot < nSlots; slot++)
+            nBusySlots += isSlotBusy[slot] ? 1u : 0u;
+        const NnUint nKvBlocks = kvBlockTable != nullptr ? kvBlockTable->nBlocks() : 0u;
+        const NnUint nUsedKvBlocks = kvBlockTable != nullptr ? nKvBlocks - kvBlockTable->nFreeBlocks() : 0u;
+        metrics->setKvCache(nBusySlots, nSlots, nUsedKvBlocks, nKvBlocks);
+    }
+
+    void forward() {
+        inference->forward();
+        metrics->recordForward(inference->getLastPerf());
+    }
+
+    // Clients that went away don't keep their slots and batch rows
+    void dropDisconnected() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = pending.begin(); it != pending.end();) {
+                if ((*it)->request.isConnectionClosed())
+                    it = pending.erase(it);
+                else
+                    ++it;
+            }
+        }
+        for (size_t i = 0; i < active.size();) {
+            ApiSequence *seq = active[i].get();
+            if (seq->request.isConnectionClosed()) {
+                printf("🚨 Client disconnected, pos=%u\n", seq->pos);
+                release(seq);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    void admit() {
+        while (true) {
+            ApiSequence *next;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pending.empty())
+                    return;
+                next = pending.front().get();
+            }
+            // Only this thread removes pending sequences, the front stays valid
+            if (next->tokens.empty())
+                tokenize(next);
+            int slot = findSlot(next);
+            if (slot < 0)
+                return;
+
+            std::unique_ptr<ApiSequence> seq;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                seq = std::move(pending.front());
+                pending.pop_front();
+            }
+            seq->slot = (NnUint)slot;
+            isSlotBusy[seq->slot] = true;
+            try {
+                start(seq.get());
+                active.push_back(std::move(seq));
+            } catch (const NnTransferSocketException &e) {
+                printf("Socket error: %d %s\n", e.code, e.what());
+                release(seq.get());
+            }
+        }
+    }
+
+    void tokenize(ApiSequence *seq) {
+        size_t nInputItems = seq->params.messages.size();
         std::unique_ptr<ChatItem[]> inputItemsPtr(new ChatItem[nInputItems]);
         ChatItem *inputItems = inputItemsPtr.get();
         for (size_t i = 0; i < nInputItems; i++) {
-            inputItems[i].role = deltaPrompt[i].role;
-            inputItems[i].message = deltaPrompt[i].content;
+            inputItems[i].role = seq->params.messages[i].role;
+            inputItems[i].message = seq->params.messages[i].content;
         }
 
+        // The whole conversation is encoded, the cached prefix is found on the token level
         GeneratedChat inputPrompt = templateGenerator->generate(nInputItems, inputItems, true);
-        printf("🔹%s🔸", inputPrompt.content);
+        if (nSlots == 1)
+            printf("🔹%s🔸", inputPrompt.content);
 
         int nPromptTokens;
-        std::unique_ptr<int[]> promptTokensPtr(new int[inputPrompt.length + 2]);
-        int *promptTokens = promptTokensPtr.get();
-        bool isStart = startPos == 0;
-        tokenizer->encode((char*)inputPrompt.content, promptTokens, &nPromptTokens, isStart, true);
-
-        pos_t promptEndPos = startPos + nPromptTokens - 1;
-        if (promptEndPos > header->seqLen)
-            promptEndPos = header->seqLen;
+        seq->tokens.resize(inputPrompt.length + 2);
+        tokenizer->encode((char*)inputPrompt.content, seq->tokens.data(), &nPromptTokens, true, true);
+        seq->tokens.resize(nPromptTokens);
+        seq->nPromptTokens = (NnUint)nPromptTokens;
+        if (inputPrompt.publicPrompt != nullptr)
+            seq->publicPrompt = inputPrompt.publicPrompt;
+    }
 
-        pos_t maxPredPos = params.max_tokens > 0 ? (promptEndPos + params.max_tokens) : header->seqLen;
-        if (maxPredPos > header->seqLen)
-            maxPredPos = header->seqLen;
+    int findSlot(const ApiSequence *seq) {
+        // Prefer the slot with the longest cached prefix, then an empty slot
+        int bestSlot = -1;
+        pos_t bestLength = 0;
+        int emptySlot = -1;
+        int anySlot = -1;
+        for (NnUint slot = 0; slot < nSlots; slot++) {
+            if (isSlotBusy[slot])
+                continue;
+            pos_t length = commonPrefixLength(slotTokens[slot], seq->tokens);
+            if (length > bestLength) {
+                bestLength = length;
+                bestSlot = (int)slot;
+            }
+            if (emptySlot < 0 && slotTokens[slot].empty())
+                emptySlot = (int)slot;
+            if (anySlot < 0)
+                anySlot = (int)slot;
+        }
+        if (bestSlot >= 0)
+            return bestSlot;
+        return emptySlot >= 0 ? emptySlot : anySlot;
+    }
 
-        for (size_t j = 0; j < deltaPrompt.size(); j++) {
-            naiveCache.push(NaiveCacheItem(promptEndPos, deltaPrompt[j]));
+    void start(ApiSequence *seq) {
+        // At least the last prompt token is forwarded to get the logits
+        const pos_t maxCachedPos = seq->nPromptTokens - 1;
+        pos_t startPos = 0;
+        if (prefixCache) {
+            const NnUint blockSize = kvBlockTable->getBlockSize();
+            kvBlockTable->release(seq->slot);
+            std::vector<NnUint> blocks = prefixCache->match(seq->tokens, maxCachedPos / blockSize);
+            for (NnUint i = 0; i < blocks.size(); i++)
+                kvBlockTable->attach(seq->slot, i, blocks[i]);
+            startPos = (pos_t)blocks.size() * blockSize;
+        } else {
+            startPos = std::min(commonPrefixLength(slotTokens[seq->slot], seq->tokens), maxCachedPos);
         }
+        slotTokens[seq->slot].clear();
+        metrics->recordPrompt(seq->nPromptTokens, startPos);
+
+        if (startPos > 0)
+            printf("🐤 Found prefix cache for %u of %u tokens\n", startPos, seq->nPromptTokens);
+        if (nSlots > 1)
+            printf("🔹 [slot %u] prompt, startPos=%u\n", seq->slot, startPos);
+
+        seq->pos = startPos;
+        seq->promptEndPos = maxCachedPos;
+        if (header->nKvSinks > 0) {
+            // The window slides, the sequence is not limited by the KV cache
+            seq->maxPredPos = seq->params.max_tokens > 0
+                ? (seq->promptEndPos + seq->params.max_tokens)
+                : std::numeric_limits<pos_t>::max();
+        } else {
+            if (seq->promptEndPos > header->seqLen)
+                seq->promptEndPos = header->seqLen;
 
-        std::string buffer;
+            seq->maxPredPos = seq->params.max_tokens > 0 ? (seq->promptEndPos + seq->params.max_tokens) : header->seqLen;
+            if (seq->maxPredPos > header->seqLen)
+                seq->maxPredPos = header->seqLen;
+        }
 
-        if (params.stream)
-            request.writeStreamStartChunk();
-        if (inputPrompt.publicPrompt != nullptr) {
-            if (params.stream)
-                writeChatCompletionChunk(request, inputPrompt.publicPrompt, false);
-            buffer += inputPrompt.publicPrompt;
+        seq->token = seq->tokens[maxCachedPos];
+        seq->sampler.reset(new Sampler(tokenizer->vocabSize, seq->params.temperature, seq->params.top_p, seq->params.seed));
+        seq->sampler->setMinP(seq->params.min_p);
+        seq->eosDetector.reset(new EosDetector(stops->nStops, tokenizer->eosTokenIds.data(), stops->stops, stops->maxStopLength, stops->maxStopLength));
+
+        if (seq->params.stream)
+            seq->request.writeStreamStartChunk();
+        if (!seq->publicPrompt.empty()) {
+            if (seq->params.stream)
+                writeChatCompletionChunk(seq->request, seq->publicPrompt, false);
+            seq->buffer += seq->publicPrompt;
         }
+    }
 
-        NnUint pos = startPos;
-        int token;
-        for (NnUint i = 0; ;) {
-            long remainingTokens = promptEndPos - pos;
-            if (remainingTokens <= 0)
-                break;
+    bool needsKvEviction(const ApiSequence *seq, NnUint nTokens) const {
+        return header->nKvSinks > 0 && seq->kvPos() + nTokens > header->seqLen;
+    }
+
+    // Attention sinks: the first nKvSinks tokens stay, the oldest tokens after them leave the KV cache and the rest
+    // of the window moves down, so the cache positions stay below seqLen. Half of the window goes at once, the rows
+    // are moved once per seqLen / 2 tokens, not on every token.
+    void evictKv(ApiSequence *seq, NnUint nTokens) {
+        const pos_t kvPos = seq->kvPos();
+        const pos_t nSinks = header->nKvSinks;
+        const pos_t nWindow = kvPos - nSinks;
+        const pos_t nDiscard = std::min(nWindow, std::max((header->seqLen - nSinks) / 2, kvPos + nTokens - header->seqLen));
+        inference->evictKv(seq->slot, nSinks, nDiscard, nWindow - nDiscard);
+        seq->nEvicted += nDiscard;
+        // Also with one slot, the model no longer sees the dropped tokens
+        printf("🪟 [slot %u] %u tokens left the KV cache, pos=%u\n", seq->slot, nDiscard, seq->pos);
+    }
+
+    // Makes sure the next forward will find free blocks, the least recently used prefixes are dropped
+    void reserveKvBlocks(NnUint nBlocks) {
+        if (prefixCache)
+            prefixCache->reserve(nBlocks);
+    }
+
+    // One prompt chunk per iteration, so long prompts don't stall the decoding sequences
+    void prefillStep() {
+        for (std::unique_ptr<ApiSequence> &seq : active) {
+            if (!seq->isPrefilling())
+                continue;
 
+            long remainingTokens = seq->promptEndPos - seq->pos;
             NnUint batchSize = remainingTokens < args->nBatches
                 ? remainingTokens
                 : args->nBatches;
 
+            if (prefixCache)
+                reserveKvBlocks(batchSize / kvBlockTable->getBlockSize() + 2);
+            if (needsKvEviction(seq.get(), batchSize))
+                evictKv(seq.get(), batchSize);
             inference->setBatchSize(batchSize);
-            inference->setPosition(pos);
+            // The decoding starts from the last prompt token, the logits of the chunk are not read
+            inference->skipLogits();
+            inference->setPosition(seq->kvPos(), seq->slot);
             for (NnUint j = 0; j < batchSize; j++)
-                inference->setToken(j, promptTokens[i + j]);
+                inference->setToken(j, seq->tokens[seq->pos + j]);
 
-            inference->forward();
+            const NnSize startUs = getMetricsTimeUs();
+            forward();
+            metrics->recordPrefillChunk(batchSize, getMetricsTimeUs() - startUs);
 
-            i += batchSize;
-            pos += batchSize;
-            token = promptTokens[i + 1];
+            seq->pos += batchSize;
+            // The prompt is shared with requests that arrive while this one is decoding
+            if (!seq->isPrefilling() && prefixCache)
+                prefixCache->insert(seq->tokens, seq->pos, seq->slot);
+            return;
         }
+    }
 
-        inference->setBatchSize(1);
-        tokenizer->resetDecoder();
-        eosDetector->reset();
-
-        for (; pos < maxPredPos;) {
-            inference->setPosition(pos);
-            inference->setToken(0, token);
-            inference->forward();
+    // All decoding sequences go through one forward, one row per sequence
+    void decodeStep() {
+        std::vector<ApiSequence *> rows;
+        bool hasKvEviction = false;
+        for (std::unique_ptr<ApiSequence> &seq : active) {
+            if (seq->isPrefilling())
+                continue;
+            if (needsKvEviction(seq.get(), 1)) {
+                // One eviction per forward, other full sequences wait for the next step
+                if (hasKvEviction)
+                    continue;
+                hasKvEviction = true;
+                evictKv(seq.get(), 1);
+            }
+            rows.push_back(seq.get());
+        }
+        if (rows.empty())
+            return;
+        if (speculativeDecoder != nullptr) {
+            decodeSpeculativeStep(rows[0]);
+            return;
+        }
 
-            token = sampler->sample(inference->logitsPipe);
+        NnUint batchSize = (NnUint)rows.size();
+        reserveKvBlocks(batchSize);
+        inference->setBatchSize(batchSize);
+        for (NnUint i = 0; i < batchSize; i++) {
+            inference->setRowPosition(i, rows[i]->kvPos(), rows[i]->slot);
+            inference->setToken(i, rows[i]->token);
+        }
+        forward();
+
+        for (NnUint i = 0; i < batchSize; i++) {
+            ApiSequence *seq = rows[i];
+            bool isFinished;
+            try {
+                isFinished = appendToken(seq, &inference->logitsPipe[i * header->vocabSize]);
+                if (isFinished)
+                    finish(seq);
+            } catch (const NnTransferSocketException &e) {
+                printf("Socket error: %d %s\n", e.code, e.what());
+                isFinished = true;
+            }
+            if (isFinished)
+                release(seq);
+        }
+    }
 
-            char *piece = tokenizer->decode(token);
-            EosDetectorType eosType = eosDetector->append(token, piece);
+    // The draft model proposes tokens of the only sequence, the target verifies them in one forward
+    void decodeSpeculativeStep(ApiSequence *seq) {
+        if (seq->pos == seq->promptEndPos)
+            speculativeDecoder->start(seq->tokens);
+        if (prefixCache)
+            reserveKvBlocks(args->nDraftTokens / kvBlockTable->getBlockSize() + 2);
 
-            if (piece != nullptr) {
-                printf("%s", piece);
-                fflush(stdout);
-            }
+        stepTokens.clear();
+        speculativeDecoder->step(seq->sampler.get(), seq->maxPredPos - seq->pos, stepTokens);
+        metrics->recordForward(inference->getLastPerf());
 
-            if (eosType == NOT_EOS || eosType == EOS) {
-                char *delta = eosDetector->getDelta();
-                if (delta != nullptr) {
-                    std::string deltaStr(delta);
-                    if (params.stream)
-                        writeChatCompletionChunk(request, deltaStr, false);
-                    buffer += deltaStr;
+        bool isFinished = false;
+        try {
+            for (int token : stepTokens) {
+                isFinished = appendSampledToken(seq, token);
+                if (isFinished) {
+                    finish(seq);
+                    break;
                 }
-                eosDetector->reset();
             }
-            pos++;
-            if (eosType == EOS) break;
+        } catch (const NnTransferSocketException &e) {
+            printf("Socket error: %d %s\n", e.code, e.what());
+            isFinished = true;
         }
+        if (isFinished)
+            release(seq);
+    }
 
-        ChatMessage chatMessage("assistant", buffer);
-        if (pos == header->seqLen) {
-            naiveCache.clear();
-        } else {
-            naiveCache.push(NaiveCacheItem(pos, chatMessage));
+    bool appendToken(ApiSequence *seq, float *logits) {
+        return appendSampledToken(seq, seq->sampler->sample(logits));
+    }
+
+    bool appendSampledToken(ApiSequence *seq, int token) {
+        const NnSize nowUs = getMetricsTimeUs();
+        if (seq->lastTokenUs == 0)
+            metrics->recordFirstToken(nowUs - seq->arrivalUs);
+        else
+            metrics->recordNextToken(nowUs - seq->lastTokenUs);
+        seq->lastTokenUs = nowUs;
+
+        seq->token = token;
+        seq->tokens.push_back(seq->token);
+
+        tokenizer->setDecoderState(seq->decoderState);
+        char *piece = tokenizer->decode(seq->token);
+        seq->decoderState = tokenizer->getDecoderState();
+        EosDetectorType eosType = seq->eosDetector->append(seq->token, piece);
+
+        if (piece != nullptr && nSlots == 1) {
+            printf("%s", piece);
+            fflush(stdout);
         }
 
-        if (params.stream) {
-            writeChatCompletionChunk(request, "", true);
+        if (eosType == NOT_EOS || eosType == EOS) {
+            char *delta = seq->eosDetector->getDelta();
+            if (delta != nullptr) {
+                std::string deltaStr(delta);
+                if (seq->params.stream)
+                    writeChatCompletionChunk(seq->request, deltaStr, false);
+                seq->buffer += deltaStr;
+            }
+            seq->eosDetector->reset();
+        }
+        seq->pos++;
+        return eosType == EOS || seq->pos >= seq->maxPredPos;
+    }
+
+    void finish(ApiSequence *seq) {
+        ChatMessage chatMessage("assistant", seq->buffer);
+
+        if (seq->params.stream) {
+            writeChatCompletionChunk(seq->request, "", true);
         } else {
-            int nCompletionTokens = pos - promptEndPos;
+            int nPromptTokens = (int)seq->nPromptTokens;
+            int nCompletionTokens = seq->pos - seq->promptEndPos;
             ChatUsage usage(nPromptTokens, nCompletionTokens, nPromptTokens + nCompletionTokens);
             Choice choice(chatMessage);
             ChatCompletion completion(choice, usage);
             std::string chatJson = ((json)completion).dump();
-            request.writeJson(chatJson);
+            seq->request.writeJson(chatJson);
         }
-        printf("🔶\n");
+        if (nSlots == 1)
+            printf("🔶\n");
+        else
+            printf("🔶 [slot %u] done, pos=%u\n", seq->slot, seq->pos);
         fflush(stdout);
     }
 
-private:
+    void release(ApiSequence *seq) {
+        // The first pos tokens stay in the cache for the next requests, after an eviction only the sinks are a prefix
+        const pos_t nCachedTokens = seq->nEvicted > 0
+            ? (pos_t)header->nKvSinks
+            : std::min((pos_t)seq->tokens.size(), seq->pos);
+        if (prefixCache) {
+            prefixCache->insert(seq->tokens, nCachedTokens, seq->slot);
+            kvBlockTable->release(seq->slot);
+        } else {
+            slotTokens[seq->slot].assign(seq->tokens.begin(), seq->tokens.begin() + nCachedTokens);
+        }
+        isSlotBusy[seq->slot] = false;
+        for (auto it = active.begin(); it != active.end(); ++it) {
+            if (it->get() == seq) {
+                active.erase(it);
+                return;
+            }
+        }
+    }
+
     InferenceParams parseRequest(HttpRequest& request) {
         InferenceParams params;
         params.temperature = args->temperature;
         params.top_p = args->topp;
+        params.min_p = args->minp;
         params.seed = args->seed;
         params.stream = false;
         params.messages = parseChatMessages(request.parsedJson["messages"]);
@@ -501,9 +1413,11 @@ private:
         if (request.parsedJson.contains("temperature")) {
             params.temperature = request.parsedJson["temperature"].template get<float>();
         }
+        if (request.parsedJson.contains("min_p")) {
+            params.min_p = request.parsedJson["min_p"].template get<float>();
+        }
         if (request.parsedJson.contains("seed")) {
             params.seed = request.parsedJson["seed"].template get<unsigned long long>();
-            sampler->setSeed(params.seed);
         }
         if (request.parsedJson.contains("max_tokens")) {
             params.max_tokens = request.parsedJson["max_tokens"].template get<int>();
@@ -518,10 +1432,6 @@ private:
     }
 };
 
-void handleCompletionsRequest(HttpRequest& request, ApiServer *api) {
-    api->complete(request);
-}
-
 void handleModelsRequest(HttpRequest& request, const char* modelPath) {
     std::string path(modelPath);
     size_t pos = path.find_last_of("/\\");
@@ -533,40 +1443,179 @@ void handleModelsRequest(HttpRequest& request, const char* modelPath) {
     request.writeJson(response);
 }
 
-static void server(AppInferenceContext *context) {
-    NnSocket serverSocket(createServerSocket(context->args->port));
-
-    TokenizerChatStops stops(context->tokenizer);
-    ChatTemplateGenerator templateGenerator(context->args->chatTemplateType, context->tokenizer->chatTemplate, stops.stops[0]);
-    EosDetector eosDetector(stops.nStops, context->tokenizer->eosTokenIds.data(), stops.stops, stops.maxStopLength, stops.maxStopLength);
-    ApiServer api(context->inference, context->tokenizer, context->sampler, context->args, context->header, &eosDetector, &templateGenerator);
+void handleMetricsRequest(HttpRequest& request, const ApiMetrics *metrics) {
+    request.writeText("text/plain; version=0.0.4; charset=utf-8", metrics->write());
+}
 
-    printf("Server URL: http://127.0.0.1:%d/v1/\n", context->args->port);
+// Event loop of the HTTP front end: accepts connections, parses requests and flushes responses.
+// Completions are queued for the scheduler, other routes are answered here, so they don't wait
+// for the inference.
+class HttpServer {
+private:
+    int serverSocket;
+    ApiServer *api;
+    std::vector<Route> routes;
+    HttpPoller poller;
+    std::map<int, std::shared_ptr<HttpConnection>> connections;
 
-    std::vector<Route> routes = {
-        {
-            "/v1/chat/completions",
-            HttpMethod::METHOD_POST,
-            std::bind(&handleCompletionsRequest, std::placeholders::_1, &api)
-        },
-        {
+public:
+    HttpServer(int serverSocket, ApiServer *api, AppCliArgs *args, const ApiMetrics *metrics)
+        : serverSocket(serverSocket), api(api) {
+        routes.push_back({
             "/v1/models",
             HttpMethod::METHOD_GET,
-            std::bind(&handleModelsRequest, std::placeholders::_1, context->args->modelPath)
+            std::bind(&handleModelsRequest, std::placeholders::_1, args->modelPath)
+        });
+        routes.push_back({
+            "/metrics",
+            HttpMethod::METHOD_GET,
+            std::bind(&handleMetricsRequest, std::placeholders::_1, metrics)
+        });
+    }
+
+    ~HttpServer() {
+        for (auto &it : connections)
+            it.second->close();
+    }
+
+    void run(std::atomic_bool *isRunning) {
+        setSocketNonBlocking(serverSocket, true);
+        poller.add(serverSocket);
+
+        std::vector<HttpPollEvent> events;
+        while (isRunning->load()) {
+            poller.wait(events, 100);
+            for (const HttpPollEvent &event : events) {
+                if (event.fd == serverSocket) {
+                    acceptConnections();
+                    continue;
+                }
+                auto it = connections.find(event.fd);
+                if (it == connections.end())
+                    continue;
+                std::shared_ptr<HttpConnection> connection = it->second;
+                bool isOpen = true;
+                if (event.writable)
+                    isOpen = connection->flush();
+                if (isOpen && event.readable)
+                    isOpen = readInput(connection.get());
+                if (isOpen)
+                    isOpen = handleInput(connection);
+                if (!isOpen)
+                    closeConnection(connection.get());
+            }
         }
-    };
+    }
 
-    while (true) {
-        try {
-            NnSocket clientSocket(acceptSocket(serverSocket.fd));
-            HttpRequest request = HttpRequest::read(clientSocket.fd);
+private:
+    void acceptConnections() {
+        while (true) {
+            int fd;
+            try {
+                fd = tryAcceptSocket(serverSocket);
+            } catch (const std::exception &e) {
+                printf("Socket error: %s\n", e.what());
+                return;
+            }
+            if (fd < 0)
+                return;
+            setSocketNonBlocking(fd, true);
+            std::shared_ptr<HttpConnection> connection(new HttpConnection(fd, &poller));
+            connections[fd] = connection;
+            poller.add(fd);
+        }
+    }
+
+    // false if the client is gone
+    bool readInput(HttpConnection *connection) {
+        // Without read interest only an error or a hang-up wakes the connection
+        if (connection->isReadClosed)
+            return false;
+        char buffer[HTTP_READ_BUFFER_SIZE];
+        while (true) {
+            const ssize_t n = recv(connection->fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection->input.append(buffer, (size_t)n);
+                continue;
+            }
+            if (n == 0) {
+                // A half-closed client still gets the answers of the requests it sent before the FIN,
+                // handleInput closes the connection if there is nothing to answer
+                connection->closeRead();
+                return true;
+            }
+            return isHttpWouldBlock();
+        }
+    }
+
+    // Handles buffered requests one by one, a keep-alive connection reads the next one after the response
+    bool handleInput(std::shared_ptr<HttpConnection> &connection) {
+        while (connection->isIdle()) {
+            HttpRequest request(connection);
+            try {
+                if (!HttpRequest::parse(connection->input, request))
+                    break;
+            } catch (const std::exception &e) {
+                printf("🚨 Request error: %s\n", e.what());
+                connection->input.clear();
+                request.writeBadRequest(e.what());
+                return true;
+            }
             printf("🔷 %s %s\n", request.getMethod().c_str(), request.path.c_str());
-            Router::resolve(request, routes);
-        } catch (const NnTransferSocketException& e) {
-            printf("Socket error: %d %s\n", e.code, e.what());
-        } catch (const NnExecutorException &e) {
-            throw;
+            connection->begin(request.keepAlive);
+            try {
+                if (request.method == HttpMethod::METHOD_POST && request.path == "/v1/chat/completions") {
+                    // The scheduler answers the request, the connection waits until it's done
+                    api->submit(request);
+                } else {
+                    Router::resolve(request, routes);
+                }
+            } catch (const NnTransferSocketException &e) {
+                return false;
+            } catch (const std::exception &e) {
+                printf("🚨 Request error: %s\n", e.what());
+                request.writeBadRequest(e.what());
+            }
         }
+        return !connection->isReadClosed || connection->hasPendingOutput();
+    }
+
+    void closeConnection(HttpConnection *connection) {
+        const int fd = connection->fd;
+        connection->close();
+        connections.erase(fd);
+    }
+};
+
+static void ioLoop(int serverSocket, ApiServer *api, AppCliArgs *args, const ApiMetrics *metrics, std::atomic_bool *isRunning) {
+    try {
+        HttpServer httpServer(serverSocket, api, args, metrics);
+        httpServer.run(isRunning);
+    } catch (const std::exception &e) {
+        printf("🚨 HTTP server error: %s\n", e.what());
+    }
+}
+
+static void server(AppInferenceContext *context) {
+    NnSocket serverSocket(createServerSocket(context->args->port));
+
+    TokenizerChatStops stops(context->tokenizer);
+    ChatTemplateGenerator templateGenerator(context->args->chatTemplateType, context->tokenizer->chatTemplate, stops.stops[0]);
+    ApiMetrics metrics(context->network, context->args->nWorkers + 1);
+    ApiServer api(context->inference, context->speculativeDecoder, context->tokenizer, context->args, context->header, &stops, &templateGenerator, &metrics);
+
+    printf("Server URL: http://127.0.0.1:%d/v1/\n", context->args->port);
+    printf("Metrics URL: http://127.0.0.1:%d/metrics\n", context->args->port);
+
+    std::atomic_bool isRunning(true);
+    std::thread ioThread(ioLoop, serverSocket.fd, &api, context->args, &metrics, &isRunning);
+    try {
+        api.run();
+    } catch (...) {
+        // The I/O thread notices the flag within one poll timeout, then the inference is torn down and retried
+        isRunning.store(false);
+        ioThread.join();
+        throw;
     }
 }
 
@@ -579,13 +1628,26 @@ static void server(AppInferenceContext *context) {
 void usage() {
     fprintf(stderr, "Usage: %s {--model <path>} {--tokenizer <path>} [--port <p>]\n", EXECUTABLE_NAME);
     fprintf(stderr, "        [--buffer-float-type {f32|f16|q40|q80}]\n");
+    fprintf(stderr, "        [--pp-sync-codec <codec>] [--tp-sync-codec <codec>]\n");
     fprintf(stderr, "        [--weights-float-type {f32|f16|q40|q80}]\n");
     fprintf(stderr, "        [--max-seq-len <max>]\n");
     fprintf(stderr, "        [--nthreads <n>]\n");
     fprintf(stderr, "        [--workers <ip:port> ...]\n");
+    fprintf(stderr, "        [--micro-batch <n>]\n");
     fprintf(stderr, "        [--temperature <temp>]\n");
     fprintf(stderr, "        [--topp <t>]\n");
+    fprintf(stderr, "        [--min-p <p>]\n");
     fprintf(stderr, "        [--seed <s>]\n");
+    fprintf(stderr, "        [--kv-slots <n>]\n");
+    fprintf(stderr, "        [--kv-block-size <n>]\n");
+    fprintf(stderr, "        [--kv-cache-blocks <n>]\n");
+    fprintf(stderr, "        [--kv-cache-type <f32|f16|q80>]\n");
+    fprintf(stderr, "        [--kv-sinks <n>]\n");
+    fprintf(stderr, "        [--draft-model <path>] [--draft-tokens <k>]\n");
+    fprintf(stderr, "        [--logits-topk <k>]\n");
+    fprintf(stderr, "        [--moe-expert-parallel <0|1>] [--moe-expert-cache <n>]\n");
+    fprintf(stderr, "        [--op-fusion <0|1>] [--weight-repack <0|1>]\n");
+    fprintf(stderr, "        [--numa <0|1>] [--cpu-affinity <cpu list>]\n");
     fprintf(stderr, "Example:\n");
     fprintf(stderr, "  sudo nice -n -20 ./dllama-api --port 9990 --nthreads 4 \\\n");
     fprintf(stderr, "    --model dllama_model_llama3_2_3b_instruct_q40.m \\\n");
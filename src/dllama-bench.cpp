@@ -0,0 +1,711 @@
+#include "nn/nn-core.hpp"
+#include "nn/nn-config-builder.hpp"
+#include "nn/nn-cpu.hpp"
+#include "nn/nn-quants.hpp"
+#include "nn/nn-network.hpp"
+#include "nn/nn-executor.hpp"
+#include "llm.hpp"
+#include "json.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+using json = nlohmann::json;
+
+// Op-level microbenchmark of the CPU kernels and of the node synchronization.
+//
+//   dllama-bench ops [--model <path> | --preset <name>] [--nthreads <n>] [--batches <n>]
+//   dllama-bench sync [--workers <host:port> ... | --loopback <nNodes>] [--nthreads <n>] [--batches <n>]
+//   dllama-bench worker --port <port>
+//
+// The ops mode runs every op alone in a one-op net with the shapes of a real model, for all
+// batch sizes and thread counts (powers of two up to --batches and --nthreads). The results are
+// compared with a roofline: the memory bandwidth is measured with a large copy for every thread
+// count, the compute roof is --peak-gflops (optional). The sync mode runs the synchronization of
+// one pipe of the model dimension over loopback (in-process workers) or over real links.
+
+#define BENCH_BANDWIDTH_BYTES (64u * 1024u * 1024u)
+#define BENCH_DEFAULT_PORT 9990
+
+enum BenchMode {
+    BENCH_OPS,
+    BENCH_SYNC,
+    BENCH_WORKER,
+};
+
+typedef struct {
+    const char *name;
+    NnUint dim;
+    NnUint hiddenDim;
+    NnUint nHeads;
+    NnUint nKvHeads;
+    NnUint headDim;
+} BenchPreset;
+
+static const BenchPreset presets[] = {
+    { "llama3_2_1b", 2048, 8192, 32, 8, 64 },
+    { "llama3_2_3b", 3072, 8192, 24, 8, 128 },
+    { "llama3_1_8b", 4096, 14336, 32, 8, 128 },
+    { "llama3_3_70b", 8192, 28672, 64, 8, 128 },
+};
+
+typedef struct {
+    BenchMode mode;
+    const char *modelPath;
+    const char *presetName;
+    const char *jsonPath;
+    NnUint nThreads;
+    NnUint nBatches;
+    NnUint nIterations;
+    NnUint maxSeqLen;
+    float peakGflops;
+    NnFloatType syncType;
+    NnUint nLoopbackNodes;
+    std::vector<std::string> workerHosts;
+    std::vector<NnUint> workerPorts;
+    NnUint port;
+    bool netShm;
+} BenchArgs;
+
+typedef struct {
+    NnUint dim;
+    NnUint hiddenDim;
+    NnUint nHeads;
+    NnUint nKvHeads;
+    NnUint headDim;
+    NnUint qDim;
+    NnUint kvDim;
+    NnUint seqLen;
+    NnFloatType weightType;
+} BenchShape;
+
+typedef struct {
+    double meanUs;
+    double minUs;
+} BenchTime;
+
+static NnUint parseUint(const char *name, const char *value) {
+    char *end;
+    long v = std::strtol(value, &end, 10);
+    if (*end != '\0' || v <= 0)
+        throw std::runtime_error(std::string("Invalid value of ") + name + ": " + value);
+    return (NnUint)v;
+}
+
+static BenchArgs parseArgs(int argc, char **argv) {
+    if (argc < 2)
+        throw std::runtime_error("Usage: dllama-bench ops|sync|worker [options]");
+
+    BenchArgs args;
+    if (std::strcmp(argv[1], "ops") == 0) args.mode = BENCH_OPS;
+    else if (std::strcmp(argv[1], "sync") == 0) args.mode = BENCH_SYNC;
+    else if (std::strcmp(argv[1], "worker") == 0) args.mode = BENCH_WORKER;
+    else throw std::runtime_error(std::string("Unsupported mode: ") + argv[1]);
+    args.modelPath = nullptr;
+    args.presetName = "llama3_1_8b";
+    args.jsonPath = nullptr;
+    args.nThreads = 1;
+    args.nBatches = 16;
+    args.nIterations = 10;
+    args.maxSeqLen = 2048;
+    args.peakGflops = 0.0f;
+    args.syncType = F_32;
+    args.nLoopbackNodes = 2;
+    args.port = BENCH_DEFAULT_PORT;
+    args.netShm = false;
+
+    for (int i = 2; i < argc; i++) {
+        const char *name = argv[i];
+        if (std::strcmp(name, "--net-shm") == 0) {
+            args.netShm = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            throw std::runtime_error(std::string("Missing value of ") + name);
+        if (std::strcmp(name, "--workers") == 0) {
+            for (; i + 1 < argc && std::strncmp(argv[i + 1], "--", 2) != 0; i++) {
+                const char *address = argv[i + 1];
+                const char *separator = std::strchr(address, ':');
+                if (separator == nullptr)
+                    throw std::runtime_error(std::string("Invalid worker address: ") + address);
+                args.workerHosts.push_back(std::string(address, separator - address));
+                args.workerPorts.push_back(parseUint("--workers", separator + 1));
+            }
+            continue;
+        }
+        char *value = argv[++i];
+        if (std::strcmp(name, "--model") == 0) args.modelPath = value;
+        else if (std::strcmp(name, "--preset") == 0) args.presetName = value;
+        else if (std::strcmp(name, "--json") == 0) args.jsonPath = value;
+        else if (std::strcmp(name, "--nthreads") == 0) args.nThreads = parseUint(name, value);
+        else if (std::strcmp(name, "--batches") == 0) args.nBatches = parseUint(name, value);
+        else if (std::strcmp(name, "--iterations") == 0) args.nIterations = parseUint(name, value);
+        else if (std::strcmp(name, "--max-seq-len") == 0) args.maxSeqLen = parseUint(name, value);
+        else if (std::strcmp(name, "--peak-gflops") == 0) args.peakGflops = std::atof(value);
+        else if (std::strcmp(name, "--loopback") == 0) args.nLoopbackNodes = parseUint(name, value);
+        else if (std::strcmp(name, "--port") == 0) args.port = parseUint(name, value);
+        else if (std::strcmp(name, "--buffer-float-type") == 0) {
+            if (std::strcmp(value, "f32") == 0) args.syncType = F_32;
+            else if (std::strcmp(value, "q80") == 0) args.syncType = F_Q80;
+            else throw std::runtime_error(std::string("Unsupported buffer float type: ") + value);
+        }
+        else throw std::runtime_error(std::string("Unknown option: ") + name);
+    }
+    return args;
+}
+
+static BenchShape resolveShape(const BenchArgs *args) {
+    BenchShape shape;
+    if (args->modelPath != nullptr) {
+        LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, F_32);
+        shape.dim = header.dim;
+        shape.hiddenDim = header.hiddenDim;
+        shape.nHeads = header.nHeads;
+        shape.nKvHeads = header.nKvHeads;
+        shape.headDim = header.headDim;
+        shape.seqLen = header.seqLen;
+        shape.weightType = header.weightType;
+    } else {
+        const BenchPreset *preset = nullptr;
+        for (const BenchPreset &p : presets) {
+            if (std::strcmp(p.name, args->presetName) == 0)
+                preset = &p;
+        }
+        if (preset == nullptr)
+            throw std::runtime_error(std::string("Unknown preset: ") + args->presetName);
+        shape.dim = preset->dim;
+        shape.hiddenDim = preset->hiddenDim;
+        shape.nHeads = preset->nHeads;
+        shape.nKvHeads = preset->nKvHeads;
+        shape.headDim = preset->headDim;
+        shape.seqLen = args->maxSeqLen;
+        shape.weightType = F_Q40;
+    }
+    shape.qDim = shape.nHeads * shape.headDim;
+    shape.kvDim = shape.nKvHeads * shape.headDim;
+    if (shape.weightType != F_Q40 && shape.weightType != F_Q4K && shape.weightType != F_Q6K && shape.weightType != F_32)
+        throw std::runtime_error("The benchmark supports only Q40, Q4K, Q6K and F32 weights");
+    return shape;
+}
+
+// 1, 2, 4, ... up to max, max is always included
+static std::vector<NnUint> powersOfTwo(NnUint max) {
+    std::vector<NnUint> values;
+    for (NnUint v = 1u; v < max; v *= 2u)
+        values.push_back(v);
+    values.push_back(max);
+    return values;
+}
+
+static void fillRandom(std::mt19937 &rng, float *data, NnSize n) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (NnSize i = 0; i < n; i++)
+        data[i] = dist(rng);
+}
+
+// Blocks with a fixed scale and random quants, quantizing a large random matrix is too slow
+static void fillRandomQ40(std::mt19937 &rng, NnBlockQ40 *blocks, NnSize nBlocks) {
+    const std::uint16_t d = CONVERT_F32_TO_F16(0.01f);
+    for (NnSize i = 0; i < nBlocks; i++) {
+        blocks[i].d = d;
+        for (NnUint j = 0; j < Q40_BLOCK_SIZE / 2; j++)
+            blocks[i].qs[j] = (std::uint8_t)rng();
+    }
+}
+
+enum BenchOpKind {
+    BENCH_OP_MATMUL,
+    BENCH_OP_MULTIHEAD_ATT,
+    BENCH_OP_CAST,
+};
+
+typedef struct {
+    const char *name;
+    BenchOpKind kind;
+    NnUint n; // input width
+    NnUint d; // output width
+} BenchOpCase;
+
+typedef struct {
+    double bytes;
+    double flops;
+} BenchOpCost;
+
+// Memory traffic and work of one forward, the KV cache rows read by the attention are counted once per row
+static BenchOpCost getOpCost(const BenchOpCase *op, const BenchShape *shape, NnFloatType inputType, NnUint batchSize) {
+    BenchOpCost cost;
+    if (op->kind == BENCH_OP_MATMUL) {
+        cost.bytes = (double)getBytes(shape->weightType, (NnSize)op->n * op->d)
+            + batchSize * ((double)getBytes(inputType, op->n) + op->d * sizeof(float));
+        cost.flops = 2.0 * op->n * op->d * batchSize;
+    } else if (op->kind == BENCH_OP_MULTIHEAD_ATT) {
+        cost.bytes = 0.0;
+        cost.flops = 0.0;
+        for (NnUint y = 0; y < batchSize; y++) {
+            const double nTokens = shape->seqLen / 2 + y + 1;
+            cost.bytes += 2.0 * nTokens * shape->kvDim * sizeof(float) + 2.0 * shape->qDim * sizeof(float);
+            cost.flops += 4.0 * nTokens * shape->qDim;
+        }
+    } else {
+        cost.bytes = batchSize * ((double)op->n * sizeof(float) + getBytes(F_Q80, op->n));
+        cost.flops = 0.0;
+    }
+    return cost;
+}
+
+// One-op net, the input and the output are pipes so the benchmark can fill them
+static void buildOpConfig(const BenchOpCase *op, const BenchShape *shape, NnFloatType inputType, NnUint nBatches,
+    NnNetConfig *netConfig, NnNodeConfig *nodeConfig)
+{
+    NnNetConfigBuilder netBuilder(1, nBatches);
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnSegmentConfigBuilder segmentBuilder;
+
+    if (op->kind == BENCH_OP_MATMUL) {
+        const NnUint xPipeIndex = netBuilder.addPipe("x", size2D(inputType, nBatches, op->n));
+        const NnUint yPipeIndex = netBuilder.addPipe("y", size2D(F_32, nBatches, op->d));
+        const NnUint expertIndexesBufferIndex = nodeBuilder.addBuffer("act_exp_ix", size2D(F_32, nBatches, 1));
+        segmentBuilder.addOp(OP_MATMUL, op->name, 0,
+            pointerBatchConfig(SRC_PIPE, xPipeIndex),
+            pointerBatchConfig(SRC_PIPE, yPipeIndex),
+            size2D(shape->weightType, op->n, op->d),
+            NnMatmulOpConfig{0, 0, expertIndexesBufferIndex});
+    } else if (op->kind == BENCH_OP_MULTIHEAD_ATT) {
+        const NnKvCacheSlice kvCacheSlice = sliceKvCache(shape->kvDim, shape->seqLen, 1);
+        const NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(shape->nHeads, shape->seqLen, 1, nBatches);
+        const NnUint positionPipeIndex = netBuilder.addPipe("pos", size2D(F_32, nBatches, 1));
+        const NnUint zPipeIndex = netBuilder.addPipe("z", size2D(F_32, nBatches, shape->qDim));
+        const NnUint qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, shape->qDim));
+        const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize);
+        const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize);
+        const NnUint attBufferIndex = nodeBuilder.addBuffer("att", multiHeadAttSlice.attSize);
+        segmentBuilder.addOp(OP_MULTIHEAD_ATT, op->name, 0,
+            pointerBatchConfig(SRC_PIPE, zPipeIndex),
+            pointerBatchConfig(SRC_PIPE, zPipeIndex),
+            size0(),
+            NnMultiHeadAttOpConfig{
+                multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0,
+                shape->nKvHeads, shape->headDim, shape->seqLen, shape->qDim, kvCacheSlice.kvDim0,
+                positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
+                1u, 0u, 0u, 0u, F_32});
+    } else {
+        const NnUint xPipeIndex = netBuilder.addPipe("x", size2D(F_32, nBatches, op->n));
+        const NnUint yPipeIndex = netBuilder.addPipe("y", size2D(F_Q80, nBatches, op->n));
+        segmentBuilder.addOp(OP_CAST, op->name, 0,
+            pointerBatchConfig(SRC_PIPE, xPipeIndex),
+            pointerBatchConfig(SRC_PIPE, yPipeIndex),
+            size0(),
+            NnCastOpCodeConfig{});
+    }
+
+    nodeBuilder.addSegment(segmentBuilder.build());
+    *netConfig = netBuilder.build();
+    *nodeConfig = nodeBuilder.build();
+}
+
+static BenchTime measure(NnExecutor *executor, NnUint nIterations) {
+    executor->forward(); // warm-up
+    BenchTime time;
+    time.meanUs = 0.0;
+    time.minUs = 0.0;
+    for (NnUint i = 0; i < nIterations; i++) {
+        // Timer has a resolution of 1 us, too coarse for the small ops
+        const auto start = std::chrono::steady_clock::now();
+        executor->forward();
+        const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        time.meanUs += us;
+        if (i == 0 || us < time.minUs)
+            time.minUs = us;
+    }
+    time.meanUs /= nIterations;
+    return time;
+}
+
+// Read + write bandwidth of a copy much larger than the caches, with the executor threads. Ops with
+// a working set that fits in the caches can go above this roof.
+static double measureBandwidth(NnUint nThreads, NnUint nIterations) {
+    const NnUint nElements = BENCH_BANDWIDTH_BYTES / sizeof(float);
+    NnNetConfigBuilder netBuilder(1, 1);
+    const NnUint xPipeIndex = netBuilder.addPipe("x", size2D(F_32, 1, nElements));
+    const NnUint yPipeIndex = netBuilder.addPipe("y", size2D(F_32, 1, nElements));
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnSegmentConfigBuilder segmentBuilder;
+    segmentBuilder.addOp(OP_CAST, "copy", 0,
+        pointerBatchConfig(SRC_PIPE, xPipeIndex),
+        pointerBatchConfig(SRC_PIPE, yPipeIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    nodeBuilder.addSegment(segmentBuilder.build());
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+
+    double gbps;
+    {
+        NnNetExecution execution(nThreads, &netConfig);
+        std::memset(execution.pipes[xPipeIndex], 0, BENCH_BANDWIDTH_BYTES);
+        std::vector<NnExecutorDevice> devices;
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(&netConfig, &nodeConfig, &execution), -1, -1));
+        NnFakeNodeSynchronizer synchronizer;
+        NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+        execution.setBatchSize(1);
+        const BenchTime time = measure(&executor, nIterations);
+        gbps = 2.0 * BENCH_BANDWIDTH_BYTES / (time.minUs * 1e3);
+    }
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+    return gbps;
+}
+
+static void fillOpInputs(const BenchOpCase *op, const BenchShape *shape, NnFloatType inputType, NnUint nBatches,
+    NnNetExecution *execution, NnCpuDevice *device, NnExecutor *executor, std::mt19937 &rng)
+{
+    if (op->kind == BENCH_OP_MATMUL) {
+        std::vector<float> x((NnSize)nBatches * op->n);
+        fillRandom(rng, x.data(), x.size());
+        if (inputType == F_Q80)
+            quantizeF32toQ80(x.data(), (NnBlockQ80 *)execution->pipes[0], x.size(), 1, 0);
+        else
+            std::memcpy(execution->pipes[0], x.data(), x.size() * sizeof(float));
+
+        const NnSize weightBytes = getBytes(shape->weightType, (NnSize)op->n * op->d);
+        std::vector<NnByte> weight(weightBytes);
+        if (shape->weightType == F_Q40) {
+            fillRandomQ40(rng, (NnBlockQ40 *)weight.data(), weightBytes / sizeof(NnBlockQ40));
+        } else if (shape->weightType == F_Q4K || shape->weightType == F_Q6K) {
+            // The scales of the super-blocks are not arbitrary, random values go through the quantizer
+            std::vector<float> w((NnSize)op->n * op->d);
+            fillRandom(rng, w.data(), w.size());
+            if (shape->weightType == F_Q4K)
+                quantizeF32toQ4K(w.data(), (NnBlockQ4K *)weight.data(), w.size(), 1, 0);
+            else
+                quantizeF32toQ6K(w.data(), (NnBlockQ6K *)weight.data(), w.size(), 1, 0);
+        } else
+            fillRandom(rng, (float *)weight.data(), weightBytes / sizeof(float));
+        executor->loadWeight(op->name, 0u, 0u, weightBytes, weight.data());
+    } else if (op->kind == BENCH_OP_MULTIHEAD_ATT) {
+        // Rows of the batch continue the sequence from the middle of the context
+        float *positions = (float *)execution->pipes[0];
+        for (NnUint y = 0; y < nBatches; y++)
+            positions[y] = (float)(shape->seqLen / 2 + y);
+        fillRandom(rng, (float *)device->buffers[0], (NnSize)nBatches * shape->qDim);
+        const NnSize cacheSize = (NnSize)shape->seqLen * shape->kvDim;
+        fillRandom(rng, (float *)device->buffers[1], cacheSize);
+        fillRandom(rng, (float *)device->buffers[2], cacheSize);
+    } else {
+        fillRandom(rng, (float *)execution->pipes[0], (NnSize)nBatches * op->n);
+    }
+}
+
+
+static void writeReport(const char *path, const json &report) {
+    if (path == nullptr)
+        return;
+    std::ofstream file(path);
+    if (!file)
+        throw std::runtime_error(std::string("Cannot open the report file: ") + path);
+    file << report.dump(2) << std::endl;
+    printf("📄 Report: %s\n", path);
+}
+
+static json shapeToJson(const BenchShape *shape) {
+    json result;
+    result["dim"] = shape->dim;
+    result["hiddenDim"] = shape->hiddenDim;
+    result["nHeads"] = shape->nHeads;
+    result["nKvHeads"] = shape->nKvHeads;
+    result["headDim"] = shape->headDim;
+    result["seqLen"] = shape->seqLen;
+    result["weightType"] = shape->weightType == F_Q40 ? "q40"
+        : shape->weightType == F_Q4K ? "q4k"
+        : shape->weightType == F_Q6K ? "q6k"
+        : "f32";
+    return result;
+}
+
+static void runOpsBenchmark(const BenchArgs *args) {
+    const BenchShape shape = resolveShape(args);
+    if (args->nBatches > shape.seqLen / 2)
+        throw std::runtime_error("The attention rows start at seqLen / 2, --batches must not be larger");
+    const NnFloatType inputType = shape.weightType == F_32 ? F_32 : F_Q80;
+    const BenchOpCase cases[] = {
+        { "matmul_q", BENCH_OP_MATMUL, shape.dim, shape.qDim },
+        { "matmul_kv", BENCH_OP_MATMUL, shape.dim, shape.kvDim },
+        { "matmul_w1", BENCH_OP_MATMUL, shape.dim, shape.hiddenDim },
+        { "matmul_w2", BENCH_OP_MATMUL, shape.hiddenDim, shape.dim },
+        { "multihead_att", BENCH_OP_MULTIHEAD_ATT, shape.qDim, shape.qDim },
+        { "cast_q80", BENCH_OP_CAST, shape.dim, shape.dim },
+    };
+    const std::vector<NnUint> threadCounts = powersOfTwo(args->nThreads);
+    const std::vector<NnUint> batchSizes = powersOfTwo(args->nBatches);
+    std::mt19937 rng(12345);
+
+    printf("💡 Dim: %u, HiddenDim: %u, Heads: %u/%u, HeadDim: %u, SeqLen: %u\n",
+        shape.dim, shape.hiddenDim, shape.nHeads, shape.nKvHeads, shape.headDim, shape.seqLen);
+
+    json report;
+    report["shape"] = shapeToJson(&shape);
+    report["peakGflops"] = args->peakGflops;
+    report["bandwidth"] = json::array();
+    report["ops"] = json::array();
+
+    for (NnUint nThreads : threadCounts) {
+        const double peakGbps = measureBandwidth(nThreads, args->nIterations);
+        printf("🧠 Threads: %u, memory bandwidth: %.2f GB/s\n", nThreads, peakGbps);
+        report["bandwidth"].push_back({ {"threads", nThreads}, {"gbps", peakGbps} });
+
+        for (const BenchOpCase &op : cases) {
+            NnNetConfig netConfig;
+            NnNodeConfig nodeConfig;
+            buildOpConfig(&op, &shape, inputType, args->nBatches, &netConfig, &nodeConfig);
+            {
+                NnNetExecution execution(nThreads, &netConfig);
+                NnCpuDevice *device = new NnCpuDevice(&netConfig, &nodeConfig, &execution);
+                std::vector<NnExecutorDevice> devices;
+                devices.push_back(NnExecutorDevice(device, -1, -1));
+                NnFakeNodeSynchronizer synchronizer;
+                NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+                fillOpInputs(&op, &shape, inputType, args->nBatches, &execution, device, &executor, rng);
+
+                for (NnUint batchSize : batchSizes) {
+                    execution.setBatchSize(batchSize);
+                    const BenchTime time = measure(&executor, args->nIterations);
+                    const BenchOpCost cost = getOpCost(&op, &shape, inputType, batchSize);
+                    const double gbps = cost.bytes / (time.minUs * 1e3);
+                    const double gflops = cost.flops / (time.minUs * 1e3);
+                    const double intensity = cost.flops / cost.bytes;
+                    double roofGflops = intensity * peakGbps;
+                    if (args->peakGflops > 0.0f && args->peakGflops < roofGflops)
+                        roofGflops = args->peakGflops;
+                    // Ops without arithmetic are compared with the bandwidth only
+                    const double roofPercent = cost.flops > 0.0
+                        ? 100.0 * gflops / roofGflops
+                        : 100.0 * gbps / peakGbps;
+
+                    printf("🔶 %-14s n=%6u d=%6u batch=%3u threads=%2u | %10.1f us | %8.2f GB/s %9.2f GFLOP/s | AI %7.2f | roof %5.1f%%\n",
+                        op.name, op.n, op.d, batchSize, nThreads, time.minUs, gbps, gflops, intensity, roofPercent);
+                    report["ops"].push_back({
+                        {"op", op.name},
+                        {"n", op.n},
+                        {"d", op.d},
+                        {"batch", batchSize},
+                        {"threads", nThreads},
+                        {"meanUs", time.meanUs},
+                        {"minUs", time.minUs},
+                        {"bytes", cost.bytes},
+                        {"flops", cost.flops},
+                        {"gbps", gbps},
+                        {"gflops", gflops},
+                        {"intensity", intensity},
+                        {"roofGflops", roofGflops},
+                        {"roofPercent", roofPercent},
+                    });
+                }
+            }
+            releaseNetConfig(&netConfig);
+            releaseNodeConfig(&nodeConfig);
+        }
+    }
+    writeReport(args->jsonPath, report);
+}
+
+// Sent by the root to every worker before each case, nIterations = 0 stops the worker
+typedef struct {
+    NnUint nodeIndex;
+    NnUint nNodes;
+    NnUint syncType;  // NnSyncType
+    NnUint floatType; // NnFloatType of the pipe
+    NnUint dim;
+    NnUint nBatches;
+    NnUint batchSize;
+    NnUint nThreads;
+    NnUint nIterations;
+} BenchSyncPacket;
+
+static const char *syncTypeToName(NnSyncType type) {
+    if (type == SYNC_WITH_ROOT) return "with_root";
+    if (type == SYNC_NODE_SLICES) return "node_slices";
+    if (type == SYNC_NODE_SLICES_EXCEPT_ROOT) return "node_slices_except_root";
+    return "unknown";
+}
+
+// The same net on all nodes: one pipe and one segment with the benchmarked sync. The forwards
+// end with an ack from every worker, so the mean time on the root covers the whole exchange.
+static BenchTime runSyncCase(NnNetwork *network, const BenchSyncPacket *packet) {
+    NnNetConfigBuilder netBuilder(packet->nNodes, packet->nBatches);
+    const NnUint xPipeIndex = netBuilder.addPipe("x", size2D((NnFloatType)packet->floatType, packet->nBatches, packet->dim));
+    NnNodeConfigBuilder nodeBuilder(packet->nodeIndex);
+    NnSegmentConfigBuilder segmentBuilder;
+    segmentBuilder.addSync(xPipeIndex, (NnSyncType)packet->syncType);
+    nodeBuilder.addSegment(segmentBuilder.build());
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+
+    BenchTime time;
+    {
+        NnNetExecution execution(packet->nThreads, &netConfig);
+        std::vector<NnExecutorDevice> devices;
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(&netConfig, &nodeConfig, &execution), -1, -1));
+        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig);
+        NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+        execution.setBatchSize(packet->batchSize);
+
+        Timer total;
+        time = measure(&executor, packet->nIterations);
+        if (packet->nodeIndex == 0) {
+            for (NnUint socketIndex = 0; socketIndex < network->nSockets; socketIndex++)
+                network->readAck(socketIndex);
+            time.meanUs = total.elapsedMicroseconds() / (double)(packet->nIterations + 1);
+        } else {
+            network->writeAck(ROOT_SOCKET_INDEX);
+        }
+    }
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+    return time;
+}
+
+static void prepareNetwork(NnNetwork *network, bool netShm) {
+    network->negotiateTransports(netShm, 4 * 1024 * 1024);
+    network->setTurbo(true);
+}
+
+static void runSyncWorker(NnUint port, bool netShm) {
+    std::unique_ptr<NnNetwork> network = NnNetwork::serve(port);
+    prepareNetwork(network.get(), netShm);
+    for (;;) {
+        BenchSyncPacket packet;
+        network->read(ROOT_SOCKET_INDEX, &packet, sizeof(packet));
+        if (packet.nIterations == 0)
+            break;
+        runSyncCase(network.get(), &packet);
+    }
+    printf("⭕ Benchmark finished\n");
+}
+
+static void runSyncBenchmark(const BenchArgs *args) {
+    const BenchShape shape = resolveShape(args);
+    const bool isLoopback = args->workerHosts.empty();
+
+    std::vector<std::string> hosts = args->workerHosts;
+    std::vector<NnUint> ports = args->workerPorts;
+    std::vector<std::thread> loopbackWorkers;
+    if (isLoopback) {
+        if (args->nLoopbackNodes < 2)
+            throw std::runtime_error("The loopback benchmark needs at least 2 nodes");
+        // Workers of the loopback run in this process, they compete with the root for the cores
+        for (NnUint i = 1; i < args->nLoopbackNodes; i++) {
+            hosts.push_back("127.0.0.1");
+            ports.push_back(args->port + i);
+            const NnUint port = args->port + i;
+            const bool netShm = args->netShm;
+            loopbackWorkers.push_back(std::thread([port, netShm]() {
+                try {
+                    runSyncWorker(port, netShm);
+                } catch (const std::exception &e) {
+                    printf("🚨 Loopback worker (port %u) error: %s\n", port, e.what());
+                }
+            }));
+        }
+        // The workers have to listen before the root connects
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    const NnUint nWorkers = hosts.size();
+    const NnUint nNodes = nWorkers + 1;
+    std::vector<char *> hostPtrs(nWorkers);
+    for (NnUint i = 0; i < nWorkers; i++)
+        hostPtrs[i] = (char *)hosts[i].c_str();
+    std::unique_ptr<NnNetwork> network = NnNetwork::connect(nWorkers, hostPtrs.data(), ports.data());
+    prepareNetwork(network.get(), args->netShm);
+
+    const NnSyncType syncTypes[] = { SYNC_WITH_ROOT, SYNC_NODE_SLICES, SYNC_NODE_SLICES_EXCEPT_ROOT };
+    const std::vector<NnUint> threadCounts = powersOfTwo(args->nThreads);
+    const std::vector<NnUint> batchSizes = powersOfTwo(args->nBatches);
+    const NnSize rowBytes = getBytes(args->syncType, shape.dim);
+
+    printf("💡 Nodes: %u, links: %s, dim: %u, row: %zu bytes\n", nNodes, isLoopback ? "loopback" : "network", shape.dim, (size_t)rowBytes);
+
+    json report;
+    report["nodes"] = nNodes;
+    report["links"] = isLoopback ? "loopback" : "network";
+    report["transport"] = network->getTransportName(0);
+    report["dim"] = shape.dim;
+    report["floatType"] = args->syncType == F_Q80 ? "q80" : "f32";
+    report["syncs"] = json::array();
+
+    for (NnSyncType syncType : syncTypes) {
+        for (NnUint nThreads : threadCounts) {
+            for (NnUint batchSize : batchSizes) {
+                BenchSyncPacket packet;
+                packet.nNodes = nNodes;
+                packet.syncType = syncType;
+                packet.floatType = args->syncType;
+                packet.dim = shape.dim;
+                packet.nBatches = args->nBatches;
+                packet.batchSize = batchSize;
+                packet.nThreads = nThreads;
+                packet.nIterations = args->nIterations;
+                for (NnUint socketIndex = 0; socketIndex < nWorkers; socketIndex++) {
+                    packet.nodeIndex = socketIndex + 1;
+                    network->write(socketIndex, &packet, sizeof(packet));
+                }
+                packet.nodeIndex = 0;
+
+                network->resetStats();
+                const BenchTime time = runSyncCase(network.get(), &packet);
+                NnSize sentBytes, recvBytes;
+                network->getStats(&sentBytes, &recvBytes);
+                const double bytes = (double)(sentBytes + recvBytes) / (args->nIterations + 1);
+                const double gbps = bytes / (time.meanUs * 1e3);
+
+                printf("🔷 %-24s batch=%3u threads=%2u | %9.1f us (min %9.1f us) | %10.0f B/root %8.3f GB/s\n",
+                    syncTypeToName(syncType), batchSize, nThreads, time.meanUs, time.minUs, bytes, gbps);
+                report["syncs"].push_back({
+                    {"sync", syncTypeToName(syncType)},
+                    {"batch", batchSize},
+                    {"threads", nThreads},
+                    {"meanUs", time.meanUs},
+                    {"minUs", time.minUs},
+                    {"rootBytes", bytes},
+                    {"gbps", gbps},
+                });
+            }
+        }
+    }
+
+    BenchSyncPacket stop;
+    std::memset(&stop, 0, sizeof(stop));
+    for (NnUint socketIndex = 0; socketIndex < nWorkers; socketIndex++)
+        network->write(socketIndex, &stop, sizeof(stop));
+    for (std::thread &worker : loopbackWorkers)
+        worker.join();
+    writeReport(args->jsonPath, report);
+}
+
+int main(int argc, char **argv) {
+    initQuants();
+    initSockets();
+
+    int returnCode = EXIT_SUCCESS;
+    try {
+        BenchArgs args = parseArgs(argc, argv);
+        if (args.mode == BENCH_OPS)
+            runOpsBenchmark(&args);
+        else if (args.mode == BENCH_SYNC)
+            runSyncBenchmark(&args);
+        else
+            runSyncWorker(args.port, args.netShm);
+    } catch (const std::exception &e) {
+        printf("🚨 Critical error: %s\n", e.what());
+        returnCode = EXIT_FAILURE;
+    }
+
+    cleanupSockets();
+    return returnCode;
+}
@@ -8,9 +8,13 @@
 #include "llm.hpp"
 #include "tokenizer.hpp"
 #include "app.hpp"
+#include "json.hpp"
 #include <stdexcept>
 #include <cmath>
 #include <algorithm>
+#include <fstream>
+
+using json = nlohmann::json;
 
 #ifndef DLLAMA_DEBUG_TOPK_LOGITS
 #define DLLAMA_DEBUG_TOPK_LOGITS 0
@@ -178,6 +182,8 @@ static void inference(AppInferenceContext *context) {
             : context->args->nBatches;
 
         context->inference->setBatchSize(batchSize);
+        // The generation starts from the last prompt token, the logits of the prompt are not read
+        context->inference->setLogitsRows(1);
         context->inference->setPosition(pos);
         for (NnUint i = 0; i < batchSize; i++)
             context->inference->setToken(i, inputTokens[pos + i]);
@@ -197,8 +203,9 @@ static void inference(AppInferenceContext *context) {
                 a.hasStage = true;
             }
         }
-        float* logits = context->inference->logitsPipe;
         NnUint vocabSize = context->header->vocabSize;
+        // Only the last row has logits
+        float* logits = &context->inference->logitsPipe[(batchSize - 1) * vocabSize];
         bool hasNaN = false;
         bool hasInf = false;
         float maxLogit = -1e9;
@@ -254,10 +261,23 @@ static void inference(AppInferenceContext *context) {
     context->tokenizer->resetDecoder();
 
     const NnUint maxPos = std::min(context->header->seqLen, context->args->steps);
-    for (; pos < maxPos; pos++) {
-        context->inference->setPosition(pos);
-        context->inference->setToken(0, token);
-        context->inference->forward();
+    SpeculativeDecoder *speculative = context->speculativeDecoder;
+    if (speculative != nullptr)
+        speculative->start(std::vector<int>(inputTokens, inputTokens + nInputTokens));
+    std::vector<int> stepTokens;
+    std::string stepPieces;
+    NnUint lastDraftTime = 0;
+
+    while (pos < maxPos) {
+        stepTokens.clear();
+        if (speculative != nullptr) {
+            // 多个 token 一次 forward 验证
+            speculative->step(context->sampler, maxPos - pos, stepTokens);
+        } else {
+            context->inference->setPosition(pos);
+            context->inference->setToken(0, token);
+            context->inference->forward();
+        }
 
         if (context->args->benchmark) {
             const std::vector<LlmPerfPacket>& perf = context->inference->getLastPerf();
@@ -273,28 +293,42 @@ static void inference(AppInferenceContext *context) {
             }
         }
 
+        if (speculative == nullptr) {
 #if DLLAMA_DEBUG_TOPK_LOGITS
-        // 预测阶段：前若干步打印 topK，快速判断 logits 是否“像正常语言模型”
-        if (pos < 16) {
-            debugTopKLogits(context, context->inference->logitsPipe, context->header->vocabSize, 10, "pred");
-            if (pos < 4) debugVocabCoverage(context->inference->logitsPipe, context->header->vocabSize, "pred");
-        }
+            // 预测阶段：前若干步打印 topK，快速判断 logits 是否“像正常语言模型”
+            if (pos < 16) {
+                debugTopKLogits(context, context->inference->logitsPipe, context->header->vocabSize, 10, "pred");
+                if (pos < 4) debugVocabCoverage(context->inference->logitsPipe, context->header->vocabSize, "pred");
+            }
 #endif
-        token = context->sampler->sample(context->inference->logitsPipe);
+            stepTokens.push_back(context->sampler->sample(context->inference->logitsPipe));
+        }
 
-        char *piece = context->tokenizer->decode(token);
+        stepPieces.clear();
+        for (int t : stepTokens) {
+            char *piece = context->tokenizer->decode(t);
+            if (piece != nullptr)
+                stepPieces += piece;
+        }
+        token = stepTokens.back();
+        pos += (NnUint)stepTokens.size();
 
         if (context->network != nullptr)
             context->network->getStats(&sentBytes, &recvBytes);
 
         NnUint predTime = context->executor->getTotalTime(STEP_EXECUTE_OP);
         NnUint syncTime = context->executor->getTotalTime(STEP_SYNC_NODES);
+        if (speculative != nullptr) {
+            // the draft model runs on the root between the target forwards
+            predTime += speculative->draftTimeUs - lastDraftTime;
+            lastDraftTime = speculative->draftTimeUs;
+        }
         printf("🔶 Pred%5u ms Sync%5u ms | Sent%6zu kB Recv%6zu kB | %s\n",
             predTime / 1000,
             syncTime / 1000,
             sentBytes / 1024,
             recvBytes / 1024,
-            piece == nullptr ? "~" : piece);
+            stepPieces.empty() ? "~" : stepPieces.c_str());
         fflush(stdout);
         predTotalTime += predTime + syncTime;
     }
@@ -315,6 +349,13 @@ static void inference(AppInferenceContext *context) {
     printf("   tokens/s: %3.2f (%3.2f ms/tok)\n",
         (nPredTokens * 1000) / predTotalTimeMs,
         predTotalTimeMs / ((float) nPredTokens));
+    if (speculative != nullptr) {
+        printf("Speculative decoding\n");
+        printf("   accepted: %u / %u draft tokens (%3.1f%%)\n",
+            speculative->nAccepted,
+            speculative->nProposed,
+            speculative->nProposed > 0 ? (100.0f * speculative->nAccepted) / speculative->nProposed : 0.0f);
+    }
 
     if (context->args->benchmark && !perfAgg.empty()) {
         printf("\n");
@@ -362,46 +403,162 @@ static NnUint readStdin(const char *guide, char *buffer, NnUint size) {
     return 0;
 }
 
-static void perplexity(AppInferenceContext *context) {
-    if (context->args->prompt == nullptr)
-        throw std::runtime_error("Prompt is required");
+// Every non-empty line of the dataset is a JSON object with the "text" field (JSON Lines)
+static std::vector<std::string> loadDataset(const char *path) {
+    std::ifstream file(path);
+    if (!file.is_open())
+        throw std::runtime_error(std::string("Cannot open the dataset: ") + path);
+    std::vector<std::string> texts;
+    std::string line;
+    NnUint lineIndex = 0;
+    while (std::getline(file, line)) {
+        lineIndex++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        json item = json::parse(line, nullptr, false);
+        if (item.is_discarded() || !item.is_object() || !item.contains("text") || !item["text"].is_string())
+            throw std::runtime_error("Dataset line " + std::to_string(lineIndex) + " is not a JSON object with the \"text\" field");
+        texts.push_back(item["text"].get<std::string>());
+    }
+    return texts;
+}
 
-    std::vector<int> inputTokensVec(std::strlen(context->args->prompt) + 3);
-    int *inputTokens = inputTokensVec.data();
+typedef struct {
+    NnUint documentIndex;
+    NnUint slot;
+    NnUint pos; // the token at pos is the next input, the token at pos + 1 is its target
+} EvalSequence;
 
-    int nInputTokens;
-    context->tokenizer->encode(context->args->prompt, inputTokens, &nInputTokens, true, true);
+static void perplexity(AppInferenceContext *context) {
+    if (context->args->prompt == nullptr && context->args->datasetPath == nullptr)
+        throw std::runtime_error("Prompt or dataset is required");
+    if (context->header->logitsTopk > 0)
+        throw std::runtime_error("Perplexity needs the full logits, remove --logits-topk");
 
-    printf("Evaluating %d tokens...\n", nInputTokens);
+    std::vector<std::string> texts;
+    if (context->args->datasetPath != nullptr)
+        texts = loadDataset(context->args->datasetPath);
+    else
+        texts.push_back(context->args->prompt);
 
-    float totalLogProb = 0.0f;
-    NnUint pos = 0;
+    const NnUint seqLen = context->header->seqLen;
+    const NnUint vocabSize = context->header->vocabSize;
+    std::vector<std::vector<int>> documents;
+    NnSize nTargets = 0;
+    NnUint nTruncated = 0;
+    for (const std::string &text : texts) {
+        std::vector<int> tokens(text.size() + 3);
+        int nTokens;
+        context->tokenizer->encode((char *)text.c_str(), tokens.data(), &nTokens, true, true);
+        if ((NnUint)nTokens > seqLen) {
+            nTokens = seqLen;
+            nTruncated++;
+        }
+        tokens.resize(nTokens);
+        if (nTokens < 2)
+            continue;
+        nTargets += nTokens - 1;
+        documents.push_back(std::move(tokens));
+    }
+    if (documents.empty())
+        throw std::runtime_error("Nothing to evaluate, every document needs at least 2 tokens");
+
+    // Documents are evaluated side by side, one KV cache slot each, every row of a batch is scored
+    const NnUint nSlots = std::max(context->header->nKvSlots, 1u);
+    NnKvBlockTable *kvBlockTable = context->inference->getKvBlockTable();
+    printf("Evaluating %zu tokens of %zu documents (%u slots, batch %u)...\n",
+        (size_t)nTargets, documents.size(), nSlots, context->args->nBatches);
+    if (nTruncated > 0)
+        printf("⚠️  %u documents are truncated to %u tokens\n", nTruncated, seqLen);
+
+    // The micro-batch schedule skips the logits of all but the last micro-batch
+    context->inference->setMicroBatchSize(0);
+
+    std::vector<EvalSequence> active;
+    std::vector<NnUint> freeSlots;
+    for (NnUint slot = nSlots; slot > 0; slot--)
+        freeSlots.push_back(slot - 1);
+    std::vector<double> documentLogProbs(documents.size(), 0.0);
+    std::vector<NnUint> rowSequences(context->args->nBatches);
+    NnUint nextDocument = 0;
+    NnSize nScored = 0;
+    double totalLogProb = 0.0;
+    Timer timer;
+
+    while (nextDocument < documents.size() || !active.empty()) {
+        while (nextDocument < documents.size() && !freeSlots.empty()) {
+            active.push_back(EvalSequence{nextDocument++, freeSlots.back(), 0});
+            freeSlots.pop_back();
+        }
 
-    context->inference->setBatchSize(1);
+        // Rows of one sequence are consecutive positions, the KV cache rows are written before the attention reads them
+        NnUint batchSize = 0;
+        for (NnUint i = 0; i < active.size() && batchSize < context->args->nBatches; i++) {
+            const NnUint nLeft = (NnUint)documents[active[i].documentIndex].size() - 1 - active[i].pos;
+            const NnUint n = std::min(nLeft, context->args->nBatches - batchSize);
+            for (NnUint j = 0; j < n; j++)
+                rowSequences[batchSize + j] = i;
+            batchSize += n;
+        }
 
-    for (pos = 0; pos < nInputTokens - 1; pos++) {
-        context->inference->setPosition(pos);
-        context->inference->setToken(0, inputTokens[pos]);
+        context->inference->setBatchSize(batchSize);
+        if (active.size() == 1u)
+            context->inference->setPosition(active[0].pos, active[0].slot);
+        NnUint row = 0;
+        for (NnUint i = 0; i < active.size() && row < batchSize; i++) {
+            for (NnUint pos = active[i].pos; row < batchSize && rowSequences[row] == i; pos++, row++) {
+                if (active.size() > 1u)
+                    context->inference->setRowPosition(row, pos, active[i].slot);
+                context->inference->setToken(row, documents[active[i].documentIndex][pos]);
+            }
+        }
         context->inference->forward();
 
-        float *logits = context->inference->logitsPipe;
-        softmax_F32(logits, context->header->vocabSize);
-
-        int targetToken = inputTokens[pos + 1];
-        float prob = logits[targetToken];
+        row = 0;
+        for (NnUint i = 0; i < active.size() && row < batchSize; i++) {
+            EvalSequence &seq = active[i];
+            const std::vector<int> &tokens = documents[seq.documentIndex];
+            for (; row < batchSize && rowSequences[row] == i; row++, seq.pos++) {
+                const float *logits = &context->inference->logitsPipe[(NnSize)row * vocabSize];
+                float maxLogit = logits[0];
+                for (NnUint t = 1; t < vocabSize; t++)
+                    maxLogit = std::max(maxLogit, logits[t]);
+                double sum = 0.0;
+                for (NnUint t = 0; t < vocabSize; t++)
+                    sum += std::exp((double)(logits[t] - maxLogit));
+                const double logProb = (double)(logits[tokens[seq.pos + 1]] - maxLogit) - std::log(sum);
+                documentLogProbs[seq.documentIndex] += logProb;
+                totalLogProb += logProb;
+                nScored++;
+            }
+        }
 
-        totalLogProb += std::log(std::max(prob, 1e-30f));
-        printf("%5d / %d, prob=%f\n", pos + 1, nInputTokens - 1, prob);
+        for (NnUint i = 0; i < active.size();) {
+            const EvalSequence &seq = active[i];
+            if (seq.pos + 1 < documents[seq.documentIndex].size()) {
+                i++;
+                continue;
+            }
+            if (documents.size() > 1u)
+                printf("📄 %5u: %6zu tokens, perplexity %f\n", seq.documentIndex + 1, documents[seq.documentIndex].size() - 1,
+                    std::exp(-documentLogProbs[seq.documentIndex] / (documents[seq.documentIndex].size() - 1)));
+            if (kvBlockTable != nullptr)
+                kvBlockTable->release(seq.slot);
+            freeSlots.push_back(seq.slot);
+            active.erase(active.begin() + i);
+        }
+        printf("🔶 %zu / %zu tokens, %u rows\n", (size_t)nScored, (size_t)nTargets, batchSize);
     }
 
-    float avgLogProb = totalLogProb / (float)(nInputTokens - 1);
-    float perplexity = expf(-avgLogProb);
+    const double avgLogProb = totalLogProb / (double)nScored;
+    const double seconds = timer.elapsedMiliseconds() / 1000.0;
 
     printf("\n");
     printf("Results\n");
-    printf("   perplexity: %f (lower = better)\n", perplexity);
+    printf("   perplexity: %f (lower = better)\n", std::exp(-avgLogProb));
     printf("   avgLogProb: %f\n", avgLogProb);
     printf("   bitPerToken: %f\n", -avgLogProb / std::log(2.0));
+    printf("   tokens: %zu in %.1f s (%.1f tokens/s)\n", (size_t)nScored, seconds, seconds > 0.0 ? nScored / seconds : 0.0);
 }
 
 static void chat(AppInferenceContext *context) {
@@ -446,6 +603,8 @@ static void chat(AppInferenceContext *context) {
                 : context->args->nBatches;
 
             context->inference->setBatchSize(batchSize);
+            // The generation starts from the last prompt token, the logits of the prompt are not read
+            context->inference->skipLogits();
             context->inference->setPosition(pos);
             for (NnUint j = 0; j < batchSize; j++)
                 context->inference->setToken(j, inputTokens[i + j]);
@@ -512,6 +671,8 @@ int main(int argc, char **argv) {
             runInferenceApp(&args, &chat);
         else if (std::strcmp(args.mode, "worker") == 0)
             runWorkerApp(&args);
+        else if (std::strcmp(args.mode, "shard") == 0)
+            runShardApp(&args);
         else
             throw std::runtime_error("Unsupported mode");
     } catch (const std::exception &e) {
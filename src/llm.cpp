@@ -5,9 +5,37 @@
 #include "nn/nn-network.hpp"
 #include "mmap.hpp"
 #include "llm.hpp"
+#include <algorithm>
 #include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include <stdexcept>
 #include <functional>
+#include <memory>
+#include <string>
+
+#define LLM_SHARD_MAGIC 0x48534c44u // 'DLSH'
+#define LLM_SHARD_VERSION 1u
+// Weights in a shard start at this alignment, so the copies from the mapping are aligned
+#define LLM_SHARD_ALIGNMENT 64u
+
+typedef struct {
+    NnUint magic;
+    NnUint version;
+    NnUint nodeIndex;
+    NnUint nNodes;
+    NnUint nJobs;
+    NnUint ratiosLen; // bytes including '\0'
+    std::uint64_t modelFileSize;
+} LlmShardHeader;
+
+typedef struct {
+    NnUint opIndex;
+    NnUint nameLen; // bytes including '\0'
+    std::uint64_t deviceOffset;
+    std::uint64_t nBytes;
+    std::uint64_t dataOffset; // from the start of the shard
+} LlmShardJob;
 
 static const char *hiddenActToString(LlmHiddenAct act) {
     if (act == HIDDEN_ACT_GELU) return "Gelu";
@@ -35,6 +63,27 @@ static float convertNormEpsilon(int value) {
     throw std::runtime_error("Unsupported norm epsilon");
 }
 
+NnUint getLlmKvBlocksPerSlot(const LlmHeader *h) {
+    return (h->seqLen + h->kvBlockSize - 1) / h->kvBlockSize;
+}
+
+NnUint getLlmKvBlocks(const LlmHeader *h) {
+    if (h->nKvBlocks > 0)
+        return h->nKvBlocks;
+    return std::max(h->nKvSlots, 1u) * getLlmKvBlocksPerSlot(h);
+}
+
+NnUint getLlmFfnAlignSize(const LlmHeader *h) {
+    // The FFN slice of a node is the input of w2, a K-quant split needs whole super-blocks
+    return std::max(32u, (NnUint)getBlockSize(h->weightType));
+}
+
+static NnUint getLlmKvCacheRows(const LlmHeader *h) {
+    if (h->kvBlockSize > 0)
+        return getLlmKvBlocks(h) * h->kvBlockSize;
+    return h->seqLen * std::max(h->nKvSlots, 1u);
+}
+
 static NnSize calculateLayerBytes(LlmHeader* h, NnSize3D moeGateSize, NnSize3D rmsNormSize, NnSize3D qkRmsNormSize) {
     NnSize bytes = 0;
     // Q, K, V, WO
@@ -68,6 +117,8 @@ LlmHeader loadLlmHeader(const char *path, const NnUint maxSeqLen, NnFloatType sy
     header.weightType = F_UNK;
     header.hiddenAct = HIDDEN_ACT_SILU;
     header.ropeType = ROPE_LLAMA;
+    header.nKvSlots = 1;
+    header.kvCacheType = F_32;
     header.ropeTheta = 10000.0f;
     header.ropeScalingFactor = 1.0f;
     header.normEpsilon = 1e-5f;
@@ -136,7 +187,15 @@ LlmHeader loadLlmHeader(const char *path, const NnUint maxSeqLen, NnFloatType sy
         header.headDim = header.dim / header.nHeads;
     header.qDim = header.headDim * header.nHeads;
     header.kvDim = header.headDim * header.nKvHeads;
+    if (header.weightType == F_Q4K || header.weightType == F_Q6K) {
+        const NnUint ffDim = header.archType == QWEN3_MOE ? header.moeHiddenDim : header.hiddenDim;
+        if (header.dim % Q4K_BLOCK_SIZE != 0 || header.qDim % Q4K_BLOCK_SIZE != 0 || ffDim % Q4K_BLOCK_SIZE != 0)
+            throw std::runtime_error(std::string("The ") + floatTypeToString(header.weightType) +
+                " weights need the dim, qDim and hiddenDim to be multiples of " + std::to_string(Q4K_BLOCK_SIZE));
+    }
     header.syncType = syncType;
+    header.ppSyncCodec = SYNC_CODEC_NONE;
+    header.tpSyncCodec = SYNC_CODEC_NONE;
     header.fileSize = (NnSize)seekToEnd(fd);
 
     if (header.archType == QWEN3 || header.archType == QWEN3_MOE)
@@ -165,6 +224,22 @@ void printLlmHeader(LlmHeader *header) {
         printf("💡 MoeHiddenDim: %u\n", header->moeHiddenDim);
     }
     printf("💡 SeqLen: %u\n", header->seqLen);
+    if (header->nKvSlots > 1)
+        printf("💡 KvSlots: %u\n", header->nKvSlots);
+    if (header->kvBlockSize > 0)
+        printf("💡 KvCache: %u blocks of %u tokens\n", getLlmKvBlocks(header), header->kvBlockSize);
+    if (header->kvCacheType != F_32)
+        printf("💡 KvCacheType: %s\n", floatTypeToString(header->kvCacheType));
+    if (header->logitsTopk > 0)
+        printf("💡 LogitsTopk: %u per node\n", header->logitsTopk);
+    if (header->ppSyncCodec != SYNC_CODEC_NONE)
+        printf("💡 PpSyncCodec: %s\n", syncCodecToString(header->ppSyncCodec));
+    if (header->tpSyncCodec != SYNC_CODEC_NONE)
+        printf("💡 TpSyncCodec: %s\n", syncCodecToString(header->tpSyncCodec));
+    if (header->seqShardBlock > 0)
+        printf("💡 SeqParallel: blocks of %u positions\n", header->seqShardBlock);
+    if (header->nKvSinks > 0)
+        printf("💡 KvSinks: %u\n", header->nKvSinks);
     printf("💡 NormEpsilon: %f\n", header->normEpsilon);
     printf("💡 RopeType: %s\n", ropeTypeToString(header->ropeType));
     printf("💡 RopeTheta: %.0f\n", header->ropeTheta);
@@ -202,8 +277,18 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
     n.rmsNormSize = size1D(F_32, h->dim);
     n.qkRmsNormSize = size1D(F_32, h->headDim);
     n.moeGateSize = size2D(F_32, h->dim, h->nExperts);
-    NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvDim, h->seqLen, nNodes); //KVslice
-    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, nNodes, nBatches);
+    const NnUint nKvSlots = std::max(h->nKvSlots, 1u);
+    // Sequence parallelism: every node keeps all KV heads of its shard of the positions, q/k/v are gathered
+    // before the attention and the partials of the shards are merged by the node of the heads
+    const bool isSeqParallel = h->seqShardBlock > 0 && nNodes > 1;
+    const NnUint nSeqShards = isSeqParallel ? nNodes : 1u;
+    const NnUint kvSeqLen = isSeqParallel ? getSeqShardRows(h->seqLen, nNodes, 0, h->seqShardBlock) : h->seqLen;
+    NnKvCacheSlice kvCacheSlice = isSeqParallel
+        ? sliceKvCache(h->kvDim, kvSeqLen * nKvSlots, 1, h->kvCacheType)
+        : sliceKvCache(h->kvDim, getLlmKvCacheRows(h), nNodes, h->kvCacheType); //KVslice
+    NnMultiHeadAttSlice multiHeadAttSlice = isSeqParallel
+        ? sliceMultiHeadAtt(h->nHeads, kvSeqLen, 1, nBatches)
+        : sliceMultiHeadAtt(h->nHeads, h->seqLen, nNodes, nBatches);
 
     n.qSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->qDim);
     n.kSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
@@ -218,7 +303,12 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
     NnUint nQNormColumns = 1;
     NnUint nKNormColumns = 1;
     NnUint nInvBufferColumns = 1;
-    if (h->archType == QWEN3 || h->archType == QWEN3_MOE) {
+    if (isSeqParallel && (h->archType == QWEN3 || h->archType == QWEN3_MOE)) {
+        // the norms run on the gathered q and k
+        nQNormColumns = h->nHeads;
+        nKNormColumns = h->nKvHeads;
+        nInvBufferColumns = std::max(nQNormColumns, nKNormColumns);
+    } else if (h->archType == QWEN3 || h->archType == QWEN3_MOE) {
         ASSERT_EQ(n.qSlice.d0 % h->headDim, 0);
         ASSERT_EQ(n.kSlice.d0 % h->headDim, 0);
         nQNormColumns = n.qSlice.d0 / h->headDim;
@@ -233,15 +323,41 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
     n.xPipeIndex = netBuilder.addPipe("X", size2D(F_32, nBatches, h->dim));
     n.logitsPipeIndex = netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize));
     const NnUint zqPipeIndex = netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, h->dim * nNodes));
+    n.slotPipeIndex = netBuilder.addPipe("SLOT", size2D(F_32, nBatches, 1));
+    n.blockTablePipeIndex = 0;
+    if (h->kvBlockSize > 0)
+        n.blockTablePipeIndex = netBuilder.addPipe("KVPG", size2D(F_32, 1, std::max(h->nKvSlots, 1u) * getLlmKvBlocksPerSlot(h)));
+    n.logitsTopkPipeIndex = 0;
+    if (h->logitsTopk > 0)
+        n.logitsTopkPipeIndex = netBuilder.addPipe("LK", size2D(F_32, nBatches, nNodes * 2 * h->logitsTopk));
+    n.kvEvictPipeIndex = 0;
+    if (h->nKvSinks > 0)
+        n.kvEvictPipeIndex = netBuilder.addPipe("KVEV", size2D(F_32, 1, 4));
+    NnUint spQPipeIndex = 0;
+    NnUint spKPipeIndex = 0;
+    NnUint spVPipeIndex = 0;
+    NnUint spAttPipeIndex = 0;
+    if (isSeqParallel) {
+        assert(h->nHeads % nNodes == 0);
+        spQPipeIndex = netBuilder.addPipe("SPQ", size2D(F_32, nBatches, h->qDim));
+        spKPipeIndex = netBuilder.addPipe("SPK", size2D(F_32, nBatches, h->kvDim));
+        spVPipeIndex = netBuilder.addPipe("SPV", size2D(F_32, nBatches, h->kvDim));
+        // the partials [m, l, o[headDim]] of all heads of every shard
+        spAttPipeIndex = netBuilder.addPipe("SPA", size2D(F_32, nBatches, nNodes * h->nHeads * (h->headDim + 2)));
+    }
 
     netBuilder.addPreSync(n.positionPipeIndex);
+    netBuilder.addPreSync(n.slotPipeIndex);
 
     n.header = h;
     n.netConfig = netBuilder.build();
     n.nodeConfigs = new NnNodeConfig[nNodes];
 
     for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-        NnRopeSlice ropeSlice = sliceRope(h->ropeType, h->qDim, h->kvDim, h->nKvHeads, nNodes, h->seqLen, h->headDim, h->ropeTheta, nodeIndex);
+        NnRopeSlice ropeSlice = isSeqParallel
+            ? sliceRope(h->ropeType, h->qDim, h->kvDim, h->nKvHeads, 1, h->seqLen, h->headDim, h->ropeTheta, 0)
+            : sliceRope(h->ropeType, h->qDim, h->kvDim, h->nKvHeads, nNodes, h->seqLen, h->headDim, h->ropeTheta, nodeIndex);
+        const NnUint seqShardIndex = isSeqParallel ? nodeIndex : 0u;
         NnNodeConfigBuilder nodeBuilder(nodeIndex);
 
         const NnUint xBufferIndex = nodeBuilder.addBuffer("x", size2D(F_32, nBatches, h->dim));
@@ -256,6 +372,13 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
         const NnUint qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, n.qSlice.d0));
         const NnUint kTempBufferIndex = nodeBuilder.addBuffer("k_temp", size2D(F_32, nBatches, n.kSlice.d0));
         const NnUint vTempBufferIndex = nodeBuilder.addBuffer("v_temp", size2D(F_32, nBatches, n.vSlice.d0));
+        // the attention reads q and k from the full buffers in the sequence parallel mode
+        const NnUint attQBufferIndex = isSeqParallel
+            ? nodeBuilder.addBuffer("q_full", size2D(F_32, nBatches, h->qDim))
+            : qBufferIndex;
+        const NnUint attKBufferIndex = isSeqParallel
+            ? nodeBuilder.addBuffer("k_full", size2D(F_32, nBatches, h->kvDim))
+            : kTempBufferIndex;
 
         const NnUint invRmsBufferIndex = nodeBuilder.addBuffer("inv_rms", size2D(F_32, nBatches, nInvBufferColumns));
 
@@ -297,8 +420,8 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
         nodeBuilder.addSegment(start.build());
 
         for (NnUint layerIndex = 0; layerIndex < h->nLayers; layerIndex++) {
-            const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize);
-            const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize);
+            const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize, BUFFER_FLAG_LAZY);
+            const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize, BUFFER_FLAG_LAZY);
 
             NnSegmentConfigBuilder att;
             NnSegmentConfigBuilder ff;
@@ -359,69 +482,143 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 size2D(h->weightType, n.vSlice.n, n.vSlice.d0),
                 NnMatmulOpConfig{0, 0, moeExpertIndexesBufferIndex});
 
+            if (isSeqParallel) {
+                att.addOp(
+                    OP_CAST, "block_cast_q_sp", layerIndex,
+                    pointerBatchConfig(SRC_BUFFER, qBufferIndex),
+                    pointerBatchedSliceConfig(SRC_PIPE, spQPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                att.addOp(
+                    OP_CAST, "block_cast_k_sp", layerIndex,
+                    pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                    pointerBatchedSliceConfig(SRC_PIPE, spKPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                att.addOp(
+                    OP_CAST, "block_cast_v_sp", layerIndex,
+                    pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
+                    pointerBatchedSliceConfig(SRC_PIPE, spVPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                att.addSync(spQPipeIndex, SYNC_NODE_SLICES);
+                att.addSync(spKPipeIndex, SYNC_NODE_SLICES);
+                att.addSync(spVPipeIndex, SYNC_NODE_SLICES);
+                nodeBuilder.addSegment(att.build());
+
+                att = NnSegmentConfigBuilder();
+                att.addOp(
+                    OP_CAST, "block_cast_q_full", layerIndex,
+                    pointerBatchConfig(SRC_PIPE, spQPipeIndex),
+                    pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                att.addOp(
+                    OP_CAST, "block_cast_k_full", layerIndex,
+                    pointerBatchConfig(SRC_PIPE, spKPipeIndex),
+                    pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+            }
+
             if (h->archType == QWEN3 || h->archType == QWEN3_MOE) {
                 att.addOp(OP_INV_RMS, "block_norm_pre_q", layerIndex,
-                    pointerBatchConfig(SRC_BUFFER, qBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
                     pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex),
                     size0(),
                     NnInvRmsOpConfig{h->normEpsilon, nQNormColumns});
                 att.addOp(
                     OP_RMS_NORM, "block_norm_q", layerIndex,
-                    pointerBatchConfig(SRC_BUFFER, qBufferIndex),
-                    pointerBatchConfig(SRC_BUFFER, qBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
                     size2D(F_32, 1, n.header->headDim),
                     NnRmsNormOpConfig{invRmsBufferIndex, nQNormColumns});
 
                 att.addOp(OP_INV_RMS, "block_norm_pre_k", layerIndex,
-                    pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
                     pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex),
                     size0(),
                     NnInvRmsOpConfig{h->normEpsilon, nKNormColumns});
                 att.addOp(
                     OP_RMS_NORM, "block_norm_k", layerIndex,
-                    pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
-                    pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
                     size2D(F_32, 1, n.header->headDim),
                     NnRmsNormOpConfig{invRmsBufferIndex, nKNormColumns});
             }
 
             att.addOp(
                 OP_ROPE, "block_rope_q", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, qBufferIndex),
-                pointerBatchConfig(SRC_BUFFER, qBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, attQBufferIndex),
                 size0(),
                 NnRopeOpConfig{n.header->ropeType, 1, n.positionPipeIndex, ropeCacheBufferIndex, 
                     h->ropeScalingFactor, h->ropeScalingLowFreqFactor, h->ropeScalingHighFreqFactory, h->ropeScalingOrigMaxSeqLen,
                     ropeSlice});
             att.addOp(
                 OP_ROPE, "block_rope_k", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
-                pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
                 size0(),
                 NnRopeOpConfig{n.header->ropeType, 0, n.positionPipeIndex, ropeCacheBufferIndex, 
                     h->ropeScalingFactor, h->ropeScalingLowFreqFactor, h->ropeScalingHighFreqFactory, h->ropeScalingOrigMaxSeqLen,
                     ropeSlice});
+            if (h->nKvSinks > 0) {
+                assert(!isSeqParallel);
+                att.addOp(
+                    OP_KV_EVICT, "block_evict_k", layerIndex,
+                    pointerRawConfig(SRC_BUFFER, kBufferIndex),
+                    pointerRawConfig(SRC_BUFFER, kBufferIndex),
+                    size0(),
+                    NnKvEvictOpCodeConfig{n.kvEvictPipeIndex, kvCacheSlice.kvDim0, nKvSlots > 1 ? kvSeqLen : 0u, 1, h->ropeType, ropeCacheBufferIndex, ropeSlice});
+                att.addOp(
+                    OP_KV_EVICT, "block_evict_v", layerIndex,
+                    pointerRawConfig(SRC_BUFFER, vBufferIndex),
+                    pointerRawConfig(SRC_BUFFER, vBufferIndex),
+                    size0(),
+                    NnKvEvictOpCodeConfig{n.kvEvictPipeIndex, kvCacheSlice.kvDim0, nKvSlots > 1 ? kvSeqLen : 0u, 0, h->ropeType, ropeCacheBufferIndex, ropeSlice});
+            }
             att.addOp(
                 OP_SHIFT, "block_shift_k", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, attKBufferIndex),
                 pointerRawConfig(SRC_BUFFER, kBufferIndex),
                 size0(),
-                NnShiftOpCodeConfig{n.positionPipeIndex});
+                NnShiftOpCodeConfig{n.positionPipeIndex, n.slotPipeIndex, nKvSlots > 1 ? kvSeqLen : 0u, h->kvBlockSize, n.blockTablePipeIndex,
+                    nSeqShards, seqShardIndex, h->seqShardBlock});
             att.addOp(
                 OP_SHIFT, "block_shift_v", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
+                isSeqParallel ? pointerBatchConfig(SRC_PIPE, spVPipeIndex) : pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
                 pointerRawConfig(SRC_BUFFER, vBufferIndex),
                 size0(),
-                NnShiftOpCodeConfig{n.positionPipeIndex});
+                NnShiftOpCodeConfig{n.positionPipeIndex, n.slotPipeIndex, nKvSlots > 1 ? kvSeqLen : 0u, h->kvBlockSize, n.blockTablePipeIndex,
+                    nSeqShards, seqShardIndex, h->seqShardBlock});
+            const NnPointerConfig attOutput = isSeqParallel
+                ? pointerBatchedSliceConfig(SRC_PIPE, spAttPipeIndex)
+                : pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex);
             att.addOp(
                 OP_MULTIHEAD_ATT, "block_multihead_att", layerIndex,
-                pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
-                pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
+                attOutput,
+                attOutput,
                 size0(),
                 NnMultiHeadAttOpConfig{
                     multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0,
-                    h->nKvHeads, h->headDim, h->seqLen, n.qSlice.d0, kvCacheSlice.kvDim0,
-                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex});
+                    h->nKvHeads, h->headDim, kvSeqLen, isSeqParallel ? h->qDim : n.qSlice.d0, kvCacheSlice.kvDim0,
+                    n.positionPipeIndex, attQBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
+                    nKvSlots, n.slotPipeIndex, h->kvBlockSize, n.blockTablePipeIndex, h->kvCacheType,
+                    nSeqShards, seqShardIndex, h->seqShardBlock});
+            if (isSeqParallel) {
+                att.addSync(spAttPipeIndex, SYNC_NODE_EXCHANGE);
+                nodeBuilder.addSegment(att.build());
+
+                const NnUint nHeads0 = h->nHeads / nNodes;
+                att = NnSegmentConfigBuilder();
+                att.addOp(
+                    OP_MERGE_ATT, "block_merge_att", layerIndex,
+                    pointerBatchConfig(SRC_PIPE, spAttPipeIndex),
+                    pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
+                    size0(),
+                    NnMergeAttOpCodeConfig{h->nHeads, nHeads0, h->headDim, nNodes, nodeIndex * nHeads0});
+            }
             att.addOp(
                 OP_CAST, "block_cast_y2", layerIndex,
                 pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
@@ -440,7 +637,7 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 pointerBatchedSliceConfig(SRC_PIPE, zqPipeIndex),
                 size0(),
                 NnCastOpCodeConfig{});
-            att.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            att.addSync(zqPipeIndex, SYNC_NODE_SLICES_STREAMED, h->tpSyncCodec);
 
             // ff
             ff.addOp(
@@ -591,13 +788,14 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 pointerBatchedSliceConfig(SRC_PIPE, zqPipeIndex),
                 size0(),
                 NnCastOpCodeConfig{});
-            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES_STREAMED, h->tpSyncCodec);
 
             nodeBuilder.addSegment(att.build());
             nodeBuilder.addSegment(ff.build());
         }
 
         NnSegmentConfigBuilder end;
+        end.addFlags(SEGMENT_LOGITS_ROWS);
         end.addOp(
             OP_MERGE_ADD, "final_merge_add", 0,
             pointerBatchConfig(SRC_PIPE, zqPipeIndex),
@@ -630,13 +828,25 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
             pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
             size2D(h->weightType, n.wclsSlice.n, n.wclsSlice.d0),
             NnMatmulOpConfig{});
-        end.addOp(
-            OP_CAST, "final_cast_logits", 0,
-            pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
-            pointerBatchedSliceConfig(SRC_PIPE, n.logitsPipeIndex),
-            size0(),
-            NnCastOpCodeConfig{});
-        end.addSync(n.logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        if (h->logitsTopk > 0) {
+            if (h->logitsTopk > n.wclsSlice.d0)
+                throw std::invalid_argument("The logits top-k is larger than the vocab slice of a node");
+            end.addOp(
+                OP_TOPK_LOGITS, "final_topk_logits", 0,
+                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                pointerBatchConfig(SRC_PIPE, n.logitsTopkPipeIndex),
+                size0(),
+                NnTopkLogitsOpCodeConfig{h->logitsTopk, nodeIndex * n.wclsSlice.d0, nodeIndex});
+            end.addSync(n.logitsTopkPipeIndex, SYNC_NODE_SLOTS_EXCEPT_ROOT);
+        } else {
+            end.addOp(
+                OP_CAST, "final_cast_logits", 0,
+                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                pointerBatchedSliceConfig(SRC_PIPE, n.logitsPipeIndex),
+                size0(),
+                NnCastOpCodeConfig{});
+            end.addSync(n.logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        }
 
         nodeBuilder.addSegment(end.build());
         n.nodeConfigs[nodeIndex] = nodeBuilder.build();
@@ -661,7 +871,8 @@ static NnNodeConfig buildLlmNodeInternal(
     NnUint ffDim = (h->archType == QWEN3_MOE) ? h->moeHiddenDim : h->hiddenDim;
 
     // 2. 计算切分 (Slicing)
-    NnKvCacheSliceUneven kvCacheSlice = sliceKvCacheUneven(h->seqLen, h->headDim, plan, nodeIndex);
+    const NnUint nKvSlots = std::max(h->nKvSlots, 1u);
+    NnKvCacheSliceUneven kvCacheSlice = sliceKvCacheUneven(getLlmKvCacheRows(h), h->headDim, plan, nodeIndex, h->kvCacheType);
     NnMultiHeadAttSliceUneven multiHeadAttSlice = sliceMultiHeadAttUneven(nBatches, h->nHeads, h->seqLen, plan, nodeIndex);
     
     NnRowMatmulSliceUneven qSlice = sliceRowMatmulAttUneven(h->weightType, h->dim, h->headDim, &plan->headSplit, h->qDim, nodeIndex);
@@ -669,9 +880,20 @@ static NnNodeConfig buildLlmNodeInternal(
     NnRowMatmulSliceUneven vSlice = sliceRowMatmulAttUneven(h->weightType, h->dim, h->headDim, &plan->kvHeadSplit, h->kvDim, nodeIndex);
     NnColMatmulSliceUneven woSlice = sliceColMatmulAttUneven(h->weightType, h->qDim, h->dim, h->headDim, plan, nodeIndex);
 
-    NnRowMatmulSliceUneven w1Slice = sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, nodeIndex);
-    NnColMatmulSliceUneven w2Slice = sliceColMatmulFfnUneven(h->weightType, ffDim, h->dim, plan, nodeIndex);
-    NnRowMatmulSliceUneven w3Slice = sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, nodeIndex);
+    // Expert parallelism: this node keeps whole experts [expertStart, expertStart + nLocalExperts)
+    const bool expertParallel = h->archType == QWEN3_MOE && isExpertParallelPlan(plan);
+    const NnUint expertStart = expertParallel ? plan->expertSplit.starts[nodeIndex] : 0u;
+    const NnUint nLocalExperts = expertParallel ? plan->expertSplit.lengths[nodeIndex] : h->nExperts;
+
+    NnRowMatmulSliceUneven w1Slice = expertParallel
+        ? sliceRowMatmulExpertUneven(h->weightType, h->dim, ffDim)
+        : sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, nodeIndex);
+    NnColMatmulSliceUneven w2Slice = expertParallel
+        ? sliceColMatmulExpertUneven(h->weightType, ffDim, h->dim)
+        : sliceColMatmulFfnUneven(h->weightType, ffDim, h->dim, plan, nodeIndex);
+    NnRowMatmulSliceUneven w3Slice = expertParallel
+        ? sliceRowMatmulExpertUneven(h->weightType, h->dim, ffDim)
+        : sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, nodeIndex);
     NnRowMatmulSliceUneven wclsSlice = sliceRowMatmulLogitsUneven(h->weightType, h->dim, h->vocabSize, plan, nodeIndex);
 
     NnRopeSliceUneven unevenRope = sliceRopeUneven(h->ropeType, h->seqLen, h->kvDim, h->nKvHeads, h->headDim, h->ropeTheta, plan, nodeIndex);
@@ -756,7 +978,7 @@ static NnNodeConfig buildLlmNodeInternal(
         
         // A. 接收 (仅 Stage Root 执行，在 Synchronizer 里判断)
         // 数据写入 n->xPipeIndex (复用这个 Pipe 作为 Buffer)
-        ppRecvSeg.addSync(n->xPipeIndex, SYNC_PP_RECV);
+        ppRecvSeg.addSync(n->xPipeIndex, SYNC_PP_RECV, h->ppSyncCodec);
         
         // B. 广播 (Stage Root -> Stage Workers)
         // 因为 SYNC_PP_RECV 只有 Root 有数据，必须马上广播给 TP 组内的其他人
@@ -772,8 +994,8 @@ static NnNodeConfig buildLlmNodeInternal(
     // 5. Layers Loop (PP: 只构建负责的层)
     for (NnUint layerIndex = startLayer; layerIndex < endLayer; layerIndex++) {
         // ... (这里的 K/V Buffer 是 Layer Local 的，需要 Slice 信息) ...
-        const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize);
-        const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize);
+        const NnUint kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize, BUFFER_FLAG_LAZY);
+        const NnUint vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize, BUFFER_FLAG_LAZY);
 
         NnSegmentConfigBuilder att;
         NnSegmentConfigBuilder ff;
@@ -821,10 +1043,14 @@ static NnNodeConfig buildLlmNodeInternal(
 
         att.addOp(OP_ROPE, "block_rope_q", layerIndex, pointerBatchConfig(SRC_BUFFER, qBufferIndex), pointerBatchConfig(SRC_BUFFER, qBufferIndex), size0(), NnRopeOpConfig{h->ropeType, 1, n->positionPipeIndex, ropeCacheBufferIndex, h->ropeScalingFactor, h->ropeScalingLowFreqFactor, h->ropeScalingHighFreqFactory, h->ropeScalingOrigMaxSeqLen, ropeSlice});
         att.addOp(OP_ROPE, "block_rope_k", layerIndex, pointerBatchConfig(SRC_BUFFER, kTempBufferIndex), pointerBatchConfig(SRC_BUFFER, kTempBufferIndex), size0(), NnRopeOpConfig{h->ropeType, 0, n->positionPipeIndex, ropeCacheBufferIndex, h->ropeScalingFactor, h->ropeScalingLowFreqFactor, h->ropeScalingHighFreqFactory, h->ropeScalingOrigMaxSeqLen, ropeSlice});
-        att.addOp(OP_SHIFT, "block_shift_k", layerIndex, pointerBatchConfig(SRC_BUFFER, kTempBufferIndex), pointerRawConfig(SRC_BUFFER, kBufferIndex), size0(), NnShiftOpCodeConfig{n->positionPipeIndex});
-        att.addOp(OP_SHIFT, "block_shift_v", layerIndex, pointerBatchConfig(SRC_BUFFER, vTempBufferIndex), pointerRawConfig(SRC_BUFFER, vBufferIndex), size0(), NnShiftOpCodeConfig{n->positionPipeIndex});
+        if (h->nKvSinks > 0) {
+            att.addOp(OP_KV_EVICT, "block_evict_k", layerIndex, pointerRawConfig(SRC_BUFFER, kBufferIndex), pointerRawConfig(SRC_BUFFER, kBufferIndex), size0(), NnKvEvictOpCodeConfig{n->kvEvictPipeIndex, kvCacheSlice.kvLen, nKvSlots > 1 ? h->seqLen : 0u, 1, h->ropeType, ropeCacheBufferIndex, ropeSlice});
+            att.addOp(OP_KV_EVICT, "block_evict_v", layerIndex, pointerRawConfig(SRC_BUFFER, vBufferIndex), pointerRawConfig(SRC_BUFFER, vBufferIndex), size0(), NnKvEvictOpCodeConfig{n->kvEvictPipeIndex, kvCacheSlice.kvLen, nKvSlots > 1 ? h->seqLen : 0u, 0, h->ropeType, ropeCacheBufferIndex, ropeSlice});
+        }
+        att.addOp(OP_SHIFT, "block_shift_k", layerIndex, pointerBatchConfig(SRC_BUFFER, kTempBufferIndex), pointerRawConfig(SRC_BUFFER, kBufferIndex), size0(), NnShiftOpCodeConfig{n->positionPipeIndex, n->slotPipeIndex, nKvSlots > 1 ? h->seqLen : 0u, h->kvBlockSize, n->blockTablePipeIndex});
+        att.addOp(OP_SHIFT, "block_shift_v", layerIndex, pointerBatchConfig(SRC_BUFFER, vTempBufferIndex), pointerRawConfig(SRC_BUFFER, vBufferIndex), size0(), NnShiftOpCodeConfig{n->positionPipeIndex, n->slotPipeIndex, nKvSlots > 1 ? h->seqLen : 0u, h->kvBlockSize, n->blockTablePipeIndex});
 
-        att.addOp(OP_MULTIHEAD_ATT, "block_multihead_att", layerIndex, pointerBatchConfig(SRC_BUFFER, mhaOutBufferIndex), pointerBatchConfig(SRC_BUFFER, mhaOutBufferIndex), size0(), NnMultiHeadAttOpConfig{multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0, h->nKvHeads, h->headDim, h->seqLen, qSlice.inLen, kvCacheSlice.kvLen, n->positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex});
+        att.addOp(OP_MULTIHEAD_ATT, "block_multihead_att", layerIndex, pointerBatchConfig(SRC_BUFFER, mhaOutBufferIndex), pointerBatchConfig(SRC_BUFFER, mhaOutBufferIndex), size0(), NnMultiHeadAttOpConfig{multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0, h->nKvHeads, h->headDim, h->seqLen, qSlice.inLen, kvCacheSlice.kvLen, n->positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex, nKvSlots, n->slotPipeIndex, h->kvBlockSize, n->blockTablePipeIndex, h->kvCacheType});
         printf("🔍 [Node %u DEBUG] MHA: nHeads=%u, nHeads0=%u\n", nodeIndex, multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0);
 
         if (mhaOutBufferIndex != mhaOutQBufferIndex) {
@@ -843,20 +1069,20 @@ static NnNodeConfig buildLlmNodeInternal(
             ff.addOp(OP_REPEAT_Z, "block_moe_y_repeat", layerIndex, pointerBatchConfig(SRC_BUFFER, yBufferIndex), pointerBatchConfig(SRC_BUFFER, moeYqBufferIndex), size0(), NnRepeatZOpCodeConfig{});
             ff.addOp(OP_MATMUL, "block_moe_gate", layerIndex, pointerBatchConfig(SRC_BUFFER, yBufferIndex), pointerBatchConfig(SRC_BUFFER, moeGtBufferIndex), n->moeGateSize, NnMatmulOpConfig{0, 0, moeExpertIndexesBufferIndex});
             ff.addOp(OP_SOFTMAX, "block_moe_softmax", layerIndex, pointerBatchConfig(SRC_BUFFER, moeGtBufferIndex), pointerBatchConfig(SRC_BUFFER, moeGtBufferIndex), size0(), NnSoftmaxOpCodeConfig{});
-            ff.addOp(OP_MOE_GATE, "block_moe_gate2", layerIndex, pointerBatchConfig(SRC_BUFFER, moeGtBufferIndex), pointerBatchConfig(SRC_BUFFER, moeSBufferIndex), size0(), NnMoeGateOpCodeConfig{h->nActiveExperts, 1u, moeExpertIndexesBufferIndex});
+            ff.addOp(OP_MOE_GATE, "block_moe_gate2", layerIndex, pointerBatchConfig(SRC_BUFFER, moeGtBufferIndex), pointerBatchConfig(SRC_BUFFER, moeSBufferIndex), size0(), NnMoeGateOpCodeConfig{h->nActiveExperts, 1u, moeExpertIndexesBufferIndex, expertParallel ? 1u : 0u, expertStart, nLocalExperts});
             
-            NnSize3D w1ExpertSliceSize = size3D(h->weightType, h->nExperts, w1Slice.n, w1Slice.inLen);
-            NnSize3D w3ExpertSliceSize = size3D(h->weightType, h->nExperts, w3Slice.n, w3Slice.inLen);
-            NnSize3D w2ExpertSliceSize = size3D(h->weightType, h->nExperts, w2Slice.n0, w2Slice.d);
+            NnSize3D w1ExpertSliceSize = size3D(h->weightType, nLocalExperts, w1Slice.n, w1Slice.inLen);
+            NnSize3D w3ExpertSliceSize = size3D(h->weightType, nLocalExperts, w3Slice.n, w3Slice.inLen);
+            NnSize3D w2ExpertSliceSize = size3D(h->weightType, nLocalExperts, w2Slice.n0, w2Slice.d);
 
-            ff.addOp(OP_MATMUL, "block_matmul_w1", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYqBufferIndex), pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), w1ExpertSliceSize, NnMatmulOpConfig{h->nExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
-            ff.addOp(OP_MATMUL, "block_matmul_w3", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYqBufferIndex), pointerBatchConfig(SRC_BUFFER, moeLBufferIndex), w3ExpertSliceSize, NnMatmulOpConfig{h->nExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
+            ff.addOp(OP_MATMUL, "block_matmul_w1", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYqBufferIndex), pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), w1ExpertSliceSize, NnMatmulOpConfig{nLocalExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
+            ff.addOp(OP_MATMUL, "block_matmul_w3", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYqBufferIndex), pointerBatchConfig(SRC_BUFFER, moeLBufferIndex), w3ExpertSliceSize, NnMatmulOpConfig{nLocalExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
             ff.addOp(OP_SILU, "block_act", layerIndex, pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), size0(), NnSiluOpCodeConfig{});
             ff.addOp(OP_MUL, "block_mul", layerIndex, pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), size0(), NnMulOpCodeConfig{moeLBufferIndex});
             if (moeDBufferIndex != moeDQBufferIndex) {
                 ff.addOp(OP_CAST, "block_cast_d2", layerIndex, pointerBatchConfig(SRC_BUFFER, moeDBufferIndex), pointerBatchConfig(SRC_BUFFER, moeDQBufferIndex), size0(), NnCastOpCodeConfig{});
             }
-            ff.addOp(OP_MATMUL, "block_matmul_w2", layerIndex, pointerBatchConfig(SRC_BUFFER, moeDQBufferIndex), pointerBatchConfig(SRC_BUFFER, moeYBufferIndex), w2ExpertSliceSize, NnMatmulOpConfig{h->nExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
+            ff.addOp(OP_MATMUL, "block_matmul_w2", layerIndex, pointerBatchConfig(SRC_BUFFER, moeDQBufferIndex), pointerBatchConfig(SRC_BUFFER, moeYBufferIndex), w2ExpertSliceSize, NnMatmulOpConfig{nLocalExperts, h->nActiveExperts, moeExpertIndexesBufferIndex});
             ff.addOp(OP_SCALE, "block_moe_scale", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYBufferIndex), pointerBatchConfig(SRC_BUFFER, moeYBufferIndex), size0(), NnScaleOpCodeConfig{moeSBufferIndex});
             ff.addOp(OP_MERGE_SUM, "block_moe_merge_sum", layerIndex, pointerBatchConfig(SRC_BUFFER, moeYBufferIndex), pointerBatchConfig(SRC_BUFFER, yBufferIndex), size0(), NnMergeSumOpCodeConfig{});
         } else {
@@ -897,13 +1123,14 @@ static NnNodeConfig buildLlmNodeInternal(
             size0(), NnCastOpCodeConfig{});
             
         // 3. Send: 触发 PP 发送
-        ppSendSeg.addSync(n->xPipeIndex, SYNC_PP_SEND);
+        ppSendSeg.addSync(n->xPipeIndex, SYNC_PP_SEND, h->ppSyncCodec);
         
         nodeBuilder.addSegment(ppSendSeg.build());
     }
 
     // 6. End Segment (Final Norm & Logits)
     NnSegmentConfigBuilder end;
+    end.addFlags(SEGMENT_LOGITS_ROWS);
     if (isLastStage) {
         end.addOp(OP_MERGE_ADD, "final_merge_add", 0, pointerBatchConfig(SRC_PIPE, n->zqPipeIndex), pointerBatchConfig(SRC_BUFFER, xBufferIndex), size0(), NnMergeAddOpCodeConfig{});
         end.addOp(OP_INV_RMS, "final_norm_pre", 0, pointerBatchConfig(SRC_BUFFER, xBufferIndex), pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex), size0(), NnInvRmsOpConfig{h->normEpsilon, 1});
@@ -915,20 +1142,34 @@ static NnNodeConfig buildLlmNodeInternal(
         
         end.addOp(OP_MATMUL, "final_matmul_logits", 0, pointerBatchConfig(SRC_BUFFER, yqBufferIndex), pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex), wclsSlice.sliceSize, NnMatmulOpConfig{});
         
-        end.addOp(OP_CAST, "final_cast_logits", 0, 
-            pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex), 
-            pointerBatchedSliceConfig(SRC_PIPE, n->logitsPipeIndex), // <--- 改回这个！
-            size0(), NnCastOpCodeConfig{});
-        
-        end.addSync(n->logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        if (h->logitsTopk > 0) {
+            if (h->logitsTopk > wclsSlice.inLen)
+                throw std::invalid_argument("The logits top-k is larger than the vocab slice of a node");
+            end.addOp(OP_TOPK_LOGITS, "final_topk_logits", 0,
+                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                pointerBatchConfig(SRC_PIPE, n->logitsTopkPipeIndex),
+                size0(), NnTopkLogitsOpCodeConfig{h->logitsTopk, wclsSlice.inStart, nodeIndex});
+            end.addSync(n->logitsTopkPipeIndex, SYNC_NODE_SLOTS_EXCEPT_ROOT);
+        } else {
+            end.addOp(OP_CAST, "final_cast_logits", 0, 
+                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex), 
+                pointerBatchedSliceConfig(SRC_PIPE, n->logitsPipeIndex), // <--- 改回这个！
+                size0(), NnCastOpCodeConfig{});
+            
+            end.addSync(n->logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        }
     }
     nodeBuilder.addSegment(end.build());
     if (nodeIndex == 0 && !isLastStage) {
         NnSegmentConfigBuilder rootWaitSeg;
+        rootWaitSeg.addFlags(SEGMENT_LOGITS_ROWS);
         
         // 这是一个纯同步 Segment，不包含计算 Op
         // 语义：Node 0 等待 Last Stage 的节点发送 Logits 给它
-        rootWaitSeg.addSync(n->logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        if (h->logitsTopk > 0)
+            rootWaitSeg.addSync(n->logitsTopkPipeIndex, SYNC_NODE_SLOTS_EXCEPT_ROOT);
+        else
+            rootWaitSeg.addSync(n->logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
         
         nodeBuilder.addSegment(rootWaitSeg.build());
     }
@@ -955,8 +1196,19 @@ LlmNet buildLlmNetUneven(LlmHeader *h, NnUint nNodes, NnUint nBatches, const NnU
     n.xPipeIndex = netBuilder.addPipe("X", size2D(F_32, nBatches, h->dim));
     n.logitsPipeIndex = netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize));
     n.zqPipeIndex = netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, h->dim * nNodes)); // Safe size
+    n.slotPipeIndex = netBuilder.addPipe("SLOT", size2D(F_32, nBatches, 1));
+    n.blockTablePipeIndex = 0;
+    if (h->kvBlockSize > 0)
+        n.blockTablePipeIndex = netBuilder.addPipe("KVPG", size2D(F_32, 1, std::max(h->nKvSlots, 1u) * getLlmKvBlocksPerSlot(h)));
+    n.logitsTopkPipeIndex = 0;
+    if (h->logitsTopk > 0)
+        n.logitsTopkPipeIndex = netBuilder.addPipe("LK", size2D(F_32, nBatches, nNodes * 2 * h->logitsTopk));
+    n.kvEvictPipeIndex = 0;
+    if (h->nKvSinks > 0)
+        n.kvEvictPipeIndex = netBuilder.addPipe("KVEV", size2D(F_32, 1, 4));
 
     netBuilder.addPreSync(n.positionPipeIndex);
+    netBuilder.addPreSync(n.slotPipeIndex);
     n.netConfig = netBuilder.build();
     n.nodeConfigs = new NnNodeConfig[nNodes];
 
@@ -993,7 +1245,207 @@ void releaseLlmNet(LlmNet *net) {
     delete[] net->nodeConfigs;
 }
 
-void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader) {
+typedef struct {
+    std::vector<NnStageDef> stages;
+    double latencyUs;
+} LlmPlanCandidate;
+
+static double getElementBytes(NnFloatType type) {
+    const NnSize blockSize = getBlockSize(type);
+    return (double)getBytes(type, blockSize) / blockSize;
+}
+
+// Free memory left for the net, the rest is for the process and the OS
+#define LLM_PLAN_MEMORY_USAGE 0.9
+
+std::string planLlmRatios(LlmHeader *h, const std::vector<LlmNodeProfile> &profiles, const NnLinkMatrix &links,
+    NnUint nBatches, NnUint nPlanExperts) {
+    const NnUint nNodes = profiles.size();
+    assert(nNodes > 0);
+    if (nNodes > LLM_PLAN_MAX_NODES)
+        throw std::runtime_error("The planner supports up to " + std::to_string(LLM_PLAN_MAX_NODES) +
+            " nodes, got " + std::to_string(nNodes) + ", pass the ratios explicitly");
+    const NnUint ffDim = h->archType == QWEN3_MOE ? h->moeHiddenDim : h->hiddenDim;
+    const double weightBytes = getElementBytes(h->weightType);
+    const double attWeightBytes = weightBytes * (2.0 * h->dim * h->qDim + 2.0 * h->dim * h->kvDim);
+    const double ffnWeightBytes = weightBytes * 3.0 * h->dim * ffDim; // one expert
+    const double kvCacheBytes = 2.0 * getLlmKvCacheRows(h) * h->kvDim * getElementBytes(h->kvCacheType);
+    // One token in the middle of the context
+    const double kvReadBytes = 2.0 * (h->seqLen / 2) * h->kvDim * getElementBytes(h->kvCacheType);
+    const double embeddingBytes = 4.0 * h->vocabSize * h->dim;
+    const double wclsBytes = weightBytes * h->vocabSize * h->dim;
+    const double syncRowBytes = getBytes(h->syncType, h->dim);
+    const double xRowBytes = 4.0 * h->dim;
+    const NnUint nExpertsOr1 = std::max(h->nExperts, 1u);
+    const NnUint nActiveExpertsOr1 = std::max(h->nActiveExperts, 1u);
+
+    // Bytes per microsecond
+    auto matmulSpeed = [&](NnUint i) { return profiles[i].matmulGbps * 1e3; };
+    auto attSpeed = [&](NnUint i) { return profiles[i].attGbps * 1e3; };
+
+    std::vector<LlmPlanCandidate> candidates;
+    // Bit k of the mask ends a stage after the node k
+    for (NnUint mask = 0; mask < (1u << (nNodes - 1)); mask++) {
+        std::vector<std::pair<NnUint, NnUint>> ranges;
+        NnUint first = 0;
+        for (NnUint k = 0; k < nNodes; k++) {
+            if (k == nNodes - 1 || (mask & (1u << k)) != 0) {
+                ranges.push_back(std::make_pair(first, k + 1));
+                first = k + 1;
+            }
+        }
+        const NnUint nStages = ranges.size();
+        if (nStages > h->nLayers)
+            continue;
+
+        // TP ratios are the speeds of the nodes on a whole layer, rounded as written to the ratios string
+        LlmPlanCandidate candidate;
+        candidate.stages.resize(nStages);
+        for (NnUint s = 0; s < nStages; s++) {
+            std::vector<double> speeds;
+            double maxSpeed = 0.0;
+            for (NnUint i = ranges[s].first; i < ranges[s].second; i++) {
+                const double layerUs = (attWeightBytes + ffnWeightBytes * nActiveExpertsOr1) / matmulSpeed(i) + kvReadBytes / attSpeed(i);
+                speeds.push_back(1.0 / layerUs);
+                maxSpeed = std::max(maxSpeed, speeds.back());
+            }
+            candidate.stages[s].nLayers = 1;
+            for (double speed : speeds)
+                candidate.stages[s].tpRatios.push_back(std::max(0.001f, (float)(std::round(1000.0 * speed / maxSpeed) / 1000.0)));
+        }
+
+        std::unique_ptr<NnUnevenPartitionPlan> plan;
+        try {
+            plan.reset(new NnUnevenPartitionPlan(createPartitionPlan(candidate.stages, h->nHeads, h->nKvHeads, h->vocabSize, ffDim, h->dim, nPlanExperts, getLlmFfnAlignSize(h))));
+        } catch (const std::exception &) {
+            continue;
+        }
+
+        bool isValid = true;
+        std::vector<double> stageLayerUs(nStages);
+        std::vector<NnUint> maxLayers(nStages);
+        for (NnUint s = 0; s < nStages && isValid; s++) {
+            const bool isLastStage = s == nStages - 1;
+            double computeUs = 0.0;
+            double syncLatencyUs = 0.0;
+            double syncRowUs = 0.0;
+            maxLayers[s] = h->nLayers;
+            for (NnUint i = ranges[s].first; i < ranges[s].second; i++) {
+                const double headShare = (double)plan->kvHeadSplit.lengths[i] / h->nKvHeads;
+                const double ffnShare = (double)plan->ffnSplit.lengths[i] / ffDim;
+                if (plan->kvHeadSplit.lengths[i] == 0 || plan->ffnSplit.lengths[i] == 0) {
+                    isValid = false;
+                    break;
+                }
+                computeUs = std::max(computeUs,
+                    headShare * (attWeightBytes / matmulSpeed(i) + kvReadBytes / attSpeed(i)) +
+                    ffnShare * ffnWeightBytes * nActiveExpertsOr1 / matmulSpeed(i));
+                if (i > ranges[s].first) {
+                    const double latencyUs = links.get(ranges[s].first, i).latencyUs;
+                    syncLatencyUs = std::max(syncLatencyUs, latencyUs);
+                    syncRowUs = std::max(syncRowUs, links.getTransferUs(ranges[s].first, i, syncRowBytes) - latencyUs);
+                }
+
+                const double layerBytes = headShare * (attWeightBytes + kvCacheBytes) + ffnShare * ffnWeightBytes * nExpertsOr1;
+                double fixedBytes = i == 0 ? embeddingBytes : 0.0;
+                if (isLastStage)
+                    fixedBytes += (double)plan->vocabSplit.lengths[i] / h->vocabSize * wclsBytes;
+                const double freeBytes = LLM_PLAN_MEMORY_USAGE * profiles[i].availableMemory - fixedBytes;
+                maxLayers[s] = std::min(maxLayers[s], freeBytes > 0.0 ? (NnUint)(freeBytes / layerBytes) : 0u);
+            }
+            // Two slice exchanges per layer (attention and feed-forward)
+            const NnUint nStageNodes = ranges[s].second - ranges[s].first;
+            stageLayerUs[s] = computeUs + (nStageNodes > 1 ? 2.0 * (syncLatencyUs + syncRowUs) : 0.0);
+            if (maxLayers[s] == 0)
+                isValid = false;
+        }
+        if (!isValid)
+            continue;
+
+        // Every stage has one layer, the rest goes to the fastest stages as far as their memory allows
+        std::vector<NnUint> order(nStages);
+        for (NnUint s = 0; s < nStages; s++)
+            order[s] = s;
+        std::sort(order.begin(), order.end(), [&](NnUint a, NnUint b) { return stageLayerUs[a] < stageLayerUs[b]; });
+        NnUint nRemaining = h->nLayers - nStages;
+        for (NnUint s : order) {
+            const NnUint n = std::min(nRemaining, maxLayers[s] - 1);
+            candidate.stages[s].nLayers += n;
+            nRemaining -= n;
+        }
+        if (nRemaining > 0)
+            continue;
+
+        candidate.latencyUs = 0.0;
+        for (NnUint s = 0; s < nStages; s++) {
+            candidate.latencyUs += candidate.stages[s].nLayers * stageLayerUs[s];
+            if (s > 0)
+                candidate.latencyUs += links.getTransferUs(ranges[s - 1].first, ranges[s].first, xRowBytes);
+        }
+        // The last stage sends the logits slices to the root
+        double logitsUs = 0.0;
+        for (NnUint i = ranges[nStages - 1].first; i < nNodes; i++) {
+            const double logitsBytes = h->logitsTopk > 0 ? 8.0 * h->logitsTopk : 4.0 * plan->vocabSplit.lengths[i];
+            logitsUs = std::max(logitsUs, links.getTransferUs(i, 0, logitsBytes));
+        }
+        candidate.latencyUs += logitsUs;
+        candidates.push_back(candidate);
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const LlmPlanCandidate &a, const LlmPlanCandidate &b) {
+        return a.latencyUs < b.latencyUs;
+    });
+
+    // The estimate of the memory skips the buffers, the net of the chosen plan is checked as built
+    for (const LlmPlanCandidate &candidate : candidates) {
+        NnUnevenPartitionPlan plan = createPartitionPlan(candidate.stages, h->nHeads, h->nKvHeads, h->vocabSize, ffDim, h->dim, nPlanExperts, getLlmFfnAlignSize(h));
+        LlmNet net = buildLlmNetUneven(h, nNodes, nBatches, &plan);
+        bool fits = true;
+        for (NnUint i = 0; i < nNodes; i++) {
+            const NnSize required = getNodeRequiredMemory(&net.netConfig, &net.nodeConfigs[i]);
+            if (required > LLM_PLAN_MEMORY_USAGE * profiles[i].availableMemory)
+                fits = false;
+        }
+        releaseLlmNet(&net);
+        if (!fits)
+            continue;
+
+        std::string ratios;
+        char value[32];
+        for (NnUint s = 0; s < candidate.stages.size(); s++) {
+            if (s > 0)
+                ratios += '*';
+            for (NnUint i = 0; i < candidate.stages[s].tpRatios.size(); i++) {
+                snprintf(value, sizeof(value), i > 0 ? ",%.3f" : "%.3f", candidate.stages[s].tpRatios[i]);
+                ratios += value;
+            }
+            snprintf(value, sizeof(value), "@%u", candidate.stages[s].nLayers);
+            ratios += value;
+        }
+        printf("⚖️  Planned ratios: %s (predicted %.2f ms per token)\n", ratios.c_str(), candidate.latencyUs / 1000.0);
+        return ratios;
+    }
+    throw std::runtime_error("No partition plan fits into the memory of the nodes");
+}
+
+LlmMappedFile::LlmMappedFile() : file(nullptr) {}
+
+LlmMappedFile::~LlmMappedFile() {
+    if (file != nullptr) {
+        closeMmapFile(file);
+        delete file;
+    }
+}
+
+void LlmMappedFile::reset(const MmapFile &file) {
+    if (this->file != nullptr)
+        closeMmapFile(this->file);
+    else
+        this->file = new MmapFile;
+    *this->file = file;
+}
+
+void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader, LlmMappedFile *keptFile) {
     MmapFile file;
     openMmapFile(&file, path, net->header->fileSize);
 #if DEBUG_USE_MMAP_FOR_WEIGHTS
@@ -1047,10 +1499,14 @@ void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader)
     printf("💿 Weights loaded\n");
 
     loader->finish();
+#if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
+    if (keptFile != nullptr)
+        keptFile->reset(*fdPtr.release());
+#endif
 }
 
 void loadLlmNetWeightUneven(const char *path, LlmNet *net, NnLocalWeightLoader *loader, 
-                            const NnUnevenPartitionPlan* plan, NnUint nodeIndex) {
+                            const NnUnevenPartitionPlan* plan, NnUint nodeIndex, LlmMappedFile *keptFile) {
     
     // 1. 自动计算层范围
     NnUint startLayer = 0;
@@ -1116,13 +1572,31 @@ void loadLlmNetWeightUneven(const char *path, LlmNet *net, NnLocalWeightLoader *
             NnUint ffDim = (h->archType == QWEN3_MOE) ? h->moeHiddenDim : h->hiddenDim;
             if (h->nExperts > 0) {
                 b += loader->loadAll("block_moe_gate", layerIndex, net->moeGateSize.nBytes, b);
-                for (NnUint expertIndex = 0u; expertIndex < h->nExperts; expertIndex++) {
-                    b += loader->loadRowMatmulSlicesUneven("block_matmul_w1", layerIndex, expertIndex, 
-                        [&](NnUint idx) { return sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, idx); }, b);
-                    b += loader->loadColMatmulSlicesUneven("block_matmul_w2", layerIndex, expertIndex, 
-                        [&](NnUint idx) { return sliceColMatmulFfnUneven(h->weightType, ffDim, h->dim, plan, idx); }, b);
-                    b += loader->loadRowMatmulSlicesUneven("block_matmul_w3", layerIndex, expertIndex, 
-                        [&](NnUint idx) { return sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, idx); }, b);
+                if (isExpertParallelPlan(plan)) {
+                    // 完整的 expert: 只加载本节点的 expert, 其余跳过
+                    const NnUint expertStart = plan->expertSplit.starts[nodeIndex];
+                    const NnUint expertEnd = expertStart + plan->expertSplit.lengths[nodeIndex];
+                    const NnSize w1Bytes = size2D(h->weightType, h->dim, ffDim).nBytes;
+                    const NnSize w2Bytes = size2D(h->weightType, ffDim, h->dim).nBytes;
+                    for (NnUint expertIndex = 0u; expertIndex < h->nExperts; expertIndex++) {
+                        if (expertIndex < expertStart || expertIndex >= expertEnd) {
+                            b += w1Bytes + w2Bytes + w1Bytes;
+                            continue;
+                        }
+                        const NnUint localIndex = expertIndex - expertStart;
+                        b += loader->loadRaw("block_matmul_w1", layerIndex, localIndex * w1Bytes, w1Bytes, b);
+                        b += loader->loadRaw("block_matmul_w2", layerIndex, localIndex * w2Bytes, w2Bytes, b);
+                        b += loader->loadRaw("block_matmul_w3", layerIndex, localIndex * w1Bytes, w1Bytes, b);
+                    }
+                } else {
+                    for (NnUint expertIndex = 0u; expertIndex < h->nExperts; expertIndex++) {
+                        b += loader->loadRowMatmulSlicesUneven("block_matmul_w1", layerIndex, expertIndex, 
+                            [&](NnUint idx) { return sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, idx); }, b);
+                        b += loader->loadColMatmulSlicesUneven("block_matmul_w2", layerIndex, expertIndex, 
+                            [&](NnUint idx) { return sliceColMatmulFfnUneven(h->weightType, ffDim, h->dim, plan, idx); }, b);
+                        b += loader->loadRowMatmulSlicesUneven("block_matmul_w3", layerIndex, expertIndex, 
+                            [&](NnUint idx) { return sliceRowMatmulFfnUneven(h->weightType, h->dim, ffDim, plan, idx); }, b);
+                    }
                 }
             } else {
                 b += loader->loadRowMatmulSlicesUneven("block_matmul_w1", layerIndex, 0, 
@@ -1192,4 +1666,112 @@ void loadLlmNetWeightUneven(const char *path, LlmNet *net, NnLocalWeightLoader *
     }
     
     loader->finish();
-}
\ No newline at end of file
+    if (keptFile != nullptr)
+        keptFile->reset(*fdPtr.release());
+}
+
+static void writeShardBytes(FILE *file, const void *data, NnSize size, NnSize *offset) {
+    if (size > 0 && fwrite(data, size, 1, file) != 1)
+        throw std::runtime_error(std::string("Cannot write shard file: ") + std::strerror(errno));
+    *offset += size;
+}
+
+void writeLlmNetShard(const char *modelPath, const char *shardPath, LlmNet *net, const NnUnevenPartitionPlan *plan, NnUint nodeIndex, const char *ratios) {
+    LlmHeader *h = net->header;
+    std::unique_ptr<FILE, int(*)(FILE *)> filePtr(fopen(shardPath, "wb"), fclose);
+    FILE *file = filePtr.get();
+    if (file == NULL)
+        throw std::runtime_error(std::string("Cannot create shard file (") + shardPath + std::string("): ") + std::strerror(errno));
+
+    {
+        MmapFile model;
+        openMmapFile(&model, modelPath, h->fileSize);
+        std::unique_ptr<MmapFile, void(*)(MmapFile *)> modelPtr(&model, closeMmapFile);
+        NnSize offset = 0;
+        writeShardBytes(file, model.data, h->headerSize, &offset);
+    }
+
+    LlmShardHeader shardHeader;
+    shardHeader.magic = LLM_SHARD_MAGIC;
+    shardHeader.version = LLM_SHARD_VERSION;
+    shardHeader.nodeIndex = nodeIndex;
+    shardHeader.nNodes = net->netConfig.nNodes;
+    shardHeader.nJobs = 0;
+    shardHeader.ratiosLen = (NnUint)std::strlen(ratios) + 1;
+    shardHeader.modelFileSize = h->fileSize;
+
+    NnSize offset = h->headerSize;
+    const long shardHeaderOffset = (long)offset;
+    writeShardBytes(file, &shardHeader, sizeof(shardHeader), &offset);
+    writeShardBytes(file, ratios, shardHeader.ratiosLen, &offset);
+
+    const NnByte zeros[LLM_SHARD_ALIGNMENT] = {0};
+    NnLocalWeightLoader writer(nodeIndex, [&](const NnLocalWeightJob &job, const NnByte *data) {
+        LlmShardJob shardJob;
+        shardJob.opIndex = job.opIndex;
+        shardJob.nameLen = (NnUint)std::strlen(job.opName) + 1;
+        shardJob.deviceOffset = job.deviceOffset;
+        shardJob.nBytes = job.nBytes;
+        const NnSize headerEnd = offset + sizeof(shardJob) + shardJob.nameLen;
+        const NnSize padding = (LLM_SHARD_ALIGNMENT - headerEnd % LLM_SHARD_ALIGNMENT) % LLM_SHARD_ALIGNMENT;
+        shardJob.dataOffset = headerEnd + padding;
+        writeShardBytes(file, &shardJob, sizeof(shardJob), &offset);
+        writeShardBytes(file, job.opName, shardJob.nameLen, &offset);
+        writeShardBytes(file, zeros, padding, &offset);
+        writeShardBytes(file, data, job.nBytes, &offset);
+        shardHeader.nJobs++;
+    });
+    loadLlmNetWeightUneven(modelPath, net, &writer, plan, nodeIndex);
+
+    // The number of jobs is known at the end
+    if (fseek(file, shardHeaderOffset, SEEK_SET) != 0 || fwrite(&shardHeader, sizeof(shardHeader), 1, file) != 1)
+        throw std::runtime_error(std::string("Cannot write shard file: ") + std::strerror(errno));
+    printf("💾 Shard of node %u: %s (%zu MB, %u tensors)\n", nodeIndex, shardPath, offset / (1024 * 1024), shardHeader.nJobs);
+}
+
+void loadLlmNetWeightShard(const char *shardPath, LlmNet *net, NnLocalWeightLoader *loader, NnUint nodeIndex, const char *ratios,
+    LlmMappedFile *keptFile) {
+    // The header of the model the net was built from may come from the full model file
+    const LlmHeader h = loadLlmHeader(shardPath, 0, F_32);
+    if (h.dim != net->header->dim || h.nLayers != net->header->nLayers || h.weightType != net->header->weightType)
+        throw std::runtime_error(std::string("The shard does not match the model: ") + shardPath);
+    MmapFile file;
+    openMmapFile(&file, shardPath, h.fileSize);
+    std::unique_ptr<MmapFile, void(*)(MmapFile *)> filePtr(&file, closeMmapFile);
+    NnByte *data = (NnByte *)file.data;
+    NnByte *end = &data[h.fileSize];
+
+    NnByte *b = &data[h.headerSize];
+    LlmShardHeader shardHeader;
+    if (b + sizeof(shardHeader) > end)
+        throw std::runtime_error("The shard file is truncated");
+    std::memcpy(&shardHeader, b, sizeof(shardHeader));
+    b += sizeof(shardHeader);
+    if (shardHeader.magic != LLM_SHARD_MAGIC)
+        throw std::runtime_error(std::string("Not a shard file: ") + shardPath);
+    if (shardHeader.version != LLM_SHARD_VERSION)
+        throw std::runtime_error("Unsupported shard version: " + std::to_string(shardHeader.version));
+    if (shardHeader.nodeIndex != nodeIndex || shardHeader.nNodes != net->netConfig.nNodes)
+        throw std::runtime_error("The shard is for node " + std::to_string(shardHeader.nodeIndex) + "/" + std::to_string(shardHeader.nNodes) +
+            ", this is node " + std::to_string(nodeIndex) + "/" + std::to_string(net->netConfig.nNodes));
+    if (b + shardHeader.ratiosLen > end || std::strcmp((const char *)b, ratios) != 0)
+        throw std::runtime_error(std::string("The shard was written for other ratios: ") + (const char *)b);
+    b += shardHeader.ratiosLen;
+
+    printf("💿 Loading weights for Node %u from shard %s...\n", nodeIndex, shardPath);
+    for (NnUint jobIndex = 0; jobIndex < shardHeader.nJobs; jobIndex++) {
+        LlmShardJob job;
+        if (b + sizeof(job) > end)
+            throw std::runtime_error("The shard file is truncated");
+        std::memcpy(&job, b, sizeof(job));
+        const char *name = (const char *)(b + sizeof(job));
+        if (&data[job.dataOffset] + job.nBytes > end)
+            throw std::runtime_error("The shard file is truncated");
+        // The names stay in the mapping until the loader finishes
+        loader->loadRaw(name, job.opIndex, job.deviceOffset, job.nBytes, &data[job.dataOffset]);
+        b = &data[job.dataOffset + job.nBytes];
+    }
+    loader->finish();
+    if (keptFile != nullptr)
+        keptFile->reset(*filePtr.release());
+}
@@ -73,6 +73,15 @@ typedef struct {
 
     NnFloatType weightType;
     NnFloatType syncType;
+    NnUint nKvSlots; // independent sequences sharing the node, each one has its own seqLen KV cache
+    NnUint kvBlockSize; // 0 = contiguous KV cache per slot, otherwise tokens per block of the paged cache
+    NnUint nKvBlocks;   // blocks in the paged KV cache pool, 0 = enough for every slot at seqLen
+    NnFloatType kvCacheType;
+    NnUint logitsTopk; // 0 = the full logits are gathered on the root, otherwise only k candidates per node
+    NnSyncCodec ppSyncCodec; // wire format of the x pipe between PP stages
+    NnSyncCodec tpSyncCodec; // wire format of the streamed ZQ slice exchange, requires the f32 sync type
+    NnUint seqShardBlock; // 0 = the KV cache is split by heads, otherwise by positions dealt to the nodes in blocks (buildLlmNet)
+    NnUint nKvSinks; // 0 = no eviction, otherwise the first nKvSinks rows stay and older rows after them can be evicted (OP_KV_EVICT)
 } LlmHeader;
 
 typedef struct {
@@ -92,6 +101,10 @@ typedef struct {
     NnUint xPipeIndex;
     NnUint logitsPipeIndex;
     NnUint zqPipeIndex;
+    NnUint slotPipeIndex;
+    NnUint blockTablePipeIndex; // valid only with a paged KV cache
+    NnUint logitsTopkPipeIndex; // valid only with logitsTopk > 0
+    NnUint kvEvictPipeIndex; // valid only with nKvSinks > 0
     NnSize3D tokenEmbeddingSize;
     NnSize3D rmsNormSize;
     NnSize3D qkRmsNormSize;
@@ -139,12 +152,57 @@ typedef struct {
 } LlmNetUneven;  
 
 
+// Positions dealt to a node at once by --seq-parallel. The rows of a node are contiguous in its cache
+// whatever the block is, small blocks keep the shards balanced on short contexts.
+static constexpr NnUint LLM_SEQ_SHARD_BLOCK = 32u;
+
 LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType);
 void printLlmHeader(LlmHeader *header);
+NnUint getLlmKvBlocksPerSlot(const LlmHeader *h);
+NnUint getLlmKvBlocks(const LlmHeader *h);
+NnUint getLlmFfnAlignSize(const LlmHeader *h);
 LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches);
 LlmNet buildLlmNetUneven(LlmHeader *h, NnUint nNodes, NnUint nBatches, const NnUnevenPartitionPlan* plan);
 void releaseLlmNet(LlmNet *net);
-void loadLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader);
-void loadLlmNetWeightUneven(const char* path, LlmNet *net, NnLocalWeightLoader *loader, const NnUnevenPartitionPlan* plan, NnUint nodeIndex);
+
+// Measured on every node by the calibration of --ratios auto
+typedef struct {
+    float matmulGbps;       // weight bytes per second of a matmul with one row
+    float attGbps;          // KV cache bytes per second of the multi-head attention
+    NnSize availableMemory; // bytes
+} LlmNodeProfile;
+
+// Splits the nodes (in their order) into PP stages and sets the TP ratios within the stages and the
+// layers of the stages so the predicted latency of one token is the lowest and the net of every node
+// fits into its memory. The slice exchanges of a stage are priced on the links to the root of the
+// stage and the hand-offs on the links between the roots of the stages, so the boundaries fall on
+// the slow links. Returns the plan in the --ratios format. Every split of the nodes into stages is
+// tried, so the planner takes at most LLM_PLAN_MAX_NODES nodes.
+#define LLM_PLAN_MAX_NODES 16
+std::string planLlmRatios(LlmHeader *h, const std::vector<LlmNodeProfile> &profiles, const NnLinkMatrix &links,
+    NnUint nBatches, NnUint nPlanExperts);
+struct MmapFile;
+
+// Owns the mapping of a weight file kept after loading, the expert cache reads the experts from it
+class LlmMappedFile {
+private:
+    MmapFile *file;
+public:
+    LlmMappedFile();
+    ~LlmMappedFile();
+    LlmMappedFile(const LlmMappedFile &) = delete;
+    LlmMappedFile &operator=(const LlmMappedFile &) = delete;
+    void reset(const MmapFile &file);
+};
+
+// With keptFile the mapping is moved there instead of being closed after loading
+void loadLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader, LlmMappedFile *keptFile = nullptr);
+void loadLlmNetWeightUneven(const char* path, LlmNet *net, NnLocalWeightLoader *loader, const NnUnevenPartitionPlan* plan, NnUint nodeIndex,
+    LlmMappedFile *keptFile = nullptr);
+// Pre-sharded model: the header of the model file followed by the weights of one node of a --ratios plan,
+// already laid out as in the device buffers. loadLlmHeader() reads a shard like a model file.
+void writeLlmNetShard(const char *modelPath, const char *shardPath, LlmNet *net, const NnUnevenPartitionPlan *plan, NnUint nodeIndex, const char *ratios);
+void loadLlmNetWeightShard(const char *shardPath, LlmNet *net, NnLocalWeightLoader *loader, NnUint nodeIndex, const char *ratios,
+    LlmMappedFile *keptFile = nullptr);
 
 #endif
\ No newline at end of file
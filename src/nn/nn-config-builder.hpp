@@ -62,9 +62,9 @@ public:
         this->nodeIndex = nodeIndex;
     }
 
-    NnUint addBuffer(const char *name, NnSize3D size) {
+    NnUint addBuffer(const char *name, NnSize3D size, NnUint flags = 0) {
         NnUint bufferIndex = buffers.size();
-        buffers.push_back({ cloneString(name), size });
+        buffers.push_back({ cloneString(name), size, flags });
         return bufferIndex;
     }
 
@@ -95,6 +95,7 @@ class NnSegmentConfigBuilder {
 private:
     std::list<NnOpConfig> ops;
     std::list<NnSyncConfig> syncs;
+    NnUint flags = 0;
 
 public:
     template <typename T>
@@ -114,8 +115,12 @@ public:
         });
     };
 
-    void addSync(NnUint pipeIndex, NnSyncType syncType) {
-        syncs.push_back({ pipeIndex, syncType });
+    void addSync(NnUint pipeIndex, NnSyncType syncType, NnSyncCodec codec = SYNC_CODEC_NONE) {
+        syncs.push_back({ pipeIndex, syncType, codec });
+    }
+
+    void addFlags(NnUint flags) {
+        this->flags |= flags;
     }
 
     NnSegmentConfig build() {
@@ -130,6 +135,7 @@ public:
             segment.syncs = new NnSyncConfig[segment.nSyncs];
             std::copy(syncs.begin(), syncs.end(), segment.syncs);
         }
+        segment.flags = flags;
         return segment;
     }
 };
@@ -8,7 +8,9 @@
 #include <cmath>
 #include <stdexcept>
 #include <vector>     
-#include <numeric>    
+#include <numeric>
+#include <algorithm>
+#include <thread>    
 
 // utility functions
 
@@ -25,6 +27,14 @@ NnSize getBytes(NnFloatType floatType, NnSize n) {
         assert(n % Q80_BLOCK_SIZE == 0);
         return (n / Q80_BLOCK_SIZE) * sizeof(NnBlockQ80);
     }
+    if (floatType == F_Q4K) {
+        assert(n % Q4K_BLOCK_SIZE == 0);
+        return (n / Q4K_BLOCK_SIZE) * sizeof(NnBlockQ4K);
+    }
+    if (floatType == F_Q6K) {
+        assert(n % Q6K_BLOCK_SIZE == 0);
+        return (n / Q6K_BLOCK_SIZE) * sizeof(NnBlockQ6K);
+    }
     throw std::invalid_argument("Unsupported float type: " + std::to_string(floatType));
 }
 
@@ -37,6 +47,10 @@ NnSize getBlockSize(NnFloatType floatType) {
         return Q40_BLOCK_SIZE;
     if (floatType == F_Q80)
         return Q80_BLOCK_SIZE;
+    if (floatType == F_Q4K)
+        return Q4K_BLOCK_SIZE;
+    if (floatType == F_Q6K)
+        return Q6K_BLOCK_SIZE;
     throw std::invalid_argument("Unsupported float type");
 }
 
@@ -55,6 +69,10 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
         if (weight == F_Q40)
             return F32_Q40_Q80;
     }
+    if (input == F_32 && output == F_16) {
+        if (weight == F_UNK || weight == F_32)
+            return F32_F32_F16;
+    }
     if (input == F_Q80 && output == F_32) {
         if (weight == F_UNK || weight == F_Q80)
             return Q80_Q80_F32;
@@ -62,6 +80,10 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
             return Q80_F32_F32;
         if (weight == F_Q40)
             return Q80_Q40_F32;
+        if (weight == F_Q4K)
+            return Q80_Q4K_F32;
+        if (weight == F_Q6K)
+            return Q80_Q6K_F32;
     }
     if (input == F_Q80 && output == F_Q80) {
         if (weight == F_UNK || weight == F_Q80)
@@ -73,6 +95,31 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
         std::string(floatTypeToString(output)));
 }
 
+const char *syncCodecToString(NnSyncCodec codec) {
+    if (codec == SYNC_CODEC_NONE) return "none";
+    if (codec == SYNC_CODEC_F16) return "f16";
+    if (codec == SYNC_CODEC_Q80) return "q80";
+    if (codec == SYNC_CODEC_Q40) return "q40";
+    throw std::invalid_argument("Unknown sync codec");
+}
+
+NnSyncCodec parseSyncCodec(const char *name) {
+    const NnSyncCodec codecs[] = { SYNC_CODEC_NONE, SYNC_CODEC_F16, SYNC_CODEC_Q80, SYNC_CODEC_Q40 };
+    for (NnSyncCodec codec : codecs) {
+        if (std::strcmp(name, syncCodecToString(codec)) == 0)
+            return codec;
+    }
+    throw std::invalid_argument("Unsupported sync codec: " + std::string(name));
+}
+
+NnFloatType getSyncCodecFloatType(NnSyncCodec codec) {
+    if (codec == SYNC_CODEC_NONE) return F_32;
+    if (codec == SYNC_CODEC_F16) return F_16;
+    if (codec == SYNC_CODEC_Q80) return F_Q80;
+    if (codec == SYNC_CODEC_Q40) return F_Q40;
+    throw std::invalid_argument("Unknown sync codec");
+}
+
 const char *opCodeToString(NnOpCode code) {
     if (code == OP_MERGE_ADD) return "MERGE_ADD";
     if (code == OP_MERGE_SUM) return "MERGE_SUM";
@@ -91,6 +138,9 @@ const char *opCodeToString(NnOpCode code) {
     if (code == OP_SHIFT) return "SHIFT";
     if (code == OP_SOFTMAX) return "SOFTMAX";
     if (code == OP_MOE_GATE) return "MOE_GATE";
+    if (code == OP_TOPK_LOGITS) return "TOPK_LOGITS";
+    if (code == OP_MERGE_ATT) return "MERGE_ATT";
+    if (code == OP_KV_EVICT) return "KV_EVICT";
     throw std::invalid_argument("Unknown op code: " + std::to_string(code));
 }
 
@@ -103,6 +153,9 @@ const char *opQuantTypeToString(NnOpQuantType type) {
     if (type == Q80_Q80_F32) return "Q80_Q80_F32";
     if (type == Q80_Q40_F32) return "Q80_Q40_F32";
     if (type == Q80_F32_F32) return "Q80_F32_F32";
+    if (type == F32_F32_F16) return "F32_F32_F16";
+    if (type == Q80_Q4K_F32) return "Q80_Q4K_F32";
+    if (type == Q80_Q6K_F32) return "Q80_Q6K_F32";
     throw std::invalid_argument("Unknown op quant type");
 }
 
@@ -175,8 +228,8 @@ void releaseNodeConfig(NnNodeConfig *nodeConfig) {
     delete[] nodeConfig->segments;
 }
 
-void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
-    unsigned long total = 0;
+NnSize getNodeRequiredMemory(const NnNetConfig *netConfig, const NnNodeConfig *nodeConfig) {
+    NnSize total = 0;
     for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++)
         total += netConfig->pipes[pipeIndex].size.nBytes;
     for (NnUint bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++)
@@ -188,7 +241,11 @@ void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
             total += segment->ops[opIndex].configSize;
         }
     }
-    printf("📀 RequiredMemory: %lu MB\n", total / (1024 * 1024));
+    return total;
+}
+
+void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
+    printf("📀 RequiredMemory: %lu MB\n", (unsigned long)(getNodeRequiredMemory(netConfig, nodeConfig) / (1024 * 1024)));
 }
 
 Timer::Timer() {
@@ -209,14 +266,151 @@ NnUint Timer::elapsedMicroseconds() {
     return (NnUint)std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
 }
 
+NnKvBlockTable::NnKvBlockTable(NnUint nSlots, NnUint nBlocksPerSlot, NnUint nBlocks, NnUint blockSize)
+    : nSlots(nSlots), nBlocksPerSlot(nBlocksPerSlot), blockSize(blockSize), table(nSlots * nBlocksPerSlot, -1.0f),
+      refCounts(nBlocks, 0u)
+{
+    assert(blockSize > 0);
+    freeBlocks.resize(nBlocks);
+    for (NnUint i = 0; i < nBlocks; i++)
+        freeBlocks[i] = nBlocks - 1 - i;
+}
+
+void NnKvBlockTable::unref(NnUint block) {
+    assert(refCounts[block] > 0);
+    refCounts[block]--;
+    if (refCounts[block] == 0)
+        freeBlocks.push_back(block);
+}
+
+void NnKvBlockTable::write(NnUint slot, NnUint position) {
+    assert(slot < nSlots);
+    const NnUint logicalBlock = position / blockSize;
+    assert(logicalBlock < nBlocksPerSlot);
+    float *slotTable = &table[slot * nBlocksPerSlot];
+
+    for (NnUint i = logicalBlock + 1; i < nBlocksPerSlot && slotTable[i] >= 0.0f; i++) {
+        unref((NnUint)slotTable[i]);
+        slotTable[i] = -1.0f;
+    }
+    if (slotTable[logicalBlock] < 0.0f) {
+        if (freeBlocks.empty())
+            throw std::runtime_error("The KV cache pool is full, increase --kv-cache-blocks");
+        const NnUint block = freeBlocks.back();
+        freeBlocks.pop_back();
+        refCounts[block] = 1;
+        slotTable[logicalBlock] = (float)block;
+        changes.push_back(slot * nBlocksPerSlot + logicalBlock);
+        changes.push_back(block);
+    }
+}
+
+void NnKvBlockTable::writeRows(const float *slots, const float *positions, NnUint nRows) {
+    std::vector<NnUint> order(nRows);
+    std::iota(order.begin(), order.end(), 0u);
+    std::sort(order.begin(), order.end(), [&](NnUint a, NnUint b) {
+        if (slots[a] != slots[b])
+            return slots[a] < slots[b];
+        return positions[a] < positions[b];
+    });
+    for (NnUint i : order)
+        write((NnUint)slots[i], (NnUint)positions[i]);
+}
+
+void NnKvBlockTable::attach(NnUint slot, NnUint logicalBlock, NnUint block) {
+    assert(slot < nSlots);
+    assert(logicalBlock < nBlocksPerSlot);
+    assert(refCounts[block] > 0);
+    float *slotTable = &table[slot * nBlocksPerSlot];
+    // the allocated entries of a slot are always a contiguous run from the first block
+    assert(slotTable[logicalBlock] < 0.0f);
+    assert(logicalBlock == 0 || slotTable[logicalBlock - 1] >= 0.0f);
+    refCounts[block]++;
+    slotTable[logicalBlock] = (float)block;
+    changes.push_back(slot * nBlocksPerSlot + logicalBlock);
+    changes.push_back(block);
+}
+
+void NnKvBlockTable::release(NnUint slot) {
+    assert(slot < nSlots);
+    float *slotTable = &table[slot * nBlocksPerSlot];
+    for (NnUint i = 0; i < nBlocksPerSlot && slotTable[i] >= 0.0f; i++) {
+        unref((NnUint)slotTable[i]);
+        slotTable[i] = -1.0f;
+    }
+}
+
+void NnKvBlockTable::retainBlock(NnUint block) {
+    assert(refCounts[block] > 0);
+    refCounts[block]++;
+}
+
+void NnKvBlockTable::releaseBlock(NnUint block) {
+    unref(block);
+}
+
+int NnKvBlockTable::getBlock(NnUint slot, NnUint logicalBlock) const {
+    assert(slot < nSlots);
+    assert(logicalBlock < nBlocksPerSlot);
+    return (int)table[slot * nBlocksPerSlot + logicalBlock];
+}
+
+void NnKvBlockTable::takeChanges(std::vector<NnUint> &out) {
+    out.swap(changes);
+    changes.clear();
+}
+
+NnSliceArrivals::NnSliceArrivals(NnUint nBatches, NnUint nNodes)
+    : nBatches(nBatches), nNodes(nNodes), entries(new std::atomic<NnUint>[nBatches * nNodes]) {
+    for (NnUint i = 0; i < nBatches * nNodes; i++)
+        entries[i].store(0);
+    epoch.store(0);
+    failed.store(false);
+}
+
+NnUint NnSliceArrivals::begin(NnUint batchSize, NnUint myNodeIndex) {
+    assert(batchSize <= nBatches);
+    NnUint e = epoch.load(std::memory_order_relaxed) + 1;
+    if (e == 0)
+        e = 1; // 0 is the initial value of the entries
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        entries[batchIndex * nNodes + myNodeIndex].store(e, std::memory_order_relaxed);
+    epoch.store(e, std::memory_order_release);
+    return e;
+}
+
+void NnSliceArrivals::markArrived(NnUint batchIndex, NnUint nodeIndex, NnUint epoch) {
+    entries[batchIndex * nNodes + nodeIndex].store(epoch, std::memory_order_release);
+}
+
+void NnSliceArrivals::markFailed() {
+    failed.store(true);
+}
+
+void NnSliceArrivals::wait(NnUint batchIndex, NnUint nodeIndex) const {
+    const NnUint e = epoch.load(std::memory_order_acquire);
+    const std::atomic<NnUint> *entry = &entries[batchIndex * nNodes + nodeIndex];
+    while (entry->load(std::memory_order_acquire) != e) {
+        if (failed.load())
+            throw std::runtime_error("Slice exchange failed");
+        std::this_thread::yield();
+    }
+}
+
+void NnSliceArrivals::waitAll(NnUint batchSize) const {
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+            wait(batchIndex, nodeIndex);
+}
+
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes) {
+NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes, NnFloatType cacheType) {
     NnKvCacheSlice s;
     assert(kvDim % nNodes == 0);
     s.kvDim0 = kvDim / nNodes;
-    s.keySize = size2D(F_32, seqLen, s.kvDim0);
-    s.valueSize = size2D(F_32, seqLen, s.kvDim0);
+    s.keySize = size2D(cacheType, seqLen, s.kvDim0);
+    s.valueSize = size2D(cacheType, seqLen, s.kvDim0);
     return s;
 }
 
@@ -232,9 +426,19 @@ NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUin
     return s;
 }
 
+static void assertColSliceAligned(NnFloatType type, NnUint start, NnUint len) {
+    // A slice of the input dimension must hold whole blocks (256 values for the K-quants)
+    const NnUint blockSize = (NnUint)getBlockSize(type);
+    if (start % blockSize != 0 || len % blockSize != 0)
+        throw std::invalid_argument(std::string("The slice ") + std::to_string(start) + "+" + std::to_string(len) +
+            " of the input dimension is not aligned to the blocks of " + floatTypeToString(type) +
+            " (" + std::to_string(blockSize) + ")");
+}
+
 NnColMatmulSlice sliceColMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d) {
     NnColMatmulSlice s;
     assert(n % nNodes == 0);
+    assertColSliceAligned(type, 0, n / nNodes);
     s.type = type;
     s.nNodes = nNodes;
     s.n = n;
@@ -288,6 +492,24 @@ NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint seqLen, NnUint nNode
     return s;
 }
 
+NnUint getSeqShardIndex(NnUint position, NnUint nShards, NnUint block) {
+    return (position / block) % nShards;
+}
+
+NnUint getSeqShardRow(NnUint position, NnUint nShards, NnUint block) {
+    return (position / (block * nShards)) * block + position % block;
+}
+
+NnUint getSeqShardRows(NnUint nPositions, NnUint nShards, NnUint shardIndex, NnUint block) {
+    const NnUint round = block * nShards;
+    const NnUint rest = nPositions % round;
+    const NnUint start = shardIndex * block;
+    NnUint rows = (nPositions / round) * block;
+    if (rest > start)
+        rows += std::min(rest - start, block);
+    return rows;
+}
+
 // splitters
 
 NnUint splitRowMatmulWeight(NnRowMatmulSlice *slice, NnUint nodeIndex, NnByte *weight, NnByte *weight0) {
@@ -429,7 +651,9 @@ NnUnevenPartitionPlan createPartitionPlan(
     NnUint globalNKvHeads,
     NnUint globalVocabSize,
     NnUint globalFfnDim,
-    NnUint globalDim
+    NnUint globalDim,
+    NnUint globalNExperts,
+    NnUint ffnAlignSize
 ) {
     NnUnevenPartitionPlan plan;
     
@@ -459,6 +683,8 @@ NnUnevenPartitionPlan createPartitionPlan(
     allocSplit(plan.vocabSplit);
     allocSplit(plan.ffnSplit);
     allocSplit(plan.dimSplit);
+    if (globalNExperts > 0)
+        allocSplit(plan.expertSplit);
 
     // GQA Check
     if (globalNHeads % globalNKvHeads != 0) {
@@ -503,7 +729,7 @@ NnUnevenPartitionPlan createPartitionPlan(
             }
 
             // FFN & Dim (Hidden Size)
-            fillDimSplitForStage(plan.ffnSplit, currentNodeOffset, globalFfnDim, def.tpRatios, 32);
+            fillDimSplitForStage(plan.ffnSplit, currentNodeOffset, globalFfnDim, def.tpRatios, ffnAlignSize);
             fillDimSplitForStage(plan.dimSplit, currentNodeOffset, globalDim, def.tpRatios, 32);
 
             // Vocab (Logits)
@@ -511,6 +737,17 @@ NnUnevenPartitionPlan createPartitionPlan(
             // 我们为所有 Stage 都计算 Vocab Split (Loader 会根据层号自动跳过非 Logits 层)
             fillDimSplitForStage(plan.vocabSplit, currentNodeOffset, globalVocabSize, def.tpRatios, 32);
 
+            // Experts: 每个 Stage 内按比例分配完整的 expert
+            if (globalNExperts > 0) {
+                if (globalNExperts < config.nNodes)
+                    throw std::invalid_argument("Expert parallelism needs at least one expert per node");
+                fillDimSplitForStage(plan.expertSplit, currentNodeOffset, globalNExperts, def.tpRatios, 1);
+                for (NnUint i = 0; i < config.nNodes; i++) {
+                    if (plan.expertSplit.lengths[currentNodeOffset + i] == 0)
+                        throw std::invalid_argument("Node " + std::to_string(currentNodeOffset + i) + " gets no experts, adjust the ratios");
+                }
+            }
+
             // 推进偏移量
             currentNodeOffset += config.nNodes;
             currentLayerOffset += config.nLayers;
@@ -526,7 +763,7 @@ NnUnevenPartitionPlan createPartitionPlan(
 
     
 NnKvCacheSliceUneven sliceKvCacheUneven(NnUint seqLen, NnUint headDim,
-                                        const NnUnevenPartitionPlan* plan, NnUint nodeIndex) {
+                                        const NnUnevenPartitionPlan* plan, NnUint nodeIndex, NnFloatType cacheType) {
     NnKvCacheSliceUneven s;
 
     // 1. 从“总蓝图”中查询本节点的 KV Head 分配
@@ -541,8 +778,8 @@ NnKvCacheSliceUneven sliceKvCacheUneven(NnUint seqLen, NnUint headDim,
     s.kvDim0 = s.kvLen; // 保留以兼容旧逻辑
 
     // 4. 计算局部缓冲区大小 (复用 size2D)
-    s.keySize = size2D(F_32, seqLen, s.kvLen);
-    s.valueSize = size2D(F_32, seqLen, s.kvLen);
+    s.keySize = size2D(cacheType, seqLen, s.kvLen);
+    s.valueSize = size2D(cacheType, seqLen, s.kvLen);
 
     return s;
 }
@@ -605,6 +842,7 @@ NnColMatmulSliceUneven sliceColMatmulAttUneven(NnFloatType type, NnUint globalIn
     // 2. 转换为维度，并填入 'outStart'/'outLen' 字段
     s.outStart = headStart * headDim;
     s.outLen = headLen * headDim;
+    assertColSliceAligned(type, s.outStart, s.outLen);
 
     // 3. 填充兼容性/派生字段
     s.n = globalInDimQ; // n 是完整输入维度
@@ -641,6 +879,35 @@ NnRowMatmulSliceUneven sliceRowMatmulFfnUneven(NnFloatType type, NnUint globalIn
 }
 
 
+bool isExpertParallelPlan(const NnUnevenPartitionPlan* plan) {
+    return plan != nullptr && plan->expertSplit.lengths != nullptr;
+}
+
+NnRowMatmulSliceUneven sliceRowMatmulExpertUneven(NnFloatType type, NnUint globalInDim, NnUint globalFfnDim) {
+    NnRowMatmulSliceUneven s;
+    s.type = type;
+    s.inStart = 0;
+    s.inLen = globalFfnDim;
+    s.d0 = globalFfnDim;
+    s.n = globalInDim;
+    s.size = size2D(type, s.n, globalFfnDim);
+    s.sliceSize = s.size;
+    return s;
+}
+
+NnColMatmulSliceUneven sliceColMatmulExpertUneven(NnFloatType type, NnUint globalFfnDim, NnUint globalOutDim) {
+    NnColMatmulSliceUneven s;
+    s.type = type;
+    s.outStart = 0;
+    s.outLen = globalFfnDim;
+    s.n = globalFfnDim;
+    s.n0 = globalFfnDim;
+    s.d = globalOutDim;
+    s.size = size2D(type, s.n, s.d);
+    s.sliceSize = s.size;
+    return s;
+}
+
 NnColMatmulSliceUneven sliceColMatmulFfnUneven(NnFloatType type, NnUint globalFfnDim, NnUint globalOutDim,
                                                const NnUnevenPartitionPlan* plan, 
                                                NnUint nodeIndex) {
@@ -650,6 +917,7 @@ NnColMatmulSliceUneven sliceColMatmulFfnUneven(NnFloatType type, NnUint globalFf
     // 1. 从 FFN 蓝图中获取分配 (不再乘以 headDim)
     s.outStart = plan->ffnSplit.starts[nodeIndex];
     s.outLen = plan->ffnSplit.lengths[nodeIndex];
+    assertColSliceAligned(type, s.outStart, s.outLen);
 
     // 3. 填充兼容性/派生字段
     s.n = globalFfnDim; // n 是完整输入维度
@@ -860,10 +1128,14 @@ void releasePartitionPlan(NnUnevenPartitionPlan* plan) {
     delete[] plan->ffnSplit.starts;
     delete[] plan->ffnSplit.lengths;
 
+    delete[] plan->expertSplit.starts;
+    delete[] plan->expertSplit.lengths;
+
     // 将指针设为 null 以防止重复释放
     plan->headSplit = {nullptr, nullptr};
     plan->kvHeadSplit = {nullptr, nullptr};
     plan->vocabSplit = {nullptr, nullptr};
     plan->ffnSplit = {nullptr, nullptr};
+    plan->expertSplit = {nullptr, nullptr};
     plan->nNodes = 0;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef NN_CORE_H
 #define NN_CORE_H
 
+#include <atomic>
 #include <chrono>
 #include <list>
 #include <memory>
@@ -82,6 +83,8 @@ struct NnUnevenPartitionPlan {
     NnDimSplit vocabSplit;
     NnDimSplit ffnSplit;
     NnDimSplit dimSplit;
+    // MoE expert parallelism: whole experts per node, starts/lengths are nullptr when every node slices all experts
+    NnDimSplit expertSplit;
 
     // 默认构造函数
     NnUnevenPartitionPlan() : nNodes(0) {
@@ -90,6 +93,7 @@ struct NnUnevenPartitionPlan {
         std::memset(&vocabSplit, 0, sizeof(vocabSplit));
         std::memset(&ffnSplit, 0, sizeof(ffnSplit));
         std::memset(&dimSplit, 0, sizeof(dimSplit));
+        std::memset(&expertSplit, 0, sizeof(expertSplit));
     }
 
     // 析构函数：释放内部数组
@@ -99,6 +103,7 @@ struct NnUnevenPartitionPlan {
         freeSplit(vocabSplit);
         freeSplit(ffnSplit);
         freeSplit(dimSplit);
+        freeSplit(expertSplit);
     }
 
     // 移动构造函数：用于 std::move 和 unique_ptr
@@ -108,7 +113,8 @@ struct NnUnevenPartitionPlan {
           kvHeadSplit(other.kvHeadSplit),
           vocabSplit(other.vocabSplit),
           ffnSplit(other.ffnSplit),
-          dimSplit(other.dimSplit) {
+          dimSplit(other.dimSplit),
+          expertSplit(other.expertSplit) {
         
         // 剥夺源对象的所有权
         other.stages = nullptr; // 接管 stages
@@ -117,6 +123,7 @@ struct NnUnevenPartitionPlan {
         zeroSplit(other.vocabSplit);
         zeroSplit(other.ffnSplit);
         zeroSplit(other.dimSplit);
+        zeroSplit(other.expertSplit);
         other.nNodes = 0;
     }
 
@@ -270,6 +277,9 @@ enum NnOpCode {
     OP_MOE_GATE,
     OP_PP_RECV,
     OP_PP_SEND,
+    OP_TOPK_LOGITS,
+    OP_MERGE_ATT,
+    OP_KV_EVICT,
 };
 
 enum NnOpQuantType {
@@ -282,10 +292,13 @@ enum NnOpQuantType {
     Q80_Q80_F32,
     Q80_Q40_F32,
     Q80_F32_F32,
+    F32_F32_F16,
+    Q80_Q4K_F32,
+    Q80_Q6K_F32,
 };
 
 #define N_OP_CODES (OP_SHIFT + 1)
-#define N_OP_QUANTS (Q80_F32_F32 + 1)
+#define N_OP_QUANTS (Q80_Q6K_F32 + 1)
 
 enum NnPointerSource {
     SRC_PIPE,
@@ -302,8 +315,19 @@ enum NnSyncType {
     SYNC_WITH_ROOT, // whole pipe to all nodes
     SYNC_NODE_SLICES, // my slice of pipe to all nodes
     SYNC_NODE_SLICES_EXCEPT_ROOT, // only workers send slices to root, root does not send
+    SYNC_NODE_SLOTS_EXCEPT_ROOT, // fixed slot per node (x / nNodes at nodeIndex), only workers producing logits send to root
     SYNC_PP_SEND,                     // PP: 当前 Stage 发送给 Next Stage
-    SYNC_PP_RECV                      // PP: 当前 Stage 从 Prev Stage 接收
+    SYNC_PP_RECV,                     // PP: 当前 Stage 从 Prev Stage 接收
+    SYNC_NODE_SLICES_STREAMED, // like SYNC_NODE_SLICES, exchanged in the background, the consumer waits per (row, node) slice
+    SYNC_NODE_EXCHANGE, // all-to-all, the slice of every node has nNodes chunks, the chunk i goes to the node i
+};
+
+// Wire format of a synced F32 pipe, the pipe itself stays F32 on both sides
+enum NnSyncCodec {
+    SYNC_CODEC_NONE = 0,
+    SYNC_CODEC_F16 = 1,
+    SYNC_CODEC_Q80 = 2,
+    SYNC_CODEC_Q40 = 3,
 };
 
 enum NnRopeType {
@@ -321,9 +345,15 @@ typedef struct {
     NnSize3D size;
 } NnPipeConfig;
 
+enum NnBufferFlag : NnUint {
+    // The buffer is not locked in RAM, pages are committed on first touch (e.g. the KV cache)
+    BUFFER_FLAG_LAZY = 1u << 0,
+};
+
 typedef struct {
     char *name;
     NnSize3D size;
+    NnUint flags; // NnBufferFlag
 } NnBufferConfig;
 
 typedef struct {
@@ -350,13 +380,20 @@ typedef struct {
 typedef struct {
     NnUint pipeIndex;
     NnSyncType syncType;
+    NnSyncCodec codec;
 } NnSyncConfig;
 
+enum NnSegmentFlags : NnUint {
+    // Ops and syncs of the segment run only on the first NnNetExecution::nLogitsRows rows of the batch
+    SEGMENT_LOGITS_ROWS = 1u << 0,
+};
+
 typedef struct  {
     NnUint nOps;
     NnOpConfig *ops;
     NnUint nSyncs;
     NnSyncConfig *syncs;
+    NnUint flags; // NnSegmentFlags
 } NnSegmentConfig;
 
 typedef struct {
@@ -426,6 +463,17 @@ typedef struct {
     NnUint keyCacheBufferIndex;
     NnUint valueCacheBufferIndex;
     NnUint attBufferIndex;
+    NnUint nKvSlots; // 0 or 1 = single sequence, otherwise the caches hold nKvSlots * seqLen rows
+    NnUint slotPipeIndex;
+    NnUint kvBlockSize; // 0 = contiguous cache, otherwise rows are resolved by the block table
+    NnUint blockTablePipeIndex;
+    NnFloatType kvCacheType; // F_32, F_16 or F_Q80
+    // Sequence parallelism: 0 or 1 = the cache holds all positions. Otherwise the cache holds only the positions
+    // of the shard seqShardIndex (see getSeqShardIndex), seqLen is the local rows per slot and the output gets
+    // the partials [m, l, o[headDim]] of all heads, not normalized, merged by OP_MERGE_ATT
+    NnUint nSeqShards;
+    NnUint seqShardIndex;
+    NnUint seqShardBlock;
 } NnMultiHeadAttOpConfig;
 
 typedef struct {
@@ -458,6 +506,16 @@ typedef struct {
 
 typedef struct {
     NnUint indexPipeIndex;
+    NnUint slotPipeIndex;
+    NnUint slotStride; // 0 = no slots, otherwise output index = slot * slotStride + index
+    NnUint blockSize; // 0 = no block table, otherwise index is mapped by the block table of the slot,
+                      // the table of the slot starts at slot * ceil(slotStride / blockSize)
+    NnUint blockTablePipeIndex;
+    // Sequence parallelism: 0 or 1 = all rows, otherwise only the positions of the shard seqShardIndex are
+    // stored at their local rows, slotStride is the local rows per slot
+    NnUint nSeqShards;
+    NnUint seqShardIndex;
+    NnUint seqShardBlock;
 } NnShiftOpCodeConfig;
 
 typedef struct {
@@ -468,14 +526,50 @@ typedef struct {
     NnUint k;
     NnUint normTopk;
     NnUint indexesBufferIndex;
+    // Expert parallelism: only the experts [expertStart, expertStart + nLocalExperts) are on this node,
+    // the other selected experts get the index -1 and the weight 0
+    NnUint expertParallel;
+    NnUint expertStart;
+    NnUint nLocalExperts;
 } NnMoeGateOpCodeConfig;
 
+typedef struct {
+    NnUint k;
+    NnUint indexOffset; // global index of the first input column
+    NnUint slotIndex;   // output row: [slotIndex * 2k, slotIndex * 2k + k) values, then k indexes
+} NnTopkLogitsOpCodeConfig;
+
+typedef struct {
+    NnUint nHeads;
+    NnUint nHeads0;
+    NnUint headDim;
+    NnUint nShards;
+    NnUint headStart; // the output holds the heads [headStart, headStart + nHeads0)
+    // The input row has the partials [m, l, o[headDim]] of all nHeads heads of every shard, shard after shard
+} NnMergeAttOpCodeConfig;
+
+typedef struct {
+    // [slot, start, nDiscard, nRows]: the rows [start + nDiscard, start + nDiscard + nRows) of the slot move to
+    // start, nDiscard = 0 = nothing to do. The pipe is set by the root only for the forward of the eviction.
+    NnUint evictPipeIndex;
+    NnUint kvDim0;
+    NnUint slotStride; // 0 = one slot, otherwise rows per slot
+    NnUint isKey;      // keys are rotated back by nDiscard positions, so they keep the RoPE of their new rows
+    NnRopeType ropeType;
+    NnUint ropeCacheBufferIndex;
+    NnRopeSlice slice;
+} NnKvEvictOpCodeConfig;
+
 // ======================================================================================
 // Functions Declarations
 // ======================================================================================
 
 const char *opCodeToString(NnOpCode code);
 const char *opQuantTypeToString(NnOpQuantType type);
+const char *syncCodecToString(NnSyncCodec codec);
+NnSyncCodec parseSyncCodec(const char *name);
+// F_32 for SYNC_CODEC_NONE
+NnFloatType getSyncCodecFloatType(NnSyncCodec codec);
 
 NnSize getBytes(NnFloatType floatType, NnSize n);
 NnSize getBlockSize(NnFloatType floatType);
@@ -492,8 +586,66 @@ bool hasPointerContinuousMemory(NnPointerConfig *config);
 void releaseNetConfig(NnNetConfig *netConfig);
 void releaseNodeConfig(NnNodeConfig *nodeConfig);
 
+// Pipes, buffers and weights of the node in bytes
+NnSize getNodeRequiredMemory(const NnNetConfig *netConfig, const NnNodeConfig *nodeConfig);
 void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
 
+// Paged KV cache: maps (slot, logical block) to a block of the shared pool. The block
+// table is kept as floats, one entry per logical block, so it can live in a pipe.
+class NnKvBlockTable {
+private:
+    NnUint nSlots;
+    NnUint nBlocksPerSlot;
+    NnUint blockSize;
+    std::vector<float> table;      // [nSlots * nBlocksPerSlot], -1 = not allocated
+    std::vector<NnUint> refCounts; // [nBlocks], a block may be shared by slots and the prefix cache
+    std::vector<NnUint> freeBlocks; // the lowest block is at the back
+    std::vector<NnUint> changes;   // (entry, block) pairs since the last takeChanges()
+    void unref(NnUint block);
+public:
+    NnKvBlockTable(NnUint nSlots, NnUint nBlocksPerSlot, NnUint nBlocks, NnUint blockSize);
+    // Maps the block of the position, blocks after it are released (the sequence was rewound)
+    void write(NnUint slot, NnUint position);
+    // write() of the rows of a batch in any order: the positions of a slot are written in ascending
+    // order, so only the first row may rewind the slot and no row releases the block of another
+    void writeRows(const float *slots, const float *positions, NnUint nRows);
+    // Maps an already computed block (a shared prefix) to the logical block of the slot
+    void attach(NnUint slot, NnUint logicalBlock, NnUint block);
+    void release(NnUint slot);
+    // Extra references held outside of the table
+    void retainBlock(NnUint block);
+    void releaseBlock(NnUint block);
+    int getBlock(NnUint slot, NnUint logicalBlock) const;
+    NnUint refCount(NnUint block) const { return refCounts[block]; }
+    NnUint getBlockSize() const { return blockSize; }
+    NnUint getBlocksPerSlot() const { return nBlocksPerSlot; }
+    NnUint nFreeBlocks() const { return (NnUint)freeBlocks.size(); }
+    NnUint nBlocks() const { return (NnUint)refCounts.size(); }
+    NnUint nEntries() const { return (NnUint)table.size(); }
+    const float *data() const { return table.data(); }
+    void takeChanges(std::vector<NnUint> &out);
+};
+
+// Arrivals of the node slices of a pipe exchanged by SYNC_NODE_SLICES_STREAMED. Every exchange
+// starts a new epoch, a (row, node) entry holds the epoch of the exchange that filled it.
+class NnSliceArrivals {
+private:
+    NnUint nBatches;
+    NnUint nNodes;
+    std::unique_ptr<std::atomic<NnUint>[]> entries; // [nBatches * nNodes]
+    std::atomic<NnUint> epoch;
+    std::atomic<bool> failed;
+public:
+    NnSliceArrivals(NnUint nBatches, NnUint nNodes);
+    // Starts a new exchange, rows of myNodeIndex are local so they are ready at once
+    NnUint begin(NnUint batchSize, NnUint myNodeIndex);
+    void markArrived(NnUint batchIndex, NnUint nodeIndex, NnUint epoch);
+    void markFailed();
+    // Throws if the exchange failed
+    void wait(NnUint batchIndex, NnUint nodeIndex) const;
+    void waitAll(NnUint batchSize) const;
+};
+
 class Timer {
 private:
     std::chrono::time_point<std::chrono::high_resolution_clock> startTime;
@@ -506,12 +658,21 @@ public:
 
 // --- Legacy Slicers ---
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes);
+NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes, NnFloatType cacheType = F_32);
 NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnColMatmulSlice sliceColMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnRopeSlice sliceRope(NnRopeType type, NnUint qDim, NnUint kvDim, NnUint nKvHeads, NnUint nNodes, NnUint seqLen, NnUint headDim, float ropeTheta, NnUint nodeIndex);
 NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint seqLen, NnUint nNodes, NnUint nBatches);
 
+// --- Sequence parallelism ---
+// Positions are dealt to the shards in blocks: [0, block) to the shard 0, [block, 2 * block) to the shard 1, ...
+// The positions of a shard are stored one after another, so the positions [0, n) of a shard are its first rows.
+
+NnUint getSeqShardIndex(NnUint position, NnUint nShards, NnUint block);
+NnUint getSeqShardRow(NnUint position, NnUint nShards, NnUint block);
+// Positions of [0, nPositions) held by the shard
+NnUint getSeqShardRows(NnUint nPositions, NnUint nShards, NnUint shardIndex, NnUint block);
+
 // --- Legacy Splitters ---
 
 NnUint splitRowMatmulWeight(NnRowMatmulSlice *slice, NnUint nodeIndex, NnByte *weight, NnByte *weight0);
@@ -532,7 +693,9 @@ NnUnevenPartitionPlan createPartitionPlan(
     NnUint globalNKvHeads,
     NnUint globalVocabSize,
     NnUint globalFfnDim,
-    NnUint globalDim
+    NnUint globalDim,
+    NnUint globalNExperts = 0, // > 0 enables the expert parallelism of MoE layers
+    NnUint ffnAlignSize = 32 // the FFN split is the input of w2, so it keeps whole blocks of the weight
 );
 
 // 释放计划 (旧接口，如果使用栈上对象+析构函数可忽略，但保留以防遗留调用)
@@ -541,7 +704,7 @@ void releasePartitionPlan(NnUnevenPartitionPlan* plan);
 // Slicers
 
 NnKvCacheSliceUneven sliceKvCacheUneven(NnUint seqLen, NnUint headDim,
-    const NnUnevenPartitionPlan* plan, NnUint nodeIndex);
+    const NnUnevenPartitionPlan* plan, NnUint nodeIndex, NnFloatType cacheType = F_32);
 
 NnMultiHeadAttSliceUneven sliceMultiHeadAttUneven(NnUint nBatches, NnUint globalNHeads, NnUint globalSeqLen,
     const NnUnevenPartitionPlan* plan, NnUint nodeIndex);
@@ -558,6 +721,11 @@ NnRowMatmulSliceUneven sliceRowMatmulFfnUneven(NnFloatType type, NnUint globalIn
 NnColMatmulSliceUneven sliceColMatmulFfnUneven(NnFloatType type, NnUint globalFfnDim, NnUint globalOutDim,
     const NnUnevenPartitionPlan* plan, NnUint nodeIndex);
 
+// Expert parallelism keeps whole experts, so the FFN of a local expert is not sliced
+bool isExpertParallelPlan(const NnUnevenPartitionPlan* plan);
+NnRowMatmulSliceUneven sliceRowMatmulExpertUneven(NnFloatType type, NnUint globalInDim, NnUint globalFfnDim);
+NnColMatmulSliceUneven sliceColMatmulExpertUneven(NnFloatType type, NnUint globalFfnDim, NnUint globalOutDim);
+
 NnRopeSliceUneven sliceRopeUneven(NnRopeType type, NnUint seqLen, 
     NnUint globalKvDim, NnUint globalNKvHeads, NnUint headDim, float ropeTheta,
     const NnUnevenPartitionPlan* plan, NnUint nodeIndex);
@@ -1,5 +1,6 @@
 #include "nn-cpu-ops.cpp"
 #include <vector>
+#include <thread>
 
 // framework
 
@@ -213,6 +214,46 @@ void testMergeSum() {
     compare_F32("mergeSum_F32", out, expectedOutput, 4u, 0.00000001f);
 }
 
+void testMergeAddStreamed() {
+    // 2 rows of 3 node slices, slices of node 0 are local, the rest arrive in the background
+    const NnUint nBatches = 2;
+    const NnUint nNodes = 3;
+    const NnUint dim = 4;
+    std::vector<float> pipe(nBatches * nNodes * dim, 0.0f);
+    std::vector<float> x(nBatches * dim, 1.0f);
+    for (NnUint i = 0; i < nBatches * dim; i++)
+        pipe[(i / dim) * nNodes * dim + i % dim] = 0.5f;
+
+    NnSliceArrivals arrivals(nBatches, nNodes);
+    NnUint epoch = arrivals.begin(nBatches, 0u);
+    std::thread exchanger([&]() {
+        for (NnUint y = 0; y < nBatches; y++) {
+            for (NnUint n = 1; n < nNodes; n++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                for (NnUint i = 0; i < dim; i++)
+                    pipe[(y * nNodes + n) * dim + i] = (float)n;
+                arrivals.markArrived(y, n, epoch);
+            }
+        }
+    });
+
+    NnByte *input[] = {(NnByte *)&pipe[0], (NnByte *)&pipe[nNodes * dim]};
+    NnByte *output[] = {(NnByte *)&x[0], (NnByte *)&x[dim]};
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = nBatches;
+    context.input = input;
+    context.inputSize = size2D(F_32, nBatches, nNodes * dim);
+    context.output = output;
+    context.outputSize = size2D(F_32, nBatches, dim);
+    context.inputArrivals = &arrivals;
+    mergeAddForward_F32_F32(1, 0, nBatches, &context);
+    exchanger.join();
+
+    std::vector<float> expectedX(nBatches * dim, 1.0f + 0.5f + 1.0f + 2.0f);
+    compare_F32("mergeAdd_streamed", x.data(), expectedX.data(), nBatches * dim, 0.00001f);
+}
+
 void testSoftmax() {
     std::vector<float> y(8);
     for (NnUint i = 0; i < 8; i++)
@@ -327,6 +368,243 @@ void testLlamafileSgemm() {
 #endif
 }
 
+void testMatmul_groupedExperts() {
+    // 5 rows, 2 active experts per row out of 3, one pair is on another node
+    const NnUint nBatches = 5;
+    const NnUint k = 2;
+    const NnUint nExperts = 3;
+    const NnUint n = 64;
+    const NnUint d = 48;
+    const float indexes[nBatches * k] = {0, 2, 2, 1, 0, 1, -1, 2, 2, 0};
+
+    std::vector<float> x(k * nBatches * n);
+    std::vector<float> w(nExperts * d * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = (float)((i * 7) % 13) / 13.0f - 0.5f;
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = (float)((i * 5) % 11) / 11.0f - 0.5f;
+    std::vector<NnBlockQ80> xQ(x.size() / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ(w.size() / Q40_BLOCK_SIZE);
+    quantizeF32toQ80(x.data(), xQ.data(), x.size(), 1, 0);
+    quantizeF32toQ40(w.data(), wQ.data(), w.size(), 1, 0);
+
+    std::vector<float> expected(k * nBatches * d, 0.0f);
+    for (NnUint y = 0; y < nBatches; y++) {
+        for (NnUint e = 0; e < k; e++) {
+            const float expert = indexes[y * k + e];
+            if (expert < 0.0f)
+                continue;
+            const NnUint slot = e * nBatches + y;
+            matmul_Q80_Q40_F32(&expected[slot * d], &xQ[slot * n / Q80_BLOCK_SIZE],
+                &wQ[(NnUint)expert * d * n / Q40_BLOCK_SIZE], n, d, 1, 0);
+        }
+    }
+
+    std::vector<float> o(k * nBatches * d, 9.0f);
+    std::vector<NnByte *> input(k * nBatches);
+    std::vector<NnByte *> output(k * nBatches);
+    for (NnUint i = 0; i < k * nBatches; i++) {
+        input[i] = (NnByte *)&xQ[i * n / Q80_BLOCK_SIZE];
+        output[i] = (NnByte *)&o[i * d];
+    }
+    NnByte *buffers[] = {(NnByte *)indexes};
+    NnMatmulOpConfig config = {nExperts, k, 0u};
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = nBatches;
+    context.buffers = buffers;
+    context.opConfig = &config;
+    context.input = input.data();
+    context.inputSize = size3D(F_Q80, k, nBatches, n);
+    context.output = output.data();
+    context.outputSize = size3D(F_32, k, nBatches, d);
+    context.weight = (NnByte *)wQ.data();
+    context.weightSize = size3D(F_Q40, nExperts, n, d);
+
+    // Threads split the output columns, so running them one by one gives the same result
+    const NnUint nThreads = 3;
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        matmulForward_Q80_Q40_F32(nThreads, threadIndex, nBatches, &context);
+    compare_F32("matmul_groupedExperts", o.data(), expected.data(), o.size(), 0.01f);
+}
+
+void testMatmul_expertCache() {
+    // 3 experts, 1 slot, every forward routes the row to another expert
+    const NnUint nExperts = 3;
+    const NnUint n = 64;
+    const NnUint d = 16;
+    std::vector<float> x(n);
+    std::vector<float> w(nExperts * d * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = (float)((i * 7) % 13) / 13.0f - 0.5f;
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = (float)((i * 5) % 11) / 11.0f - 0.5f;
+
+    std::vector<float> slots(d * n);
+    NnCpuExpertCache cache(nExperts, 1u, d * n * sizeof(float), (NnByte *)slots.data());
+    for (NnUint e = 0; e < nExperts; e++)
+        cache.setSource(e, (const NnByte *)&w[e * d * n]);
+
+    float index;
+    float o[d];
+    float expected[d];
+    NnByte *buffers[] = {(NnByte *)&index};
+    NnByte *input[] = {(NnByte *)x.data()};
+    NnByte *output[] = {(NnByte *)o};
+    NnMatmulOpConfig config = {nExperts, 1u, 0u};
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = 1;
+    context.buffers = buffers;
+    context.opConfig = &config;
+    context.input = input;
+    context.inputSize = size3D(F_32, 1, 1, n);
+    context.output = output;
+    context.outputSize = size3D(F_32, 1, 1, d);
+    context.weight = (NnByte *)slots.data();
+    context.weightSize = size3D(F_32, nExperts, n, d);
+    context.expertCache = &cache;
+
+    const NnUint experts[] = {0, 1, 1, 2, 0};
+    for (NnUint expert : experts) {
+        index = (float)expert;
+        matmulForward_F32_F32_F32(1, 0, 1, &context);
+        matmul_F32_F32_F32(expected, x.data(), &w[expert * d * n], n, d, 1, 0);
+        compare_F32("matmul_expertCache", o, expected, d, 0.00001f);
+    }
+    NnCpuExpertCacheStats stats;
+    memset(&stats, 0, sizeof(stats));
+    cache.addStats(&stats);
+    assert(stats.nHits == 2);
+    assert(stats.nMisses == 3);
+    assert(stats.nPromotions == 3);
+    assert(cache.getWeight(0) == (const NnByte *)slots.data());
+    assert(cache.getWeight(1) == (const NnByte *)&w[d * n]);
+}
+
+void testMatmul_Q80_Q40x4_F32() {
+    const NnUint n = 256;
+    const NnUint d = 24;
+    const NnUint nBatches = 11; // more than MATMUL_X4_MAX_ROWS
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    std::vector<float> x(nBatches * n);
+    std::vector<float> w(d * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = (float)((i * 7) % 13) / 13.0f - 0.5f;
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = (float)((i * 5) % 17) / 17.0f - 0.5f;
+    std::vector<NnBlockQ80> xQ80(nBatches * nBlocks);
+    std::vector<NnBlockQ40> wQ40(d * nBlocks);
+    std::vector<NnBlockQ40x4> wQ40x4(d * nBlocks / Q40_REPACK_ROWS);
+    quantizeF32toQ80(x.data(), xQ80.data(), x.size(), 1, 0);
+    quantizeF32toQ40(w.data(), wQ40.data(), w.size(), 1, 0);
+    repackQ40toQ40x4(wQ40.data(), wQ40x4.data(), d, nBlocks);
+
+    std::vector<float> y(nBatches * d);
+    std::vector<float> expectedY(nBatches * d);
+    std::vector<NnByte *> inputs(nBatches);
+    std::vector<NnByte *> outputs(nBatches);
+    for (NnUint b = 0; b < nBatches; b++) {
+        inputs[b] = (NnByte *)&xQ80[b * nBlocks];
+        outputs[b] = (NnByte *)&y[b * d];
+        matmul_Q80_Q40_F32(&expectedY[b * d], &xQ80[b * nBlocks], wQ40.data(), n, d, 1, 0);
+    }
+    const NnUint nThreads = 4;
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        matmul_Q80_Q40x4_F32(outputs.data(), inputs.data(), nBatches, wQ40x4.data(), n, d, nThreads, threadIndex);
+    compare_F32("matmul_Q80_Q40x4_F32", y.data(), expectedY.data(), nBatches * d, 0.0001f);
+}
+
+// The K-quant kernels against the f32 matmul of the dequantized input and weight
+void testMatmul_kQuants() {
+    const NnUint n = 2 * Q4K_BLOCK_SIZE;
+    const NnUint d = 12;
+    std::vector<float> x(n);
+    std::vector<float> w(d * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = (float)((i * 7) % 13) / 13.0f - 0.5f;
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = (float)((i * 5) % 17) / 17.0f - 0.3f + (float)((i / 32) % 5) * 0.2f;
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<float> xDeq(n);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+    dequantizeQ80toF32(xQ80.data(), xDeq.data(), n, 1, 0);
+
+    std::vector<float> wDeq(d * n);
+    std::vector<float> y(d);
+    std::vector<float> expectedY(d);
+    const NnUint nThreads = 3;
+
+    std::vector<NnBlockQ4K> wQ4K(d * n / Q4K_BLOCK_SIZE);
+    quantizeF32toQ4K(w.data(), wQ4K.data(), w.size(), 1, 0);
+    dequantizeQ4KtoF32(wQ4K.data(), wDeq.data(), w.size(), 1, 0);
+    compare_F32("quantization_Q4K", w.data(), wDeq.data(), w.size(), 0.08f);
+    matmul_F32_F32_F32(expectedY.data(), xDeq.data(), wDeq.data(), n, d, 1, 0);
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        matmul_Q80_Q4K_F32(y.data(), xQ80.data(), wQ4K.data(), n, d, nThreads, threadIndex);
+    compare_F32("matmul_Q80_Q4K_F32", y.data(), expectedY.data(), d, 0.001f);
+
+    std::vector<NnBlockQ6K> wQ6K(d * n / Q6K_BLOCK_SIZE);
+    quantizeF32toQ6K(w.data(), wQ6K.data(), w.size(), 1, 0);
+    dequantizeQ6KtoF32(wQ6K.data(), wDeq.data(), w.size(), 1, 0);
+    compare_F32("quantization_Q6K", w.data(), wDeq.data(), w.size(), 0.025f);
+    matmul_F32_F32_F32(expectedY.data(), xDeq.data(), wDeq.data(), n, d, 1, 0);
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        matmul_Q80_Q6K_F32(y.data(), xQ80.data(), wQ6K.data(), n, d, nThreads, threadIndex);
+    compare_F32("matmul_Q80_Q6K_F32", y.data(), expectedY.data(), d, 0.001f);
+}
+
+// Every dispatched variant against the kernels of the build (no features)
+void testCpuDispatch() {
+    const NnUint n = 288; // an odd number of blocks
+    const NnUint d = 16;
+    const NnUint nBatches = 3;
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    std::vector<float> x(nBatches * n);
+    std::vector<float> w(d * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = (float)((i * 11) % 23) / 23.0f - 0.5f;
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = (float)((i * 5) % 19) / 19.0f - 0.5f;
+    std::vector<NnBlockQ40> wQ40(d * nBlocks);
+    std::vector<NnBlockQ40x4> wQ40x4(d * nBlocks / Q40_REPACK_ROWS);
+    quantizeF32toQ40(w.data(), wQ40.data(), w.size(), 1, 0);
+    repackQ40toQ40x4(wQ40.data(), wQ40x4.data(), d, nBlocks);
+
+    std::vector<NnBlockQ80> xQ80[2];
+    std::vector<float> y[2];
+    std::vector<float> yRepacked[2];
+    const NnUint detected = getDetectedCpuFeatures();
+    for (NnUint mask = detected; ; mask &= mask - 1u) {
+        for (NnUint k = 0; k < 2; k++) {
+            // k = 0: all features of the mask, k = 1: none
+            setCpuFeatureMask(k == 0 ? mask : 0u);
+            xQ80[k].resize(nBatches * nBlocks);
+            y[k].resize(nBatches * d);
+            yRepacked[k].resize(nBatches * d);
+            quantizeF32toQ80(x.data(), xQ80[k].data(), x.size(), 1, 0);
+            std::vector<NnByte *> inputs(nBatches);
+            std::vector<NnByte *> outputs(nBatches);
+            for (NnUint b = 0; b < nBatches; b++) {
+                matmul_Q80_Q40_F32(&y[k][b * d], &xQ80[0][b * nBlocks], wQ40.data(), n, d, 1, 0);
+                inputs[b] = (NnByte *)&xQ80[0][b * nBlocks];
+                outputs[b] = (NnByte *)&yRepacked[k][b * d];
+            }
+            matmul_Q80_Q40x4_F32(outputs.data(), inputs.data(), nBatches, wQ40x4.data(), n, d, 1, 0);
+        }
+        setCpuFeatureMask(~0u);
+        if (std::memcmp(xQ80[0].data(), xQ80[1].data(), xQ80[0].size() * sizeof(NnBlockQ80)) != 0) {
+            printf("❌ quantizeF32toQ80 (%s) failed\n", cpuFeaturesToString(mask).c_str());
+            exit(1);
+        }
+        compare_F32("matmul_Q80_Q40_F32 (dispatch)", y[0].data(), y[1].data(), nBatches * d, 0.0001f);
+        // The same block sums in the same order
+        compare_F32("matmul_Q80_Q40x4_F32 (dispatch)", yRepacked[0].data(), yRepacked[1].data(), nBatches * d, 0.0f);
+        if (mask == 0u)
+            break;
+    }
+}
+
 void testScale() {
     float i[] = {1.0f, 2.0f, 3.0f, 4.0f};
     float o[4];
@@ -344,6 +622,735 @@ void testTopk() {
     printPassed("testTopk");
 }
 
+void testMoeGate_expertParallel() {
+    // 4 experts, this node keeps the experts [2, 4), the top 2 of the row are the experts 1 and 3
+    float probs[] = {0.1f, 0.4f, 0.2f, 0.3f};
+    float scales[2] = {-1.0f, -1.0f};
+    float indexes[2];
+    NnByte *buffers[] = {(NnByte *)indexes};
+    NnByte *input[] = {(NnByte *)probs};
+    NnByte *gateOutput[] = {(NnByte *)&scales[0], (NnByte *)&scales[1]};
+    NnMoeGateOpCodeConfig gateConfig = {2u, 1u, 0u, 1u, 2u, 2u};
+
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = 1;
+    context.buffers = buffers;
+    context.opConfig = &gateConfig;
+    context.input = input;
+    context.inputSize = size2D(F_32, 1u, 4u);
+    context.output = gateOutput;
+    context.outputSize = size3D(F_32, 2u, 1u, 1u);
+    initMoeGateForward(&context);
+    moeGateForward_F32_F32(1, 0, 1, &context);
+
+    assert(indexes[0] == -1.0f);
+    assert(indexes[1] == 1.0f);
+    const float expectedScales[] = {0.0f, 0.3f / 0.7f};
+    compare_F32("moeGate_expertParallel", scales, expectedScales, 2u, 0.00001f);
+
+    // The matmul of a local expert reads its local weight, the remote one leaves a zero row
+    const NnUint n = 8;
+    const NnUint d = 2;
+    std::vector<float> x(2 * n, 1.0f); // (2 active experts, 1 row, n)
+    std::vector<float> w(2 * d * n, 9.0f); // (2 local experts, d, n)
+    for (NnUint i = 0; i < d * n; i++)
+        w[d * n + i] = (float)(i / n + 1);
+    std::vector<float> y(2 * d, 5.0f);
+    NnByte *matmulInput[] = {(NnByte *)&x[0], (NnByte *)&x[n]};
+    NnByte *matmulOutput[] = {(NnByte *)&y[0], (NnByte *)&y[d]};
+    NnMatmulOpConfig matmulConfig = {2u, 2u, 0u};
+    context.opConfig = &matmulConfig;
+    context.input = matmulInput;
+    context.inputSize = size3D(F_32, 2u, 1u, n);
+    context.output = matmulOutput;
+    context.outputSize = size3D(F_32, 2u, 1u, d);
+    context.weight = (NnByte *)w.data();
+    context.weightSize = size3D(F_32, 2u, n, d);
+    matmulForward_F32_F32_F32(1, 0, 1, &context);
+
+    const float expectedY[] = {0.0f, 0.0f, 8.0f, 16.0f};
+    compare_F32("matmul_expertParallel", y.data(), expectedY, 4u, 0.00001f);
+}
+
+void testTopkLogits() {
+    // two rows of a vocab slice starting at 100, the candidates go to slot 1 of the pipe row
+    const NnUint nBatches = 2;
+    const NnUint n = 64;
+    const NnUint k = 3;
+    const NnUint rowSize = 2 * 2 * k;
+    std::vector<float> logits(nBatches * n);
+    for (NnUint i = 0; i < logits.size(); i++)
+        logits[i] = sinf(i * 0.37f);
+    logits[7] = 5.0f;
+    logits[40] = 4.0f;
+    logits[n + 63] = 9.0f;
+    std::vector<float> pipe(nBatches * rowSize, -1.0f);
+
+    NnTopkLogitsOpCodeConfig config{k, 100u, 1u};
+    NnByte *input[] = {(NnByte *)&logits[0], (NnByte *)&logits[n]};
+    NnByte *output[] = {(NnByte *)&pipe[0], (NnByte *)&pipe[rowSize]};
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = nBatches;
+    context.opConfig = &config;
+    context.input = input;
+    context.inputSize = size2D(F_32, nBatches, n);
+    context.output = output;
+    context.outputSize = size2D(F_32, nBatches, rowSize);
+    initTopkLogitsForward(&context);
+    topkLogitsForward_F32_F32(1, 0, nBatches, &context);
+
+    for (NnUint y = 0; y < nBatches; y++) {
+        const float *row = &logits[y * n];
+        std::vector<NnUint> expected(k);
+        topk_F32(row, expected.data(), n, k);
+        const float *values = &pipe[y * rowSize + 2 * k];
+        const float *indexes = &values[k];
+        for (NnUint i = 0; i < k; i++) {
+            assert((NnUint)indexes[i] == 100u + expected[i]);
+            assert(values[i] == row[expected[i]]);
+        }
+        // slot 0 belongs to another node
+        for (NnUint i = 0; i < 2 * k; i++)
+            assert(pipe[y * rowSize + i] == -1.0f);
+    }
+    assert((NnUint)pipe[2 * k + k] == 107u);
+    assert((NnUint)pipe[rowSize + 2 * k + k] == 163u);
+    printPassed("testTopkLogits");
+}
+
+void testShiftAndMultiHeadAtt_rowSlots() {
+    // two rows from different sequences: row 0 is at position 3 of slot 1, row 1 is at position 5 of slot 0
+    const NnUint nBatches = 2;
+    const NnUint nHeads = 2;
+    const NnUint nKvHeads = 1;
+    const NnUint headDim = 8;
+    const NnUint seqLen = 8;
+    const NnUint nKvSlots = 2;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint qDim0 = nHeads * headDim;
+
+    std::vector<float> keyCache(nKvSlots * seqLen * kvDim0);
+    std::vector<float> valueCache(nKvSlots * seqLen * kvDim0);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = sinf(i * 0.37f);
+        valueCache[i] = cosf(i * 0.11f);
+    }
+    std::vector<float> query(nBatches * qDim0);
+    for (NnUint i = 0; i < query.size(); i++)
+        query[i] = sinf(i * 0.73f + 1.0f);
+    std::vector<float> att(nBatches * nHeads * seqLen);
+    std::vector<float> y(nBatches * qDim0);
+    float positions[nBatches] = {3.0f, 5.0f};
+    float slots[nBatches] = {1.0f, 0.0f};
+
+    // shift writes the new key row into the slot of its sequence
+    std::vector<float> kRows(nBatches * kvDim0);
+    for (NnUint i = 0; i < kRows.size(); i++)
+        kRows[i] = 10.0f + i;
+    {
+        NnShiftOpCodeConfig config{0, 1, seqLen};
+        NnByte *pipes[] = {(NnByte *)positions, (NnByte *)slots};
+        NnByte *input[] = {(NnByte *)&kRows[0], (NnByte *)&kRows[kvDim0]};
+        NnByte *output[] = {(NnByte *)keyCache.data()};
+        NnCpuOpContext context;
+        memset(&context, 0, sizeof(context));
+        context.nBatches = nBatches;
+        context.pipes = pipes;
+        context.opConfig = &config;
+        context.input = input;
+        context.inputSize = size2D(F_32, nBatches, kvDim0);
+        context.hasInputContinuousMemory = true;
+        context.output = output;
+        context.outputSize = size2D(F_32, 1, (NnSize)keyCache.size());
+        context.hasOutputContinuousMemory = true;
+        shiftForward_F32_F32(1, 0, nBatches, &context);
+    }
+    for (NnUint b = 0; b < nBatches; b++) {
+        const NnUint row = (NnUint)slots[b] * seqLen + (NnUint)positions[b];
+        for (NnUint i = 0; i < kvDim0; i++)
+            assert(keyCache[row * kvDim0 + i] == kRows[b * kvDim0 + i]);
+    }
+
+    // reference attention, every row reads only its own slot
+    std::vector<float> expectedY(nBatches * qDim0);
+    for (NnUint b = 0; b < nBatches; b++) {
+        const NnUint pos = (NnUint)positions[b];
+        const float *k = &keyCache[(NnUint)slots[b] * seqLen * kvDim0];
+        const float *v = &valueCache[(NnUint)slots[b] * seqLen * kvDim0];
+        for (NnUint h = 0; h < nHeads; h++) {
+            const float *q = &query[b * qDim0 + h * headDim];
+            const NnUint kvHead = h / (nHeads / nKvHeads);
+            float scores[seqLen];
+            float maxScore = -1e10f;
+            for (NnUint p = 0; p <= pos; p++) {
+                float score = 0.0f;
+                for (NnUint i = 0; i < headDim; i++)
+                    score += q[i] * k[p * kvDim0 + kvHead * headDim + i];
+                scores[p] = score / sqrtf((float)headDim);
+                maxScore = std::max(maxScore, scores[p]);
+            }
+            float sum = 0.0f;
+            for (NnUint p = 0; p <= pos; p++) {
+                scores[p] = expf(scores[p] - maxScore);
+                sum += scores[p];
+            }
+            for (NnUint i = 0; i < headDim; i++) {
+                float o = 0.0f;
+                for (NnUint p = 0; p <= pos; p++)
+                    o += scores[p] / sum * v[p * kvDim0 + kvHead * headDim + i];
+                expectedY[b * qDim0 + h * headDim + i] = o;
+            }
+        }
+    }
+
+    NnMultiHeadAttOpConfig config{nHeads, nHeads, nKvHeads, headDim, seqLen, qDim0, kvDim0,
+        0, 0, 1, 2, 3, nKvSlots, 1};
+    NnByte *buffers[] = {(NnByte *)query.data(), (NnByte *)keyCache.data(), (NnByte *)valueCache.data(), (NnByte *)att.data()};
+    NnByte *pipes[] = {(NnByte *)positions, (NnByte *)slots};
+    NnByte *output[] = {(NnByte *)&y[0], (NnByte *)&y[qDim0]};
+    NnCpuOpContext context;
+    memset(&context, 0, sizeof(context));
+    context.nBatches = nBatches;
+    context.buffers = buffers;
+    context.pipes = pipes;
+    context.opConfig = &config;
+    context.output = output;
+    multiHeadAttForward_F32_F32(1, 0, nBatches, &context);
+
+    compare_F32("multiHeadAtt_rowSlots", y.data(), expectedY.data(), nBatches * qDim0, 0.0001f);
+}
+
+void testKvBlockTable() {
+    NnKvBlockTable table(2, 4, 4, 4u);
+    std::vector<NnUint> changes;
+    for (NnUint pos = 0; pos < 6; pos++)
+        table.write(0, pos);
+    table.write(1, 0);
+    assert(table.data()[0] == 0.0f);
+    assert(table.data()[1] == 1.0f);
+    assert(table.data()[4] == 2.0f);
+    assert(table.nFreeBlocks() == 1);
+    table.takeChanges(changes);
+    assert(changes.size() == 6);
+
+    // the sequence of slot 0 is rewound, the released block goes to slot 1
+    table.write(0, 2);
+    table.write(1, 4);
+    assert(table.data()[1] == -1.0f);
+    assert(table.data()[5] == 1.0f);
+    table.takeChanges(changes);
+    assert(changes.size() == 2 && changes[0] == 5 && changes[1] == 1);
+
+    table.release(1);
+    assert(table.nFreeBlocks() == 3);
+
+    // a block shared by a prefix cache survives the release of its slot
+    table.write(0, 4);
+    const NnUint sharedBlock = (NnUint)table.getBlock(0, 0);
+    table.retainBlock(sharedBlock);
+    table.release(0);
+    assert(table.nFreeBlocks() == 3);
+    table.attach(1, 0, sharedBlock);
+    table.write(1, 4);
+    assert(table.refCount(sharedBlock) == 2);
+    table.takeChanges(changes);
+    assert(changes.size() == 6 && changes[2] == 4 && changes[3] == sharedBlock);
+    table.release(1);
+    table.releaseBlock(sharedBlock);
+    assert(table.nFreeBlocks() == 4);
+    printPassed("testKvBlockTable");
+}
+
+// A prefill of positions 0..16 with the logits row rotated to the front of the batch
+void testKvBlockTable_rotatedRows() {
+    const NnUint nRows = 17;
+    NnKvBlockTable table(1, 4, 4, 16u);
+    std::vector<float> positions(nRows);
+    std::vector<float> slots(nRows, 0.0f);
+    for (NnUint i = 0; i < nRows; i++)
+        positions[i] = (float)((i + nRows - 1) % nRows);
+    table.writeRows(slots.data(), positions.data(), nRows);
+
+    std::vector<NnUint> changes;
+    table.takeChanges(changes);
+    assert(table.getBlock(0, 0) >= 0 && table.getBlock(0, 1) >= 0);
+    assert(table.getBlock(0, 0) != table.getBlock(0, 1));
+    assert(table.nFreeBlocks() == 2);
+    assert(changes.size() == 4);
+
+    // The next forward continues the sequence, no block is remapped
+    positions[0] = 17.0f;
+    table.writeRows(slots.data(), positions.data(), 1);
+    table.takeChanges(changes);
+    assert(changes.empty());
+    printPassed("testKvBlockTable_rotatedRows");
+}
+
+template <typename T>
+static void multiheadAttAllHeads(float *y, const float *q, float *att, const T *keyCache, const T *valueCache,
+    const NnUint pos, const NnUint nHeads, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
+    const float *blockTable, const NnUint blockSize) {
+    for (NnUint h = 0; h < nHeads; h++)
+        multiheadAtt(y, q, att, keyCache, valueCache, pos + 1, nHeads, nKvHeads, kvDim0, headDim, seqLen,
+            blockTable, blockSize, false, h, 0u, 1u, (std::atomic<NnUint> *)nullptr);
+}
+
+void testMultiHeadAtt_pagedKvCache() {
+    // the same cache as contiguous rows and as shuffled blocks must produce the same output
+    const NnUint nHeads = 2;
+    const NnUint nKvHeads = 2;
+    const NnUint headDim = 8;
+    const NnUint seqLen = 8;
+    const NnUint blockSize = 2;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint qDim0 = nHeads * headDim;
+    const NnUint pos = 6;
+    float blockTable[] = {3.0f, 0.0f, 2.0f, 1.0f};
+
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    std::vector<float> pagedKeyCache(seqLen * kvDim0);
+    std::vector<float> pagedValueCache(seqLen * kvDim0);
+    for (NnUint t = 0; t < seqLen; t++) {
+        const NnUint row = (NnUint)blockTable[t / blockSize] * blockSize + t % blockSize;
+        for (NnUint i = 0; i < kvDim0; i++) {
+            keyCache[t * kvDim0 + i] = sinf(t * 1.3f + i * 0.2f);
+            valueCache[t * kvDim0 + i] = cosf(t * 0.7f + i * 0.5f);
+            pagedKeyCache[row * kvDim0 + i] = keyCache[t * kvDim0 + i];
+            pagedValueCache[row * kvDim0 + i] = valueCache[t * kvDim0 + i];
+        }
+    }
+    std::vector<float> q(qDim0);
+    for (NnUint i = 0; i < qDim0; i++)
+        q[i] = cosf(i * 0.9f);
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> y(qDim0);
+    std::vector<float> pagedY(qDim0);
+
+    multiheadAttAllHeads(y.data(), q.data(), att.data(), keyCache.data(), valueCache.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, nullptr, 0u);
+    multiheadAttAllHeads(pagedY.data(), q.data(), att.data(), pagedKeyCache.data(), pagedValueCache.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, blockTable, blockSize);
+
+    compare_F32("multiHeadAtt_pagedKvCache", pagedY.data(), y.data(), qDim0, 0.00001f);
+}
+
+void testMultiHeadAtt_quantizedKvCache() {
+    const NnUint nHeads = 4;
+    const NnUint nKvHeads = 2;
+    const NnUint headDim = 32;
+    const NnUint seqLen = 16;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint qDim0 = nHeads * headDim;
+    const NnUint pos = 12;
+
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = sinf(i * 0.31f);
+        valueCache[i] = cosf(i * 0.17f);
+    }
+    std::vector<NnFp16> keyCacheF16(keyCache.size());
+    std::vector<NnFp16> valueCacheF16(valueCache.size());
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCacheF16[i] = CONVERT_F32_TO_F16(keyCache[i]);
+        valueCacheF16[i] = CONVERT_F32_TO_F16(valueCache[i]);
+    }
+    std::vector<NnBlockQ80> keyCacheQ80(keyCache.size() / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ80> valueCacheQ80(valueCache.size() / Q80_BLOCK_SIZE);
+    quantizeF32toQ80(keyCache.data(), keyCacheQ80.data(), keyCache.size(), 1, 0);
+    quantizeF32toQ80(valueCache.data(), valueCacheQ80.data(), valueCache.size(), 1, 0);
+
+    std::vector<float> q(qDim0);
+    for (NnUint i = 0; i < qDim0; i++)
+        q[i] = cosf(i * 0.43f);
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> y(qDim0);
+    std::vector<float> yF16(qDim0);
+    std::vector<float> yQ80(qDim0);
+
+    multiheadAttAllHeads(y.data(), q.data(), att.data(), keyCache.data(), valueCache.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, nullptr, 0u);
+    multiheadAttAllHeads(yF16.data(), q.data(), att.data(), keyCacheF16.data(), valueCacheF16.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, nullptr, 0u);
+    multiheadAttAllHeads(yQ80.data(), q.data(), att.data(), keyCacheQ80.data(), valueCacheQ80.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, nullptr, 0u);
+
+    compare_F32("multiHeadAtt_F16KvCache", yF16.data(), y.data(), qDim0, 0.002f);
+    compare_F32("multiHeadAtt_Q80KvCache", yQ80.data(), y.data(), qDim0, 0.03f);
+}
+
+void testMultiHeadAtt_timeChunks() {
+    // the context split into chunks with merged softmax stats must match the single pass
+    const NnUint nHeads = 2;
+    const NnUint nKvHeads = 1;
+    const NnUint headDim = 16;
+    const NnUint seqLen = 256;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint qDim0 = nHeads * headDim;
+    const NnUint pos = 200;
+    const NnUint nChunks = 3;
+
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = sinf(i * 0.13f) * 2.0f;
+        valueCache[i] = cosf(i * 0.29f);
+    }
+    std::vector<float> q(qDim0);
+    for (NnUint i = 0; i < qDim0; i++)
+        q[i] = sinf(i * 0.61f + 0.5f);
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> y(qDim0);
+    std::vector<float> chunkedY(qDim0);
+    std::atomic<NnUint> counters[nHeads];
+    for (NnUint h = 0; h < nHeads; h++)
+        counters[h].store(0);
+
+    multiheadAttAllHeads(y.data(), q.data(), att.data(), keyCache.data(), valueCache.data(), pos,
+        nHeads, nKvHeads, kvDim0, headDim, seqLen, (const float *)nullptr, 0u);
+    // chunks finish in any order, the last one merges
+    const NnUint chunkOrder[nChunks] = {2, 0, 1};
+    for (NnUint h = 0; h < nHeads; h++) {
+        for (NnUint c = 0; c < nChunks; c++) {
+            multiheadAtt(chunkedY.data(), q.data(), att.data(), keyCache.data(), valueCache.data(), pos + 1,
+                nHeads, nKvHeads, kvDim0, headDim, seqLen, nullptr, 0u, false, h, chunkOrder[c], nChunks, &counters[h]);
+        }
+        assert(counters[h].load() == 0);
+    }
+
+    compare_F32("multiHeadAtt_timeChunks", chunkedY.data(), y.data(), qDim0, 0.00001f);
+}
+
+void testShiftAndMultiHeadAtt_seqShards() {
+    // every shard keeps blocks of 2 positions, the merged partials of 2 shards must match the attention over the whole cache
+    const NnUint nBatches = 2;
+    const NnUint nHeads = 2;
+    const NnUint nKvHeads = 1;
+    const NnUint headDim = 8;
+    const NnUint seqLen = 12;
+    const NnUint nShards = 2;
+    const NnUint block = 2;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint qDim0 = nHeads * headDim;
+    const NnUint partialSize = attPartialSize(headDim);
+    const NnUint rowSize = nShards * nHeads * partialSize;
+    const NnUint localSeqLen = getSeqShardRows(seqLen, nShards, 0, block);
+    assert(localSeqLen == 6);
+    assert(getSeqShardRows(7, nShards, 0, block) == 4);
+    assert(getSeqShardRows(7, nShards, 1, block) == 3);
+
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = sinf(i * 0.23f) * 2.0f;
+        valueCache[i] = cosf(i * 0.17f);
+    }
+    std::vector<float> query(nBatches * qDim0);
+    for (NnUint i = 0; i < query.size(); i++)
+        query[i] = sinf(i * 0.41f + 0.3f);
+    float positions[nBatches] = {6.0f, 9.0f};
+
+    std::vector<float> att(nBatches * nHeads * seqLen);
+    std::vector<float> expectedY(nBatches * qDim0);
+    for (NnUint b = 0; b < nBatches; b++)
+        multiheadAttAllHeads(&expectedY[b * qDim0], &query[b * qDim0], att.data(), keyCache.data(), valueCache.data(),
+            (NnUint)positions[b], nHeads, nKvHeads, kvDim0, headDim, seqLen, (const float *)nullptr, 0u);
+
+    std::vector<float> shiftPositions(seqLen);
+    std::vector<NnByte *> shiftInput(seqLen);
+    for (NnUint t = 0; t < seqLen; t++)
+        shiftPositions[t] = (float)t;
+    std::vector<float> pipe(nBatches * rowSize);
+    for (NnUint shardIndex = 0; shardIndex < nShards; shardIndex++) {
+        // the shard stores only its positions, one after another
+        std::vector<float> localKeyCache(localSeqLen * kvDim0);
+        std::vector<float> localValueCache(localSeqLen * kvDim0);
+        NnShiftOpCodeConfig shiftConfig{0, 0, 0, 0, 0, nShards, shardIndex, block};
+        NnByte *shiftPipes[] = {(NnByte *)shiftPositions.data()};
+        for (NnUint c = 0; c < 2; c++) {
+            const std::vector<float> &cache = c == 0 ? keyCache : valueCache;
+            std::vector<float> &localCache = c == 0 ? localKeyCache : localValueCache;
+            for (NnUint t = 0; t < seqLen; t++)
+                shiftInput[t] = (NnByte *)&cache[t * kvDim0];
+            NnByte *output[] = {(NnByte *)localCache.data()};
+            NnCpuOpContext context;
+            memset(&context, 0, sizeof(context));
+            context.nBatches = seqLen;
+            context.pipes = shiftPipes;
+            context.opConfig = &shiftConfig;
+            context.input = shiftInput.data();
+            context.inputSize = size2D(F_32, seqLen, kvDim0);
+            context.hasInputContinuousMemory = true;
+            context.output = output;
+            context.outputSize = size2D(F_32, 1, (NnSize)localCache.size());
+            context.hasOutputContinuousMemory = true;
+            shiftForward_F32_F32(1, 0, seqLen, &context);
+        }
+        const NnUint t = shardIndex * block + nShards * block; // the first row of the second round
+        for (NnUint i = 0; i < kvDim0; i++)
+            assert(localKeyCache[block * kvDim0 + i] == keyCache[t * kvDim0 + i]);
+
+        NnMultiHeadAttOpConfig config{nHeads, nHeads, nKvHeads, headDim, localSeqLen, qDim0, kvDim0,
+            0, 0, 1, 2, 3, 1, 0, 0, 0, F_32, nShards, shardIndex, block};
+        NnByte *buffers[] = {(NnByte *)query.data(), (NnByte *)localKeyCache.data(), (NnByte *)localValueCache.data(), (NnByte *)att.data()};
+        NnByte *pipes[] = {(NnByte *)positions};
+        NnByte *output[] = {(NnByte *)&pipe[shardIndex * nHeads * partialSize], (NnByte *)&pipe[rowSize + shardIndex * nHeads * partialSize]};
+        NnCpuOpContext context;
+        memset(&context, 0, sizeof(context));
+        context.nBatches = nBatches;
+        context.buffers = buffers;
+        context.pipes = pipes;
+        context.opConfig = &config;
+        context.output = output;
+        multiHeadAttForward_F32_F32(1, 0, nBatches, &context);
+    }
+
+    // every node merges its own heads
+    std::vector<float> y(nBatches * qDim0);
+    for (NnUint headStart = 0; headStart < nHeads; headStart++) {
+        NnMergeAttOpCodeConfig config{nHeads, 1, headDim, nShards, headStart};
+        NnByte *input[] = {(NnByte *)&pipe[0], (NnByte *)&pipe[rowSize]};
+        NnByte *output[] = {(NnByte *)&y[headStart * headDim], (NnByte *)&y[qDim0 + headStart * headDim]};
+        NnCpuOpContext context;
+        memset(&context, 0, sizeof(context));
+        context.nBatches = nBatches;
+        context.opConfig = &config;
+        context.input = input;
+        context.inputSize = size2D(F_32, nBatches, rowSize);
+        context.output = output;
+        context.outputSize = size2D(F_32, nBatches, headDim);
+        initMergeAttForward(&context);
+        mergeAttForward_F32_F32(1, 0, nBatches, &context);
+    }
+
+    compare_F32("multiHeadAtt_seqShards", y.data(), expectedY.data(), nBatches * qDim0, 0.0001f);
+}
+
+void testKvEvict(const NnRopeType ropeType, const char *name) {
+    // 2 sinks stay, 5 rows are dropped, the next 7 rows move down and their keys must match keys roped at the new rows
+    const NnUint nKvHeads = 2;
+    const NnUint headDim = 8;
+    const NnUint kvDim0 = nKvHeads * headDim;
+    const NnUint seqLen = 16;
+    const NnUint nSinks = 2;
+    const NnUint nDiscard = 5;
+    const NnUint nRows = 7;
+    const NnUint slot = 1;
+
+    NnRopeSlice slice = sliceRope(ropeType, kvDim0, kvDim0, nKvHeads, 1, seqLen, headDim, 10000.0f, 0);
+    NnRopeOpConfig ropeConfig{ropeType, 0, 0, 0, 1.0f, 1.0f, 1.0f, seqLen, slice};
+    std::vector<float> ropeCache(slice.cacheSize.length);
+    fullfillRopeCache(&ropeConfig, ropeCache.data());
+
+    std::vector<float> keys(2 * seqLen * kvDim0);
+    rand(keys.data(), (NnUint)keys.size(), 11);
+    std::vector<float> keyCache(keys);
+    std::vector<float> expectedKeyCache(keys);
+    for (NnUint t = 0; t < 2 * seqLen; t++) {
+        // only the slot 1 is evicted, rows are written in order, so the moved rows overwrite the dropped ones
+        const NnUint pos = t % seqLen;
+        const bool isMoved = t >= slot * seqLen && pos >= nSinks + nDiscard && pos < nSinks + nDiscard + nRows;
+        const NnUint newPos = isMoved ? pos - nDiscard : pos;
+        float *x = &keyCache[t * kvDim0];
+        float *expectedX = &expectedKeyCache[(t - pos + newPos) * kvDim0];
+        std::memcpy(expectedX, &keys[t * kvDim0], kvDim0 * sizeof(float));
+        if (ropeType == ROPE_FALCON) {
+            ropeFalcon_F32(x, ropeCache.data(), false, pos, &slice, 1, 0);
+            ropeFalcon_F32(expectedX, ropeCache.data(), false, newPos, &slice, 1, 0);
+        } else {
+            ropeLlama_F32(x, ropeCache.data(), false, pos, &slice, 1, 0);
+            ropeLlama_F32(expectedX, ropeCache.data(), false, newPos, &slice, 1, 0);
+        }
+    }
+    std::vector<float> valueCache(2 * seqLen * kvDim0);
+    rand(valueCache.data(), (NnUint)valueCache.size(), 12);
+    std::vector<float> expectedValueCache(valueCache);
+    for (NnUint r = 0; r < nRows; r++)
+        std::memcpy(&expectedValueCache[(slot * seqLen + nSinks + r) * kvDim0], &valueCache[(slot * seqLen + nSinks + nDiscard + r) * kvDim0], kvDim0 * sizeof(float));
+
+    float eviction[] = {(float)slot, (float)nSinks, (float)nDiscard, (float)nRows};
+    NnByte *pipes[] = {(NnByte *)eviction};
+    NnByte *buffers[] = {(NnByte *)ropeCache.data()};
+    for (NnUint isKey = 0; isKey < 2; isKey++) {
+        NnKvEvictOpCodeConfig config{0, kvDim0, seqLen, isKey, ropeType, 0, slice};
+        NnByte *output[] = {(NnByte *)(isKey ? keyCache.data() : valueCache.data())};
+        NnCpuOpContext context;
+        memset(&context, 0, sizeof(context));
+        context.nBatches = 1;
+        context.buffers = buffers;
+        context.pipes = pipes;
+        context.opConfig = &config;
+        context.input = output;
+        context.inputSize = size2D(F_32, 1, (NnSize)keyCache.size());
+        context.output = output;
+        context.outputSize = size2D(F_32, 1, (NnSize)keyCache.size());
+        // the threads run one after another, the rows of a column pair are owned by one thread
+        const NnUint nThreads = 3;
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+            kvEvictForward_F32_F32(nThreads, threadIndex, 1, &context);
+    }
+
+    // the rows after the moved ones are stale and get overwritten by the next tokens
+    const NnUint nValidRows = seqLen + nSinks + nRows;
+    compare_F32(name, keyCache.data(), expectedKeyCache.data(), nValidRows * kvDim0, 0.00001f);
+    for (NnUint i = 0; i < nValidRows * kvDim0; i++)
+        assert(valueCache[i] == expectedValueCache[i]);
+}
+
+void testOpFusion() {
+    const NnUint n = 256;
+    const NnUint nBatches = 2;
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    const NnUint nThreads = 3;
+    std::vector<float> x(nBatches * n);
+    std::vector<float> l(nBatches * n);
+    std::vector<float> w(n);
+    for (NnUint i = 0; i < x.size(); i++) {
+        x[i] = (float)((i * 7) % 13) / 13.0f - 0.5f;
+        l[i] = (float)((i * 5) % 11) / 11.0f - 0.5f;
+    }
+    for (NnUint i = 0; i < n; i++)
+        w[i] = 0.5f + (float)(i % 5) / 5.0f;
+
+    // silu -> mul -> cast
+    {
+        std::vector<float> d(x);
+        std::vector<NnBlockQ80> dq(nBatches * nBlocks);
+        std::vector<float> expectedD(x);
+        std::vector<NnBlockQ80> expectedDq(nBatches * nBlocks);
+        for (NnUint b = 0; b < nBatches; b++) {
+            silu_F32(&expectedD[b * n], n, 1, 0);
+            mul_F32(&expectedD[b * n], &expectedD[b * n], &l[b * n], n, 1, 0);
+            quantizeF32toQ80(&expectedD[b * n], &expectedDq[b * nBlocks], n, 1, 0);
+        }
+
+        NnByte *buffers[] = {(NnByte *)d.data(), (NnByte *)l.data()};
+        NnByte *dRows[] = {(NnByte *)&d[0], (NnByte *)&d[n]};
+        NnByte *dqRows[] = {(NnByte *)&dq[0], (NnByte *)&dq[nBlocks]};
+        NnMulOpCodeConfig mulConfig = {1u};
+        NnCpuOpContext contexts[3];
+        memset(contexts, 0, sizeof(contexts));
+        for (NnUint i = 0; i < 3; i++) {
+            contexts[i].nBatches = nBatches;
+            contexts[i].buffers = buffers;
+            contexts[i].input = dRows;
+            contexts[i].inputSize = size3D(F_32, 1, nBatches, n);
+            contexts[i].output = dRows;
+            contexts[i].outputSize = size3D(F_32, 1, nBatches, n);
+        }
+        contexts[1].opConfig = &mulConfig;
+        contexts[2].output = dqRows;
+        contexts[2].outputSize = size3D(F_Q80, 1, nBatches, n);
+
+        NnOpConfig ops[3];
+        memset(ops, 0, sizeof(ops));
+        ops[0].code = OP_SILU;
+        ops[1].code = OP_MUL;
+        ops[2].code = OP_CAST;
+        ops[2].output.pointerIndex = 2u;
+        const NnOpQuantType quants[] = {F32_F32_F32, F32_F32_F32, F32_F32_Q80};
+
+        NnCpuOpForward fused = nullptr;
+        assert(getCpuOpFusion(ops, quants, contexts, 3, 0, &fused) == 3);
+        assert(getCpuOpFusion(ops, quants, contexts, 2, 0, &fused) == 2);
+        assert(getCpuOpFusion(ops, quants, contexts, 3, 0, &fused) == 3);
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+            fused(nThreads, threadIndex, nBatches, contexts);
+
+        std::vector<float> dequantized(nBatches * n);
+        std::vector<float> expectedDequantized(nBatches * n);
+        dequantizeQ80toF32(dq.data(), dequantized.data(), nBatches * n, 1, 0);
+        dequantizeQ80toF32(expectedDq.data(), expectedDequantized.data(), nBatches * n, 1, 0);
+        compare_F32("opFusion_siluMul", d.data(), expectedD.data(), nBatches * n, 0.00001f);
+        compare_F32("opFusion_siluMulCast", dequantized.data(), expectedDequantized.data(), nBatches * n, 0.00001f);
+    }
+
+    // rms norm -> cast
+    {
+        std::vector<float> y(nBatches * n);
+        std::vector<NnBlockQ80> yq(nBatches * nBlocks);
+        float invRms[nBatches];
+        std::vector<float> expectedY(nBatches * n);
+        std::vector<NnBlockQ80> expectedYq(nBatches * nBlocks);
+        for (NnUint b = 0; b < nBatches; b++) {
+            invRms[b] = invRms_F32(&x[b * n], n, 1e-5f);
+            rmsNorm_F32(&expectedY[b * n], &x[b * n], invRms[b], w.data(), n, 1, 0);
+            quantizeF32toQ80(&expectedY[b * n], &expectedYq[b * nBlocks], n, 1, 0);
+        }
+
+        NnByte *buffers[] = {(NnByte *)invRms};
+        NnBufferConfig bufferConfigs[1];
+        bufferConfigs[0].size = size2D(F_32, nBatches, 1);
+        NnByte *xRows[] = {(NnByte *)&x[0], (NnByte *)&x[n]};
+        NnByte *yRows[] = {(NnByte *)&y[0], (NnByte *)&y[n]};
+        NnByte *yqRows[] = {(NnByte *)&yq[0], (NnByte *)&yq[nBlocks]};
+        NnRmsNormOpConfig normConfig = {0u, 1u};
+        NnCpuOpContext contexts[2];
+        memset(contexts, 0, sizeof(contexts));
+        contexts[0].nBatches = nBatches;
+        contexts[0].buffers = buffers;
+        contexts[0].bufferConfigs = bufferConfigs;
+        contexts[0].opConfig = &normConfig;
+        contexts[0].input = xRows;
+        contexts[0].inputSize = size3D(F_32, 1, nBatches, n);
+        contexts[0].output = yRows;
+        contexts[0].outputSize = size3D(F_32, 1, nBatches, n);
+        contexts[0].weight = (NnByte *)w.data();
+        contexts[0].weightSize = size1D(F_32, n);
+        contexts[1].nBatches = nBatches;
+        contexts[1].input = yRows;
+        contexts[1].inputSize = size3D(F_32, 1, nBatches, n);
+        contexts[1].output = yqRows;
+        contexts[1].outputSize = size3D(F_Q80, 1, nBatches, n);
+
+        NnOpConfig ops[2];
+        memset(ops, 0, sizeof(ops));
+        ops[0].code = OP_RMS_NORM;
+        ops[0].config = (NnByte *)&normConfig;
+        ops[1].code = OP_CAST;
+        const NnOpQuantType quants[] = {F32_F32_F32, F32_F32_Q80};
+
+        NnCpuOpForward fused = nullptr;
+        assert(getCpuOpFusion(ops, quants, contexts, 2, 0, &fused) == 2);
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+            fused(nThreads, threadIndex, nBatches, contexts);
+
+        std::vector<float> dequantized(nBatches * n);
+        std::vector<float> expectedDequantized(nBatches * n);
+        dequantizeQ80toF32(yq.data(), dequantized.data(), nBatches * n, 1, 0);
+        dequantizeQ80toF32(expectedYq.data(), expectedDequantized.data(), nBatches * n, 1, 0);
+        compare_F32("opFusion_rmsNorm", y.data(), expectedY.data(), nBatches * n, 0.00001f);
+        compare_F32("opFusion_rmsNormCast", dequantized.data(), expectedDequantized.data(), nBatches * n, 0.00001f);
+    }
+
+    // independent matmuls, the chained one stays in its own step
+    {
+        NnMatmulOpConfig config = {0u, 0u, 0u};
+        NnCpuOpContext contexts[3];
+        memset(contexts, 0, sizeof(contexts));
+        NnOpConfig ops[3];
+        memset(ops, 0, sizeof(ops));
+        for (NnUint i = 0; i < 3; i++) {
+            ops[i].code = OP_MATMUL;
+            ops[i].config = (NnByte *)&config;
+            ops[i].input.pointerIndex = 0u;
+            ops[i].output.pointerIndex = i + 1u;
+        }
+        ops[2].input.pointerIndex = 2u; // reads the output of the second matmul
+        const NnOpQuantType quants[] = {Q80_Q40_F32, Q80_Q40_F32, Q80_Q40_F32};
+
+        NnCpuOpForward fused = nullptr;
+        assert(getCpuOpFusion(ops, quants, contexts, 3, 0, &fused) == 2);
+        assert(getCpuOpFusion(ops, quants, contexts, 3, 1, &fused) == 1);
+        ops[2].input.pointerIndex = 0u;
+        assert(getCpuOpFusion(ops, quants, contexts, 3, 0, &fused) == 3);
+        printPassed("opFusion_independent");
+    }
+}
+
 int main() {
     initQuants();
 
@@ -362,13 +1369,31 @@ int main() {
     testAdd(2);
     testAdd(1);
     testMergeSum();
+    testMergeAddStreamed();
     testSoftmax();
     testSilu();
     testMatmul_F32_Q40_F32(32);
     testMatmul_F32_Q40_F32(2);
     testMatmul_F32_Q40_F32(1);
     testLlamafileSgemm();
+    testMatmul_groupedExperts();
+    testMatmul_expertCache();
+    testMatmul_Q80_Q40x4_F32();
+    testMatmul_kQuants();
+    testCpuDispatch();
     testScale();
     testTopk();
+    testMoeGate_expertParallel();
+    testTopkLogits();
+    testShiftAndMultiHeadAtt_rowSlots();
+    testKvBlockTable();
+    testKvBlockTable_rotatedRows();
+    testMultiHeadAtt_pagedKvCache();
+    testMultiHeadAtt_quantizedKvCache();
+    testMultiHeadAtt_timeChunks();
+    testShiftAndMultiHeadAtt_seqShards();
+    testKvEvict(ROPE_LLAMA, "kvEvict_llama");
+    testKvEvict(ROPE_FALCON, "kvEvict_falcon");
+    testOpFusion();
     return 0;
 }
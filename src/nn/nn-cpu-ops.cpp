@@ -5,6 +5,13 @@
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
 #elif defined(__AVX2__) || defined(__AVX512F__)
@@ -16,6 +23,12 @@
 
 #define DEBUG_OP_INPUT_OUTPUT false
 
+#define EXPERT_NONE (~0u)
+// The hottest non-resident experts advised to the kernel after every update
+#define EXPERT_CACHE_PREFETCH 2u
+// The router counts are halved and an expert may be advised again after this many updates
+#define EXPERT_CACHE_DECAY_UPDATES 64u
+
 #if DEBUG_OP_INPUT_OUTPUT
     #define DEBUG_VECTOR(context, suffix, v) \
         if (threadIndex == 0) { \
@@ -228,12 +241,78 @@ static void matmul_F32_F32_F32(float *output, const float *x, const float *w, co
 #endif
 }
 
-static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
-    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
-    assert(n % Q40_BLOCK_SIZE == 0);
-    const unsigned int nBlocks = n / Q40_BLOCK_SIZE;
+#if defined(NN_CPU_DISPATCH_X86)
+NN_TARGET_AVX512 static void matmul_Q80_Q40_F32_avx512(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint nBlocks, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i++) {
+        float sum = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ40 *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j];
+            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
 
-#if defined(__ARM_NEON)
+            __m128i w8 = _mm_loadu_si128((const __m128i*)wb->qs);
+            __m128i v_w0 = _mm_and_si128(w8, _mm_set1_epi8(0x0F));
+            __m128i v_w1 = _mm_srli_epi16(w8, 4);
+            v_w1 = _mm_and_si128(v_w1, _mm_set1_epi8(0x0F));
+            
+            v_w0 = _mm_sub_epi8(v_w0, _mm_set1_epi8(8));
+            v_w1 = _mm_sub_epi8(v_w1, _mm_set1_epi8(8));
+
+            __m256i w8_combined = _mm256_set_m128i(v_w1, v_w0);
+            __m512i w16 = _mm512_cvtepi8_epi16(w8_combined);
+
+            __m256i x8 = _mm256_loadu_si256((const __m256i*)xb->qs);
+            __m512i x16 = _mm512_cvtepi8_epi16(x8);
+
+            __m512i products = _mm512_madd_epi16(w16, x16);
+            sum += _mm512_reduce_add_epi32(products) * s;
+        }
+        output[i] = sum;
+    }
+}
+
+NN_TARGET_AVX512_VNNI static inline int sumBlock_avx512vnni(const __m256i p) {
+    const __m128i s = _mm_add_epi32(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+    const __m128i s2 = _mm_add_epi32(s, _mm_unpackhi_epi64(s, s));
+    return _mm_cvtsi128_si32(_mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+// vpdpbusd multiplies unsigned by signed bytes, so the nibbles are not offset: w * x = (q * x) - (8 * x)
+NN_TARGET_AVX512_VNNI static inline __m256i unpackQ40_avx512vnni(const NnBlockQ40 *b) {
+    const __m128i m4b = _mm_set1_epi8(0x0F);
+    const __m128i packed = _mm_loadu_si128((const __m128i *)b->qs);
+    return _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(packed, 4), m4b), _mm_and_si128(packed, m4b));
+}
+
+// Two blocks per iteration, the block sums are exact so the output is the same as the AVX2 kernel
+NN_TARGET_AVX512_VNNI static void matmul_Q80_Q40_F32_avx512vnni(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint nBlocks, const NnUint start, const NnUint end) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i eights = _mm512_set1_epi8(8);
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ40 *wr = &w[i * nBlocks];
+        float sum = 0.0f;
+        NnUint j = 0;
+        for (; j + 1 < nBlocks; j += 2) {
+            const __m512i wq = _mm512_inserti64x4(_mm512_castsi256_si512(unpackQ40_avx512vnni(&wr[j])), unpackQ40_avx512vnni(&wr[j + 1]), 1);
+            const __m512i xq = _mm512_inserti64x4(
+                _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)x[j].qs)),
+                _mm256_loadu_si256((const __m256i *)x[j + 1].qs), 1);
+            const __m512i p = _mm512_sub_epi32(_mm512_dpbusd_epi32(zero, wq, xq), _mm512_dpbusd_epi32(zero, eights, xq));
+            sum += sumBlock_avx512vnni(_mm512_castsi512_si256(p)) * (CONVERT_F16_TO_F32(wr[j].d) * CONVERT_F16_TO_F32(x[j].d));
+            sum += sumBlock_avx512vnni(_mm512_extracti64x4_epi64(p, 1)) * (CONVERT_F16_TO_F32(wr[j + 1].d) * CONVERT_F16_TO_F32(x[j + 1].d));
+        }
+        if (j < nBlocks) {
+            const __m256i xq = _mm256_loadu_si256((const __m256i *)x[j].qs);
+            const __m256i p = _mm256_sub_epi32(
+                _mm256_dpbusd_epi32(_mm256_setzero_si256(), unpackQ40_avx512vnni(&wr[j]), xq),
+                _mm256_dpbusd_epi32(_mm256_setzero_si256(), _mm512_castsi512_si256(eights), xq));
+            sum += sumBlock_avx512vnni(p) * (CONVERT_F16_TO_F32(wr[j].d) * CONVERT_F16_TO_F32(x[j].d));
+        }
+        output[i] = sum;
+    }
+}
+#elif defined(NN_CPU_DISPATCH_ARM)
+NN_TARGET_DOTPROD static void matmul_Q80_Q40_F32_dotprod(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint nBlocks, const NnUint start, const NnUint end) {
     const uint8x16_t m4b = vdupq_n_u8(0x0F);
     const int8x16_t s8b = vdupq_n_s8(0x8);
 
@@ -245,7 +324,6 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
 
         unsigned int j = 0;
         
-#if defined(__ARM_FEATURE_DOTPROD)
         for (; j + 3 < nBlocks; j += 4) {
             __builtin_prefetch(&w[di * nBlocks + j + 4]);
             __builtin_prefetch(&x[j + 4]);
@@ -288,7 +366,62 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
             sumv2 = vmlaq_n_f32(sumv2, vcvtq_f32_s32(p2), CONVERT_F16_TO_F32(w2->d) * CONVERT_F16_TO_F32(x2->d));
             sumv3 = vmlaq_n_f32(sumv3, vcvtq_f32_s32(p3), CONVERT_F16_TO_F32(w3->d) * CONVERT_F16_TO_F32(x3->d));
         }
-#else
+
+        for (; j < nBlocks; j++) {
+            const NnBlockQ40 *wb = &w[di * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j];
+
+            const uint8x16_t wqs = vld1q_u8(wb->qs);
+            const int8x16_t wl = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(wqs, m4b)), s8b);
+            const int8x16_t wh = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(wqs, 4)), s8b);
+
+            const int8x16_t xl = vld1q_s8(xb->qs);
+            const int8x16_t xh = vld1q_s8(xb->qs + 16);
+
+            const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), wl, xl), wh, xh);
+            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+            sumv0 = vmlaq_n_f32(sumv0, vcvtq_f32_s32(p), s);
+        }
+
+        output[di] = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + vaddvq_f32(sumv2) + vaddvq_f32(sumv3);
+    }
+}
+#endif
+
+static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    assert(n % Q40_BLOCK_SIZE == 0);
+    const unsigned int nBlocks = n / Q40_BLOCK_SIZE;
+
+#if defined(NN_CPU_DISPATCH_X86)
+    const NnUint features = getCpuFeatures();
+    if (features & CPU_FEATURE_AVX512_VNNI) {
+        matmul_Q80_Q40_F32_avx512vnni(output, x, w, nBlocks, start, end);
+        return;
+    }
+    if (features & CPU_FEATURE_AVX512) {
+        matmul_Q80_Q40_F32_avx512(output, x, w, nBlocks, start, end);
+        return;
+    }
+#elif defined(NN_CPU_DISPATCH_ARM)
+    if (getCpuFeatures() & CPU_FEATURE_DOTPROD) {
+        matmul_Q80_Q40_F32_dotprod(output, x, w, nBlocks, start, end);
+        return;
+    }
+#endif
+
+#if defined(__ARM_NEON)
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t s8b = vdupq_n_s8(0x8);
+
+    for (unsigned int di = start; di < end; di++) {
+        float32x4_t sumv0 = vmovq_n_f32(0.0f);
+        float32x4_t sumv1 = vmovq_n_f32(0.0f);
+        float32x4_t sumv2 = vmovq_n_f32(0.0f);
+        float32x4_t sumv3 = vmovq_n_f32(0.0f);
+
+        unsigned int j = 0;
+        
         for (; j + 1 < nBlocks; j += 2) {
             const NnBlockQ40 *w0 = &w[di * nBlocks + j];
             const NnBlockQ40 *w1 = &w[di * nBlocks + j + 1];
@@ -326,7 +459,6 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
             sumv0 = vmlaq_n_f32(sumv0, vcvtq_f32_s32(vaddq_s32(pl0, ph0)), CONVERT_F16_TO_F32(w0->d) * CONVERT_F16_TO_F32(x0->d));
             sumv1 = vmlaq_n_f32(sumv1, vcvtq_f32_s32(vaddq_s32(pl1, ph1)), CONVERT_F16_TO_F32(w1->d) * CONVERT_F16_TO_F32(x1->d));
         }
-#endif
 
         for (; j < nBlocks; j++) {
             const NnBlockQ40 *wb = &w[di * nBlocks + j];
@@ -339,9 +471,6 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
             const int8x16_t xl = vld1q_s8(xb->qs);
             const int8x16_t xh = vld1q_s8(xb->qs + 16);
 
-#if defined(__ARM_FEATURE_DOTPROD)
-            const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), wl, xl), wh, xh);
-#else
             const int16x8_t pll = vmull_s8(vget_low_s8(wl), vget_low_s8(xl));
             const int16x8_t plh = vmull_s8(vget_high_s8(wl), vget_high_s8(xl));
             const int16x8_t phl = vmull_s8(vget_low_s8(wh), vget_low_s8(xh));
@@ -350,40 +479,12 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
             const int32x4_t pl = vaddq_s32(vpaddlq_s16(pll), vpaddlq_s16(plh));
             const int32x4_t ph = vaddq_s32(vpaddlq_s16(phl), vpaddlq_s16(phh));
             const int32x4_t p = vaddq_s32(pl, ph);
-#endif
             const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
             sumv0 = vmlaq_n_f32(sumv0, vcvtq_f32_s32(p), s);
         }
 
         output[di] = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + vaddvq_f32(sumv2) + vaddvq_f32(sumv3);
     }
-#elif defined(__AVX512F__)
-    for (NnUint i = start; i < end; i++) {
-        float sum = 0.0f;
-        for (NnUint j = 0; j < nBlocks; j++) {
-            const NnBlockQ40 *wb = &w[i * nBlocks + j];
-            const NnBlockQ80 *xb = &x[j];
-            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
-
-            __m128i w8 = _mm_loadu_si128((const __m128i*)wb->qs);
-            __m128i v_w0 = _mm_and_si128(w8, _mm_set1_epi8(0x0F));
-            __m128i v_w1 = _mm_srli_epi16(w8, 4);
-            v_w1 = _mm_and_si128(v_w1, _mm_set1_epi8(0x0F));
-            
-            v_w0 = _mm_sub_epi8(v_w0, _mm_set1_epi8(8));
-            v_w1 = _mm_sub_epi8(v_w1, _mm_set1_epi8(8));
-
-            __m256i w8_combined = _mm256_set_m128i(v_w1, v_w0);
-            __m512i w16 = _mm512_cvtepi8_epi16(w8_combined);
-
-            __m256i x8 = _mm256_loadu_si256((const __m256i*)xb->qs);
-            __m512i x16 = _mm512_cvtepi8_epi16(x8);
-
-            __m512i products = _mm512_madd_epi16(w16, x16);
-            sum += _mm512_reduce_add_epi32(products) * s;
-        }
-        output[i] = sum;
-    }
 #elif defined(__AVX2__)
     for (NnUint i = start; i < end; i++) {
         float sum = 0.0f;
@@ -448,6 +549,483 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
 #endif
 }
 
+// dx * sum(xq) of every input block, the K-quant kernels take the mins and the offsets from it
+static const float *getQ80BlockSums(const NnBlockQ80 *x, const NnUint nBlocks) {
+    static thread_local std::vector<float> sums;
+    sums.resize(nBlocks);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        int sum = 0;
+        for (NnUint l = 0; l < Q80_BLOCK_SIZE; l++)
+            sum += x[j].qs[l];
+        sums[j] = CONVERT_F16_TO_F32(x[j].d) * sum;
+    }
+    return sums.data();
+}
+
+#if defined(__ARM_NEON)
+static inline int dot16_neon(const int8x16_t a, const int8x16_t b) {
+    const int16x8_t pl = vmull_s8(vget_low_s8(a), vget_low_s8(b));
+    const int16x8_t ph = vmull_s8(vget_high_s8(a), vget_high_s8(b));
+    return vaddvq_s32(vaddq_s32(vpaddlq_s16(pl), vpaddlq_s16(ph)));
+}
+#endif
+
+// One super-block of the weight covers Q4K_BLOCK_SIZE / Q80_BLOCK_SIZE input blocks, one per sub-block
+static void matmul_Q80_Q4K_F32(float *output, const NnBlockQ80 *x, const NnBlockQ4K *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    assert(n % Q4K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    constexpr NnUint nSubBlocks = Q4K_BLOCK_SIZE / Q80_BLOCK_SIZE;
+    const float *xSums = getQ80BlockSums(x, n / Q80_BLOCK_SIZE);
+
+    for (NnUint i = start; i < end; i++) {
+        float sumMins = 0.0f;
+#if defined(__AVX2__)
+        const __m256i m4b = _mm256_set1_epi8(0x0F);
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256 acc = _mm256_setzero_ps();
+#else
+        float sum = 0.0f;
+#endif
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ4K *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j * nSubBlocks];
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            const float wdmin = CONVERT_F16_TO_F32(wb->dmin);
+            std::uint8_t scales[nSubBlocks];
+            float mins = 0.0f;
+            for (NnUint s = 0; s < nSubBlocks; s++) {
+                std::uint8_t min;
+                getScaleMinQ4K(s, wb->scales, &scales[s], &min);
+                mins += min * xSums[j * nSubBlocks + s];
+            }
+            sumMins += wdmin * mins;
+
+            for (NnUint p = 0; p < nSubBlocks / 2; p++) {
+                const NnBlockQ80 *x0 = &xb[p * 2];
+                const NnBlockQ80 *x1 = &xb[p * 2 + 1];
+#if defined(__AVX2__)
+                const __m256i q = _mm256_loadu_si256((const __m256i *)&wb->qs[p * 32]);
+                const __m256i q0 = _mm256_and_si256(q, m4b);
+                const __m256i q1 = _mm256_and_si256(_mm256_srli_epi16(q, 4), m4b);
+                const __m256i p0 = _mm256_madd_epi16(_mm256_maddubs_epi16(q0, _mm256_loadu_si256((const __m256i *)x0->qs)), ones);
+                const __m256i p1 = _mm256_madd_epi16(_mm256_maddubs_epi16(q1, _mm256_loadu_si256((const __m256i *)x1->qs)), ones);
+                acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(p0), _mm256_set1_ps(wd * scales[p * 2] * CONVERT_F16_TO_F32(x0->d)), acc);
+                acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(p1), _mm256_set1_ps(wd * scales[p * 2 + 1] * CONVERT_F16_TO_F32(x1->d)), acc);
+#elif defined(__ARM_NEON)
+                const uint8x16_t m4b = vdupq_n_u8(0x0F);
+                const uint8x16_t qa = vld1q_u8(&wb->qs[p * 32]);
+                const uint8x16_t qb = vld1q_u8(&wb->qs[p * 32 + 16]);
+                const int dot0 =
+                    dot16_neon(vreinterpretq_s8_u8(vandq_u8(qa, m4b)), vld1q_s8(x0->qs)) +
+                    dot16_neon(vreinterpretq_s8_u8(vandq_u8(qb, m4b)), vld1q_s8(x0->qs + 16));
+                const int dot1 =
+                    dot16_neon(vreinterpretq_s8_u8(vshrq_n_u8(qa, 4)), vld1q_s8(x1->qs)) +
+                    dot16_neon(vreinterpretq_s8_u8(vshrq_n_u8(qb, 4)), vld1q_s8(x1->qs + 16));
+                sum += wd * (scales[p * 2] * CONVERT_F16_TO_F32(x0->d) * dot0 + scales[p * 2 + 1] * CONVERT_F16_TO_F32(x1->d) * dot1);
+#else
+                int dot0 = 0;
+                int dot1 = 0;
+                for (NnUint l = 0; l < 32; l++) {
+                    dot0 += (wb->qs[p * 32 + l] & 0x0F) * x0->qs[l];
+                    dot1 += (wb->qs[p * 32 + l] >> 4) * x1->qs[l];
+                }
+                sum += wd * (scales[p * 2] * CONVERT_F16_TO_F32(x0->d) * dot0 + scales[p * 2 + 1] * CONVERT_F16_TO_F32(x1->d) * dot1);
+#endif
+            }
+        }
+#if defined(__AVX2__)
+        output[i] = horizontalSum_avx2(acc) - sumMins;
+#else
+        output[i] = sum - sumMins;
+#endif
+    }
+}
+
+// Every input block is one quarter of a half of the super-block, its two halves have their own scales.
+// The weights are kept as q (0..63) in the dot and the offset 32 is taken from the sums of the input.
+static void matmul_Q80_Q6K_F32(float *output, const NnBlockQ80 *x, const NnBlockQ6K *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    assert(n % Q6K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    constexpr NnUint nXBlocks = Q6K_BLOCK_SIZE / Q80_BLOCK_SIZE;
+#if !defined(__AVX2__)
+    const float *xSums = getQ80BlockSums(x, n / Q80_BLOCK_SIZE);
+#endif
+
+    for (NnUint i = start; i < end; i++) {
+#if defined(__AVX2__)
+        const __m256i m4b = _mm256_set1_epi8(0x0F);
+        const __m256i m2b = _mm256_set1_epi8(0x03);
+        const __m256i offset = _mm256_set1_epi8(32);
+        __m256 acc = _mm256_setzero_ps();
+#else
+        float sum = 0.0f;
+#endif
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ6K *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j * nXBlocks];
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint h = 0; h < 2; h++) {
+                const std::uint8_t *ql = &wb->ql[h * 64];
+                const std::uint8_t *qh = &wb->qh[h * 32];
+                const std::int8_t *scales = &wb->scales[h * 8];
+#if defined(__AVX2__)
+                const __m256i qla = _mm256_loadu_si256((const __m256i *)ql);
+                const __m256i qlb = _mm256_loadu_si256((const __m256i *)(ql + 32));
+                const __m256i qhv = _mm256_loadu_si256((const __m256i *)qh);
+                const __m256i q[4] = {
+                    _mm256_or_si256(_mm256_and_si256(qla, m4b), _mm256_slli_epi16(_mm256_and_si256(qhv, m2b), 4)),
+                    _mm256_or_si256(_mm256_and_si256(qlb, m4b), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qhv, 2), m2b), 4)),
+                    _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(qla, 4), m4b), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qhv, 4), m2b), 4)),
+                    _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(qlb, 4), m4b), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qhv, 6), m2b), 4)),
+                };
+                for (NnUint g = 0; g < 4; g++) {
+                    const NnBlockQ80 *xg = &xb[h * 4 + g];
+                    const __m256i xq = _mm256_loadu_si256((const __m256i *)xg->qs);
+                    const __m256i sc = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_set1_epi16(scales[g * 2])), _mm_set1_epi16(scales[g * 2 + 1]), 1);
+                    const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(q[g], xq), sc);
+                    const __m256i off = _mm256_madd_epi16(_mm256_maddubs_epi16(offset, xq), sc);
+                    acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(dot, off)),
+                        _mm256_set1_ps(wd * CONVERT_F16_TO_F32(xg->d)), acc);
+                }
+#else
+                for (NnUint g = 0; g < 4; g++) {
+                    const NnBlockQ80 *xg = &xb[h * 4 + g];
+                    const std::uint8_t *qlg = &ql[(g % 2) * 32];
+                    const NnUint lShift = (g / 2) * 4;
+                    const NnUint hShift = g * 2;
+    #if defined(__ARM_NEON)
+                    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+                    const uint8x16_t m2b = vdupq_n_u8(0x03);
+                    const int8x16_t hShiftV = vdupq_n_s8(-(int)hShift);
+                    int dots[2];
+                    for (NnUint k = 0; k < 2; k++) {
+                        const uint8x16_t l4 = vandq_u8(lShift ? vshrq_n_u8(vld1q_u8(&qlg[k * 16]), 4) : vld1q_u8(&qlg[k * 16]), m4b);
+                        const uint8x16_t h2 = vandq_u8(vshlq_u8(vld1q_u8(&qh[k * 16]), hShiftV), m2b);
+                        dots[k] = dot16_neon(vreinterpretq_s8_u8(vorrq_u8(l4, vshlq_n_u8(h2, 4))), vld1q_s8(xg->qs + k * 16));
+                    }
+    #else
+                    int dots[2] = {0, 0};
+                    for (NnUint l = 0; l < 32; l++) {
+                        const int q = ((qlg[l] >> lShift) & 0xF) | (((qh[l] >> hShift) & 3) << 4);
+                        dots[l / 16] += q * xg->qs[l];
+                    }
+    #endif
+                    const float dx = CONVERT_F16_TO_F32(xg->d);
+                    sum += wd * (dx * (scales[g * 2] * dots[0] + scales[g * 2 + 1] * dots[1]));
+                }
+#endif
+            }
+#if !defined(__AVX2__)
+            // The offset 32 of the weights, the sums of the input halves are split by the scales
+            for (NnUint b = 0; b < nXBlocks; b++) {
+                const NnBlockQ80 *xg = &xb[b];
+                int half0 = 0;
+                for (NnUint l = 0; l < 16; l++)
+                    half0 += xg->qs[l];
+                const float dx = CONVERT_F16_TO_F32(xg->d);
+                const std::int8_t *scales = &wb->scales[b * 2];
+                sum -= 32.0f * wd * (scales[0] * dx * half0 + scales[1] * (xSums[j * nXBlocks + b] - dx * half0));
+            }
+#endif
+        }
+#if defined(__AVX2__)
+        output[i] = horizontalSum_avx2(acc);
+#else
+        output[i] = sum;
+#endif
+    }
+}
+
+// Input rows against the repacked weight (NnBlockQ40x4): the threads split the groups of rows,
+// a group is unpacked once per block and shared by up to MATMUL_X4_MAX_ROWS input rows
+#define MATMUL_X4_MAX_ROWS 8u
+
+// y[b] are the Q40_REPACK_ROWS outputs of the group for the input row x[b]
+typedef void (*NnMatmulGroupKernel)(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks);
+
+#if defined(__AVX2__)
+static void matmulGroup_Q80_Q40x4_avx2(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    const __m128i m4b = _mm_set1_epi8(0x0F);
+    const __m256i s8b = _mm256_set1_epi8(8);
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m128 sums[MATMUL_X4_MAX_ROWS];
+    for (NnUint b = 0; b < nRows; b++)
+        sums[b] = _mm_setzero_ps();
+
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        __m256i ws[Q40_REPACK_ROWS];
+        __m256i wa[Q40_REPACK_ROWS];
+        for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+            const __m128i packed = _mm_loadu_si128((const __m128i *)wb->qs[r]);
+            const __m128i lo = _mm_and_si128(packed, m4b);
+            const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), m4b);
+            ws[r] = _mm256_sub_epi8(_mm256_set_m128i(hi, lo), s8b);
+            wa[r] = _mm256_abs_epi8(ws[r]);
+        }
+        const __m128 wd = _mm_set_ps(
+            CONVERT_F16_TO_F32(wb->d[3]), CONVERT_F16_TO_F32(wb->d[2]),
+            CONVERT_F16_TO_F32(wb->d[1]), CONVERT_F16_TO_F32(wb->d[0]));
+
+        for (NnUint b = 0; b < nRows; b++) {
+            const NnBlockQ80 *xb = &x[b][j];
+            const __m256i xv = _mm256_loadu_si256((const __m256i *)xb->qs);
+            // |w| * (x with the sign of w) = w * x, the unsigned operand of maddubs must be |w|
+            __m256i p[Q40_REPACK_ROWS];
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++)
+                p[r] = _mm256_madd_epi16(_mm256_maddubs_epi16(wa[r], _mm256_sign_epi8(xv, ws[r])), ones);
+            const __m256i h = _mm256_hadd_epi32(_mm256_hadd_epi32(p[0], p[1]), _mm256_hadd_epi32(p[2], p[3]));
+            const __m128i blockSums = _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+            const __m128 s = _mm_mul_ps(wd, _mm_set1_ps(CONVERT_F16_TO_F32(xb->d)));
+            sums[b] = _mm_add_ps(sums[b], _mm_mul_ps(_mm_cvtepi32_ps(blockSums), s));
+        }
+    }
+    for (NnUint b = 0; b < nRows; b++)
+        _mm_storeu_ps(y[b], sums[b]);
+}
+#endif
+
+#if defined(NN_CPU_DISPATCH_X86)
+// The same block sums as the AVX2 kernel, vpdpbusd starts from -8 * x so the nibbles are not offset
+NN_TARGET_AVX512_VNNI static void matmulGroup_Q80_Q40x4_avx512vnni(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    const __m128i m4b = _mm_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i eights = _mm256_set1_epi8(8);
+    __m128 sums[MATMUL_X4_MAX_ROWS];
+    for (NnUint b = 0; b < nRows; b++)
+        sums[b] = _mm_setzero_ps();
+
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        __m256i wq[Q40_REPACK_ROWS];
+        for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+            const __m128i packed = _mm_loadu_si128((const __m128i *)wb->qs[r]);
+            wq[r] = _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(packed, 4), m4b), _mm_and_si128(packed, m4b));
+        }
+        const __m128 wd = _mm_set_ps(
+            CONVERT_F16_TO_F32(wb->d[3]), CONVERT_F16_TO_F32(wb->d[2]),
+            CONVERT_F16_TO_F32(wb->d[1]), CONVERT_F16_TO_F32(wb->d[0]));
+
+        for (NnUint b = 0; b < nRows; b++) {
+            const NnBlockQ80 *xb = &x[b][j];
+            const __m256i xv = _mm256_loadu_si256((const __m256i *)xb->qs);
+            const __m256i offset = _mm256_sub_epi32(zero, _mm256_dpbusd_epi32(zero, eights, xv));
+            __m256i p[Q40_REPACK_ROWS];
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++)
+                p[r] = _mm256_dpbusd_epi32(offset, wq[r], xv);
+            const __m256i h = _mm256_hadd_epi32(_mm256_hadd_epi32(p[0], p[1]), _mm256_hadd_epi32(p[2], p[3]));
+            const __m128i blockSums = _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+            const __m128 s = _mm_mul_ps(wd, _mm_set1_ps(CONVERT_F16_TO_F32(xb->d)));
+            sums[b] = _mm_add_ps(sums[b], _mm_mul_ps(_mm_cvtepi32_ps(blockSums), s));
+        }
+    }
+    for (NnUint b = 0; b < nRows; b++)
+        _mm_storeu_ps(y[b], sums[b]);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void matmulGroup_Q80_Q40x4_neon(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t s8b = vdupq_n_s8(0x8);
+    float sums[MATMUL_X4_MAX_ROWS][Q40_REPACK_ROWS];
+    std::memset(sums, 0, sizeof(sums));
+
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        int8x16_t wl[Q40_REPACK_ROWS];
+        int8x16_t wh[Q40_REPACK_ROWS];
+        for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+            const uint8x16_t wqs = vld1q_u8(wb->qs[r]);
+            wl[r] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(wqs, m4b)), s8b);
+            wh[r] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(wqs, 4)), s8b);
+        }
+        for (NnUint b = 0; b < nRows; b++) {
+            const NnBlockQ80 *xb = &x[b][j];
+            const float xd = CONVERT_F16_TO_F32(xb->d);
+            const int8x16_t xl = vld1q_s8(xb->qs);
+            const int8x16_t xh = vld1q_s8(xb->qs + 16);
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+                const int16x8_t pll = vmull_s8(vget_low_s8(wl[r]), vget_low_s8(xl));
+                const int16x8_t plh = vmull_s8(vget_high_s8(wl[r]), vget_high_s8(xl));
+                const int16x8_t phl = vmull_s8(vget_low_s8(wh[r]), vget_low_s8(xh));
+                const int16x8_t phh = vmull_s8(vget_high_s8(wh[r]), vget_high_s8(xh));
+                const int32x4_t p = vaddq_s32(
+                    vaddq_s32(vpaddlq_s16(pll), vpaddlq_s16(plh)),
+                    vaddq_s32(vpaddlq_s16(phl), vpaddlq_s16(phh)));
+                sums[b][r] += vaddvq_s32(p) * (CONVERT_F16_TO_F32(wb->d[r]) * xd);
+            }
+        }
+    }
+    for (NnUint b = 0; b < nRows; b++)
+        std::memcpy(y[b], sums[b], sizeof(sums[b]));
+}
+#endif
+
+#if defined(NN_CPU_DISPATCH_ARM)
+NN_TARGET_DOTPROD static void matmulGroup_Q80_Q40x4_dotprod(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t s8b = vdupq_n_s8(0x8);
+    float sums[MATMUL_X4_MAX_ROWS][Q40_REPACK_ROWS];
+    std::memset(sums, 0, sizeof(sums));
+
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        int8x16_t wl[Q40_REPACK_ROWS];
+        int8x16_t wh[Q40_REPACK_ROWS];
+        for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+            const uint8x16_t wqs = vld1q_u8(wb->qs[r]);
+            wl[r] = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(wqs, m4b)), s8b);
+            wh[r] = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(wqs, 4)), s8b);
+        }
+        for (NnUint b = 0; b < nRows; b++) {
+            const NnBlockQ80 *xb = &x[b][j];
+            const float xd = CONVERT_F16_TO_F32(xb->d);
+            const int8x16_t xl = vld1q_s8(xb->qs);
+            const int8x16_t xh = vld1q_s8(xb->qs + 16);
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+                const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), wl[r], xl), wh[r], xh);
+                sums[b][r] += vaddvq_s32(p) * (CONVERT_F16_TO_F32(wb->d[r]) * xd);
+            }
+        }
+    }
+    for (NnUint b = 0; b < nRows; b++)
+        std::memcpy(y[b], sums[b], sizeof(sums[b]));
+}
+
+// smmla multiplies 2x8 by 8x2 bytes: two rows of the group against two input rows per instruction.
+// The block sums are the same as the dotprod kernel, an odd last input row is left to it
+NN_TARGET_I8MM static void matmulGroup_Q80_Q40x4_i8mm(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t s8b = vdupq_n_s8(0x8);
+    const NnUint nPairs = nRows / 2;
+    float sums[MATMUL_X4_MAX_ROWS][Q40_REPACK_ROWS];
+    std::memset(sums, 0, sizeof(sums));
+
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        // [rp][k]: the values 8k..8k+7 of the rows 2rp and 2rp+1
+        int8x16_t wm[Q40_REPACK_ROWS / 2][4];
+        for (NnUint rp = 0; rp < Q40_REPACK_ROWS / 2; rp++) {
+            const uint8x16_t q0 = vld1q_u8(wb->qs[2 * rp]);
+            const uint8x16_t q1 = vld1q_u8(wb->qs[2 * rp + 1]);
+            const int64x2_t l0 = vreinterpretq_s64_s8(vsubq_s8(vreinterpretq_s8_u8(vandq_u8(q0, m4b)), s8b));
+            const int64x2_t h0 = vreinterpretq_s64_s8(vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q0, 4)), s8b));
+            const int64x2_t l1 = vreinterpretq_s64_s8(vsubq_s8(vreinterpretq_s8_u8(vandq_u8(q1, m4b)), s8b));
+            const int64x2_t h1 = vreinterpretq_s64_s8(vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(q1, 4)), s8b));
+            wm[rp][0] = vreinterpretq_s8_s64(vzip1q_s64(l0, l1));
+            wm[rp][1] = vreinterpretq_s8_s64(vzip2q_s64(l0, l1));
+            wm[rp][2] = vreinterpretq_s8_s64(vzip1q_s64(h0, h1));
+            wm[rp][3] = vreinterpretq_s8_s64(vzip2q_s64(h0, h1));
+        }
+        float wd[Q40_REPACK_ROWS];
+        for (NnUint r = 0; r < Q40_REPACK_ROWS; r++)
+            wd[r] = CONVERT_F16_TO_F32(wb->d[r]);
+
+        for (NnUint bp = 0; bp < nPairs; bp++) {
+            const NnBlockQ80 *x0 = &x[2 * bp][j];
+            const NnBlockQ80 *x1 = &x[2 * bp + 1][j];
+            const int64x2_t x0l = vreinterpretq_s64_s8(vld1q_s8(x0->qs));
+            const int64x2_t x0h = vreinterpretq_s64_s8(vld1q_s8(x0->qs + 16));
+            const int64x2_t x1l = vreinterpretq_s64_s8(vld1q_s8(x1->qs));
+            const int64x2_t x1h = vreinterpretq_s64_s8(vld1q_s8(x1->qs + 16));
+            const int8x16_t xm[4] = {
+                vreinterpretq_s8_s64(vzip1q_s64(x0l, x1l)),
+                vreinterpretq_s8_s64(vzip2q_s64(x0l, x1l)),
+                vreinterpretq_s8_s64(vzip1q_s64(x0h, x1h)),
+                vreinterpretq_s8_s64(vzip2q_s64(x0h, x1h)),
+            };
+            const float xd0 = CONVERT_F16_TO_F32(x0->d);
+            const float xd1 = CONVERT_F16_TO_F32(x1->d);
+            for (NnUint rp = 0; rp < Q40_REPACK_ROWS / 2; rp++) {
+                int32x4_t p = vdupq_n_s32(0);
+                for (NnUint k = 0; k < 4; k++)
+                    p = vmmlaq_s32(p, wm[rp][k], xm[k]);
+                // [row 2rp x x0, row 2rp x x1, row 2rp+1 x x0, row 2rp+1 x x1]
+                sums[2 * bp][2 * rp] += vgetq_lane_s32(p, 0) * (wd[2 * rp] * xd0);
+                sums[2 * bp + 1][2 * rp] += vgetq_lane_s32(p, 1) * (wd[2 * rp] * xd1);
+                sums[2 * bp][2 * rp + 1] += vgetq_lane_s32(p, 2) * (wd[2 * rp + 1] * xd0);
+                sums[2 * bp + 1][2 * rp + 1] += vgetq_lane_s32(p, 3) * (wd[2 * rp + 1] * xd1);
+            }
+        }
+    }
+    for (NnUint b = 0; b < 2 * nPairs; b++)
+        std::memcpy(y[b], sums[b], sizeof(sums[b]));
+    if (nRows % 2 != 0)
+        matmulGroup_Q80_Q40x4_dotprod(&y[nRows - 1], &x[nRows - 1], 1u, wg, nBlocks);
+}
+#endif
+
+#if !defined(__AVX2__) && !defined(__ARM_NEON)
+static void matmulGroup_Q80_Q40x4_scalar(float **y, const NnBlockQ80 **x, const NnUint nRows, const NnBlockQ40x4 *wg, const NnUint nBlocks) {
+    float sums[MATMUL_X4_MAX_ROWS][Q40_REPACK_ROWS];
+    std::memset(sums, 0, sizeof(sums));
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const NnBlockQ40x4 *wb = &wg[j];
+        for (NnUint b = 0; b < nRows; b++) {
+            const NnBlockQ80 *xb = &x[b][j];
+            const float xd = CONVERT_F16_TO_F32(xb->d);
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+                int blockSum = 0;
+                for (NnUint k = 0; k < Q40_BLOCK_SIZE / 2; k++) {
+                    const int w0 = (wb->qs[r][k] & 0x0F) - 8;
+                    const int w1 = (wb->qs[r][k] >> 4) - 8;
+                    blockSum += w0 * xb->qs[k] + w1 * xb->qs[k + Q80_BLOCK_SIZE / 2];
+                }
+                sums[b][r] += blockSum * (CONVERT_F16_TO_F32(wb->d[r]) * xd);
+            }
+        }
+    }
+    for (NnUint b = 0; b < nRows; b++)
+        std::memcpy(y[b], sums[b], sizeof(sums[b]));
+}
+#endif
+
+static NnMatmulGroupKernel getMatmulGroupKernel() {
+#if defined(NN_CPU_DISPATCH_X86)
+    if (getCpuFeatures() & CPU_FEATURE_AVX512_VNNI)
+        return matmulGroup_Q80_Q40x4_avx512vnni;
+#elif defined(NN_CPU_DISPATCH_ARM)
+    const NnUint features = getCpuFeatures();
+    if (features & CPU_FEATURE_I8MM)
+        return matmulGroup_Q80_Q40x4_i8mm;
+    if (features & CPU_FEATURE_DOTPROD)
+        return matmulGroup_Q80_Q40x4_dotprod;
+#endif
+#if defined(__AVX2__)
+    return matmulGroup_Q80_Q40x4_avx2;
+#elif defined(__ARM_NEON)
+    return matmulGroup_Q80_Q40x4_neon;
+#else
+    return matmulGroup_Q80_Q40x4_scalar;
+#endif
+}
+
+static void matmul_Q80_Q40x4_F32(NnByte **outputs, NnByte **inputs, const NnUint nInputs, const NnBlockQ40x4 *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q40_BLOCK_SIZE == 0);
+    assert(d % Q40_REPACK_ROWS == 0);
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    const NnMatmulGroupKernel kernel = getMatmulGroupKernel();
+    SPLIT_THREADS(start, end, d / Q40_REPACK_ROWS, nThreads, threadIndex);
+
+    for (NnUint g = start; g < end; g++) {
+        const NnBlockQ40x4 *wg = &w[g * nBlocks];
+        for (NnUint i0 = 0; i0 < nInputs; i0 += MATMUL_X4_MAX_ROWS) {
+            const NnUint nRows = std::min(nInputs - i0, MATMUL_X4_MAX_ROWS);
+            const NnBlockQ80 *x[MATMUL_X4_MAX_ROWS];
+            float *y[MATMUL_X4_MAX_ROWS];
+            for (NnUint b = 0; b < nRows; b++) {
+                x[b] = (const NnBlockQ80 *)inputs[i0 + b];
+                y[b] = &((float *)outputs[i0 + b])[g * Q40_REPACK_ROWS];
+            }
+            kernel(y, x, nRows, wg, nBlocks);
+        }
+    }
+}
+
 #define SQRT_2_OVER_PI 0.79788456080286535587989211986876f
 #define GELU_COEF_A 0.044715f
 
@@ -719,71 +1297,363 @@ void softmax_F32(float *x, const NnUint size) {
 #endif
 }
 
-static float dotProduct_F32(const float *a, const float *b, const unsigned int size) {
+static float dotProduct_F32(const float *a, const float *b, const unsigned int size) {
+#if defined(__ARM_NEON)
+    assert(size % 4 == 0);
+    float32x4_t fa;
+    float32x4_t fb;
+    float32x4_t fs = vmovq_n_f32(0);
+    for (unsigned int i = 0; i < size; i += 4) {
+        fa = vld1q_f32(&a[i]);
+        fb = vld1q_f32(&b[i]);
+        fs = vmlaq_f32(fs, fa, fb);
+    }
+    return vaddvq_f32(fs);
+#elif defined(__AVX2__)
+    assert(size % 8 == 0);
+    __m256 a0, b0;
+    __m256 u = _mm256_set1_ps(0.0f);
+    for (unsigned int i = 0; i < size; i += 8) {
+        a0 = _mm256_loadu_ps(&a[i]);
+        b0 = _mm256_loadu_ps(&b[i]);
+        u = _mm256_fmadd_ps(a0, b0, u);
+    }
+    return horizontalSum_avx2(u);
+#else
+    float sum = 0.0f;
+    for (unsigned int i = 0; i < size; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+#endif
+}
+
+// blockTable = nullptr: rows of the cache are contiguous, otherwise the row of the position t is
+// blockTable[t / blockSize] * blockSize + t % blockSize
+static inline NnSize kvCacheRow(const float *blockTable, const NnUint blockSize, const NnUint t) {
+    if (blockTable == nullptr)
+        return t;
+    return (NnSize)blockTable[t / blockSize] * blockSize + t % blockSize;
+}
+
+// KV cache rows are stored as F32, F16 or Q80. Offsets are in elements, Q80 rows are aligned to blocks.
+
+static inline const float *kvAt(const float *cache, const NnSize offset) { return &cache[offset]; }
+static inline const NnFp16 *kvAt(const NnFp16 *cache, const NnSize offset) { return &cache[offset]; }
+static inline const NnBlockQ80 *kvAt(const NnBlockQ80 *cache, const NnSize offset) { return &cache[offset / Q80_BLOCK_SIZE]; }
+
+static float dotProduct_F32_F16(const float *a, const NnFp16 *b, const NnUint size) {
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    assert(size % 4 == 0);
+    float32x4_t fs = vmovq_n_f32(0);
+    for (NnUint i = 0; i < size; i += 4) {
+        const float32x4_t fb = vcvt_f32_f16(vld1_f16((const float16_t *)&b[i]));
+        fs = vmlaq_f32(fs, vld1q_f32(&a[i]), fb);
+    }
+    return vaddvq_f32(fs);
+#elif defined(__AVX2__) && defined(__F16C__)
+    assert(size % 8 == 0);
+    __m256 u = _mm256_set1_ps(0.0f);
+    for (NnUint i = 0; i < size; i += 8) {
+        const __m256 a0 = _mm256_loadu_ps(&a[i]);
+        const __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&b[i]));
+        u = _mm256_fmadd_ps(a0, b0, u);
+    }
+    return horizontalSum_avx2(u);
+#else
+    float sum = 0.0f;
+    for (NnUint i = 0; i < size; i++)
+        sum += a[i] * CONVERT_F16_TO_F32(b[i]);
+    return sum;
+#endif
+}
+
+static float dotProduct_Q80_Q80(const NnBlockQ80 *a, const NnBlockQ80 *b, const NnUint nBlocks) {
+#if defined(__ARM_NEON)
+    float32x4_t sumv = vmovq_n_f32(0.0f);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const int8x16_t al = vld1q_s8(a[j].qs);
+        const int8x16_t ah = vld1q_s8(a[j].qs + 16);
+        const int8x16_t bl = vld1q_s8(b[j].qs);
+        const int8x16_t bh = vld1q_s8(b[j].qs + 16);
+#if defined(__ARM_FEATURE_DOTPROD)
+        const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), al, bl), ah, bh);
+#else
+        const int16x8_t pll = vmull_s8(vget_low_s8(al), vget_low_s8(bl));
+        const int16x8_t plh = vmull_s8(vget_high_s8(al), vget_high_s8(bl));
+        const int16x8_t phl = vmull_s8(vget_low_s8(ah), vget_low_s8(bh));
+        const int16x8_t phh = vmull_s8(vget_high_s8(ah), vget_high_s8(bh));
+        const int32x4_t p = vaddq_s32(
+            vaddq_s32(vpaddlq_s16(pll), vpaddlq_s16(plh)),
+            vaddq_s32(vpaddlq_s16(phl), vpaddlq_s16(phh)));
+#endif
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), CONVERT_F16_TO_F32(a[j].d) * CONVERT_F16_TO_F32(b[j].d));
+    }
+    return vaddvq_f32(sumv);
+#elif defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256 acc = _mm256_set1_ps(0.0f);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)a[j].qs);
+        const __m256i y = _mm256_loadu_si256((const __m256i *)b[j].qs);
+        // maddubs multiplies unsigned by signed bytes, so the sign of x is moved to y
+        const __m256i p16 = _mm256_maddubs_epi16(_mm256_sign_epi8(x, x), _mm256_sign_epi8(y, x));
+        const __m256i p32 = _mm256_madd_epi16(p16, ones);
+        const __m256 d = _mm256_set1_ps(CONVERT_F16_TO_F32(a[j].d) * CONVERT_F16_TO_F32(b[j].d));
+        acc = _mm256_fmadd_ps(d, _mm256_cvtepi32_ps(p32), acc);
+    }
+    return horizontalSum_avx2(acc);
+#else
+    float sum = 0.0f;
+    for (NnUint j = 0; j < nBlocks; j++) {
+        int p = 0;
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i++)
+            p += (int)a[j].qs[i] * (int)b[j].qs[i];
+        sum += (float)p * CONVERT_F16_TO_F32(a[j].d) * CONVERT_F16_TO_F32(b[j].d);
+    }
+    return sum;
+#endif
+}
+
+// y += a * v
+
+static void addScaled_F32(float *y, const float *v, const float a, const NnUint size) {
+    for (NnUint i = 0; i < size; i++)
+        y[i] += a * v[i];
+}
+
+static void addScaled_F16(float *y, const NnFp16 *v, const float a, const NnUint size) {
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    assert(size % 4 == 0);
+    for (NnUint i = 0; i < size; i += 4) {
+        const float32x4_t fv = vcvt_f32_f16(vld1_f16((const float16_t *)&v[i]));
+        vst1q_f32(&y[i], vmlaq_n_f32(vld1q_f32(&y[i]), fv, a));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    assert(size % 8 == 0);
+    const __m256 a0 = _mm256_set1_ps(a);
+    for (NnUint i = 0; i < size; i += 8) {
+        const __m256 v0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&v[i]));
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(a0, v0, _mm256_loadu_ps(&y[i])));
+    }
+#else
+    for (NnUint i = 0; i < size; i++)
+        y[i] += a * CONVERT_F16_TO_F32(v[i]);
+#endif
+}
+
+static void addScaled_Q80(float *y, const NnBlockQ80 *v, const float a, const NnUint nBlocks) {
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const float s = a * CONVERT_F16_TO_F32(v[j].d);
+        float *yb = &y[j * Q80_BLOCK_SIZE];
+#if defined(__ARM_NEON)
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const int16x8_t q16 = vmovl_s8(vld1_s8(&v[j].qs[i]));
+            const float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16)));
+            const float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16)));
+            vst1q_f32(&yb[i], vmlaq_n_f32(vld1q_f32(&yb[i]), lo, s));
+            vst1q_f32(&yb[i + 4], vmlaq_n_f32(vld1q_f32(&yb[i + 4]), hi, s));
+        }
+#elif defined(__AVX2__)
+        const __m256 s0 = _mm256_set1_ps(s);
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&v[j].qs[i])));
+            _mm256_storeu_ps(&yb[i], _mm256_fmadd_ps(s0, q, _mm256_loadu_ps(&yb[i])));
+        }
+#else
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i++)
+            yb[i] += s * (float)v[j].qs[i];
+#endif
+    }
+}
+
+static inline float kvDot(const float *q, const NnBlockQ80 *qQ80, const float *k, const NnUint headDim) {
+    return dotProduct_F32(q, k, headDim);
+}
+static inline float kvDot(const float *q, const NnBlockQ80 *qQ80, const NnFp16 *k, const NnUint headDim) {
+    return dotProduct_F32_F16(q, k, headDim);
+}
+static inline float kvDot(const float *q, const NnBlockQ80 *qQ80, const NnBlockQ80 *k, const NnUint headDim) {
+    return dotProduct_Q80_Q80(qQ80, k, headDim / Q80_BLOCK_SIZE);
+}
+
+static inline void kvAddScaled(float *y, const float *v, const float a, const NnUint headDim) { addScaled_F32(y, v, a, headDim); }
+static inline void kvAddScaled(float *y, const NnFp16 *v, const float a, const NnUint headDim) { addScaled_F16(y, v, a, headDim); }
+static inline void kvAddScaled(float *y, const NnBlockQ80 *v, const float a, const NnUint headDim) { addScaled_Q80(y, v, a, headDim / Q80_BLOCK_SIZE); }
+
+static inline bool kvNeedsQ80Query(const float *) { return false; }
+static inline bool kvNeedsQ80Query(const NnFp16 *) { return false; }
+static inline bool kvNeedsQ80Query(const NnBlockQ80 *) { return true; }
+
+#define KV_MAX_HEAD_DIM 512
+// Scores of one tile are kept on the stack, the softmax is computed online tile by tile
+#define ATT_TILE_SIZE 64
+
+// x[i] = exp(x[i] - maxVal), returns the sum
+static float expSub_F32(float *x, const NnUint size, const float maxVal) {
+    NnUint i = 0;
+    float sum = 0.0f;
 #if defined(__ARM_NEON)
-    assert(size % 4 == 0);
-    float32x4_t fa;
-    float32x4_t fb;
-    float32x4_t fs = vmovq_n_f32(0);
-    for (unsigned int i = 0; i < size; i += 4) {
-        fa = vld1q_f32(&a[i]);
-        fb = vld1q_f32(&b[i]);
-        fs = vmlaq_f32(fs, fa, fb);
+    const float32x4_t maxVec = vdupq_n_f32(maxVal);
+    float32x4_t sumVec = vdupq_n_f32(0.0f);
+    for (; i + 4 <= size; i += 4) {
+        const float32x4_t e = expf_neon(vsubq_f32(vld1q_f32(&x[i]), maxVec));
+        vst1q_f32(&x[i], e);
+        sumVec = vaddq_f32(sumVec, e);
     }
-    return vaddvq_f32(fs);
+    sum = vaddvq_f32(sumVec);
 #elif defined(__AVX2__)
-    assert(size % 8 == 0);
-    __m256 a0, b0;
-    __m256 u = _mm256_set1_ps(0.0f);
-    for (unsigned int i = 0; i < size; i += 8) {
-        a0 = _mm256_loadu_ps(&a[i]);
-        b0 = _mm256_loadu_ps(&b[i]);
-        u = _mm256_fmadd_ps(a0, b0, u);
-    }
-    return horizontalSum_avx2(u);
-#else
-    float sum = 0.0f;
-    for (unsigned int i = 0; i < size; i++) {
-        sum += a[i] * b[i];
+    const __m256 maxVec = _mm256_set1_ps(maxVal);
+    __m256 sumVec = _mm256_setzero_ps();
+    for (; i + 8 <= size; i += 8) {
+        const __m256 e = expf_avx2(_mm256_sub_ps(_mm256_loadu_ps(&x[i]), maxVec));
+        _mm256_storeu_ps(&x[i], e);
+        sumVec = _mm256_add_ps(sumVec, e);
+    }
+    sum = horizontalSum_avx2(sumVec);
+#endif
+    for (; i < size; i++) {
+        x[i] = expf(x[i] - maxVal);
+        sum += x[i];
     }
     return sum;
-#endif
 }
 
-static void multiheadAtt_F32(
-    float *y, const float *q, float *att, float *keyCache, float *valueCache,
-    const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
-    const NnUint nThreads, const NnUint threadIndex) 
+// Online softmax over the positions [t0, t1) of one head. The output is not normalized:
+// o = sum(exp(s - m) * v), l = sum(exp(s - m)), m = max(s)
+template <typename T>
+static void attendRange(
+    float *o, float *m, float *l,
+    const float *hQ, const NnBlockQ80 *hQQ80, const T *keyCache, const T *valueCache,
+    const NnSize headOffset, const NnUint kvDim0, const NnUint headDim, const float scale,
+    const NnUint t0, const NnUint t1, const float *blockTable, const NnUint blockSize)
 {
-    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
-    const NnUint kvMul = nHeads / nKvHeads;
-    const float headDimRoot = sqrtf(headDim);
-
-    for (NnUint h0 = h0Start; h0 < h0End; h0++) {
-        const float *hQ = &q[h0 * headDim];
-        const NnUint headIndex = h0 / kvMul;
-        const float *hKc = &keyCache[headIndex * headDim];
-        const float *hVc = &valueCache[headIndex * headDim];
-        float *hAtt = &att[h0 * seqLen];
-
-        for (NnUint t = 0; t <= pos; t++) {
-            const float *posK = &hKc[t * kvDim0];
-            const float score = dotProduct_F32(hQ, posK, headDim) / headDimRoot;
-            hAtt[t] = score;
+    float scores[ATT_TILE_SIZE];
+    float maxScore = -INFINITY;
+    float sum = 0.0f;
+    std::memset(o, 0, headDim * sizeof(float));
+
+    NnUint t = t0;
+    while (t < t1) {
+        // a tile never crosses a block of the paged cache, so its rows are contiguous
+        NnUint tileEnd = std::min(t + ATT_TILE_SIZE, t1);
+        if (blockTable != nullptr)
+            tileEnd = std::min(tileEnd, (t / blockSize + 1) * blockSize);
+        const NnUint tileSize = tileEnd - t;
+        const NnSize row0 = kvCacheRow(blockTable, blockSize, t);
+
+        float tileMax = -INFINITY;
+        for (NnUint i = 0; i < tileSize; i++) {
+            const T *posK = kvAt(keyCache, (row0 + i) * kvDim0 + headOffset);
+            scores[i] = kvDot(hQ, hQQ80, posK, headDim) * scale;
+            tileMax = std::max(tileMax, scores[i]);
+        }
+        if (tileMax > maxScore) {
+            const float c = expf(maxScore - tileMax);
+            for (NnUint i = 0; i < headDim; i++)
+                o[i] *= c;
+            sum *= c;
+            maxScore = tileMax;
+        }
+        sum += expSub_F32(scores, tileSize, maxScore);
+        for (NnUint i = 0; i < tileSize; i++) {
+            const T *posV = kvAt(valueCache, (row0 + i) * kvDim0 + headOffset);
+            kvAddScaled(o, posV, scores[i], headDim);
         }
+        t = tileEnd;
+    }
+    *m = maxScore;
+    *l = sum;
+}
+
+// Partial results of chunks are stored in the att buffer of the head: [m, l, o[headDim]] per chunk
+static inline NnUint attPartialSize(const NnUint headDim) {
+    return headDim + 2;
+}
 
-        softmax_F32(hAtt, pos + 1);
+// Merges the partials [m, l, o] placed every stride floats into one partial, not normalized
+static void reduceAttPartials(float *o, float *m, float *l, const float *partials, const NnUint nPartials, const NnSize stride, const NnUint headDim) {
+    float maxScore = -INFINITY;
+    for (NnUint c = 0; c < nPartials; c++)
+        maxScore = std::max(maxScore, partials[c * stride]);
+    float sum = 0.0f;
+    std::memset(o, 0, headDim * sizeof(float));
+    for (NnUint c = 0; c < nPartials; c++) {
+        const float *partial = &partials[c * stride];
+        if (partial[1] == 0.0f)
+            continue;
+        const float w = expf(partial[0] - maxScore);
+        sum += partial[1] * w;
+        addScaled_F32(o, &partial[2], w, headDim);
+    }
+    *m = maxScore;
+    *l = sum;
+}
 
-        float *hY = &y[h0 * headDim];
-        std::memset(hY, 0, headDim * sizeof(float));
+static void mergeAttPartials(float *y, const float *partials, const NnUint nPartials, const NnSize stride, const NnUint headDim) {
+    float m, l;
+    reduceAttPartials(y, &m, &l, partials, nPartials, stride, headDim);
+    const float invSum = 1.0f / l;
+    for (NnUint i = 0; i < headDim; i++)
+        y[i] *= invSum;
+}
 
-        for (NnUint t = 0; t <= pos; t++) {
-            const float *posV = &hVc[t * kvDim0];
-            const float posA = hAtt[t];
-            for (int i = 0; i < headDim; i++) {
-                hY[i] += posA * posV[i];
-            }
+// Attention of the head h0 of one row over the positions [0, nPositions) for the time chunk chunkIndex of nChunks.
+// With nChunks > 1 chunks are computed by different threads, the thread that finishes the last chunk of the head
+// merges the partial softmax stats. The counter of the head must be 0 at the start. If isPartial is set, the head
+// writes its partial [m, l, o[headDim]] to y instead of the normalized output.
+template <typename T>
+static void multiheadAtt(
+    float *y, const float *q, float *att, const T *keyCache, const T *valueCache,
+    const NnUint nPositions, const NnUint nHeads, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
+    const float *blockTable, const NnUint blockSize, const bool isPartial,
+    const NnUint h0, const NnUint chunkIndex, const NnUint nChunks, std::atomic<NnUint> *counter)
+{
+    const NnUint kvMul = nHeads / nKvHeads;
+    const NnSize headOffset = (NnSize)(h0 / kvMul) * headDim;
+    const float scale = 1.0f / sqrtf(headDim);
+    const float *hQ = &q[h0 * headDim];
+    float *hY = isPartial ? &y[h0 * attPartialSize(headDim)] : &y[h0 * headDim];
+    // a Q80 cache is multiplied by the quantized query
+    NnBlockQ80 hQQ80[KV_MAX_HEAD_DIM / Q80_BLOCK_SIZE];
+    if (kvNeedsQ80Query(keyCache))
+        quantizeF32toQ80(hQ, hQQ80, headDim, 1u, 0u);
+
+    if (nChunks == 1) {
+        if (isPartial) {
+            attendRange(&hY[2], &hY[0], &hY[1], hQ, hQQ80, keyCache, valueCache, headOffset, kvDim0, headDim, scale,
+                0u, nPositions, blockTable, blockSize);
+            return;
         }
+        float m, l;
+        attendRange(hY, &m, &l, hQ, hQQ80, keyCache, valueCache, headOffset, kvDim0, headDim, scale,
+            0u, nPositions, blockTable, blockSize);
+        const float invSum = 1.0f / l;
+        for (NnUint i = 0; i < headDim; i++)
+            hY[i] *= invSum;
+        return;
+    }
+
+    assert(nChunks * attPartialSize(headDim) <= seqLen);
+    const NnUint chunkSize = std::max((nPositions + nChunks - 1) / nChunks, (NnUint)ATT_TILE_SIZE);
+    const NnUint t0 = std::min(chunkIndex * chunkSize, nPositions);
+    const NnUint t1 = std::min(t0 + chunkSize, nPositions);
+    float *partials = &att[h0 * seqLen];
+    float *partial = &partials[chunkIndex * attPartialSize(headDim)];
+    if (t0 < t1) {
+        attendRange(&partial[2], &partial[0], &partial[1], hQ, hQQ80, keyCache, valueCache, headOffset, kvDim0, headDim, scale,
+            t0, t1, blockTable, blockSize);
+    } else {
+        partial[0] = -INFINITY;
+        partial[1] = 0.0f;
+    }
+
+    if (counter->fetch_add(1, std::memory_order_acq_rel) == nChunks - 1) {
+        if (isPartial)
+            reduceAttPartials(&hY[2], &hY[0], &hY[1], partials, nChunks, attPartialSize(headDim), headDim);
+        else
+            mergeAttPartials(hY, partials, nChunks, attPartialSize(headDim), headDim);
+        counter->store(0, std::memory_order_relaxed);
     }
 }
 
@@ -924,6 +1794,8 @@ static void mergeAddForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint
         float *output = (float *)context->output[batchIndex];
         float *input = (float *)context->input[batchIndex];
         for (NnUint sliceIndex = 0; sliceIndex < nSlices; sliceIndex++) {
+            if (context->inputArrivals != nullptr)
+                context->inputArrivals->wait(batchIndex, sliceIndex);
             float *i = &input[sliceIndex * context->outputSize.x];
             DEBUG_VECTOR(context, "input", i);
             add_F32(
@@ -946,6 +1818,8 @@ static void mergeAddForward_Q80_F32(NnUint nThreads, NnUint threadIndex, NnUint
         float *output = (float *)context->output[batchIndex];
         NnBlockQ80 *input = (NnBlockQ80 *)context->input[batchIndex];
         for (NnUint sliceIndex = 0; sliceIndex < nSlices; sliceIndex++) {
+            if (context->inputArrivals != nullptr)
+                context->inputArrivals->wait(batchIndex, sliceIndex);
             add_Q80_F32(
                 output,
                 &input[sliceIndex * xSize],
@@ -1100,6 +1974,140 @@ static void rmsNormForward_Q80_F32_F32(NnUint nThreads, NnUint threadIndex, NnUi
     }
 }
 
+NnCpuExpertCache::NnCpuExpertCache(NnUint nExperts, NnUint nSlots, NnSize expertBytes, NnByte *slots)
+    : nExperts(nExperts), nSlots(nSlots), expertBytes(expertBytes), slots(slots),
+      sources(new const NnByte *[nExperts]), weights(new std::atomic<const NnByte *>[nExperts]),
+      slotExperts(nSlots, EXPERT_NONE), expertSlots(nExperts, EXPERT_NONE),
+      lastUse(nExperts, 0u), routerCounts(nExperts, 0u), lastAdvise(nExperts, 0u), epoch(0u),
+      nHits(0u), nMisses(0u), nPromotions(0u) {
+    assert(nSlots > 0u && nSlots < nExperts);
+    for (NnUint e = 0u; e < nExperts; e++) {
+        sources[e] = nullptr;
+        weights[e].store(nullptr, std::memory_order_relaxed);
+    }
+    batchExperts.reserve(nExperts);
+}
+
+void NnCpuExpertCache::setSource(NnUint expertIndex, const NnByte *source) {
+    assert(expertIndex < nExperts);
+    sources[expertIndex] = source;
+    // The first experts start resident, every slot belongs to one expert so the loader threads don't race
+    if (expertIndex < nSlots) {
+        NnByte *slot = &slots[expertIndex * expertBytes];
+        std::memcpy(slot, source, expertBytes);
+        slotExperts[expertIndex] = expertIndex;
+        expertSlots[expertIndex] = expertIndex;
+        weights[expertIndex].store(slot, std::memory_order_release);
+    } else {
+        weights[expertIndex].store(source, std::memory_order_release);
+    }
+}
+
+NnUint NnCpuExpertCache::findVictimSlot() const {
+    NnUint victim = EXPERT_NONE;
+    NnSize victimUse = 0u;
+    for (NnUint s = 0u; s < nSlots; s++) {
+        const NnUint expert = slotExperts[s];
+        if (expert == EXPERT_NONE)
+            return s;
+        // An expert of the current batch may be read by the other threads
+        if (lastUse[expert] == epoch)
+            continue;
+        if (victim == EXPERT_NONE || lastUse[expert] < victimUse) {
+            victim = s;
+            victimUse = lastUse[expert];
+        }
+    }
+    return victim;
+}
+
+void NnCpuExpertCache::update(const float *activeExpertIndexes, NnUint nIndexes) {
+    epoch++;
+    batchExperts.clear();
+    for (NnUint i = 0u; i < nIndexes; i++) {
+        const float expertIndex = activeExpertIndexes[i];
+        if (expertIndex < 0.0f)
+            continue;
+        const NnUint expert = (NnUint)expertIndex;
+        assert(expert < nExperts);
+        routerCounts[expert]++;
+        if (lastUse[expert] != epoch) {
+            lastUse[expert] = epoch;
+            batchExperts.push_back(expert);
+        }
+    }
+
+    NnSize hits = 0u;
+    NnSize promotions = 0u;
+    for (NnUint expert : batchExperts) {
+        if (expertSlots[expert] != EXPERT_NONE) {
+            hits++;
+            continue;
+        }
+        const NnUint slot = findVictimSlot();
+        if (slot == EXPERT_NONE)
+            continue; // All slots hold experts of this batch, the expert is read from the file
+        const NnUint evicted = slotExperts[slot];
+        if (evicted != EXPERT_NONE) {
+            weights[evicted].store(sources[evicted], std::memory_order_release);
+            expertSlots[evicted] = EXPERT_NONE;
+        }
+        NnByte *slotWeight = &slots[slot * expertBytes];
+        std::memcpy(slotWeight, sources[expert], expertBytes);
+        slotExperts[slot] = expert;
+        expertSlots[expert] = slot;
+        weights[expert].store(slotWeight, std::memory_order_release);
+        promotions++;
+    }
+    nHits += hits;
+    nMisses += (NnSize)batchExperts.size() - hits;
+    nPromotions += promotions;
+
+    if (epoch % EXPERT_CACHE_DECAY_UPDATES == 0u) {
+        for (NnUint e = 0u; e < nExperts; e++)
+            routerCounts[e] /= 2u;
+    }
+    prefetch();
+}
+
+void NnCpuExpertCache::prefetch() {
+#ifndef _WIN32
+    static const std::uintptr_t pageSize = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+    for (NnUint p = 0u; p < EXPERT_CACHE_PREFETCH; p++) {
+        NnUint hottest = EXPERT_NONE;
+        for (NnUint e = 0u; e < nExperts; e++) {
+            if (expertSlots[e] != EXPERT_NONE || routerCounts[e] == 0u)
+                continue;
+            if (lastAdvise[e] != 0u && epoch - lastAdvise[e] < EXPERT_CACHE_DECAY_UPDATES)
+                continue;
+            if (hottest == EXPERT_NONE || routerCounts[e] > routerCounts[hottest])
+                hottest = e;
+        }
+        if (hottest == EXPERT_NONE)
+            break;
+        lastAdvise[hottest] = epoch;
+        const std::uintptr_t start = (std::uintptr_t)sources[hottest] & ~(pageSize - 1);
+        const std::uintptr_t end = (std::uintptr_t)sources[hottest] + expertBytes;
+        // Only a hint, a miss faults the pages in anyway
+        madvise((void *)start, end - start, MADV_WILLNEED);
+    }
+#endif
+}
+
+void NnCpuExpertCache::addStats(NnCpuExpertCacheStats *stats) const {
+    stats->nHits += nHits.load();
+    stats->nMisses += nMisses.load();
+    stats->nPromotions += nPromotions.load();
+    stats->residentBytes += nSlots * expertBytes;
+    stats->pagedBytes += nExperts * expertBytes;
+}
+
+static inline const NnByte *getExpertWeight(const NnCpuOpContext *context, NnUint expertIndex) {
+    if (context->expertCache != nullptr)
+        return context->expertCache->getWeight(expertIndex);
+    return &context->weight[expertIndex * context->weightSize.nBytesXY];
+}
+
 static void initMatmulForward(NnCpuOpContext *context) {
     const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
     ASSERT_EQ(context->inputSize.y, context->nBatches);
@@ -1135,25 +2143,123 @@ static bool matmulForward_llamafile(NnUint nThreads, NnUint threadIndex, NnUint
     );
 }
 
+// MoE: the rows of all tokens routed to one expert go through one sgemm. The output columns are
+// split between the threads like in the row kernels, so every thread gathers its own copy of the
+// rows and the op needs no barrier. rowKernel(output, input, weight) is used if sgemm declines.
+template <typename RowKernel>
+static void matmulForward_grouped(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context, RowKernel rowKernel) {
+    const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
+    const NnUint k = config->nActiveExperts;
+    const float *activeExpertIndexes = (const float *)context->buffers[config->activeExpertIndexesBufferIndex];
+    const NnUint nExperts = context->weightSize.z;
+    const NnUint d = context->weightSize.x;
+    const NnUint nBlocks = context->weightSize.y / getBlockSize(context->inputSize.floatType);
+    const NnSize inputRowBytes = getBytes(context->inputSize.floatType, context->inputSize.x);
+    const NnSize weightRowBytes = getBytes(context->weightSize.floatType, context->weightSize.y);
+    SPLIT_THREADS(dStart, dEnd, d, nThreads, threadIndex);
+    const NnUint dLen = dEnd - dStart;
+
+    static thread_local std::vector<NnUint> expertStarts; // first entry of an expert in slots
+    static thread_local std::vector<NnUint> slots;        // pointer index e * nBatches + y, grouped by expert
+    static thread_local std::vector<NnByte> rows;
+    static thread_local std::vector<float> tile;
+
+    // Counting sort of the (row, active expert) pairs by the expert
+    expertStarts.assign(nExperts + 1u, 0u);
+    for (NnUint i = 0u; i < batchSize * k; i++) {
+        const float expertIndex = activeExpertIndexes[i];
+        if (expertIndex >= 0.0f)
+            expertStarts[(NnUint)expertIndex + 1u]++;
+    }
+    for (NnUint e = 0u; e < nExperts; e++)
+        expertStarts[e + 1u] += expertStarts[e];
+    slots.resize(batchSize * k);
+    for (NnUint y = 0u; y < batchSize; y++) {
+        for (NnUint e = 0u; e < k; e++) {
+            const float expertIndex = activeExpertIndexes[y * k + e];
+            const NnUint slot = e * context->outputSize.y + y;
+            if (expertIndex < 0.0f) {
+                // The expert is on another node (expert parallelism)
+                std::memset(&((float *)context->output[slot])[dStart], 0, dLen * sizeof(float));
+                continue;
+            }
+            slots[expertStarts[(NnUint)expertIndex]++] = slot;
+        }
+    }
+    // The fill moved every start to the end of its group
+    for (NnUint e = nExperts; e > 0u; e--)
+        expertStarts[e] = expertStarts[e - 1u];
+    expertStarts[0] = 0u;
+
+    if (dLen == 0u)
+        return;
+    for (NnUint expert = 0u; expert < nExperts; expert++) {
+        const NnUint first = expertStarts[expert];
+        const NnUint nRows = expertStarts[expert + 1u] - first;
+        if (nRows == 0u)
+            continue;
+        const NnByte *weight = getExpertWeight(context, expert);
+
+        rows.resize(nRows * inputRowBytes);
+        for (NnUint r = 0u; r < nRows; r++)
+            std::memcpy(&rows[r * inputRowBytes], context->input[slots[first + r]], inputRowBytes);
+        tile.resize(dLen * nRows);
+        if (llamafile_sgemm(
+            dLen, nRows, nBlocks,
+            &weight[dStart * weightRowBytes], nBlocks,
+            rows.data(), nBlocks,
+            tile.data(), dLen,
+            0, 1, 0,
+            context->weightSize.floatType,
+            context->inputSize.floatType,
+            F_32
+        )) {
+            for (NnUint r = 0u; r < nRows; r++)
+                std::memcpy(&((float *)context->output[slots[first + r]])[dStart], &tile[r * dLen], dLen * sizeof(float));
+        } else {
+            for (NnUint r = 0u; r < nRows; r++) {
+                const NnUint slot = slots[first + r];
+                rowKernel((float *)context->output[slot], context->input[slot], weight);
+            }
+        }
+    }
+}
+
 static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
         return;
 
     const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
+    if (context->expertCache != nullptr && threadIndex == 0u)
+        context->expertCache->update((const float *)context->buffers[config->activeExpertIndexesBufferIndex], batchSize * config->nActiveExperts);
+    if (config->nActiveExperts > 0u && batchSize > 1u) {
+        matmulForward_grouped(nThreads, threadIndex, batchSize, context, [&](float *output, const NnByte *input, const NnByte *weight) {
+            matmul_F32_F32_F32(output, (const float *)input, (const float *)weight,
+                context->weightSize.y, context->weightSize.x, nThreads, threadIndex);
+        });
+        return;
+    }
     const NnUint nActiveExpertsOr1 = std::max(config->nActiveExperts, 1u);
     const float *activeExpertIndexes = (const float *)context->buffers[config->activeExpertIndexesBufferIndex];
 
     for (NnUint y = 0; y < batchSize; y++) {
         for (NnUint e = 0; e < nActiveExpertsOr1; e++) {
-            const NnUint activeExpertIndex = config->nActiveExperts == 0u
-                ? 0u
-                : (NnUint)activeExpertIndexes[y * config->nActiveExperts + e];
+            const float expertIndex = config->nActiveExperts == 0u
+                ? 0.0f
+                : activeExpertIndexes[y * config->nActiveExperts + e];
 
             float *output = (float *)context->output[e * context->outputSize.y + y];
+            if (expertIndex < 0.0f) {
+                // The expert is on another node (expert parallelism)
+                if (threadIndex == 0u)
+                    std::memset(output, 0, context->outputSize.x * sizeof(float));
+                continue;
+            }
+            const NnUint activeExpertIndex = (NnUint)expertIndex;
             matmul_F32_F32_F32(
                 output,
                 (float *)context->input[e * context->inputSize.y + y],
-                (float *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY],
+                (const float *)getExpertWeight(context, activeExpertIndex),
                 context->weightSize.y,
                 context->weightSize.x,
                 nThreads,
@@ -1164,24 +2270,88 @@ static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUin
 }
 
 static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    if (context->hasRepackedWeight) {
+        // Only dense matmuls are repacked, sgemm does not know the layout
+        matmul_Q80_Q40x4_F32(context->output, context->input, batchSize, (const NnBlockQ40x4 *)context->weight,
+            context->weightSize.y, context->weightSize.x, nThreads, threadIndex);
+        return;
+    }
     if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
         return;
 
     const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
+    if (context->expertCache != nullptr && threadIndex == 0u)
+        context->expertCache->update((const float *)context->buffers[config->activeExpertIndexesBufferIndex], batchSize * config->nActiveExperts);
+    if (config->nActiveExperts > 0u && batchSize > 1u) {
+        matmulForward_grouped(nThreads, threadIndex, batchSize, context, [&](float *output, const NnByte *input, const NnByte *weight) {
+            matmul_Q80_Q40_F32(output, (const NnBlockQ80 *)input, (const NnBlockQ40 *)weight,
+                context->weightSize.y, context->weightSize.x, nThreads, threadIndex);
+        });
+        return;
+    }
     const NnUint nActiveExpertsOr1 = std::max(config->nActiveExperts, 1u);
     const float *activeExpertIndexes = (const float *)context->buffers[config->activeExpertIndexesBufferIndex];
 
     for (NnUint y = 0; y < batchSize; y++) {
         for (NnUint e = 0; e < nActiveExpertsOr1; e++) {
-            const NnUint activeExpertIndex = config->nActiveExperts == 0u
-                ? 0u
-                : (NnUint)activeExpertIndexes[y * config->nActiveExperts + e];
+            const float expertIndex = config->nActiveExperts == 0u
+                ? 0.0f
+                : activeExpertIndexes[y * config->nActiveExperts + e];
 
             float *output = (float *)context->output[e * context->outputSize.y + y];
+            if (expertIndex < 0.0f) {
+                // The expert is on another node (expert parallelism)
+                if (threadIndex == 0u)
+                    std::memset(output, 0, context->outputSize.x * sizeof(float));
+                continue;
+            }
+            const NnUint activeExpertIndex = (NnUint)expertIndex;
             matmul_Q80_Q40_F32(
                 output,
                 (NnBlockQ80 *)context->input[e * context->inputSize.y + y],
-                (NnBlockQ40 *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY],
+                (const NnBlockQ40 *)getExpertWeight(context, activeExpertIndex),
+                context->weightSize.y,
+                context->weightSize.x,
+                nThreads,
+                threadIndex);
+            DEBUG_VECTOR(context, "output", output);
+        }
+    }
+}
+
+// The K-quants have no sgemm and no repacked layout, every row goes through the row kernel
+template <typename WeightBlock, void (*rowKernel)(float *, const NnBlockQ80 *, const WeightBlock *, const NnUint, const NnUint, const NnUint, const NnUint)>
+static void matmulForward_Q80_rows(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
+    if (context->expertCache != nullptr && threadIndex == 0u)
+        context->expertCache->update((const float *)context->buffers[config->activeExpertIndexesBufferIndex], batchSize * config->nActiveExperts);
+    if (config->nActiveExperts > 0u && batchSize > 1u) {
+        matmulForward_grouped(nThreads, threadIndex, batchSize, context, [&](float *output, const NnByte *input, const NnByte *weight) {
+            rowKernel(output, (const NnBlockQ80 *)input, (const WeightBlock *)weight,
+                context->weightSize.y, context->weightSize.x, nThreads, threadIndex);
+        });
+        return;
+    }
+    const NnUint nActiveExpertsOr1 = std::max(config->nActiveExperts, 1u);
+    const float *activeExpertIndexes = (const float *)context->buffers[config->activeExpertIndexesBufferIndex];
+
+    for (NnUint y = 0; y < batchSize; y++) {
+        for (NnUint e = 0; e < nActiveExpertsOr1; e++) {
+            const float expertIndex = config->nActiveExperts == 0u
+                ? 0.0f
+                : activeExpertIndexes[y * config->nActiveExperts + e];
+
+            float *output = (float *)context->output[e * context->outputSize.y + y];
+            if (expertIndex < 0.0f) {
+                // The expert is on another node (expert parallelism)
+                if (threadIndex == 0u)
+                    std::memset(output, 0, context->outputSize.x * sizeof(float));
+                continue;
+            }
+            rowKernel(
+                output,
+                (NnBlockQ80 *)context->input[e * context->inputSize.y + y],
+                (const WeightBlock *)getExpertWeight(context, (NnUint)expertIndex),
                 context->weightSize.y,
                 context->weightSize.x,
                 nThreads,
@@ -1191,6 +2361,14 @@ static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUin
     }
 }
 
+static void matmulForward_Q80_Q4K_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    matmulForward_Q80_rows<NnBlockQ4K, matmul_Q80_Q4K_F32>(nThreads, threadIndex, batchSize, context);
+}
+
+static void matmulForward_Q80_Q6K_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    matmulForward_Q80_rows<NnBlockQ6K, matmul_Q80_Q6K_F32>(nThreads, threadIndex, batchSize, context);
+}
+
 static void siluForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     assert(context->weightSize.nBytes == 0);
     ASSERT_EQ(context->inputSize.x, context->outputSize.x);
@@ -1248,43 +2426,112 @@ static void initMultiHeadAttForward(NnCpuOpContext *context) {
     const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
 
     assert(context->weightSize.nBytes == 0);
-    ASSERT_EQ(context->outputSize.x, config->qSliceD0);
+    if (config->nSeqShards > 1) {
+        ASSERT_EQ(context->outputSize.x, config->nHeads0 * attPartialSize(config->headDim));
+        ASSERT_EQ(config->kvBlockSize, 0);
+        assert(config->seqShardIndex < config->nSeqShards);
+    } else {
+        ASSERT_EQ(context->outputSize.x, config->qSliceD0);
+    }
     ASSERT_EQ(context->outputSize.y, context->nBatches);
     NnSize3D *querySize = &context->bufferConfigs[config->queryBufferIndex].size;
     ASSERT_EQ(querySize->x, config->qSliceD0);
     NnSize3D *posSize = &context->pipeConfigs[config->positionPipeIndex].size;
     ASSERT_EQ(posSize->x, 1);
     ASSERT_EQ(posSize->y, context->nBatches);
+    if (config->nKvSlots > 1) {
+        NnSize3D *slotSize = &context->pipeConfigs[config->slotPipeIndex].size;
+        ASSERT_EQ(slotSize->x, 1);
+        ASSERT_EQ(slotSize->y, context->nBatches);
+    }
+    NnSize3D *keyCacheSize = &context->bufferConfigs[config->keyCacheBufferIndex].size;
+    NnSize3D *valueCacheSize = &context->bufferConfigs[config->valueCacheBufferIndex].size;
+    ASSERT_EQ(keyCacheSize->floatType, config->kvCacheType);
+    ASSERT_EQ(valueCacheSize->floatType, config->kvCacheType);
+    if (config->kvCacheType == F_Q80) {
+        ASSERT_EQ(config->headDim % Q80_BLOCK_SIZE, 0);
+        assert(config->headDim <= KV_MAX_HEAD_DIM);
+    }
+    if (config->kvBlockSize > 0) {
+        NnSize3D *tableSize = &context->pipeConfigs[config->blockTablePipeIndex].size;
+        ASSERT_EQ(tableSize->x, std::max(config->nKvSlots, 1u) * ((config->seqLen + config->kvBlockSize - 1) / config->kvBlockSize));
+    }
+
+    // one counter of finished time chunks per (row, head)
+    const NnUint nCounters = context->nBatches * config->nHeads0;
+    context->scratch = new NnByte[nCounters * sizeof(std::atomic<NnUint>)];
+    std::atomic<NnUint> *counters = (std::atomic<NnUint> *)context->scratch;
+    for (NnUint i = 0; i < nCounters; i++)
+        new (&counters[i]) std::atomic<NnUint>(0u);
 }
 
-static void multiHeadAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+template <typename T>
+static void multiHeadAttForward(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
 
     float *query = (float *)context->buffers[config->queryBufferIndex];
-    float *keyCache = (float *)context->buffers[config->keyCacheBufferIndex];
-    float *valueCache = (float *)context->buffers[config->valueCacheBufferIndex];
+    const T *keyCache = (T *)context->buffers[config->keyCacheBufferIndex];
+    const T *valueCache = (T *)context->buffers[config->valueCacheBufferIndex];
     float *att = (float *)context->buffers[config->attBufferIndex];
     const float *positions = (float *)context->pipes[config->positionPipeIndex];
+    const float *slots = config->nKvSlots > 1 ? (float *)context->pipes[config->slotPipeIndex] : nullptr;
+    const float *blockTable = config->kvBlockSize > 0 ? (float *)context->pipes[config->blockTablePipeIndex] : nullptr;
+    const NnUint nBlocksPerSlot = config->kvBlockSize > 0 ? (config->seqLen + config->kvBlockSize - 1) / config->kvBlockSize : 0;
+    const NnSize slotSize = (NnSize)config->seqLen * config->kvDim0; // elements
+    std::atomic<NnUint> *counters = (std::atomic<NnUint> *)context->scratch;
+    const bool isSeqSharded = config->nSeqShards > 1;
+
+    // If there are fewer heads than threads, the context of every head is split into time chunks
+    const NnUint nRowHeads = batchSize * config->nHeads0;
+    NnUint nChunks = 1;
+    if (nRowHeads < nThreads && counters != nullptr) {
+        nChunks = std::min((nThreads + nRowHeads - 1) / nRowHeads, config->seqLen / attPartialSize(config->headDim));
+        nChunks = std::max(nChunks, 1u);
+    }
+
+    SPLIT_THREADS(unitStart, unitEnd, nRowHeads * nChunks, nThreads, threadIndex);
+    for (NnUint unit = unitStart; unit < unitEnd; unit++) {
+        const NnUint batchIndex = unit / (config->nHeads0 * nChunks);
+        const NnUint h0 = (unit / nChunks) % config->nHeads0;
+        const NnUint chunkIndex = unit % nChunks;
 
-    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
         float *y = (float *)context->output[batchIndex];
-        float *q = &query[batchIndex * config->qSliceD0];
-        NnUint pos = (NnUint)positions[batchIndex];
-        assert(pos < config->seqLen);
-
-        DEBUG_VECTOR(context, "input", y);
-        DEBUG_VECTOR(context, "q", q);
-
-        multiheadAtt_F32(y, q, 
-            &att[batchIndex * config->nHeads0 * config->seqLen],
-            keyCache, valueCache, pos,
-            config->nHeads, config->nHeads0,
-            config->nKvHeads, config->kvDim0, config->headDim, config->seqLen, nThreads, threadIndex);
+        const float *q = &query[batchIndex * config->qSliceD0];
+        const NnUint pos = (NnUint)positions[batchIndex];
+        NnUint nPositions = pos + 1;
+        if (isSeqSharded)
+            nPositions = getSeqShardRows(nPositions, config->nSeqShards, config->seqShardIndex, config->seqShardBlock);
+        assert(nPositions <= config->seqLen);
+        NnSize slotOffset = 0;
+        const float *slotBlockTable = blockTable;
+        if (slots != nullptr) {
+            const NnUint slot = (NnUint)slots[batchIndex];
+            assert(slot < config->nKvSlots);
+            if (blockTable != nullptr)
+                slotBlockTable = &blockTable[slot * nBlocksPerSlot];
+            else
+                slotOffset = slot * slotSize;
+        }
 
-        DEBUG_VECTOR(context, "output", y);
+        const NnUint rowHeadIndex = batchIndex * config->nHeads0;
+        multiheadAtt(y, q, &att[rowHeadIndex * config->seqLen],
+            kvAt(keyCache, slotOffset), kvAt(valueCache, slotOffset), nPositions,
+            config->nHeads, config->nKvHeads, config->kvDim0, config->headDim, config->seqLen,
+            slotBlockTable, config->kvBlockSize, isSeqSharded,
+            h0, chunkIndex, nChunks, nChunks > 1 ? &counters[rowHeadIndex + h0] : nullptr);
     }
 }
 
+static void multiHeadAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
+    if (config->kvCacheType == F_16)
+        multiHeadAttForward<NnFp16>(nThreads, threadIndex, batchSize, context);
+    else if (config->kvCacheType == F_Q80)
+        multiHeadAttForward<NnBlockQ80>(nThreads, threadIndex, batchSize, context);
+    else
+        multiHeadAttForward<float>(nThreads, threadIndex, batchSize, context);
+}
+
 static void initMulForward(NnCpuOpContext *context) {
     assert(context->weightSize.nBytes == 0);
     ASSERT_EQ(context->inputSize.x, context->outputSize.x);
@@ -1416,6 +2663,32 @@ static void repeatZForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint b
     }
 }
 
+// SHIFT_SKIP_ROW if the position of the row is kept by another shard of the sequence
+static constexpr NnSize SHIFT_SKIP_ROW = ~(NnSize)0;
+
+static NnSize resolveShiftIndex(const NnShiftOpCodeConfig *config, NnCpuOpContext *context, const NnUint batchIndex) {
+    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
+    const float *slots = config->slotStride > 0 ? (float *)context->pipes[config->slotPipeIndex] : nullptr;
+    NnSize index = (NnSize)indexes[batchIndex];
+    if (config->nSeqShards > 1) {
+        if (getSeqShardIndex((NnUint)index, config->nSeqShards, config->seqShardBlock) != config->seqShardIndex)
+            return SHIFT_SKIP_ROW;
+        index = getSeqShardRow((NnUint)index, config->nSeqShards, config->seqShardBlock);
+    }
+    if (config->blockSize > 0) {
+        const float *blockTable = (float *)context->pipes[config->blockTablePipeIndex];
+        const NnUint nBlocksPerSlot = (config->slotStride + config->blockSize - 1) / config->blockSize;
+        const NnUint slot = slots != nullptr ? (NnUint)slots[batchIndex] : 0u;
+        const float *slotBlockTable = &blockTable[slot * nBlocksPerSlot];
+        assert(slotBlockTable[index / config->blockSize] >= 0.0f);
+        index = kvCacheRow(slotBlockTable, config->blockSize, (NnUint)index);
+    } else if (slots != nullptr) {
+        index += (NnSize)slots[batchIndex] * config->slotStride;
+    }
+    assert((index + 1) * context->inputSize.x <= context->outputSize.x);
+    return index;
+}
+
 static void shiftForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     ASSERT_EQ(context->hasInputContinuousMemory, true);
     ASSERT_EQ(context->hasOutputContinuousMemory, true);
@@ -1424,13 +2697,13 @@ static void shiftForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint bat
     ASSERT_EQ(context->outputSize.y, 1);
 
     const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
-    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
     const NnSize dimBytes = getBytes(F_32, context->inputSize.x);
     NnByte *output = context->output[0];
 
     for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
-        const NnSize index = (NnSize)indexes[batchIndex];
-        assert((index + 1) * context->inputSize.x <= context->outputSize.x);
+        const NnSize index = resolveShiftIndex(config, context, batchIndex);
+        if (index == SHIFT_SKIP_ROW)
+            continue;
         copy_UNK(
             &output[index * dimBytes],
             context->input[batchIndex],
@@ -1440,6 +2713,108 @@ static void shiftForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint bat
     }
 }
 
+static void shiftForward_F32_F16(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_16);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const NnUint dim = context->inputSize.x;
+    NnFp16 *output = (NnFp16 *)context->output[0];
+    SPLIT_THREADS(start, end, dim, nThreads, threadIndex);
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = resolveShiftIndex(config, context, batchIndex);
+        if (index == SHIFT_SKIP_ROW)
+            continue;
+        const float *x = (float *)context->input[batchIndex];
+        NnFp16 *y = &output[index * dim];
+        for (NnUint i = start; i < end; i++)
+            y[i] = CONVERT_F32_TO_F16(x[i]);
+    }
+}
+
+static void shiftForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_Q80);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const NnUint dim = context->inputSize.x;
+    NnBlockQ80 *output = (NnBlockQ80 *)context->output[0];
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = resolveShiftIndex(config, context, batchIndex);
+        if (index == SHIFT_SKIP_ROW)
+            continue;
+        quantizeF32toQ80(
+            (float *)context->input[batchIndex],
+            &output[index * dim / Q80_BLOCK_SIZE],
+            dim,
+            nThreads,
+            threadIndex);
+    }
+}
+
+// Threads own column pairs of all rows, rows move down in order, so a source row is read before it's overwritten
+static void kvEvictForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->outputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnKvEvictOpCodeConfig *config = (NnKvEvictOpCodeConfig *)context->opConfig;
+    const float *eviction = (float *)context->pipes[config->evictPipeIndex];
+    const NnUint nDiscard = (NnUint)eviction[2];
+    if (nDiscard == 0)
+        return;
+    const NnUint slot = (NnUint)eviction[0];
+    const NnUint start = (NnUint)eviction[1];
+    const NnUint nRows = (NnUint)eviction[3];
+    const NnUint dim = config->kvDim0;
+    const NnSize firstRow = (NnSize)slot * config->slotStride + start;
+    assert((firstRow + nDiscard + nRows) * dim <= context->outputSize.x);
+    float *cache = &((float *)context->output[0])[firstRow * dim];
+
+    SPLIT_THREADS(s, e, dim / 2, nThreads, threadIndex);
+    if (config->isKey == 0) {
+        const NnSize nBytes = (NnSize)(e - s) * 2 * sizeof(float);
+        for (NnUint r = 0; r < nRows; r++)
+            std::memcpy(&cache[(NnSize)r * dim + s * 2], &cache[(NnSize)(r + nDiscard) * dim + s * 2], nBytes);
+        return;
+    }
+
+    // R(p - d) = R(-d) R(p), the rope cache row d holds cos and sin of R(d)
+    const NnRopeSlice *slice = &config->slice;
+    const float *ropeCache = (float *)context->buffers[config->ropeCacheBufferIndex];
+    const bool isFalcon = config->ropeType == ROPE_FALCON;
+    const float *posCache = isFalcon ? &ropeCache[nDiscard * slice->headDim] : &ropeCache[nDiscard * slice->sliceDim];
+    const NnUint headDimHalf = slice->headDim / 2;
+    for (NnUint r = 0; r < nRows; r++) {
+        float *y = &cache[(NnSize)r * dim];
+        const float *x = &cache[(NnSize)(r + nDiscard) * dim];
+        for (NnUint p = s; p < e; p++) {
+            NnUint i0, i1, c0, c1;
+            if (isFalcon) {
+                const NnUint j = p % headDimHalf;
+                i0 = (p / headDimHalf) * slice->headDim + j;
+                i1 = i0 + headDimHalf;
+                c0 = j;
+                c1 = j + headDimHalf;
+            } else {
+                i0 = p * 2;
+                i1 = i0 + 1;
+                c0 = i0;
+                c1 = i1;
+            }
+            const float fcr = posCache[c0];
+            const float fci = posCache[c1];
+            const float v0 = x[i0];
+            const float v1 = x[i1];
+            y[i0] = v0 * fcr + v1 * fci;
+            y[i1] = v1 * fcr - v0 * fci;
+        }
+    }
+}
+
 static void softmaxForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     assert(*context->input == *context->output);
 
@@ -1457,6 +2832,10 @@ static void initMoeGateForward(NnCpuOpContext *context) {
     ASSERT_EQ(context->outputSize.z, config->k);
     ASSERT_EQ(context->outputSize.y, context->nBatches);
     ASSERT_EQ(context->outputSize.x, 1u);
+    if (config->expertParallel == 1u) {
+        assert(config->nLocalExperts > 0u);
+        assert(config->expertStart + config->nLocalExperts <= context->inputSize.x);
+    }
 }
 
 static void moeGateForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
@@ -1480,10 +2859,21 @@ static void moeGateForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint b
 
         for (NnUint k = 0u; k < config->k; k++) {
             const NnUint p = pos[k];
-            indexes[y * config->k + k] = (float)p;
-
             // (nActiveExperts, nBatches, 1)
             float *output = (float *)context->output[k * context->outputSize.y + y];
+
+            if (config->expertParallel == 1u) {
+                // The node holding the expert adds its part in the all-reduce of the layer output
+                if (p >= config->expertStart && p < config->expertStart + config->nLocalExperts) {
+                    indexes[y * config->k + k] = (float)(p - config->expertStart);
+                    *output = input[p] / sum;
+                } else {
+                    indexes[y * config->k + k] = -1.0f;
+                    *output = 0.0f;
+                }
+                continue;
+            }
+            indexes[y * config->k + k] = (float)p;
             *output = input[p] / sum;
         }
 
@@ -1491,8 +2881,261 @@ static void moeGateForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint b
     }
 }
 
+static void initTopkLogitsForward(NnCpuOpContext *context) {
+    const NnTopkLogitsOpCodeConfig *config = (NnTopkLogitsOpCodeConfig *)context->opConfig;
+    ASSERT_EQ(context->inputSize.y, context->nBatches);
+    ASSERT_EQ(context->outputSize.y, context->nBatches);
+    assert(config->k > 0u);
+    assert(config->k <= context->inputSize.x);
+    assert((config->slotIndex + 1u) * 2u * config->k <= context->outputSize.x);
+}
+
+static void topkLogitsForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    // Only k candidates of the local vocab slice leave the node, the root samples from the merged set
+    const NnTopkLogitsOpCodeConfig *config = (NnTopkLogitsOpCodeConfig *)context->opConfig;
+    const NnUint k = config->k;
+    const NnUint n = context->inputSize.x;
+    auto greater = [](const std::pair<float, NnUint> &a, const std::pair<float, NnUint> &b) {
+        return a.first > b.first;
+    };
+
+    std::vector<std::pair<float, NnUint>> heap;
+    heap.reserve(k);
+    for (NnUint y = threadIndex; y < batchSize; y += nThreads) {
+        const float *input = (float *)context->input[y];
+        heap.clear();
+        // Min-heap of the k largest logits, the root is the smallest candidate
+        for (NnUint i = 0u; i < n; i++) {
+            const float v = input[i];
+            if (heap.size() < k) {
+                heap.push_back(std::make_pair(v, i));
+                std::push_heap(heap.begin(), heap.end(), greater);
+            } else if (v > heap[0].first) {
+                std::pop_heap(heap.begin(), heap.end(), greater);
+                heap.back() = std::make_pair(v, i);
+                std::push_heap(heap.begin(), heap.end(), greater);
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), greater);
+
+        float *values = &((float *)context->output[y])[config->slotIndex * 2u * k];
+        float *indexes = &values[k];
+        for (NnUint i = 0u; i < k; i++) {
+            values[i] = heap[i].first;
+            indexes[i] = (float)(config->indexOffset + heap[i].second);
+        }
+    }
+}
+
+static void initMergeAttForward(NnCpuOpContext *context) {
+    const NnMergeAttOpCodeConfig *config = (NnMergeAttOpCodeConfig *)context->opConfig;
+    assert(context->weightSize.nBytes == 0);
+    ASSERT_EQ(context->inputSize.y, context->nBatches);
+    ASSERT_EQ(context->outputSize.y, context->nBatches);
+    ASSERT_EQ(context->inputSize.x, config->nShards * config->nHeads * attPartialSize(config->headDim));
+    ASSERT_EQ(context->outputSize.x, config->nHeads0 * config->headDim);
+    assert(config->headStart + config->nHeads0 <= config->nHeads);
+}
+
+static void mergeAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    // Softmax stats of the shards are combined like the time chunks of one node
+    const NnMergeAttOpCodeConfig *config = (NnMergeAttOpCodeConfig *)context->opConfig;
+    const NnUint partialSize = attPartialSize(config->headDim);
+    const NnSize shardStride = (NnSize)config->nHeads * partialSize;
+
+    SPLIT_THREADS(unitStart, unitEnd, batchSize * config->nHeads0, nThreads, threadIndex);
+    for (NnUint unit = unitStart; unit < unitEnd; unit++) {
+        const NnUint batchIndex = unit / config->nHeads0;
+        const NnUint h0 = unit % config->nHeads0;
+        const float *partials = &((float *)context->input[batchIndex])[(config->headStart + h0) * partialSize];
+        float *y = &((float *)context->output[batchIndex])[h0 * config->headDim];
+        mergeAttPartials(y, partials, config->nShards, shardStride, config->headDim);
+    }
+}
+
+// fusion
+
+// SILU -> MUL [-> CAST F32 -> Q80] of the feed forward in one pass. Every thread runs the ops on
+// its own range of the row (whole Q80 blocks if the cast is fused), so no barrier is needed.
+template <bool quantize>
+static void fusedSiluMulForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnCpuOpContext *silu = &context[0];
+    const NnCpuOpContext *mul = &context[1];
+    const NnMulOpCodeConfig *config = (NnMulOpCodeConfig *)mul->opConfig;
+    const float *multiplier = (float *)mul->buffers[config->multiplierBufferIndex];
+    const NnUint n = mul->outputSize.x;
+    const NnUint unit = quantize ? Q80_BLOCK_SIZE : 1u;
+    SPLIT_THREADS(start, end, n / unit, nThreads, threadIndex);
+    const NnUint offset = start * unit;
+    const NnUint len = (end - start) * unit;
+    if (len == 0u)
+        return;
+
+    for (NnUint z = 0u; z < mul->inputSize.z; z++) {
+        const NnUint zOffset = z * mul->inputSize.y;
+        for (NnUint y = 0u; y < batchSize; y++) {
+            const NnUint index = zOffset + y;
+            silu_F32(&((float *)silu->output[index])[offset], len, 1u, 0u);
+            float *output = (float *)mul->output[index];
+            mul_F32(
+                &output[offset],
+                &((float *)mul->input[index])[offset],
+                &multiplier[n * index + offset],
+                len,
+                1u,
+                0u);
+            if (quantize)
+                quantizeF32toQ80(&output[offset], &((NnBlockQ80 *)context[2].output[index])[start], len, 1u, 0u);
+        }
+    }
+}
+
+// RMS_NORM -> CAST F32 -> Q80, the norm and the quantization of a block run on the same thread
+static void fusedRmsNormCastForward_F32_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnCpuOpContext *norm = &context[0];
+    const NnCpuOpContext *cast = &context[1];
+    const NnRmsNormOpConfig *config = (NnRmsNormOpConfig *)norm->opConfig;
+    const float *weight = (float *)norm->weight;
+    const NnUint invRmsBatchSize = norm->bufferConfigs[config->invRmsBufferIndex].size.x;
+    const float *invRms = (float *)norm->buffers[config->invRmsBufferIndex];
+    SPLIT_THREADS(start, end, norm->weightSize.x / Q80_BLOCK_SIZE, nThreads, threadIndex);
+    const NnUint offset = start * Q80_BLOCK_SIZE;
+    const NnUint len = (end - start) * Q80_BLOCK_SIZE;
+    if (len == 0u)
+        return;
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        float *output = (float *)norm->output[batchIndex];
+        rmsNorm_F32(
+            &output[offset],
+            &((float *)norm->input[batchIndex])[offset],
+            invRms[batchIndex * invRmsBatchSize],
+            &weight[offset],
+            len,
+            1u,
+            0u);
+        quantizeF32toQ80(&output[offset], &((NnBlockQ80 *)cast->output[batchIndex])[start], len, 1u, 0u);
+    }
+}
+
+// Independent ops (e.g. the Q/K/V projections) in one step, a thread runs its part of each of them
+template <NnCpuOpForward forward, NnUint nOps>
+static void fusedIndependentForward(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    for (NnUint i = 0u; i < nOps; i++)
+        forward(nThreads, threadIndex, batchSize, &context[i]);
+}
+
+#define MAX_FUSED_INDEPENDENT_OPS 3u
+
+// The output rows of the op are the input rows of the next one
+static bool isChained(const NnCpuOpContext *from, const NnCpuOpContext *to) {
+    const NnUint nRows = from->outputSize.z * from->outputSize.y;
+    if (from->outputSize.floatType != to->inputSize.floatType ||
+        from->outputSize.x != to->inputSize.x ||
+        nRows != to->inputSize.z * to->inputSize.y)
+        return false;
+    for (NnUint i = 0u; i < nRows; i++) {
+        if (from->output[i] != to->input[i])
+            return false;
+    }
+    return true;
+}
+
+static bool isSameMemory(const NnPointerConfig *a, const NnPointerConfig *b) {
+    return a->source == b->source && a->pointerIndex == b->pointerIndex;
+}
+
+static bool isIndependent(const NnOpConfig *a, const NnOpConfig *b) {
+    return !isSameMemory(&a->output, &b->input) &&
+        !isSameMemory(&b->output, &a->input) &&
+        !isSameMemory(&a->output, &b->output);
+}
+
+static bool canRunIndependently(const NnOpConfig *opConfig, const NnCpuOpContext *context) {
+    if (opConfig->code == OP_ROPE)
+        return true;
+    // Different experts would be routed to the rows, the expert cache is updated by the op
+    return opConfig->code == OP_MATMUL &&
+        ((NnMatmulOpConfig *)opConfig->config)->nExperts == 0u &&
+        context->expertCache == nullptr;
+}
+
+static NnCpuOpForward getFusedIndependentForward(NnCpuOpForward forward, NnUint nOps) {
+#define FUSED_INDEPENDENT_FORWARD(f) \
+    if (forward == f) return nOps == 2u ? fusedIndependentForward<f, 2u> : fusedIndependentForward<f, 3u>;
+    FUSED_INDEPENDENT_FORWARD(matmulForward_F32_F32_F32)
+    FUSED_INDEPENDENT_FORWARD(matmulForward_Q80_Q40_F32)
+    FUSED_INDEPENDENT_FORWARD(matmulForward_Q80_Q4K_F32)
+    FUSED_INDEPENDENT_FORWARD(matmulForward_Q80_Q6K_F32)
+    FUSED_INDEPENDENT_FORWARD(ropeForward_F32_F32)
+#undef FUSED_INDEPENDENT_FORWARD
+    return nullptr;
+}
+
+NnUint getCpuOpFusion(const NnOpConfig *ops, const NnOpQuantType *opQuants, const NnCpuOpContext *contexts, NnUint nOps, NnUint opIndex, NnCpuOpForward *forward) {
+    const NnOpConfig *op = &ops[opIndex];
+    const NnUint nNext = nOps - opIndex - 1u;
+
+    if (op->code == OP_SILU && opQuants[opIndex] == F32_F32_F32 && nNext >= 1u &&
+        ops[opIndex + 1].code == OP_MUL && opQuants[opIndex + 1] == F32_F32_F32 &&
+        isChained(&contexts[opIndex], &contexts[opIndex + 1])) {
+        if (nNext >= 2u &&
+            ops[opIndex + 2].code == OP_CAST && opQuants[opIndex + 2] == F32_F32_Q80 &&
+            contexts[opIndex + 1].outputSize.x % Q80_BLOCK_SIZE == 0u &&
+            isChained(&contexts[opIndex + 1], &contexts[opIndex + 2])) {
+            *forward = fusedSiluMulForward_F32_F32<true>;
+            return 3u;
+        }
+        *forward = fusedSiluMulForward_F32_F32<false>;
+        return 2u;
+    }
+
+    if (op->code == OP_RMS_NORM && opQuants[opIndex] == F32_F32_F32 && nNext >= 1u &&
+        ((NnRmsNormOpConfig *)op->config)->nColumns == 1u &&
+        contexts[opIndex].outputSize.x % Q80_BLOCK_SIZE == 0u &&
+        ops[opIndex + 1].code == OP_CAST && opQuants[opIndex + 1] == F32_F32_Q80 &&
+        contexts[opIndex].inputSize.z == 1u &&
+        isChained(&contexts[opIndex], &contexts[opIndex + 1])) {
+        *forward = fusedRmsNormCastForward_F32_F32_Q80;
+        return 2u;
+    }
+
+    if (canRunIndependently(op, &contexts[opIndex])) {
+        const NnCpuOpForward opForward = getCpuOpForward(op->code, opQuants[opIndex]);
+        NnUint n = 1u;
+        while (n < MAX_FUSED_INDEPENDENT_OPS && n <= nNext) {
+            const NnUint nextIndex = opIndex + n;
+            if (ops[nextIndex].code != op->code || opQuants[nextIndex] != opQuants[opIndex] ||
+                !canRunIndependently(&ops[nextIndex], &contexts[nextIndex]))
+                break;
+            bool independent = true;
+            for (NnUint i = opIndex; i < nextIndex && independent; i++)
+                independent = isIndependent(&ops[i], &ops[nextIndex]);
+            if (!independent)
+                break;
+            n++;
+        }
+        if (n > 1u) {
+            NnCpuOpForward fused = getFusedIndependentForward(opForward, n);
+            if (fused != nullptr) {
+                *forward = fused;
+                return n;
+            }
+        }
+    }
+    return 1u;
+}
+
 // device
 
+NnUint getCpuQ40RepackRows() {
+#if defined(__AVX2__) || defined(__ARM_NEON)
+    return Q40_REPACK_ROWS;
+#else
+    return 0u;
+#endif
+}
+
 void printCpuInstructionSet() {
     printf("🧠 CPU:");
 #if defined(__ARM_NEON)
@@ -1511,6 +3154,9 @@ void printCpuInstructionSet() {
     printf(" avx512f");
 #endif
     printf("\n");
+    const NnUint features = getCpuFeatures();
+    if (features != 0u)
+        printf("🧠 CPU kernels: %s\n", cpuFeaturesToString(features).c_str());
 }
 
 NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
@@ -1534,6 +3180,10 @@ NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
         return initRepeatZForward;
     if (code == OP_MOE_GATE)
         return initMoeGateForward;
+    if (code == OP_TOPK_LOGITS)
+        return initTopkLogitsForward;
+    if (code == OP_MERGE_ATT)
+        return initMergeAttForward;
     return nullptr;
 }
 
@@ -1559,6 +3209,8 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_MATMUL) {
         if (quantType == F32_F32_F32) return matmulForward_F32_F32_F32;
         if (quantType == Q80_Q40_F32) return matmulForward_Q80_Q40_F32;
+        if (quantType == Q80_Q4K_F32) return matmulForward_Q80_Q4K_F32;
+        if (quantType == Q80_Q6K_F32) return matmulForward_Q80_Q6K_F32;
     }
     if (code == OP_ROPE) {
         if (quantType == F32_F32_F32) return ropeForward_F32_F32;
@@ -1589,6 +3241,8 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     }
     if (code == OP_SHIFT) {
         if (quantType == F32_F32_F32) return shiftForward_F32_F32;
+        if (quantType == F32_F32_F16) return shiftForward_F32_F16;
+        if (quantType == F32_F32_Q80) return shiftForward_F32_Q80;
     }
     if (code == OP_SOFTMAX) {
         if (quantType == F32_F32_F32) return softmaxForward_F32_F32;
@@ -1596,5 +3250,14 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_MOE_GATE) {
         if (quantType == F32_F32_F32) return moeGateForward_F32_F32;
     }
+    if (code == OP_TOPK_LOGITS) {
+        if (quantType == F32_F32_F32) return topkLogitsForward_F32_F32;
+    }
+    if (code == OP_MERGE_ATT) {
+        if (quantType == F32_F32_F32) return mergeAttForward_F32_F32;
+    }
+    if (code == OP_KV_EVICT) {
+        if (quantType == F32_F32_F32) return kvEvictForward_F32_F32;
+    }
     return nullptr;
 }
@@ -2,6 +2,9 @@
 #define NN_CPU_OPS_H
 
 #include "nn-core.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #define ASSERT_EQ(a, b) \
     if (a != b) { \
@@ -9,6 +12,49 @@
         exit(-1); \
     }
 
+typedef struct {
+    NnSize nHits;       // expert lookups served from the resident slots
+    NnSize nMisses;     // expert lookups served from the mapped file
+    NnSize nPromotions; // experts copied into a slot
+    NnSize residentBytes;
+    NnSize pagedBytes;  // experts of the ops with a cache
+} NnCpuExpertCacheStats;
+
+// MoE: the experts of a matmul stay in the mapped model file, only nSlots of them are resident
+// in the weight buffer of the op. The slots keep the least recently used experts.
+class NnCpuExpertCache {
+private:
+    NnUint nExperts;
+    NnUint nSlots;
+    NnSize expertBytes;
+    NnByte *slots;
+    std::unique_ptr<const NnByte *[]> sources;
+    std::unique_ptr<std::atomic<const NnByte *>[]> weights; // the slot or the source of every expert
+    std::vector<NnUint> slotExperts;   // EXPERT_NONE for an empty slot
+    std::vector<NnUint> expertSlots;
+    std::vector<NnSize> lastUse;       // the update of the last batch routed to the expert
+    std::vector<NnUint> routerCounts;  // decayed rows routed to the expert, they pick the prefetched experts
+    std::vector<NnSize> lastAdvise;
+    std::vector<NnUint> batchExperts;
+    NnSize epoch;
+    std::atomic<NnSize> nHits;
+    std::atomic<NnSize> nMisses;
+    std::atomic<NnSize> nPromotions;
+    NnUint findVictimSlot() const;
+    void prefetch();
+public:
+    NnCpuExpertCache(NnUint nExperts, NnUint nSlots, NnSize expertBytes, NnByte *slots);
+    // The source must stay mapped while the cache is used, it may be called on many threads for distinct experts
+    void setSource(NnUint expertIndex, const NnByte *source);
+    // Thread 0 before the matmul: experts routed to the batch but not resident are copied into the slots
+    // of experts the batch does not use, the other threads may read the weights at the same time
+    void update(const float *activeExpertIndexes, NnUint nIndexes);
+    const NnByte *getWeight(NnUint expertIndex) const {
+        return weights[expertIndex].load(std::memory_order_acquire);
+    }
+    void addStats(NnCpuExpertCacheStats *stats) const;
+};
+
 typedef struct {
     const char *name;
     NnByte nBatches;
@@ -29,14 +75,25 @@ typedef struct {
 
     NnByte *weight;
     NnSize3D weightSize;
+
+    NnByte *scratch; // state of the op allocated by its init function, released with the segment
+    const NnSliceArrivals *inputArrivals; // nullptr unless the input pipe is exchanged by SYNC_NODE_SLICES_STREAMED
+    NnCpuExpertCache *expertCache; // nullptr unless the experts of the matmul are paged, the weight holds the slots
+    bool hasRepackedWeight; // the Q40 weight rows are interleaved (NnBlockQ40x4), see repackQ40toQ40x4
 } NnCpuOpContext;
 
 typedef void (*NnCpuOpForwardInit)(NnCpuOpContext *context);
 typedef void (*NnCpuOpForward)(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context);
 
 void printCpuInstructionSet();
+// Rows interleaved by the Q40 weight repacking on this CPU, 0 if it has no kernel for it
+NnUint getCpuQ40RepackRows();
 NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType);
 NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType);
+// Fusion pass: the number of ops from opIndex run by one fused forward, or 1 if no pattern matches
+// (rms norm + quantization, silu + mul [+ quantization], independent matmuls or ropes). The fused
+// forward gets the context of the first op, the contexts of the other ops follow it.
+NnUint getCpuOpFusion(const NnOpConfig *ops, const NnOpQuantType *opQuants, const NnCpuOpContext *contexts, NnUint nOps, NnUint opIndex, NnCpuOpForward *forward);
 
 void softmax_F32(float *x, const NnUint size);
 
@@ -1,7 +1,10 @@
 #include "nn-cpu.hpp"
 #include "nn-cpu-ops.hpp"
 #include "nn-core.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream> 
 #include <cstring>
 #include <stdexcept>
@@ -13,25 +16,206 @@
 #include <fcntl.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #define DEBUG_CPU_OP_QUANTS false
 
 #define BUFFER_ALIGNMENT 64
 
-static NnByte *allocAlignedBuffer(NnSize size) {
+// Linux memory policies (numaif.h), the build does not depend on libnuma
+#define NUMA_MAX_NODES 1024
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+static NnByte *allocAlignedBuffer(NnSize size, bool lock = true, NnSize alignment = BUFFER_ALIGNMENT) {
     NnByte *buffer;
 #ifdef _WIN32
-    buffer = (NnByte *)_aligned_malloc(size, BUFFER_ALIGNMENT);
+    buffer = (NnByte *)_aligned_malloc(size, alignment);
     if (buffer == NULL)
         throw std::runtime_error("_aligned_malloc failed");
 #else
-    if (posix_memalign((void **)&buffer, BUFFER_ALIGNMENT, size) != 0)
+    if (posix_memalign((void **)&buffer, alignment, size) != 0)
         throw std::runtime_error("posix_memalign failed");
-    mlock(buffer, size);
+    if (lock)
+        mlock(buffer, size);
 #endif
     return buffer;
 }
 
+static NnSize getPageSize() {
+#ifdef _WIN32
+    return 4096;
+#else
+    return (NnSize)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static std::vector<int> parseCpuList(const char *list) {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        const long first = std::strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            throw std::invalid_argument(std::string("Invalid CPU list: ") + list);
+        p = end;
+        if (*p == '-') {
+            last = std::strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                throw std::invalid_argument(std::string("Invalid CPU list: ") + list);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back((int)cpu);
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            throw std::invalid_argument(std::string("Invalid CPU list: ") + list);
+    }
+    return cpus;
+}
+
+// NUMA node of every CPU (-1 = unknown), empty if the system does not report the nodes
+static std::vector<int> readCpuNodes() {
+    std::vector<int> cpuNodes;
+#ifdef __linux__
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == nullptr)
+            continue;
+        char line[4096];
+        if (fgets(line, sizeof(line), file) != nullptr) {
+            for (int cpu : parseCpuList(line)) {
+                if (cpu >= (int)cpuNodes.size())
+                    cpuNodes.resize(cpu + 1, -1);
+                cpuNodes[cpu] = node;
+            }
+        }
+        fclose(file);
+    }
+#endif
+    return cpuNodes;
+}
+
+static std::vector<int> getProcessCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+NnCpuPlacement createCpuPlacement(NnUint nThreads, const char *cpuList, bool numa) {
+    NnCpuPlacement placement;
+    placement.threadCpus.assign(nThreads, -1);
+    placement.threadNodes.assign(nThreads, -1);
+    placement.numa = false;
+    if (cpuList == nullptr && !numa)
+        return placement;
+
+#if !defined(__linux__) && !defined(_WIN32)
+    throw std::runtime_error("Pinning of threads is not supported on this platform");
+#endif
+    const std::vector<int> cpus = cpuList != nullptr ? parseCpuList(cpuList) : getProcessCpus();
+    if (cpus.empty())
+        throw std::invalid_argument("The CPU list is empty");
+
+    std::vector<int> cpuNodes;
+    if (numa) {
+#ifndef __linux__
+        throw std::runtime_error("NUMA placement is supported only on Linux");
+#endif
+        cpuNodes = readCpuNodes();
+        if (cpuNodes.empty())
+            printf("⚠️  NUMA nodes are not reported by the system, threads are pinned without the memory placement\n");
+    }
+    if (cpuNodes.empty()) {
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+            placement.threadCpus[threadIndex] = cpus[threadIndex % cpus.size()];
+    } else {
+        // CPUs of every node in the order of the list
+        std::vector<int> nodes;
+        std::vector<std::vector<int>> nodeCpus;
+        for (int cpu : cpus) {
+            const int node = cpu < (int)cpuNodes.size() ? cpuNodes[cpu] : -1;
+            if (node < 0)
+                throw std::invalid_argument("Cannot find the NUMA node of the CPU " + std::to_string(cpu));
+            NnUint i = 0;
+            while (i < nodes.size() && nodes[i] != node)
+                i++;
+            if (i == nodes.size()) {
+                nodes.push_back(node);
+                nodeCpus.push_back(std::vector<int>());
+            }
+            nodeCpus[i].push_back(cpu);
+        }
+        // Every node gets threads in proportion to its CPUs, the threads of a node are adjacent
+        NnUint nCpusBefore = 0;
+        for (NnUint i = 0; i < nodes.size(); i++) {
+            const NnUint start = (NnUint)((NnSize)nThreads * nCpusBefore / cpus.size());
+            nCpusBefore += nodeCpus[i].size();
+            const NnUint end = (NnUint)((NnSize)nThreads * nCpusBefore / cpus.size());
+            for (NnUint threadIndex = start; threadIndex < end; threadIndex++) {
+                placement.threadCpus[threadIndex] = nodeCpus[i][(threadIndex - start) % nodeCpus[i].size()];
+                placement.threadNodes[threadIndex] = nodes[i];
+            }
+            if (end > start)
+                printf("🧭 NUMA node %d: threads %u-%u\n", nodes[i], start, end - 1);
+        }
+        placement.numa = true;
+    }
+
+    printf("📌 Threads pinned to CPUs:");
+    for (int cpu : placement.threadCpus)
+        printf(" %d", cpu);
+    printf("\n");
+    return placement;
+}
+
+// Best effort, the memory stays where it is if the kernel refuses the policy
+static void setMemoryPolicy(NnByte *data, NnSize size, int mode, const std::vector<int> &nodes) {
+#ifdef __linux__
+    static bool isWarningPrinted = false;
+    const uintptr_t pageMask = (uintptr_t)getPageSize() - 1;
+    const uintptr_t begin = ((uintptr_t)data + pageMask) & ~pageMask;
+    const uintptr_t end = ((uintptr_t)data + size) & ~pageMask;
+    if (end <= begin)
+        return;
+    const NnUint nBits = 8 * sizeof(unsigned long);
+    unsigned long mask[NUMA_MAX_NODES / nBits];
+    std::memset(mask, 0, sizeof(mask));
+    for (int node : nodes)
+        mask[node / nBits] |= 1ul << (node % nBits);
+    if (syscall(SYS_mbind, (void *)begin, (unsigned long)(end - begin), mode, mask, (unsigned long)NUMA_MAX_NODES + 1, NUMA_MPOL_MF_MOVE) != 0 && !isWarningPrinted) {
+        printf("⚠️  mbind failed (%s), the memory is not placed on the NUMA nodes\n", std::strerror(errno));
+        isWarningPrinted = true;
+    }
+#endif
+}
+
+static NnUint getThreadRowStart(NnUint nRows, NnUint nThreads, NnUint threadIndex) {
+    SPLIT_THREADS(start, end, nRows, nThreads, threadIndex);
+    return start;
+}
+
 static void releaseAlignedBuffer(NnByte *buffer) {
 #ifdef _WIN32
     _aligned_free(buffer);
@@ -40,6 +224,120 @@ static void releaseAlignedBuffer(NnByte *buffer) {
 #endif
 }
 
+static void lockBuffer(NnByte *buffer, NnSize size) {
+#ifndef _WIN32
+    mlock(buffer, size);
+#endif
+}
+
+static NnSize alignSize(NnSize size, NnSize alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+#define ARENA_PAGE_2M (2ull << 20)
+#define ARENA_PAGE_1G (1ull << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifdef __linux__
+// Bytes of the range on transparent huge pages
+static NnSize readAnonHugePageBytes(const NnByte *start, const NnByte *end) {
+    FILE *file = fopen("/proc/self/smaps", "r");
+    if (file == nullptr)
+        return 0;
+    char line[512];
+    bool isInRange = false;
+    NnSize bytes = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        unsigned long long from, to, kB;
+        if (sscanf(line, "%llx-%llx ", &from, &to) == 2)
+            isInRange = from < (unsigned long long)(uintptr_t)end && to > (unsigned long long)(uintptr_t)start;
+        else if (isInRange && sscanf(line, "AnonHugePages: %llu kB", &kB) == 1)
+            bytes += kB * 1024;
+    }
+    fclose(file);
+    return bytes;
+}
+#endif
+
+NnCpuArena::NnCpuArena(NnSize size, NnSize alignment, bool allowHugetlb)
+    : base(nullptr), mappedSize(0), data(nullptr), size(std::max(size, alignment)), used(0), alignment(alignment), backing("heap")
+{
+#ifdef __linux__
+    if (allowHugetlb) {
+        // 1 GB pages only if the rounding wastes at most 1/8 of the arena
+        const NnSize pageSizes[2] = { ARENA_PAGE_1G, ARENA_PAGE_2M };
+        const int pageFlags[2] = { 30 << MAP_HUGE_SHIFT, 21 << MAP_HUGE_SHIFT };
+        const char *names[2] = { "hugetlb 1 GB", "hugetlb 2 MB" };
+        for (NnUint i = 0; i < 2; i++) {
+            const NnSize alignedSize = alignSize(this->size, pageSizes[i]);
+            if (alignedSize - this->size > this->size / 8)
+                continue;
+            void *mapping = mmap(nullptr, alignedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | pageFlags[i], -1, 0);
+            if (mapping != MAP_FAILED) {
+                base = data = (NnByte *)mapping;
+                mappedSize = alignedSize;
+                backing = names[i];
+                return;
+            }
+        }
+    }
+    // One page more to start the range on a 2 MB boundary
+    void *mapping = mmap(nullptr, this->size + ARENA_PAGE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED) {
+        base = (NnByte *)mapping;
+        mappedSize = this->size + ARENA_PAGE_2M;
+        data = (NnByte *)alignSize((NnSize)(uintptr_t)base, ARENA_PAGE_2M);
+        if (madvise(data, this->size, MADV_HUGEPAGE) == 0)
+            backing = "transparent huge pages";
+        else
+            backing = "normal pages";
+        return;
+    }
+#endif
+    data = allocAlignedBuffer(this->size, false, alignment);
+}
+
+NnCpuArena::~NnCpuArena() {
+#ifndef _WIN32
+    if (mappedSize > 0) {
+        munmap(base, mappedSize);
+        return;
+    }
+#endif
+    releaseAlignedBuffer(data);
+}
+
+NnByte *NnCpuArena::alloc(NnSize nBytes) {
+    const NnSize alignedBytes = alignSize(nBytes, alignment);
+    if (used + alignedBytes > size)
+        throw std::runtime_error("The memory arena of the CPU device is full");
+    NnByte *memory = &data[used];
+    used += alignedBytes;
+    return memory;
+}
+
+void NnCpuArena::getStats(NnCpuArenaStats *stats) const {
+    stats->usedBytes = used;
+    stats->backing = backing;
+    stats->hugePageBytes = 0;
+    if (std::strncmp(backing, "hugetlb", 7) == 0)
+        stats->hugePageBytes = used;
+#ifdef __linux__
+    else if (mappedSize > 0)
+        stats->hugePageBytes = std::min(used, readAnonHugePageBytes(data, &data[used]));
+#endif
+}
+
+static NnSize getOpWeightBytes(NnOpConfig *opConfig, NnUint nExpertCacheSlots) {
+    const NnUint nExperts = opConfig->code == OP_MATMUL ? ((NnMatmulOpConfig *)opConfig->config)->nExperts : 0u;
+    // Only the slots of the expert cache are resident
+    if (nExpertCacheSlots > 0u && nExpertCacheSlots < nExperts)
+        return nExpertCacheSlots * opConfig->weightSize.nBytesXY;
+    return opConfig->weightSize.nBytes;
+}
+
 static NnUint getSplitTotal(const NnDimSplit* split, NnUint nNodes) {
     if (!split || !split->lengths) return 0;
     NnUint sum = 0;
@@ -76,34 +374,114 @@ static NnUint getSplitTotalForStage(const NnDimSplit* split, const NnStageConfig
 }
 
 
-NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *partitionPlan) {
+NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *partitionPlan,
+    NnUint nExpertCacheSlots, bool opFusion, bool weightRepack, const NnCpuPlacement *placement) {
     this->netConfig = netConfig;
     this->nodeConfig = nodeConfig;
     this->netExecution = netExecution;
     this->partitionPlan = partitionPlan;
+    this->nExpertCacheSlots = nExpertCacheSlots;
+    this->opFusion = opFusion;
+    this->weightRepack = weightRepack;
+    this->placement = placement;
 
     printCpuInstructionSet();
 
+    if (placement != nullptr && placement->numa) {
+        assert(placement->threadNodes.size() == netExecution->nThreads);
+        for (int node : placement->threadNodes) {
+            if (std::find(numaNodes.begin(), numaNodes.end(), node) == numaNodes.end())
+                numaNodes.push_back(node);
+        }
+    }
+
+    // All memory of the device is known from the configs, it is carved from one arena
+    const NnSize alignment = numaNodes.empty() ? BUFFER_ALIGNMENT : getPageSize();
+    NnSize arenaSize = 0;
+    NnSize lazyArenaSize = 0;
+    for (NnUint bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++) {
+        const NnBufferConfig *config = &nodeConfig->buffers[bufferIndex];
+        if ((config->flags & BUFFER_FLAG_LAZY) != 0)
+            lazyArenaSize += alignSize(config->size.nBytes, alignment);
+        else
+            arenaSize += alignSize(config->size.nBytes, alignment);
+    }
+    for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++)
+        arenaSize += alignSize(netConfig->pipes[pipeIndex].size.nBytes, alignment);
+#if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++)
+            arenaSize += alignSize(getOpWeightBytes(&segmentConfig->ops[opIndex], nExpertCacheSlots), alignment);
+    }
+#endif
+    arena.reset(new NnCpuArena(arenaSize, alignment, numaNodes.empty()));
+    // Explicit huge pages are reserved by mmap, lazy buffers must grow with the pages touched
+    if (lazyArenaSize > 0)
+        lazyArena.reset(new NnCpuArena(lazyArenaSize, alignment, false));
+
     nBuffers = nodeConfig->nBuffers;
     buffers = new NnByte *[nBuffers];
     for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
         NnBufferConfig *config = &nodeConfig->buffers[bufferIndex];
-        NnByte *buffer = allocAlignedBuffer(config->size.nBytes);
+        const bool isLazy = (config->flags & BUFFER_FLAG_LAZY) != 0;
+        NnByte *buffer = (isLazy ? lazyArena : arena)->alloc(config->size.nBytes);
+        // Activations are read by the threads of all nodes
+        if (!numaNodes.empty())
+            setMemoryPolicy(buffer, config->size.nBytes, NUMA_MPOL_INTERLEAVE, numaNodes);
+        if (!isLazy)
+            lockBuffer(buffer, config->size.nBytes);
         buffers[bufferIndex] = buffer;
     }
+    for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
+        const NnSize nBytes = netConfig->pipes[pipeIndex].size.nBytes;
+        NnByte *pipe = arena->alloc(nBytes);
+        if (!numaNodes.empty())
+            setMemoryPolicy(pipe, nBytes, NUMA_MPOL_INTERLEAVE, numaNodes);
+        netExecution->setPipeMemory(pipeIndex, pipe, nBytes);
+    }
 
     bufferFlags = new NnByte[nBuffers];
     std::memset(bufferFlags, 0, nBuffers * sizeof(NnByte));
 }
 
 NnCpuDevice::~NnCpuDevice() {
-    for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
-        releaseAlignedBuffer(buffers[bufferIndex]);
-    }
     delete[] buffers;
     delete[] bufferFlags;
 }
 
+NnByte *NnCpuDevice::allocWeight(NnOpConfig *opConfig, NnSize nBytes) {
+    NnByte *weight = arena->alloc(nBytes);
+    if (numaNodes.empty()) {
+        lockBuffer(weight, nBytes);
+        return weight;
+    }
+    const NnUint nRows = opConfig->weightSize.x;
+    const NnSize matrixBytes = opConfig->weightSize.nBytesXY;
+    if (opConfig->code != OP_MATMUL || nRows == 0u || matrixBytes % nRows != 0u) {
+        setMemoryPolicy(weight, nBytes, NUMA_MPOL_INTERLEAVE, numaNodes);
+    } else {
+        // Every node keeps the rows of its threads, in every expert (or expert cache slot)
+        const std::vector<int> &threadNodes = placement->threadNodes;
+        const NnUint nThreads = threadNodes.size();
+        const NnSize rowBytes = matrixBytes / nRows;
+        for (NnSize offset = 0; offset + matrixBytes <= nBytes; offset += matrixBytes) {
+            for (NnUint threadIndex = 0; threadIndex < nThreads;) {
+                NnUint endThreadIndex = threadIndex + 1;
+                while (endThreadIndex < nThreads && threadNodes[endThreadIndex] == threadNodes[threadIndex])
+                    endThreadIndex++;
+                const NnUint rowStart = getThreadRowStart(nRows, nThreads, threadIndex);
+                const NnUint rowEnd = getThreadRowStart(nRows, nThreads, endThreadIndex);
+                setMemoryPolicy(&weight[offset + rowStart * rowBytes], (rowEnd - rowStart) * rowBytes,
+                    NUMA_MPOL_BIND, std::vector<int>(1, threadNodes[threadIndex]));
+                threadIndex = endThreadIndex;
+            }
+        }
+    }
+    lockBuffer(weight, nBytes);
+    return weight;
+}
+
 NnUint NnCpuDevice::maxNThreads() {
     return std::thread::hardware_concurrency();
 }
@@ -187,18 +565,56 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
         opContext->hasOutputContinuousMemory = hasPointerContinuousMemory(&opConfig->output);
         std::memcpy(opContext->output, outputsPtr[opIndex].data(), outputsPtr[opIndex].size() * sizeof(NnByte *));
 
+        opContext->expertCache = nullptr;
 #if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
-        if (opContext->weightSize.nBytes > 0)
-            opContext->weight = allocAlignedBuffer(opContext->weightSize.nBytes);
+        const NnUint nExperts = opConfig->code == OP_MATMUL ? ((NnMatmulOpConfig *)opConfig->config)->nExperts : 0u;
+        if (nExpertCacheSlots > 0u && nExpertCacheSlots < nExperts) {
+            // Only the slots are allocated, loadWeight records where every expert is in the file
+            opContext->weight = allocWeight(opConfig, nExpertCacheSlots * opContext->weightSize.nBytesXY);
+            expertCaches.push_back(std::unique_ptr<NnCpuExpertCache>(
+                new NnCpuExpertCache(nExperts, nExpertCacheSlots, opContext->weightSize.nBytesXY, opContext->weight)));
+            opContext->expertCache = expertCaches.back().get();
+        } else if (opContext->weightSize.nBytes > 0)
+            opContext->weight = allocWeight(opConfig, opContext->weightSize.nBytes);
         else
             opContext->weight = nullptr;
 #endif
+        const NnUint repackRows = getCpuQ40RepackRows();
+        opContext->hasRepackedWeight = !DEBUG_USE_MMAP_FOR_WEIGHTS && weightRepack && repackRows > 0u &&
+            opConfig->code == OP_MATMUL && opQuants[opIndex] == Q80_Q40_F32 &&
+            ((NnMatmulOpConfig *)opConfig->config)->nExperts == 0u &&
+            opContext->weightSize.x % repackRows == 0u;
+
+        opContext->inputArrivals = nullptr;
+        if (opConfig->input.source == SRC_PIPE) {
+            opContext->inputArrivals = netExecution->getSliceArrivals(opConfig->input.pointerIndex);
+            // Only the merge waits for the slices, other ops would read a half exchanged pipe
+            if (opContext->inputArrivals != nullptr && opConfig->code != OP_MERGE_ADD)
+                throw std::invalid_argument(std::string("Op ") + opConfig->name + " cannot read a streamed pipe");
+        }
 
+        opContext->scratch = nullptr;
         if (opInit != nullptr)
             opInit(opContext);
         opForward[opIndex] = opForwardLocal[opIndex];
     }
-    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->nOps);
+
+    // The ops inside of a fused run keep their own forward, the executor calls only the first one
+    NnUint *opSpans = new NnUint[segmentConfig->nOps];
+    for (NnUint opIndex = 0; opIndex < segmentConfig->nOps;) {
+        NnUint span = 1u;
+        if (opFusion) {
+            NnCpuOpForward fused;
+            span = getCpuOpFusion(segmentConfig->ops, opQuants.data(), opContexts, segmentConfig->nOps, opIndex, &fused);
+            if (span > 1u)
+                opForward[opIndex] = fused;
+        }
+        opSpans[opIndex] = span;
+        for (NnUint i = 1u; i < span; i++)
+            opSpans[opIndex + i] = 1u;
+        opIndex += span;
+    }
+    return new NnCpuDeviceSegment(opForward, opContexts, opSpans, segmentConfig->nOps);
 }
 
 NnCpuDeviceSegment::~NnCpuDeviceSegment() {
@@ -206,13 +622,12 @@ NnCpuDeviceSegment::~NnCpuDeviceSegment() {
         NnCpuOpContext *context = &opContexts[opIndex];
         delete[] context->input;
         delete[] context->output;
-#if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
-        if (context->weightSize.nBytes > 0)
-            releaseAlignedBuffer(context->weight);
-#endif
+        // The weight is in the arena of the device
+        delete[] context->scratch;
     }
     delete[] opForward;
     delete[] opContexts;
+    delete[] opSpans;
 }
 
 std::vector<NnByte *> NnCpuDevice::resolvePointer(NnSize3D *pntrSize, NnPointerConfig *pointerConfig) {
@@ -393,10 +808,33 @@ void NnCpuDeviceSegment::loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes
     assert(offset == 0u);
     context->weight = weight;
 #else
+    if (context->expertCache != nullptr) {
+        const NnSize expertBytes = context->weightSize.nBytesXY;
+        if (offset % expertBytes != 0u || nBytes != expertBytes)
+            throw std::runtime_error(std::string("The expert cache requires whole experts, op: ") + context->name);
+        context->expertCache->setSource((NnUint)(offset / expertBytes), weight);
+        return;
+    }
+    if (context->hasRepackedWeight) {
+        // A load has whole slices, so it has whole groups of rows
+        const NnSize rowBytes = getBytes(F_Q40, context->weightSize.y);
+        const NnSize groupBytes = rowBytes * Q40_REPACK_ROWS;
+        if (offset % groupBytes != 0u || nBytes % groupBytes != 0u)
+            throw std::runtime_error(std::string("The repacked weight requires whole groups of rows, op: ") + context->name);
+        repackQ40toQ40x4((const NnBlockQ40 *)weight, (NnBlockQ40x4 *)&context->weight[offset],
+            (NnUint)(nBytes / rowBytes), context->weightSize.y / Q40_BLOCK_SIZE);
+        return;
+    }
     std::memcpy(&context->weight[offset], weight, nBytes);
 #endif
 }
 
+void NnCpuDevice::getExpertCacheStats(NnCpuExpertCacheStats *stats) const {
+    std::memset(stats, 0, sizeof(NnCpuExpertCacheStats));
+    for (const std::unique_ptr<NnCpuExpertCache> &cache : expertCaches)
+        cache->addStats(stats);
+}
+
 void NnCpuDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) {
     NnCpuOpContext *context = &opContexts[opIndex];
     // printf("forward: %d %s (%d/%d)\n", opIndex, context->name, threadIndex + 1, nThreads); fflush(stdout);
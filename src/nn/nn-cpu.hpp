@@ -1,6 +1,7 @@
 #ifndef NN_CPU_H
 #define NN_CPU_H
 
+#include <memory>
 #include <vector>
 #include "nn-executor.hpp"
 #include "nn-cpu-ops.hpp"
@@ -8,6 +9,44 @@
 
 #define DEBUG_USE_MMAP_FOR_WEIGHTS false
 
+// Where the executor threads of the CPU device run. With NUMA the threads are grouped by nodes in
+// the thread order, so the rows of a matmul (split by SPLIT_THREADS) form one contiguous range per
+// node, like a tensor parallel split inside of the machine.
+typedef struct {
+    std::vector<int> threadCpus;  // -1 = the thread is not pinned
+    std::vector<int> threadNodes; // NUMA node of the thread, -1 = unknown
+    bool numa;                    // weights are placed on the nodes of their threads, buffers and pipes are interleaved
+} NnCpuPlacement;
+
+// cpuList is "0-15,32-47" (nullptr = all CPUs of the process). Without a list and NUMA the threads are not pinned.
+NnCpuPlacement createCpuPlacement(NnUint nThreads, const char *cpuList, bool numa);
+
+typedef struct {
+    NnSize usedBytes;
+    NnSize hugePageBytes;
+    const char *backing;
+} NnCpuArenaStats;
+
+// One mapping for the memory of a CPU device (buffers, pipes, weights), the pieces are never freed
+// one by one. Lazy buffers (the KV cache) have their own arena without explicit huge pages. Linux: explicit huge pages (1 GB, then 2 MB) if the system has a pool of them, else
+// transparent huge pages. Other systems and a failed mapping fall back to the heap.
+class NnCpuArena {
+private:
+    NnByte *base;
+    NnSize mappedSize; // 0 = heap
+    NnByte *data;
+    NnSize size;
+    NnSize used;
+    NnSize alignment;
+    const char *backing;
+public:
+    // allowHugetlb = false keeps the arena on normal pages, required for mbind on smaller ranges
+    NnCpuArena(NnSize size, NnSize alignment, bool allowHugetlb);
+    ~NnCpuArena();
+    NnByte *alloc(NnSize nBytes);
+    void getStats(NnCpuArenaStats *stats) const;
+};
+
 class NnCpuDevice : public NnDevice {
 public:
     NnByte **buffers;
@@ -18,12 +57,30 @@ private:
     const NnUnevenPartitionPlan *partitionPlan;
     NnUint nBuffers;
     NnByte *bufferFlags;
+    NnUint nExpertCacheSlots;
+    bool opFusion;
+    bool weightRepack;
+    const NnCpuPlacement *placement;
+    std::vector<int> numaNodes; // empty = the memory is not placed
+    std::unique_ptr<NnCpuArena> arena;
+    std::unique_ptr<NnCpuArena> lazyArena; // BUFFER_FLAG_LAZY buffers, never on explicit huge pages
+    std::vector<std::unique_ptr<NnCpuExpertCache>> expertCaches;
+    NnByte *allocWeight(NnOpConfig *opConfig, NnSize nBytes);
 public:
-    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *partitionPlan = nullptr);
+    // nExpertCacheSlots > 0 keeps only this many experts of every MoE matmul resident, the others
+    // are read from the mapped model file (the loader must pass pointers into the kept mapping).
+    // opFusion runs chains of small ops (see getCpuOpFusion) as one step without barriers.
+    // weightRepack interleaves the rows of dense Q40 matmuls at load time if the CPU has a kernel for it,
+    // the repacked matmuls don't use llamafile sgemm for the prefill batches.
+    // placement (optional, must outlive the device) with NUMA moves the memory to the nodes of the threads.
+    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, const NnUnevenPartitionPlan *partitionPlan = nullptr,
+        NnUint nExpertCacheSlots = 0u, bool opFusion = false, bool weightRepack = false, const NnCpuPlacement *placement = nullptr);
     ~NnCpuDevice() override;
     NnUint maxNThreads() override;
     NnDeviceSegment *createSegment(NnUint segmentIndex) override;
     std::vector<NnByte *> resolvePointer(NnSize3D *pntrSize, NnPointerConfig *pointerConfig);
+    void getExpertCacheStats(NnCpuExpertCacheStats *stats) const;
+    void getArenaStats(NnCpuArenaStats *stats) const { arena->getStats(stats); }
 };
 
 class NnCpuDeviceSegment : public NnDeviceSegment {
@@ -31,11 +88,13 @@ public:
     NnUint nOps;
     NnCpuOpForward *opForward;
     NnCpuOpContext *opContexts;
-    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnUint nOps)
-        : opForward(opForward), opContexts(opContexts), nOps(nOps) {}
+    NnUint *opSpans;
+    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnUint *opSpans, NnUint nOps)
+        : opForward(opForward), opContexts(opContexts), opSpans(opSpans), nOps(nOps) {}
     ~NnCpuDeviceSegment() override;
     void loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) override;
     void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) override;
+    NnUint getOpSpan(NnUint opIndex) override { return opSpans[opIndex]; }
 };
 
 #endif
\ No newline at end of file
@@ -1,6 +1,11 @@
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include "nn-executor.hpp"
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 void NnFakeNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) {
     // Nothing
@@ -11,6 +16,7 @@ NnNetExecution::NnNetExecution(NnUint nThreads, NnNetConfig *netConfig) {
     this->nBatches = netConfig->nBatches;
     this->nPipes = netConfig->nPipes;
     this->batchSize = 0; // This value must be overwritten before calling forward
+    this->nLogitsRows = 0;
 
     pipes = new NnByte *[netConfig->nPipes];
     for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
@@ -19,17 +25,43 @@ NnNetExecution::NnNetExecution(NnUint nThreads, NnNetConfig *netConfig) {
         std::memset(pipe, 0, pipeConfig->size.nBytes);
         pipes[pipeIndex] = pipe;
     }
+    sliceArrivals.resize(netConfig->nPipes);
+    isPipeExternal.resize(netConfig->nPipes, false);
 }
 
 NnNetExecution::~NnNetExecution() {
-    for (NnUint pipeIndex = 0; pipeIndex < nPipes; pipeIndex++)
-        delete[] pipes[pipeIndex];
+    for (NnUint pipeIndex = 0; pipeIndex < nPipes; pipeIndex++) {
+        if (!isPipeExternal[pipeIndex])
+            delete[] pipes[pipeIndex];
+    }
     delete[] pipes;
 }
 
+void NnNetExecution::setPipeMemory(NnUint pipeIndex, NnByte *memory, NnSize nBytes) {
+    assert(pipeIndex < nPipes);
+    std::memcpy(memory, pipes[pipeIndex], nBytes);
+    if (!isPipeExternal[pipeIndex])
+        delete[] pipes[pipeIndex];
+    pipes[pipeIndex] = memory;
+    isPipeExternal[pipeIndex] = true;
+}
+
 void NnNetExecution::setBatchSize(NnUint batchSize) {
     assert(batchSize <= nBatches);
     this->batchSize = batchSize;
+    this->nLogitsRows = batchSize;
+}
+
+void NnNetExecution::setLogitsRows(NnUint nLogitsRows) {
+    assert(nLogitsRows <= batchSize);
+    this->nLogitsRows = nLogitsRows;
+}
+
+NnSliceArrivals *NnNetExecution::enableSliceArrivals(NnUint pipeIndex, NnUint nNodes) {
+    assert(pipeIndex < nPipes);
+    if (!sliceArrivals[pipeIndex])
+        sliceArrivals[pipeIndex].reset(new NnSliceArrivals(nBatches, nNodes));
+    return sliceArrivals[pipeIndex].get();
 }
 
 NnExecutorDevice::NnExecutorDevice(NnDevice *device, int segmentFrom, int segmentTo) {
@@ -42,6 +74,38 @@ NnExecutorException::NnExecutorException(const std::string message)
     : std::runtime_error(message) 
 {}
 
+// How many times a thread polls before it parks on the condition variable.
+// Step handoffs are usually shorter than this, long waits (network sync, idle worker) are not.
+#define EXECUTOR_SPIN_COUNT 8192
+
+template <typename Condition>
+static inline void waitForCondition(NnExecutorContext *context, Condition condition) {
+    for (NnUint i = 0; i < EXECUTOR_SPIN_COUNT; i++) {
+        if (condition())
+            return;
+    }
+    std::unique_lock<std::mutex> lock(context->parkMutex);
+    context->nParkedThreads.fetch_add(1);
+    while (!condition())
+        context->parkCond.wait(lock);
+    context->nParkedThreads.fetch_sub(1);
+}
+
+static inline void wakeParkedThreads(NnExecutorContext *context) {
+    // The state change must be published before this check, parked threads re-check it under the lock
+    if (context->nParkedThreads.load() > 0) {
+        std::lock_guard<std::mutex> lock(context->parkMutex);
+        context->parkCond.notify_all();
+    }
+}
+
+static void *executorWorkerHandler(void *arg);
+
+NnSize getTraceTimeUs() {
+    return (NnSize)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::vector<NnExecutorDevice> *devices, NnNetExecution *netExecution, NnNodeSynchronizer *synchronizer, bool benchmark)
     : segments(nodeConfig->nSegments), steps()
 {
@@ -72,19 +136,27 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
             throw std::invalid_argument("Cannot locate device for segment " + std::to_string(segmentIndex));
 
         NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        const bool isLogitsRows = (segmentConfig->flags & SEGMENT_LOGITS_ROWS) != 0u;
         if (segmentConfig->nOps > 0) {
             printf("🔧 [DEBUG] Creating Segment %u ...\n", segmentIndex);
             NnDeviceSegment *segment = device->createSegment(segmentIndex);
             segments[segmentIndex] = std::unique_ptr<NnDeviceSegment>(segment);
 
-            for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
-                printf("  🔨 [DEBUG] Adding Step: Segment %u, Op %u (%s)\n", segmentIndex, opIndex, segmentConfig->ops[opIndex].name);
-                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex] });
+            for (NnUint opIndex = 0; opIndex < segmentConfig->nOps;) {
+                const NnUint span = segment->getOpSpan(opIndex);
+                if (span > 1u)
+                    printf("  🔨 [DEBUG] Adding Step: Segment %u, Op %u (%s + %u fused)\n", segmentIndex, opIndex, segmentConfig->ops[opIndex].name, span - 1u);
+                else
+                    printf("  🔨 [DEBUG] Adding Step: Segment %u, Op %u (%s)\n", segmentIndex, opIndex, segmentConfig->ops[opIndex].name);
+                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex], isLogitsRows });
+                stepLayers.push_back(segmentConfig->ops[opIndex].index);
+                opIndex += span;
             }
         }
         if (useSynchronizer && segmentConfig->nSyncs > 0){
             printf("  📡 [DEBUG] Adding Step: Segment %u, Sync Nodes (%u syncs)\n", segmentIndex, segmentConfig->nSyncs);
-            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr });
+            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr, isLogitsRows });
+            stepLayers.push_back(stepLayers.empty() ? 0u : stepLayers.back());
         }
 
     }
@@ -95,25 +167,76 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
     context.synchronizer = synchronizer;
     context.nSteps = (NnUint)steps.size();
     context.steps = steps.data();
+    context.stepLayers = stepLayers.data();
     if (benchmark)
         context.timer = new Timer();
     else
         context.timer = nullptr;
 
+    context.isAlive.store(true);
+    context.currentStepIndex.store(0);
+    context.doneThreadCount.store(0);
+    context.generation.store(0);
+    context.nFinishedThreads.store(0);
+    context.isShutdown.store(false);
+    context.nParkedThreads.store(0);
+    context.trace = nullptr;
+    context.traceStepStartUs = 0;
+
     threads = new NnExecutorThread[netExecution->nThreads];
     for (NnUint threadIndex = 0; threadIndex < netExecution->nThreads; threadIndex++) {
         NnExecutorThread *thread = &threads[threadIndex];
         thread->threadIndex = threadIndex;
         thread->context = &context;
     }
+    // Thread 0 is the caller of forward(), the rest live as long as the executor
+    for (NnUint threadIndex = 1; threadIndex < netExecution->nThreads; threadIndex++) {
+        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorWorkerHandler, (void *)&threads[threadIndex]);
+        assert(result == 0 && "Failed to create thread");
+    }
 }
 
 NnExecutor::~NnExecutor() {
+    context.isShutdown.store(true);
+    context.generation.fetch_add(1);
+    wakeParkedThreads(&context);
+    for (NnUint threadIndex = 1; threadIndex < context.nThreads; threadIndex++)
+        pthread_join(threads[threadIndex].handler, NULL);
+
     if (context.timer != nullptr)
         delete context.timer;
     delete[] threads;
 }
 
+static void pinThread(PthreadHandler handler, int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(handler, sizeof(set), &set) != 0)
+        throw NnExecutorException("Cannot pin a thread to the CPU " + std::to_string(cpu));
+#elif defined(_WIN32)
+    if (cpu >= 64 || SetThreadAffinityMask(handler, (DWORD_PTR)1 << cpu) == 0)
+        throw NnExecutorException("Cannot pin a thread to the CPU " + std::to_string(cpu));
+#else
+    throw NnExecutorException("Pinning of threads is not supported on this platform");
+#endif
+}
+
+void NnExecutor::setThreadCpus(const std::vector<int> &threadCpus) {
+    assert(threadCpus.size() == context.nThreads);
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        if (threadCpus[threadIndex] < 0)
+            continue;
+#ifdef _WIN32
+        PthreadHandler handler = threadIndex == 0 ? GetCurrentThread() : threads[threadIndex].handler;
+#else
+        PthreadHandler handler = threadIndex == 0 ? pthread_self() : threads[threadIndex].handler;
+#endif
+        pinThread(handler, threadCpus[threadIndex]);
+    }
+}
+
 void NnExecutor::loadWeight(const char *name, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
     for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
         NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
@@ -137,7 +260,10 @@ void NnExecutor::loadWeight(const char *name, NnUint opIndex, NnSize offset, NnS
 
 inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread *thread, NnExecutorContext *context) {
     if (step->type == STEP_EXECUTE_OP) {
-        step->segment->forward(step->arg0, nThreads, thread->threadIndex, context->batchSize);
+        // The syncs still run, they finish the exchanges the skipped ops would wait for
+        if (step->isLogitsRows && context->nLogitsRows == 0)
+            return;
+        step->segment->forward(step->arg0, nThreads, thread->threadIndex, step->isLogitsRows ? context->nLogitsRows : context->batchSize);
     } else if (step->type == STEP_SYNC_NODES) {
         context->synchronizer->sync(step->arg0, nThreads, thread->threadIndex);
     } else {
@@ -145,6 +271,54 @@ inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread
     }
 }
 
+static void takeTrafficSnapshot(NnExecutorContext *context, std::vector<NnSize> &sentBytes, std::vector<NnSize> &recvBytes) {
+    if (context->synchronizer != nullptr)
+        context->synchronizer->getPeerBytes(sentBytes, recvBytes);
+}
+
+// Called by the thread that finished the step, before the next step is released
+static void recordTraceEvent(NnExecutorContext *context, NnUint stepIndex) {
+    const NnSize now = getTraceTimeUs();
+    NnExecutorStep *step = &context->steps[stepIndex];
+    NnTraceEvent event;
+    std::memset(&event, 0, sizeof(event));
+    if (step->type == STEP_EXECUTE_OP) {
+        std::strncpy(event.name, step->opConfig->name, NN_TRACE_NAME_LENGTH - 1);
+        event.nFusedOps = step->segment->getOpSpan(step->arg0);
+    } else {
+        std::snprintf(event.name, NN_TRACE_NAME_LENGTH, "sync_%u", step->arg0);
+    }
+    event.type = (NnUint)step->type;
+    event.stepIndex = stepIndex;
+    event.layerIndex = context->stepLayers[stepIndex];
+    event.batchSize = step->isLogitsRows ? context->nLogitsRows : context->batchSize;
+    event.peerNodeIndex = -1;
+    event.startUs = context->traceStepStartUs;
+    event.endUs = now;
+
+    if (step->type == STEP_SYNC_NODES) {
+        // Background senders may move bytes at the same time, they are counted to the running step
+        takeTrafficSnapshot(context, context->traceSentBytesEnd, context->traceRecvBytesEnd);
+        NnSize maxBytes = 0;
+        const size_t nNodes = std::min(context->traceSentBytesEnd.size(), context->traceSentBytes.size());
+        for (size_t nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+            const NnSize sent = context->traceSentBytesEnd[nodeIndex] - context->traceSentBytes[nodeIndex];
+            const NnSize recv = context->traceRecvBytesEnd[nodeIndex] - context->traceRecvBytes[nodeIndex];
+            event.sentBytes += sent;
+            event.recvBytes += recv;
+            if (sent + recv > maxBytes) {
+                maxBytes = sent + recv;
+                event.peerNodeIndex = (int)nodeIndex;
+            }
+        }
+    }
+    context->trace->push_back(event);
+
+    context->traceStepStartUs = now;
+    if (stepIndex + 1 < context->nSteps && context->steps[stepIndex + 1].type == STEP_SYNC_NODES)
+        takeTrafficSnapshot(context, context->traceSentBytes, context->traceRecvBytes);
+}
+
 static inline void *executorThreadHandler(void *arg) {
     NnExecutorThread *thread = (NnExecutorThread *)arg;
     NnExecutorContext *context = thread->context;
@@ -161,6 +335,7 @@ static inline void *executorThreadHandler(void *arg) {
             executeStep(step, nThreads, thread, context);
         } catch (const std::runtime_error &e) {
             context->isAlive.store(false);
+            wakeParkedThreads(context);
             printf("🚨 Execution error: %s\n", e.what());
             break;
         }
@@ -172,19 +347,42 @@ static inline void *executorThreadHandler(void *arg) {
                 context->totalTime[step->type] += time;
                 context->timer->reset();
             }
+            if (context->trace != nullptr)
+                recordTraceEvent(context, currentStepIndex);
 
             context->doneThreadCount.store(0);
             context->currentStepIndex.fetch_add(1);
+            wakeParkedThreads(context);
         } else {
-            while (
-                context->currentStepIndex.load() == currentStepIndex &&
-                context->isAlive.load()
-            );
+            waitForCondition(context, [context, currentStepIndex]() {
+                return context->currentStepIndex.load() != currentStepIndex || !context->isAlive.load();
+            });
         }
     }
     return nullptr;
 }
 
+static void *executorWorkerHandler(void *arg) {
+    NnExecutorThread *thread = (NnExecutorThread *)arg;
+    NnExecutorContext *context = thread->context;
+    NnUint lastGeneration = 0;
+
+    while (true) {
+        waitForCondition(context, [context, lastGeneration]() {
+            return context->generation.load() != lastGeneration;
+        });
+        lastGeneration = context->generation.load();
+        if (context->isShutdown.load())
+            break;
+
+        executorThreadHandler(arg);
+
+        context->nFinishedThreads.fetch_add(1);
+        wakeParkedThreads(context);
+    }
+    return nullptr;
+}
+
 void NnExecutor::forward() {
     assert(netExecution->batchSize > 0);
 
@@ -193,20 +391,30 @@ void NnExecutor::forward() {
     context.currentStepIndex.exchange(0);
     context.doneThreadCount.exchange(0);
     context.batchSize = netExecution->batchSize;
+    context.nLogitsRows = netExecution->nLogitsRows;
 
     if (context.timer != nullptr) {
         std::memset(context.totalTime, 0, sizeof(context.totalTime));
         context.timer->reset();
     }
-
-    NnUint threadIndex;
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++) {
-        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorThreadHandler, (void *)&threads[threadIndex]);
-        assert(result == 0 && "Failed to create thread");
+    if (context.trace != nullptr) {
+        trace.clear();
+        context.traceStepStartUs = getTraceTimeUs();
+        if (context.nSteps > 0 && steps[0].type == STEP_SYNC_NODES)
+            takeTrafficSnapshot(&context, context.traceSentBytes, context.traceRecvBytes);
     }
+
+    // Workers from the previous forward have all finished, so it's safe to start a new generation
+    context.nFinishedThreads.store(0);
+    context.generation.fetch_add(1);
+    wakeParkedThreads(&context);
+
     executorThreadHandler((void *)&threads[0]);
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++)
-        pthread_join(threads[threadIndex].handler, NULL);
+
+    const NnUint nWorkers = nThreads - 1;
+    waitForCondition(&context, [this, nWorkers]() {
+        return context.nFinishedThreads.load() == nWorkers;
+    });
 
     if (!context.isAlive.load())
         throw NnExecutorException("Execution failed in one of the threads");
@@ -216,3 +424,12 @@ NnUint NnExecutor::getTotalTime(NnExecutorStepType type) {
     assert((NnUint)type < N_STEP_TYPES);
     return context.totalTime[type];
 }
+
+void NnExecutor::setTraceEnabled(bool enabled) {
+    if (enabled) {
+        trace.reserve(steps.size());
+        context.trace = &trace;
+    } else {
+        context.trace = nullptr;
+    }
+}
@@ -3,6 +3,8 @@
 
 #include "nn-core.hpp"
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <vector>
 #include <stdexcept>
 #include "pthread.h"
@@ -12,6 +14,8 @@ public:
     virtual ~NnDeviceSegment() {};
     virtual void loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) = 0;
     virtual void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) = 0;
+    // Ops run by forward(opIndex), more than 1 if the device fused the next ops into it
+    virtual NnUint getOpSpan(NnUint opIndex) { (void)opIndex; return 1u; }
 };
 
 class NnDevice {
@@ -25,6 +29,11 @@ class NnNodeSynchronizer {
 public:
     virtual ~NnNodeSynchronizer() {};
     virtual void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) = 0;
+    // Bytes sent to and received from every node so far (index = node), the trace diffs them around sync steps
+    virtual void getPeerBytes(std::vector<NnSize> &sentBytes, std::vector<NnSize> &recvBytes) {
+        sentBytes.clear();
+        recvBytes.clear();
+    }
 };
 
 class NnFakeNodeSynchronizer : public NnNodeSynchronizer {
@@ -40,9 +49,19 @@ public:
     NnByte **pipes;
     NnUint batchSize;
     NnUint nBatches;
+    NnUint nLogitsRows; // rows of SEGMENT_LOGITS_ROWS segments (0 = their ops are skipped), reset to batchSize by setBatchSize
+    std::vector<std::unique_ptr<NnSliceArrivals>> sliceArrivals; // per pipe, nullptr if the pipe is not streamed
     NnNetExecution(NnUint nThreads, NnNetConfig *netConfig);
     ~NnNetExecution();
     void setBatchSize(NnUint batchSize);
+    // Must be called after setBatchSize
+    void setLogitsRows(NnUint nLogitsRows);
+    NnSliceArrivals *enableSliceArrivals(NnUint pipeIndex, NnUint nNodes);
+    NnSliceArrivals *getSliceArrivals(NnUint pipeIndex) { return sliceArrivals[pipeIndex].get(); }
+    // The pipe moves to the memory of a device (the content is copied), the device must outlive every use of the pipe
+    void setPipeMemory(NnUint pipeIndex, NnByte *memory, NnSize nBytes);
+private:
+    std::vector<bool> isPipeExternal;
 };
 
 enum NnExecutorStepType {
@@ -65,19 +84,57 @@ typedef struct {
     NnDeviceSegment *segment;
     NnUint arg0;
     NnOpConfig *opConfig;
+    bool isLogitsRows; // the segment has SEGMENT_LOGITS_ROWS
 } NnExecutorStep;
 
+#define NN_TRACE_NAME_LENGTH 32
+
+// One executed step of a traced forward, the timestamps are getTraceTimeUs() of the node
+typedef struct {
+    char name[NN_TRACE_NAME_LENGTH];
+    NnUint type;          // NnExecutorStepType
+    NnUint stepIndex;
+    NnUint layerIndex;    // index of the op, the layer of the previous op for sync steps
+    NnUint nFusedOps;     // ops run by the step, 0 for sync steps
+    NnUint batchSize;
+    int peerNodeIndex;    // sync steps: the node that moved the most bytes, -1 if none
+    NnSize startUs;
+    NnSize endUs;
+    NnSize sentBytes;
+    NnSize recvBytes;
+} NnTraceEvent;
+
+// Monotonic clock of the trace in microseconds
+NnSize getTraceTimeUs();
+
 typedef struct {
     NnUint nThreads;
     NnUint nSteps;
     NnExecutorStep *steps;
+    const NnUint *stepLayers;
     NnNodeSynchronizer *synchronizer;
     std::atomic_uint currentStepIndex;
     std::atomic_uint doneThreadCount;
     std::atomic_bool isAlive;
+    // Persistent pool: workers wait for a new generation, then run all steps
+    std::atomic_uint generation;
+    std::atomic_uint nFinishedThreads;
+    std::atomic_bool isShutdown;
+    // Threads that exhausted the spin budget sleep on parkCond
+    std::atomic_uint nParkedThreads;
+    std::mutex parkMutex;
+    std::condition_variable parkCond;
     NnUint batchSize;
+    NnUint nLogitsRows;
     Timer *timer;
     NnUint totalTime[N_STEP_TYPES];
+    // nullptr if the trace is disabled, appended by the thread that finishes a step
+    std::vector<NnTraceEvent> *trace;
+    NnSize traceStepStartUs;
+    std::vector<NnSize> traceSentBytes;
+    std::vector<NnSize> traceRecvBytes;
+    std::vector<NnSize> traceSentBytesEnd;
+    std::vector<NnSize> traceRecvBytesEnd;
 } NnExecutorContext;
 
 typedef struct {
@@ -97,6 +154,8 @@ private:
     NnNodeConfig *nodeConfig;
     std::vector<std::unique_ptr<NnDeviceSegment>> segments;
     std::vector<NnExecutorStep> steps;
+    std::vector<NnUint> stepLayers;
+    std::vector<NnTraceEvent> trace;
     NnExecutorThread *threads;
     NnExecutorContext context;
 public:
@@ -105,6 +164,12 @@ public:
     void loadWeight(const char *name, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight);
     void forward();
     NnUint getTotalTime(NnExecutorStepType type);
+    // Every next forward() records one NnTraceEvent per step
+    void setTraceEnabled(bool enabled);
+    // threadCpus[i] = CPU of the thread i, -1 = not pinned. The thread 0 is the caller of this method,
+    // it must be the one that calls forward()
+    void setThreadCpus(const std::vector<int> &threadCpus);
+    const std::vector<NnTraceEvent> &getTrace() const { return trace; }
 };
 
 #endif
\ No newline at end of file
@@ -1,61 +1,79 @@
 #include "nn-network-local.hpp"
 #include "nn-executor.hpp" // 需要 NnExecutor 的完整定义 (loadWeight)
 #include "nn-core.hpp"     // 需要 split...Uneven 函数
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
 #include <cstring>
-
-NnLocalWeightLoader::NnLocalWeightLoader(NnExecutor *executor, NnUint nodeIndex) {
-    this->executor = executor;
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// The prefetch stays this far ahead of the copy, so the page cache is not flooded on small hosts
+#define PREFETCH_WINDOW_BYTES (256ull * 1024ull * 1024ull)
+
+NnLocalWeightLoader::NnLocalWeightLoader(NnExecutor *executor, NnUint nodeIndex, NnUint nThreads) {
+    this->sink = [executor](const NnLocalWeightJob &job, const NnByte *data) {
+        executor->loadWeight(job.opName, job.opIndex, job.deviceOffset, job.nBytes, (NnByte *)data);
+    };
     this->myNodeIndex = nodeIndex;
-    this->tempSize = 0;
-    this->temp = nullptr;
-}
-
-NnLocalWeightLoader::~NnLocalWeightLoader() {
-    if (tempSize > 0) delete[] temp;
+    this->nThreads = nThreads < 1 ? 1 : nThreads;
 }
 
-void NnLocalWeightLoader::allocate(NnSize size) {
-    if (tempSize < size) {
-        if (tempSize > 0) delete[] temp;
-        tempSize = size;
-        temp = new NnByte[size];
-    }
+NnLocalWeightLoader::NnLocalWeightLoader(NnUint nodeIndex, NnLocalWeightSink sink) {
+    this->sink = sink;
+    this->myNodeIndex = nodeIndex;
+    this->nThreads = 1;
 }
 
-void NnLocalWeightLoader::finish() {
-    // 本地加载不需要网络握手
-    if (tempSize > 0) {
-        delete[] temp;
-        tempSize = 0;
-        temp = nullptr;
-    }
+NnLocalWeightLoader::~NnLocalWeightLoader() {}
+
+void NnLocalWeightLoader::addJob(const char *opName, NnUint opIndex, NnSize deviceOffset, NnSize nBytes, NnByte *source, NnSize sourceBytes) {
+    NnLocalWeightJob job;
+    job.opName = opName;
+    job.opIndex = opIndex;
+    job.deviceOffset = deviceOffset;
+    job.nBytes = nBytes;
+    job.source = source;
+    job.sourceBytes = sourceBytes;
+    job.isColSlice = false;
+    jobs.push_back(job);
 }
 
 NnSize NnLocalWeightLoader::loadRoot(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight) {
     // [Fix] Allow any node in the first stage to load embedding, not just Node 0
-    // printf("DEBUG: loadRoot op=%s node=%d size=%lu\n", opName, myNodeIndex, nBytes);
-    executor->loadWeight(opName, opIndex, 0u, nBytes, weight);
+    addJob(opName, opIndex, 0u, nBytes, weight, nBytes);
     return nBytes;
 }
 
 NnSize NnLocalWeightLoader::loadAll(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight) {
     // 所有节点都加载完整的权重 (e.g., Norms)
-    // printf("DEBUG: loadAll op=%s node=%d size=%lu\n", opName, myNodeIndex, nBytes);
-    executor->loadWeight(opName, opIndex, 0u, nBytes, weight);
+    addJob(opName, opIndex, 0u, nBytes, weight, nBytes);
     return nBytes;
 }
 
-NnSize NnLocalWeightLoader::loadRowMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex, 
+NnSize NnLocalWeightLoader::loadRaw(const char *opName, NnUint opIndex, NnSize deviceOffset, NnSize nBytes, NnByte *weight) {
+    addJob(opName, opIndex, deviceOffset, nBytes, weight, nBytes);
+    return nBytes;
+}
+
+NnSize NnLocalWeightLoader::loadRowMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex,
                                                       std::function<NnRowMatmulSliceUneven(NnUint)> slicer, NnByte *weight) {
     // 1. 获取本节点的切片信息
     NnRowMatmulSliceUneven slice = slicer(myNodeIndex);
-    
+
     // offset: 设备内存中的偏移 (用于 MoE 的 expert 偏移，非 MoE 通常为 0)
-    NnUint deviceOffset = expertIndex * slice.sliceSize.nBytes;
+    NnSize deviceOffset = (NnSize)expertIndex * slice.sliceSize.nBytes;
 
     // [优化] Row Parallel (按行/Head 切分) 的数据在文件中是连续存储的。
     // 我们不需要 allocate temp 和 memcpy，直接计算文件内的偏移量即可。
-    
+
     // 2. 计算本节点数据在文件中的起始偏移量
     // 计算 Block 大小 (例如 Q40 是 32 个 float 一组)
     NnSize blockSize = getBlockSize(slice.type);
@@ -73,33 +91,163 @@ NnSize NnLocalWeightLoader::loadRowMatmulSlicesUneven(const char *opName, const
     // slice.inStart 是本节点的起始行号
     NnSize fileByteOffset = slice.inStart * bytesPerRow;
 
-    // 3. 直接加载 (Zero-Copy)
+    // 3. 直接加载 (Zero-Copy), 只需要预读本节点的这一段
     // weight 是当前 Tensor 的全局起始位置，weight + fileByteOffset 是本节点数据的起始位置
-    // printf("DEBUG: loadRowMatmulSlicesUneven op=%s node=%d offset=%lu size=%lu\n", opName, myNodeIndex, fileByteOffset, slice.sliceSize.nBytes);
-    executor->loadWeight(opName, opIndex, deviceOffset, slice.sliceSize.nBytes, weight + fileByteOffset);
+    addJob(opName, opIndex, deviceOffset, slice.sliceSize.nBytes, weight + fileByteOffset, slice.sliceSize.nBytes);
 
     // 4. 关键：返回 Tensor 的【全局大小】，让主循环的 b 指针正确跳过整个 Tensor
     return slice.size.nBytes;
 }
 
-NnSize NnLocalWeightLoader::loadColMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex, 
+NnSize NnLocalWeightLoader::loadColMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex,
                                                       std::function<NnColMatmulSliceUneven(NnUint)> slicer, NnByte *weight) {
     // 1. 获取本节点的切片信息
     NnColMatmulSliceUneven slice = slicer(myNodeIndex);
-    NnUint deviceOffset = expertIndex * slice.sliceSize.nBytes;
+    NnSize deviceOffset = (NnSize)expertIndex * slice.sliceSize.nBytes;
 
     // 2. Col Parallel (按列切分) 数据在文件中是跨步的 (Strided)。
     // 也就是数据是 [行0...][行1...]，我们需要取每一行的第 x 到 y 列。
-    // 这在内存中不连续，必须分配 buffer 进行重组。
-    allocate(slice.sliceSize.nBytes);
+    // 这在内存中不连续，拷贝时由 splitColMatmulWeightUneven 收集到线程的 temp 缓冲区。
+    // 每一行的片段通常小于一页, 所以预读整个 Tensor
+    addJob(opName, opIndex, deviceOffset, slice.sliceSize.nBytes, weight, slice.size.nBytes);
+    jobs.back().isColSlice = true;
+    jobs.back().colSlice = slice;
 
-    // 3. 使用之前的辅助函数，将散落的列数据收集到 temp 缓冲区
-    // splitColMatmulWeightUneven 内部已经处理了复杂的 Strided Copy 逻辑
-    splitColMatmulWeightUneven(&slice, weight, temp);
+    // 3. 关键：返回 Tensor 的【全局大小】
+    return slice.size.nBytes;
+}
 
-    // 4. 加载重组后的连续数据
-    executor->loadWeight(opName, opIndex, deviceOffset, slice.sliceSize.nBytes, temp);
+static void adviseWillNeed(const NnByte *data, NnSize size) {
+#ifndef _WIN32
+    const std::uintptr_t pageSize = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+    const std::uintptr_t start = (std::uintptr_t)data & ~(pageSize - 1);
+    const std::uintptr_t end = (std::uintptr_t)data + size;
+    // Only a hint, the copy faults the pages in anyway
+    madvise((void *)start, end - start, MADV_WILLNEED);
+#else
+    (void)data;
+    (void)size;
+#endif
+}
 
-    // 5. 关键：返回 Tensor 的【全局大小】
-    return slice.size.nBytes;
-}
\ No newline at end of file
+typedef struct {
+    std::atomic<NnUint> nextJob;
+    std::atomic<NnSize> copiedBytes;
+    std::atomic<NnSize> adviseUs;
+    std::mutex mutex;
+    NnUint nPrefetchedJobs; // guarded by mutex
+    NnUint nRanges;
+    NnSize prefetchedBytes;
+    std::string error;
+} NnLocalLoadState;
+
+// Advises the jobs starting before the read offset + window, adjacent jobs are merged into one range
+static void prefetchJobs(NnLocalLoadState *state, const std::vector<NnLocalWeightJob> &jobs, const std::vector<NnSize> &jobStarts, NnSize readOffset) {
+    NnUint from, to;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        from = state->nPrefetchedJobs;
+        to = from;
+        while (to < jobs.size() && jobStarts[to] < readOffset + PREFETCH_WINDOW_BYTES)
+            to++;
+        state->nPrefetchedJobs = to;
+    }
+    if (from == to)
+        return;
+
+    Timer timer;
+    NnUint nRanges = 0;
+    NnSize nBytes = 0;
+    NnUint i = from;
+    while (i < to) {
+        const NnByte *start = jobs[i].source;
+        const NnByte *end = start + jobs[i].sourceBytes;
+        for (i++; i < to && jobs[i].source >= start && jobs[i].source <= end; i++) {
+            const NnByte *jobEnd = jobs[i].source + jobs[i].sourceBytes;
+            if (jobEnd > end)
+                end = jobEnd;
+        }
+        adviseWillNeed(start, (NnSize)(end - start));
+        nBytes += (NnSize)(end - start);
+        nRanges++;
+    }
+    state->adviseUs += timer.elapsedMicroseconds();
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->nRanges += nRanges;
+    state->prefetchedBytes += nBytes;
+}
+
+static void runLocalLoadJobs(const NnLocalWeightSink *sink, const std::vector<NnLocalWeightJob> &jobs, const std::vector<NnSize> &jobStarts,
+    NnSize totalBytes, NnLocalLoadState *state, NnUint threadIndex) {
+    std::vector<NnByte> temp;
+    Timer progressTimer;
+    try {
+        while (true) {
+            const NnUint jobIndex = state->nextJob++;
+            if (jobIndex >= jobs.size())
+                break;
+            const NnLocalWeightJob &job = jobs[jobIndex];
+            prefetchJobs(state, jobs, jobStarts, jobStarts[jobIndex]);
+
+            if (job.isColSlice) {
+                temp.resize(job.nBytes);
+                NnColMatmulSliceUneven slice = job.colSlice;
+                splitColMatmulWeightUneven(&slice, job.source, temp.data());
+                (*sink)(job, temp.data());
+            } else {
+                (*sink)(job, job.source);
+            }
+
+            const NnSize copiedBytes = (state->copiedBytes += job.nBytes);
+            if (threadIndex == 0 && progressTimer.elapsedMiliseconds() > 5000) {
+                printf("💿 Loaded %zu/%zu MB...\n", copiedBytes / (1024 * 1024), totalBytes / (1024 * 1024));
+                progressTimer.reset();
+            }
+        }
+    } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->error.empty())
+            state->error = e.what();
+        state->nextJob = (NnUint)jobs.size(); // Stops the other threads
+    }
+}
+
+void NnLocalWeightLoader::finish() {
+    // 本地加载不需要网络握手
+    std::vector<NnSize> jobStarts(jobs.size());
+    NnSize readBytes = 0;
+    NnSize totalBytes = 0;
+    for (NnUint i = 0; i < jobs.size(); i++) {
+        jobStarts[i] = readBytes;
+        readBytes += jobs[i].sourceBytes;
+        totalBytes += jobs[i].nBytes;
+    }
+
+    NnLocalLoadState state;
+    state.nextJob = 0;
+    state.copiedBytes = 0;
+    state.adviseUs = 0;
+    state.nPrefetchedJobs = 0;
+    state.nRanges = 0;
+    state.prefetchedBytes = 0;
+
+    Timer timer;
+    const NnUint nWorkers = std::min(nThreads, (NnUint)std::max<std::size_t>(jobs.size(), 1));
+    std::vector<std::thread> threads;
+    for (NnUint threadIndex = 1; threadIndex < nWorkers; threadIndex++)
+        threads.push_back(std::thread(runLocalLoadJobs, &sink, std::cref(jobs), std::cref(jobStarts), totalBytes, &state, threadIndex));
+    runLocalLoadJobs(&sink, jobs, jobStarts, totalBytes, &state, 0);
+    for (std::thread &thread : threads)
+        thread.join();
+    const NnUint loadMs = timer.elapsedMiliseconds();
+
+    jobs.clear();
+    if (!state.error.empty())
+        throw std::runtime_error("Local weight loading failed: " + state.error);
+
+    const double mb = 1024.0 * 1024.0;
+    printf("💿 Prefetch: %.1f MB in %u ranges, madvise %u ms\n",
+        state.prefetchedBytes / mb, state.nRanges, (NnUint)(state.adviseUs.load() / 1000));
+    printf("💿 Copy: %.1f MB with %u threads in %u ms (%.1f MB/s)\n",
+        totalBytes / mb, nWorkers, loadMs, loadMs > 0 ? (totalBytes / mb) / (loadMs / 1000.0) : 0.0);
+}
@@ -3,35 +3,58 @@
 
 #include "nn-core.hpp"
 #include <functional>
+#include <vector>
 
 class NnExecutor; // 前置声明
 
+// 一次拷贝: 文件 (mmap) 中的一段 -> 设备内存中 op 的权重
+struct NnLocalWeightJob {
+    const char *opName;
+    NnUint opIndex;
+    NnSize deviceOffset;
+    NnSize nBytes;       // bytes written to the device
+    NnByte *source;      // the first byte read from the file
+    NnSize sourceBytes;  // span of the file read by the job
+    bool isColSlice;     // strided, gathered through a temp buffer
+    NnColMatmulSliceUneven colSlice;
+};
+
+// Receives the bytes of a job instead of the executor (e.g. to write a shard file)
+typedef std::function<void(const NnLocalWeightJob &job, const NnByte *data)> NnLocalWeightSink;
+
 // [分离] 仅用于本地加载权重的加载器
+// The load* calls only record what this node needs, finish() prefetches these byte ranges of
+// the file (madvise WILLNEED, a window ahead of the copy) and copies the tensors on nThreads.
 class NnLocalWeightLoader {
 public:
-    NnLocalWeightLoader(NnExecutor *executor, NnUint nodeIndex);
+    NnLocalWeightLoader(NnExecutor *executor, NnUint nodeIndex, NnUint nThreads = 1);
+    // The sink is called on one thread in the file order
+    NnLocalWeightLoader(NnUint nodeIndex, NnLocalWeightSink sink);
     ~NnLocalWeightLoader();
 
     // 基础加载接口
     NnSize loadRoot(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight);
     NnSize loadAll(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight);
+    // Bytes already laid out as in the device buffer (pre-sharded files)
+    NnSize loadRaw(const char *opName, NnUint opIndex, NnSize deviceOffset, NnSize nBytes, NnByte *weight);
 
     // 非均匀加载接口
-    NnSize loadRowMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex, 
+    NnSize loadRowMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex,
                                      std::function<NnRowMatmulSliceUneven(NnUint)> slicer, NnByte *weight);
-                                     
-    NnSize loadColMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex, 
+
+    NnSize loadColMatmulSlicesUneven(const char *opName, const NnUint opIndex, const NnUint expertIndex,
                                      std::function<NnColMatmulSliceUneven(NnUint)> slicer, NnByte *weight);
 
-    void finish(); // 空实现
+    // Runs the recorded jobs, the file must stay mapped until it returns
+    void finish();
 
 private:
-    void allocate(NnSize size);
+    void addJob(const char *opName, NnUint opIndex, NnSize deviceOffset, NnSize nBytes, NnByte *source, NnSize sourceBytes);
 
-    NnExecutor *executor;
+    NnLocalWeightSink sink;
     NnUint myNodeIndex;
-    NnByte *temp;
-    NnSize tempSize;
+    NnUint nThreads;
+    std::vector<NnLocalWeightJob> jobs;
 };
 
-#endif
\ No newline at end of file
+#endif
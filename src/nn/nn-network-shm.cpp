@@ -0,0 +1,172 @@
+#include "nn-network-shm.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define NN_SHM_SUPPORTED 1
+#else
+#define NN_SHM_SUPPORTED 0
+#endif
+
+#define SHM_MAGIC 0x4d48534eu // 'NSHM'
+
+struct NnShmRing {
+    alignas(64) std::atomic<std::uint64_t> head; // bytes written by the sender
+    alignas(64) std::atomic<std::uint64_t> tail; // bytes read by the receiver
+};
+
+struct NnShmHeader {
+    std::uint32_t magic;
+    std::uint32_t reserved;
+    std::uint64_t capacity; // bytes of every ring
+    NnShmRing rings[2];
+};
+
+#if NN_SHM_SUPPORTED
+static std::string getShmPath(const char *name) {
+    return std::string("/dev/shm/") + name;
+}
+#endif
+
+NnShmTransport::NnShmTransport(NnShmHeader *header, NnSize mappedSize, bool isCreator) {
+    this->header = header;
+    this->mappedSize = mappedSize;
+    txRing = isCreator ? 0 : 1;
+    rxRing = 1 - txRing;
+    NnByte *rings = (NnByte *)header + sizeof(NnShmHeader);
+    txData = &rings[txRing * header->capacity];
+    rxData = &rings[rxRing * header->capacity];
+}
+
+NnShmTransport::~NnShmTransport() {
+#if NN_SHM_SUPPORTED
+    munmap(header, mappedSize);
+#endif
+}
+
+std::string NnShmTransport::getHostId() {
+#if NN_SHM_SUPPORTED
+    // The boot id differs between hosts, /dev/shm may still be private to a container, open() tells
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file == nullptr)
+        return std::string();
+    char id[64] = {0};
+    if (fgets(id, sizeof(id), file) == nullptr)
+        id[0] = '\0';
+    fclose(file);
+    id[strcspn(id, "\n")] = '\0';
+    return std::string(id);
+#else
+    return std::string();
+#endif
+}
+
+NnShmTransport *NnShmTransport::create(const char *name, NnSize capacity) {
+#if NN_SHM_SUPPORTED
+    std::string path = getShmPath(name);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Cannot create shared memory " + path + ": " + strerror(errno));
+    NnSize mappedSize = sizeof(NnShmHeader) + 2 * capacity;
+    if (ftruncate(fd, (off_t)mappedSize) != 0) {
+        close(fd);
+        ::unlink(path.c_str());
+        throw std::runtime_error("Cannot resize shared memory " + path);
+    }
+    void *data = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ::unlink(path.c_str());
+        throw std::runtime_error("Cannot map shared memory " + path);
+    }
+    NnShmHeader *header = (NnShmHeader *)data;
+    header->capacity = capacity;
+    for (NnUint i = 0; i < 2; i++) {
+        header->rings[i].head.store(0);
+        header->rings[i].tail.store(0);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHM_MAGIC;
+    return new NnShmTransport(header, mappedSize, true);
+#else
+    (void)name;
+    (void)capacity;
+    throw std::runtime_error("Shared memory transport is not supported on this platform");
+#endif
+}
+
+NnShmTransport *NnShmTransport::open(const char *name) {
+#if NN_SHM_SUPPORTED
+    std::string path = getShmPath(name);
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return nullptr;
+    NnShmHeader header;
+    const size_t prefixSize = offsetof(NnShmHeader, rings);
+    if (pread(fd, &header, prefixSize, 0) != (ssize_t)prefixSize || header.magic != SHM_MAGIC) {
+        close(fd);
+        return nullptr;
+    }
+    NnSize mappedSize = sizeof(NnShmHeader) + 2 * header.capacity;
+    void *data = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    return new NnShmTransport((NnShmHeader *)data, mappedSize, false);
+#else
+    (void)name;
+    return nullptr;
+#endif
+}
+
+void NnShmTransport::unlink(const char *name) {
+#if NN_SHM_SUPPORTED
+    ::unlink(getShmPath(name).c_str());
+#else
+    (void)name;
+#endif
+}
+
+NnSize NnShmTransport::getCapacity() const {
+    return header->capacity;
+}
+
+NnSize NnShmTransport::trySend(const void *data, NnSize size) {
+    NnShmRing *ring = &header->rings[txRing];
+    const std::uint64_t capacity = header->capacity;
+    const std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const std::uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    const NnSize n = (NnSize)std::min<std::uint64_t>(size, capacity - (head - tail));
+    if (n == 0)
+        return 0;
+    const NnSize offset = (NnSize)(head % capacity);
+    const NnSize first = std::min(n, (NnSize)capacity - offset);
+    std::memcpy(&txData[offset], data, first);
+    std::memcpy(txData, (const NnByte *)data + first, n - first);
+    ring->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+NnSize NnShmTransport::tryRecv(void *data, NnSize size) {
+    NnShmRing *ring = &header->rings[rxRing];
+    const std::uint64_t capacity = header->capacity;
+    const std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    const std::uint64_t head = ring->head.load(std::memory_order_acquire);
+    const NnSize n = (NnSize)std::min<std::uint64_t>(size, head - tail);
+    if (n == 0)
+        return 0;
+    const NnSize offset = (NnSize)(tail % capacity);
+    const NnSize first = std::min(n, (NnSize)capacity - offset);
+    std::memcpy(data, &rxData[offset], first);
+    std::memcpy((NnByte *)data + first, rxData, n - first);
+    ring->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
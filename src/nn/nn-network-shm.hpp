@@ -0,0 +1,35 @@
+#ifndef NN_NETWORK_SHM_HPP
+#define NN_NETWORK_SHM_HPP
+
+#include "nn-network.hpp"
+#include <string>
+
+struct NnShmHeader;
+
+// Link to a node on the same host: two single-producer single-consumer rings in a shared
+// memory segment, one per direction. The side that creates the segment sends on the first ring.
+class NnShmTransport : public NnTransport {
+private:
+    NnShmHeader *header;
+    NnSize mappedSize;
+    NnByte *txData;
+    NnByte *rxData;
+    NnUint txRing;
+    NnUint rxRing;
+    NnShmTransport(NnShmHeader *header, NnSize mappedSize, bool isCreator);
+public:
+    // An id shared by the processes that can map the same segments, empty if shm is not supported
+    static std::string getHostId();
+    static NnShmTransport *create(const char *name, NnSize capacity);
+    // nullptr if the segment cannot be mapped (e.g. the peer is in another container)
+    static NnShmTransport *open(const char *name);
+    // The mapping stays valid after the name is removed
+    static void unlink(const char *name);
+    ~NnShmTransport() override;
+    const char *getName() const override { return "shm"; }
+    NnSize getCapacity() const;
+    NnSize trySend(const void *data, NnSize size) override;
+    NnSize tryRecv(void *data, NnSize size) override;
+};
+
+#endif
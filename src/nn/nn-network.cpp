@@ -7,23 +7,44 @@ typedef SSIZE_T ssize_t;
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <poll.h>
 #include <netdb.h>  // for getaddrinfo
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #endif
 #include "nn-network.hpp"
+#include "nn-network-shm.hpp"
 #include "nn-core.hpp"
+#include "nn-quants.hpp"
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
 #include <vector>
 #include <chrono>
 #include <fcntl.h>
+#include <algorithm>
+#include <thread>
 
 #define SOCKET_LAST_ERRCODE errno
 #define SOCKET_LAST_ERROR strerror(errno)
 
 #define ACK 23571114
 #define MAX_CHUNK_SIZE 65536
+// Below this size the completion notification costs more than the copy
+#define ZEROCOPY_MIN_SIZE 16384
+// Idle polls of a non-socket transport between checks of the TCP socket of the peer
+#define TRANSPORT_CHECK_PEER_INTERVAL 65536
+#define TRANSPORT_OFFER_MAGIC 0x5452534eu // 'NSRT'
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define NN_NETWORK_ZEROCOPY 1
+#else
+#define NN_NETWORK_ZEROCOPY 0
+#endif
 
 static inline bool isEagainError() {
     #ifdef _WIN32
@@ -502,6 +523,24 @@ int acceptSocket(int serverSocket) {
     return clientSocket;
 }
 
+int tryAcceptSocket(int serverSocket) {
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrSize = sizeof(clientAddr);
+    int clientSocket = ::accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrSize);
+    if (clientSocket < 0) {
+        if (isEagainError())
+            return -1;
+        throw std::runtime_error("Error accepting connection");
+    }
+    setNoDelay(clientSocket);
+    setQuickAck(clientSocket);
+    return clientSocket;
+}
+
+void setSocketNonBlocking(int socket, bool enabled) {
+    setNonBlocking(socket, enabled);
+}
+
 void initSockets() {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -605,7 +644,7 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
     }
 
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets));
+    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets, nodeIndex + 1));
 }
 
 std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnUint *ports) {
@@ -634,21 +673,37 @@ std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnU
         writeAckPacket(sockets[i].fd);
     }
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets));
+    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets, 0));
 }
 
-NnNetwork::NnNetwork(std::vector<NnSocket> *sockets) {
+NnNetwork::NnNetwork(std::vector<NnSocket> *sockets, NnUint nodeIndex) {
     this->nSockets = sockets->size();
+    this->nodeIndex = nodeIndex;
     this->sockets = new int[nSockets];
     for (NnUint i = 0; i < nSockets; i++)
         this->sockets[i] = sockets->at(i).release();
     this->sentBytes = new NnSize[nSockets];
     this->recvBytes = new NnSize[nSockets];
+    this->nSendCalls = new NnSize[nSockets];
+    this->zeroCopyBytes = new NnSize[nSockets];
+    this->isZeroCopy = new bool[nSockets];
+    this->nZeroCopyPending = new NnUint[nSockets];
+    for (NnUint i = 0; i < nSockets; i++) {
+        isZeroCopy[i] = false;
+        nZeroCopyPending[i] = 0;
+    }
+    transports.resize(nSockets);
+    resetStats();
 }
 
 NnNetwork::~NnNetwork() {
+    transports.clear();
     delete[] sentBytes;
     delete[] recvBytes;
+    delete[] nSendCalls;
+    delete[] zeroCopyBytes;
+    delete[] isZeroCopy;
+    delete[] nZeroCopyPending;
     for (NnUint i = 0; i < nSockets; i++)
         destroySocket(sockets[i]);
     delete[] sockets;
@@ -661,21 +716,479 @@ void NnNetwork::setTurbo(bool enabled) {
     }
 }
 
-void NnNetwork::write(const NnUint socketIndex, const void *data, const NnSize size) {
+NnLinkMatrix::NnLinkMatrix(NnUint nNodes)
+    : nNodes(nNodes), links(nNodes * nNodes, NnLinkProfile{0.0f, 0.0f})
+{}
+
+void NnLinkMatrix::set(NnUint a, NnUint b, NnLinkProfile profile) {
+    links[a * nNodes + b] = profile;
+    links[b * nNodes + a] = profile;
+}
+
+double NnLinkMatrix::getTransferUs(NnUint a, NnUint b, double nBytes) const {
+    if (a == b)
+        return 0.0;
+    const NnLinkProfile &link = get(a, b);
+    return link.latencyUs + (link.gbps > 0.0f ? nBytes / (link.gbps * 1e3) : 0.0);
+}
+
+#define LINK_PROBE_ROUND_TRIPS 16
+#define LINK_PROBE_BYTES (4 * 1024 * 1024)
+#define LINK_PROBE_TRANSFERS 3
+
+enum NnLinkProbeCommandType : NnUint {
+    LINK_PROBE_DONE = 0,   // the matrix follows
+    LINK_PROBE_SEND = 1,   // probe the peer and send the profile to the root
+    LINK_PROBE_ANSWER = 2, // answer the probes of the peer
+};
+
+typedef struct {
+    NnUint type;
+    NnUint socketIndex; // the peer
+} NnLinkProbeCommand;
+
+// The prober writes NnUint size + size bytes and the peer acks every probe until a probe of size 0.
+// The latency is the half of the fastest round trip of 1 byte, the throughput is from the fastest
+// transfer of LINK_PROBE_BYTES without the round trip.
+static NnLinkProfile probeLink(NnNetwork *network, NnUint socketIndex) {
+    std::vector<NnByte> payload(LINK_PROBE_BYTES, 0);
+    NnUint size = 1;
+    NnSize minRoundTripUs = 0;
+    for (NnUint i = 0; i < LINK_PROBE_ROUND_TRIPS; i++) {
+        const NnSize startUs = getTraceTimeUs();
+        network->write(socketIndex, &size, sizeof(size));
+        network->write(socketIndex, payload.data(), size);
+        network->readAck(socketIndex);
+        const NnSize us = getTraceTimeUs() - startUs;
+        if (i == 0 || us < minRoundTripUs)
+            minRoundTripUs = us;
+    }
+    size = LINK_PROBE_BYTES;
+    NnSize minTransferUs = 0;
+    for (NnUint i = 0; i < LINK_PROBE_TRANSFERS; i++) {
+        const NnSize startUs = getTraceTimeUs();
+        network->write(socketIndex, &size, sizeof(size));
+        network->write(socketIndex, payload.data(), size);
+        network->readAck(socketIndex);
+        const NnSize us = getTraceTimeUs() - startUs;
+        if (i == 0 || us < minTransferUs)
+            minTransferUs = us;
+    }
+    size = 0;
+    network->write(socketIndex, &size, sizeof(size));
+
+    NnLinkProfile profile;
+    profile.latencyUs = minRoundTripUs / 2.0f;
+    profile.gbps = LINK_PROBE_BYTES / (std::max(minTransferUs - std::min(minRoundTripUs, minTransferUs), (NnSize)1) * 1e3f);
+    return profile;
+}
+
+static void answerLinkProbes(NnNetwork *network, NnUint socketIndex) {
+    std::vector<NnByte> payload;
+    for (;;) {
+        NnUint size;
+        network->read(socketIndex, &size, sizeof(size));
+        if (size == 0)
+            break;
+        payload.resize(size);
+        network->read(socketIndex, payload.data(), size);
+        network->writeAck(socketIndex);
+    }
+}
+
+void NnNetwork::probeLinks() {
+    const NnUint nNodes = nSockets + 1;
+    linkMatrix.reset(new NnLinkMatrix(nNodes));
+
+    if (nodeIndex != 0) {
+        for (;;) {
+            NnLinkProbeCommand command;
+            read(ROOT_SOCKET_INDEX, &command, sizeof(command));
+            if (command.type == LINK_PROBE_DONE)
+                break;
+            if (command.type == LINK_PROBE_SEND) {
+                const NnLinkProfile profile = probeLink(this, command.socketIndex);
+                write(ROOT_SOCKET_INDEX, &profile, sizeof(profile));
+            } else {
+                answerLinkProbes(this, command.socketIndex);
+            }
+        }
+        read(ROOT_SOCKET_INDEX, linkMatrix->links.data(), linkMatrix->links.size() * sizeof(NnLinkProfile));
+        return;
+    }
+
+    // One pair at a time, so the probes do not share the links or the hosts
+    for (NnUint a = 0; a < nNodes; a++) {
+        for (NnUint b = a + 1; b < nNodes; b++) {
+            NnLinkProbeCommand command;
+            command.type = LINK_PROBE_ANSWER;
+            command.socketIndex = getSocketIndexForNode(a, b);
+            write(getSocketIndexForNode(b, 0), &command, sizeof(command));
+            if (a == 0) {
+                linkMatrix->set(a, b, probeLink(this, getSocketIndexForNode(b, 0)));
+                continue;
+            }
+            const NnUint socketIndex = getSocketIndexForNode(a, 0);
+            command.type = LINK_PROBE_SEND;
+            command.socketIndex = getSocketIndexForNode(b, a);
+            write(socketIndex, &command, sizeof(command));
+            NnLinkProfile profile;
+            read(socketIndex, &profile, sizeof(profile));
+            linkMatrix->set(a, b, profile);
+        }
+    }
+    NnLinkProbeCommand done;
+    done.type = LINK_PROBE_DONE;
+    done.socketIndex = 0;
+    for (NnUint socketIndex = 0; socketIndex < nSockets; socketIndex++) {
+        write(socketIndex, &done, sizeof(done));
+        write(socketIndex, linkMatrix->links.data(), linkMatrix->links.size() * sizeof(NnLinkProfile));
+    }
+}
+
+typedef struct {
+    NnUint magic;
+    NnUint enableShm;
+    NnUint pid;
+    char hostId[52];
+} NnTransportOffer;
+
+void NnNetwork::negotiateTransports(bool enableShm, NnSize shmCapacity) {
+    // Every phase writes to all peers first and reads after, so the order of the sockets doesn't matter
+    NnTransportOffer myOffer;
+    std::memset(&myOffer, 0, sizeof(myOffer));
+    myOffer.magic = TRANSPORT_OFFER_MAGIC;
+    myOffer.pid = (NnUint)getpid();
+    std::string hostId = NnShmTransport::getHostId();
+    myOffer.enableShm = (enableShm && !hostId.empty()) ? 1u : 0u;
+    std::strncpy(myOffer.hostId, hostId.c_str(), sizeof(myOffer.hostId) - 1);
+
+    std::vector<NnTransportOffer> offers(nSockets);
+    for (NnUint i = 0; i < nSockets; i++)
+        write(i, &myOffer, sizeof(myOffer));
+    for (NnUint i = 0; i < nSockets; i++) {
+        read(i, &offers[i], sizeof(NnTransportOffer));
+        if (offers[i].magic != TRANSPORT_OFFER_MAGIC)
+            throw std::runtime_error("Invalid transport offer, the nodes run different versions");
+    }
+
+    // The side with the lower pid creates the segment, the other one reports if it could map it
+    std::vector<bool> isShared(nSockets);
+    std::vector<std::unique_ptr<NnTransport>> created(nSockets);
+    std::vector<std::string> names(nSockets);
+    for (NnUint i = 0; i < nSockets; i++) {
+        const NnTransportOffer *offer = &offers[i];
+        isShared[i] = myOffer.enableShm && offer->enableShm &&
+            std::strncmp(myOffer.hostId, offer->hostId, sizeof(myOffer.hostId)) == 0 &&
+            myOffer.pid != offer->pid;
+        if (!isShared[i] || myOffer.pid > offer->pid)
+            continue;
+        char name[64] = {0};
+        std::snprintf(name, sizeof(name), "dllama-%u-%u", myOffer.pid, offer->pid);
+        try {
+            created[i].reset(NnShmTransport::create(name, shmCapacity));
+            names[i] = name;
+        } catch (const std::exception &e) {
+            printf("⭕ Socket[%u]: %s\n", i, e.what());
+            name[0] = '\0';
+        }
+        write(i, name, sizeof(name));
+    }
+    for (NnUint i = 0; i < nSockets; i++) {
+        if (!isShared[i] || myOffer.pid < offers[i].pid)
+            continue;
+        char name[64];
+        read(i, name, sizeof(name));
+        if (name[0] != '\0')
+            created[i].reset(NnShmTransport::open(name));
+        NnUint isOpened = created[i] ? 1u : 0u;
+        write(i, &isOpened, sizeof(isOpened));
+        transports[i] = std::move(created[i]);
+    }
+    for (NnUint i = 0; i < nSockets; i++) {
+        if (!isShared[i] || myOffer.pid > offers[i].pid)
+            continue;
+        NnUint isOpened;
+        read(i, &isOpened, sizeof(isOpened));
+        if (!names[i].empty())
+            NnShmTransport::unlink(names[i].c_str());
+        if (isOpened == 1)
+            transports[i] = std::move(created[i]);
+    }
+
+    for (NnUint i = 0; i < nSockets; i++) {
+        if (transports[i])
+            printf("⭕ Socket[%u]: %s transport\n", i, transports[i]->getName());
+    }
+}
+
+const char *NnNetwork::getTransportName(NnUint socketIndex) const {
     assert(socketIndex < nSockets);
+    return transports[socketIndex] ? transports[socketIndex]->getName() : "tcp";
+}
 
-    NnByte *current = (NnByte *)data;
+void NnNetwork::checkPeer(NnUint socketIndex) {
+#ifndef _WIN32
+    char byte;
+    if (recv(sockets[socketIndex], &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+        throw NnTransferSocketException(0, "Socket closed");
+#else
+    (void)socketIndex;
+#endif
+}
+
+void NnNetwork::writeTransport(NnUint socketIndex, const void *data, NnSize size) {
+    NnTransport *transport = transports[socketIndex].get();
+    unsigned long nIdle = 0;
+    while (size > 0) {
+        NnSize n = transport->trySend(data, size);
+        if (n == 0) {
+            if (++nIdle % TRANSPORT_CHECK_PEER_INTERVAL == 0)
+                checkPeer(socketIndex);
+            std::this_thread::yield();
+            continue;
+        }
+        nIdle = 0;
+        data = (const NnByte *)data + n;
+        size -= n;
+    }
+}
+
+bool NnNetwork::readTransport(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts) {
+    // maxAttempts = 0 means infinite attempts, like tryReadSocket
+    NnTransport *transport = transports[socketIndex].get();
+    const NnSize totalSize = size;
+    unsigned long nIdle = 0;
+    while (size > 0) {
+        NnSize n = transport->tryRecv(data, size);
+        if (n == 0) {
+            if (size == totalSize && maxAttempts > 0 && --maxAttempts == 0)
+                return false;
+            if (++nIdle % TRANSPORT_CHECK_PEER_INTERVAL == 0)
+                checkPeer(socketIndex);
+            std::this_thread::yield();
+            continue;
+        }
+        nIdle = 0;
+        data = (NnByte *)data + n;
+        size -= n;
+    }
+    return true;
+}
+
+bool NnNetwork::setZeroCopy(bool enabled) {
+#if NN_NETWORK_ZEROCOPY
+    for (NnUint i = 0; i < nSockets; i++) {
+        if (transports[i])
+            continue;
+        waitZeroCopy(i);
+        if (enabled) {
+            int value = 1;
+            if (setsockopt(sockets[i], SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) < 0)
+                return false;
+        }
+        isZeroCopy[i] = enabled;
+    }
+    return true;
+#else
+    return !enabled;
+#endif
+}
+
+int NnNetwork::getSendFlags(NnUint socketIndex, NnSize size) {
+#if NN_NETWORK_ZEROCOPY
+    if (isZeroCopy[socketIndex] && size >= ZEROCOPY_MIN_SIZE)
+        return MSG_ZEROCOPY;
+#endif
+    return 0;
+}
+
+void NnNetwork::onSent(NnUint socketIndex, int flags, NnSize size) {
+    nSendCalls[socketIndex]++;
+#if NN_NETWORK_ZEROCOPY
+    if ((flags & MSG_ZEROCOPY) != 0) {
+        zeroCopyBytes[socketIndex] += size;
+        nZeroCopyPending[socketIndex]++;
+    }
+#endif
+}
+
+// The caller may reuse the buffers when a write returns, so the kernel must be done with the
+// pages sent with MSG_ZEROCOPY. Completions come on the error queue of the socket.
+void NnNetwork::waitZeroCopy(NnUint socketIndex) {
+#if NN_NETWORK_ZEROCOPY
     int s = sockets[socketIndex];
-    for (NnSize chunk = 0; chunk < size; chunk += MAX_CHUNK_SIZE) {
-        NnSize chunkSize = chunk + MAX_CHUNK_SIZE < size ? MAX_CHUNK_SIZE : size - chunk;
-        writeSocket(s, current, chunkSize);
-        current += chunkSize;
+    while (nZeroCopyPending[socketIndex] > 0) {
+        char control[128];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                struct pollfd pfd = { s, 0, 0 }; // POLLERR is always reported
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            NnUint nCompleted = err.ee_data - err.ee_info + 1;
+            nZeroCopyPending[socketIndex] -= std::min(nCompleted, nZeroCopyPending[socketIndex]);
+            if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0 && isZeroCopy[socketIndex]) {
+                // E.g. loopback, the kernel copied the pages anyway and we only pay for the notification
+                isZeroCopy[socketIndex] = false;
+                printf("⭕ Socket[%u]: MSG_ZEROCOPY falls back to a copy, disabled\n", socketIndex);
+            }
+        }
     }
+#else
+    (void)socketIndex;
+#endif
+}
+
+void NnNetwork::write(const NnUint socketIndex, const void *data, const NnSize size) {
+    NnIoBuffer buffer = { data, size };
+    writeGather(socketIndex, 1, &buffer);
+}
+
+void NnNetwork::writeGather(const NnUint socketIndex, NnUint nBuffers, const NnIoBuffer *buffers) {
+    assert(socketIndex < nSockets);
+    int s = sockets[socketIndex];
+    NnSize size = 0;
+    if (transports[socketIndex]) {
+        for (NnUint i = 0; i < nBuffers; i++) {
+            writeTransport(socketIndex, buffers[i].data, buffers[i].size);
+            size += buffers[i].size;
+        }
+        sentBytes[socketIndex] += size;
+        return;
+    }
+#ifdef _WIN32
+    for (NnUint i = 0; i < nBuffers; i++) {
+        NnByte *current = (NnByte *)buffers[i].data;
+        for (NnSize chunk = 0; chunk < buffers[i].size; chunk += MAX_CHUNK_SIZE) {
+            NnSize chunkSize = chunk + MAX_CHUNK_SIZE < buffers[i].size ? MAX_CHUNK_SIZE : buffers[i].size - chunk;
+            writeSocket(s, current, chunkSize);
+            onSent(socketIndex, 0, chunkSize);
+            current += chunkSize;
+        }
+        size += buffers[i].size;
+    }
+#else
+    std::vector<struct iovec> iov(nBuffers);
+    for (NnUint i = 0; i < nBuffers; i++) {
+        iov[i].iov_base = (void *)buffers[i].data;
+        iov[i].iov_len = buffers[i].size;
+        size += buffers[i].size;
+    }
+    struct iovec *current = iov.data();
+    NnUint nCurrent = nBuffers;
+    NnSize left = size;
+    while (left > 0) {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = current;
+        msg.msg_iovlen = nCurrent;
+        int flags = getSendFlags(socketIndex, left);
+        ssize_t n = sendmsg(s, &msg, flags);
+        if (n < 0) {
+            if (isEagainError())
+                continue;
+            if (flags != 0 && errno == ENOBUFS) {
+                // Too many pages are pinned by pending zero-copy sends
+                waitZeroCopy(socketIndex);
+                continue;
+            }
+            throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+        } else if (n == 0) {
+            throw NnTransferSocketException(0, "Socket closed");
+        }
+        onSent(socketIndex, flags, n);
+        left -= n;
+        while (nCurrent > 0 && (NnSize)n >= current->iov_len) {
+            n -= current->iov_len;
+            current++;
+            nCurrent--;
+        }
+        if (n > 0) {
+            current->iov_base = (char *)current->iov_base + n;
+            current->iov_len -= n;
+        }
+    }
+    waitZeroCopy(socketIndex);
+#endif
     sentBytes[socketIndex] += size;
 }
 
+void NnNetwork::readScatter(const NnUint socketIndex, NnUint nBuffers, const NnIoBuffer *buffers) {
+    assert(socketIndex < nSockets);
+    if (transports[socketIndex]) {
+        for (NnUint i = 0; i < nBuffers; i++)
+            read(socketIndex, (void *)buffers[i].data, buffers[i].size);
+        return;
+    }
+#ifdef _WIN32
+    for (NnUint i = 0; i < nBuffers; i++)
+        read(socketIndex, (void *)buffers[i].data, buffers[i].size);
+#else
+    int s = sockets[socketIndex];
+    std::vector<struct iovec> iov(nBuffers);
+    NnSize size = 0;
+    for (NnUint i = 0; i < nBuffers; i++) {
+        iov[i].iov_base = (void *)buffers[i].data;
+        iov[i].iov_len = buffers[i].size;
+        size += buffers[i].size;
+    }
+    struct iovec *current = iov.data();
+    NnUint nCurrent = nBuffers;
+    NnSize left = size;
+    while (left > 0) {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = current;
+        msg.msg_iovlen = nCurrent;
+        ssize_t n = recvmsg(s, &msg, 0);
+        if (n < 0) {
+            if (isEagainError()) {
+                // The peers may still compute, sleep until the socket has data
+                struct pollfd pfd = { s, POLLIN, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+        } else if (n == 0) {
+            throw NnTransferSocketException(0, "Socket closed");
+        }
+        left -= n;
+        while (nCurrent > 0 && (NnSize)n >= current->iov_len) {
+            n -= current->iov_len;
+            current++;
+            nCurrent--;
+        }
+        if (n > 0) {
+            current->iov_base = (char *)current->iov_base + n;
+            current->iov_len -= n;
+        }
+    }
+    recvBytes[socketIndex] += size;
+#endif
+}
+
 void NnNetwork::read(const NnUint socketIndex, void *data, const NnSize size) {
     assert(socketIndex < nSockets);
+    if (transports[socketIndex]) {
+        readTransport(socketIndex, data, size, 0);
+        recvBytes[socketIndex] += size;
+        return;
+    }
 
     NnByte *current = (NnByte *)data;
     int s = sockets[socketIndex];
@@ -689,17 +1202,32 @@ void NnNetwork::read(const NnUint socketIndex, void *data, const NnSize size) {
 
 void NnNetwork::writeAck(const NnUint socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
+    if (transports[socketIndex]) {
+        NnUint packet = ACK;
+        writeTransport(socketIndex, &packet, sizeof(packet));
+        return;
+    }
     writeAckPacket(sockets[socketIndex]);
 }
 
 void NnNetwork::readAck(const NnUint socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
+    if (transports[socketIndex]) {
+        NnUint packet;
+        readTransport(socketIndex, &packet, sizeof(packet), 0);
+        if (packet != ACK)
+            throw std::runtime_error("Invalid ack packet");
+        return;
+    }
     readAckPacket(sockets[socketIndex]);
 }
 
 bool NnNetwork::tryReadWithMaxAttempts(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
-    if (tryReadSocket(sockets[socketIndex], data, size, maxAttempts)) {
+    bool isRead = transports[socketIndex]
+        ? readTransport(socketIndex, data, size, maxAttempts)
+        : tryReadSocket(sockets[socketIndex], data, size, maxAttempts);
+    if (isRead) {
         recvBytes[socketIndex] += size;
         return true;
     }
@@ -709,6 +1237,7 @@ bool NnNetwork::tryReadWithMaxAttempts(NnUint socketIndex, void *data, NnSize si
 void NnNetwork::writeMany(NnUint n, NnSocketIo *ios) {
     bool isWriting;
     NnSize nBytes = 0;
+    unsigned long nIdle = 0;
     for (NnUint i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
         assert(io->socketIndex < nSockets);
@@ -720,22 +1249,44 @@ void NnNetwork::writeMany(NnUint n, NnSocketIo *ios) {
             NnSocketIo *io = &ios[i];
             if (io->size > 0) {
                 isWriting = true;
+                NnTransport *transport = transports[io->socketIndex].get();
+                if (transport != nullptr) {
+                    NnSize s = transport->trySend(io->data, io->size);
+                    if (s == 0) {
+                        if (++nIdle % TRANSPORT_CHECK_PEER_INTERVAL == 0)
+                            checkPeer(io->socketIndex);
+                        std::this_thread::yield();
+                    }
+                    io->size -= s;
+                    io->data = (const NnByte *)io->data + s;
+                    continue;
+                }
                 int socket = sockets[io->socketIndex];
                 ssize_t chunkSize = io->size > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : io->size;
-                ssize_t s = send(socket, (const char*)io->data, chunkSize, 0);
+                int flags = getSendFlags(io->socketIndex, chunkSize);
+                ssize_t s = send(socket, (const char*)io->data, chunkSize, flags);
                 if (s < 0) {
                     if (isEagainError()) {
                         continue;
                     }
+                    if (flags != 0 && errno == ENOBUFS) {
+                        waitZeroCopy(io->socketIndex);
+                        continue;
+                    }
                     throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
                 } else if (s == 0) {
                     throw NnTransferSocketException(0, "Socket closed");
                 }
+                onSent(io->socketIndex, flags, s);
                 io->size -= s;
                 io->data = (char*)io->data + s;
             }
         }
     } while (isWriting);
+    for (NnUint i = 0; i < n; i++) {
+        if (!transports[ios[i].socketIndex])
+            waitZeroCopy(ios[i].socketIndex);
+    }
 }
 
 void NnNetwork::writeAll(void *data, NnSize size) {
@@ -752,6 +1303,7 @@ void NnNetwork::writeAll(void *data, NnSize size) {
 void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
     bool isReading;
     NnSize nBytes = 0;
+    unsigned long nIdle = 0;
     for (NnUint i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
         assert(io->socketIndex < nSockets);
@@ -763,6 +1315,18 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
             NnSocketIo *io = &ios[i];
             if (io->size > 0) {
                 isReading = true;
+                NnTransport *transport = transports[io->socketIndex].get();
+                if (transport != nullptr) {
+                    NnSize r = transport->tryRecv((void *)io->data, io->size);
+                    if (r == 0) {
+                        if (++nIdle % TRANSPORT_CHECK_PEER_INTERVAL == 0)
+                            checkPeer(io->socketIndex);
+                        std::this_thread::yield();
+                    }
+                    io->size -= r;
+                    io->data = (NnByte *)io->data + r;
+                    continue;
+                }
                 int socket = sockets[io->socketIndex];
                 ssize_t r = recv(socket, (char*)io->data, io->size, 0);
                 if (r < 0) {
@@ -780,20 +1344,36 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
     } while (isReading);
 }
 
-void NnNetwork::getStats(NnSize *sentBytes, NnSize *recvBytes) {
+void NnNetwork::getStats(NnSize *sentBytes, NnSize *recvBytes, NnNetworkIoStats *ioStats) {
     *sentBytes = 0;
     *recvBytes = 0;
+    if (ioStats != nullptr) {
+        ioStats->nSendCalls = 0;
+        ioStats->zeroCopyBytes = 0;
+    }
     for (NnUint i = 0; i < nSockets; i++) {
         *sentBytes += this->sentBytes[i];
         *recvBytes += this->recvBytes[i];
+        if (ioStats != nullptr) {
+            ioStats->nSendCalls += nSendCalls[i];
+            ioStats->zeroCopyBytes += zeroCopyBytes[i];
+        }
     }
     resetStats();
 }
 
+void NnNetwork::getPeerStats(NnUint socketIndex, NnSize *sentBytes, NnSize *recvBytes) const {
+    assert(socketIndex < nSockets);
+    *sentBytes = this->sentBytes[socketIndex];
+    *recvBytes = this->recvBytes[socketIndex];
+}
+
 void NnNetwork::resetStats() {
     for (NnUint i = 0; i < nSockets; i++) {
         sentBytes[i] = 0;
         recvBytes[i] = 0;
+        nSendCalls[i] = 0;
+        zeroCopyBytes[i] = 0;
     }
 }
 
@@ -831,85 +1411,242 @@ void NnNetwork::recvFromNode(NnUint sourceNodeIndex, NnUint myNodeIndex, void* d
     }
 }
 
+// Broadcast collectives. The group is ordered by rank, the root has rank 0 and the node of rank r
+// receives from the rank (r - 1) / fanout and forwards every chunk to the ranks r * fanout + 1 ...
+// r * fanout + fanout. fanout = nNodes - 1 is the direct broadcast, 2 the binary tree and 1 the
+// pipelined ring (chain). TCP keeps the order of the bytes in every socket, so no ACK is needed.
+#define BROADCAST_TREE_MIN_BYTES 16384
+#define BROADCAST_RING_MIN_BYTES 1048576
+#define BROADCAST_CHUNK_SIZE 65536
+
+static NnUint getBroadcastFanout(NnUint nGroupNodes, NnSize nBytes) {
+    if (nGroupNodes <= 3 || nBytes < BROADCAST_TREE_MIN_BYTES)
+        return nGroupNodes - 1; // latency bound, one hop is the fastest
+    if (nBytes >= BROADCAST_RING_MIN_BYTES)
+        return 1; // bandwidth bound, every uplink sends the payload once
+    return 2;
+}
+
+// Predicted microseconds of the broadcast over the probed links: the slowest path of latencies, the
+// busiest sender and the chunks that fill the pipeline of forwarding nodes
+static double getBroadcastUs(const NnLinkMatrix *links, const std::vector<NnUint> &rankNodes, NnUint fanout, NnSize nBytes) {
+    const NnUint nRanks = (NnUint)rankNodes.size();
+    const double chunkBytes = fanout + 1 >= nRanks ? (double)nBytes : (double)std::min((NnSize)BROADCAST_CHUNK_SIZE, nBytes);
+    std::vector<double> pathUs(nRanks, 0.0);
+    std::vector<NnUint> depth(nRanks, 0u);
+    std::vector<double> sendUs(nRanks, 0.0);
+    std::vector<double> chunkUs(nRanks, 0.0);
+    double maxPathUs = 0.0;
+    NnUint maxDepth = 0;
+    for (NnUint r = 1; r < nRanks; r++) {
+        const NnUint parent = (r - 1) / fanout;
+        const NnLinkProfile &link = links->get(rankNodes[parent], rankNodes[r]);
+        pathUs[r] = pathUs[parent] + link.latencyUs;
+        depth[r] = depth[parent] + 1;
+        sendUs[parent] += links->getTransferUs(rankNodes[parent], rankNodes[r], (double)nBytes) - link.latencyUs;
+        chunkUs[parent] += links->getTransferUs(rankNodes[parent], rankNodes[r], chunkBytes) - link.latencyUs;
+        maxPathUs = std::max(maxPathUs, pathUs[r]);
+        maxDepth = std::max(maxDepth, depth[r]);
+    }
+    return maxPathUs + *std::max_element(sendUs.begin(), sendUs.end()) +
+        (maxDepth - 1) * *std::max_element(chunkUs.begin(), chunkUs.end());
+}
+
+// With the probed links every rank is the node nearest to the previous rank, so the nodes behind
+// the same switch are neighbours in the chain and in the subtrees and a slow link is crossed rarely.
+// All nodes have the same matrix, so they agree on the order and on the fanout.
+static NnUint planBroadcast(const NnLinkMatrix *links, std::vector<NnUint> &rankNodes, NnSize nBytes) {
+    const NnUint nRanks = (NnUint)rankNodes.size();
+    for (NnUint r = 1; r + 1 < nRanks; r++) {
+        NnUint best = r;
+        for (NnUint i = r + 1; i < nRanks; i++) {
+            if (links->getTransferUs(rankNodes[r - 1], rankNodes[i], (double)nBytes) <
+                links->getTransferUs(rankNodes[r - 1], rankNodes[best], (double)nBytes))
+                best = i;
+        }
+        std::swap(rankNodes[r], rankNodes[best]);
+    }
+    NnUint bestFanout = nRanks - 1;
+    double bestUs = getBroadcastUs(links, rankNodes, bestFanout, nBytes);
+    for (NnUint fanout = 2; fanout >= 1; fanout--) {
+        if (fanout + 1 >= nRanks)
+            continue;
+        const double us = getBroadcastUs(links, rankNodes, fanout, nBytes);
+        if (us < bestUs) {
+            bestUs = us;
+            bestFanout = fanout;
+        }
+    }
+    return bestFanout;
+}
+
+static void broadcastInGroup(
+    NnNetwork *network,
+    NnUint myNodeIndex,
+    const std::vector<NnUint> &rankNodes, // rankNodes[0] is the root
+    NnUint fanout,
+    NnByte *buffer,
+    NnSize nBytes,
+    NnUint nThreads,
+    NnUint threadIndex
+) {
+    const NnUint nRanks = (NnUint)rankNodes.size();
+    NnUint myRank = 0;
+    while (myRank < nRanks && rankNodes[myRank] != myNodeIndex)
+        myRank++;
+    if (myRank == nRanks)
+        return; // not in the group
+
+    std::vector<int> children;
+    for (NnUint r = myRank * fanout + 1; r <= myRank * fanout + fanout && r < nRanks; r++)
+        children.push_back(network->getSocketIndexForNode(rankNodes[r], myNodeIndex));
+
+    if (myRank == 0 && fanout + 1 >= nRanks) {
+        // 直接广播: root 的线程分担 socket
+        const NnUint nChildren = (NnUint)children.size();
+        std::vector<NnSocketIo> ios;
+        for (NnUint i = threadIndex; i < nChildren; i += nThreads) {
+            NnSocketIo io;
+            io.socketIndex = children[i];
+            io.data = buffer;
+            io.size = nBytes;
+            ios.push_back(io);
+        }
+        if (!ios.empty())
+            network->writeMany((NnUint)ios.size(), &ios[0]);
+        return;
+    }
+
+    // Forwarding nodes relay every chunk as soon as it arrives
+    if (threadIndex != 0)
+        return;
+    const int parent = myRank == 0 ? -1 : network->getSocketIndexForNode(rankNodes[(myRank - 1) / fanout], myNodeIndex);
+    std::vector<NnSocketIo> ios(children.size());
+    for (NnSize offset = 0; offset < nBytes; offset += BROADCAST_CHUNK_SIZE) {
+        const NnSize chunkSize = std::min((NnSize)BROADCAST_CHUNK_SIZE, nBytes - offset);
+        if (parent >= 0)
+            network->read(parent, &buffer[offset], chunkSize);
+        for (NnUint i = 0; i < children.size(); i++) {
+            ios[i].socketIndex = children[i];
+            ios[i].data = &buffer[offset];
+            ios[i].size = chunkSize;
+        }
+        if (!ios.empty())
+            network->writeMany((NnUint)ios.size(), &ios[0]);
+    }
+}
+
 static void syncWithRoot(
     NnNetwork *network, 
     NnUint myNodeIndex, 
+    NnUint nNodes,
     NnByte *buffer, 
     NnSize nBytes, 
     NnUint nThreads, 
     NnUint threadIndex,
-    const NnStageConfig *stage // [新增] 传入 Stage 信息
+    const NnStageConfig *stage // Stage 内广播, nullptr = 全局广播
 ) {
-    // 1. 确定谁是 Root
-    NnUint groupRootIndex = getGroupRootIndex(stage); // 复用之前的辅助函数
-    bool amIRoot = (myNodeIndex == groupRootIndex);
-    
-    if (amIRoot) {
-        // --- Root 发送 (Broadcast) ---
-        
-        // 确定目标节点列表
-        std::vector<int> targetSockets;
-        if (stage) {
-            // Stage 内广播：只发给组内其他节点
-            for(NnUint i=0; i<stage->nNodes; ++i) {
-                NnUint target = stage->nodeIndices[i];
-                if(target != myNodeIndex) {
-                    int sock = network->getSocketIndexForNode(target, myNodeIndex);
-                    if(sock >= 0) targetSockets.push_back(sock);
-                }
-            }
-        } else {
-            // 全局广播：发给所有 Socket (简单处理)
-            // 注意：这假设 network->nSockets 包含了所有 Worker
-            for(NnUint i=0; i<network->nSockets; ++i) targetSockets.push_back(i);
-        }
-
-        NnUint nTargets = targetSockets.size();
-        if (nTargets == 0) return;
-
-        // 分配给线程
-        NnUint nSocketsPerThread = nTargets / nThreads + (nTargets % nThreads > threadIndex ? 1 : 0);
-        if (nSocketsPerThread == 0) return;
-
-        NnUint startIdx = 0;
-        for (NnUint t = 0; t < threadIndex; ++t) {
-            startIdx += nTargets / nThreads + (nTargets % nThreads > t ? 1 : 0);
-        }
-
-        std::vector<NnSocketIo> ios(nSocketsPerThread);
-        for (NnUint i = 0; i < nSocketsPerThread; i++) {
-            ios[i].socketIndex = targetSockets[startIdx + i]; // 使用真实的 Socket Index
-            ios[i].data = buffer;
-            ios[i].size = nBytes;
-        }
-        network->writeMany(nSocketsPerThread, &ios[0]);
-
-        // [新增] Root 等待 Workers 确认 (ACK)
-        // 确保 Workers 已经接收完数据，实现同步屏障
-        for (NnUint i = 0; i < nSocketsPerThread; i++) {
-            network->readAck(ios[i].socketIndex);
-        }
-
-    } else {
-        // --- Worker 接收 ---
-
-        if (threadIndex != 0) return; // 接收通常只需要一个线程
-
-        int rootSocketIndex = network->getSocketIndexForNode(groupRootIndex, myNodeIndex);
-        if (rootSocketIndex < 0) {
-            // 异常：找不到 Root 的连接
-            return; 
-        }
+    const NnUint groupRootIndex = getGroupRootIndex(stage);
+    std::vector<NnUint> rankNodes;
+    rankNodes.push_back(groupRootIndex);
+    const NnUint nGroupNodes = stage ? stage->nNodes : nNodes;
+    for (NnUint i = 0; i < nGroupNodes; ++i) {
+        const NnUint node = stage ? stage->nodeIndices[i] : i;
+        if (node != groupRootIndex)
+            rankNodes.push_back(node);
+    }
+    if (rankNodes.size() < 2)
+        return;
 
-        NnSocketIo ios;
-        ios.data = buffer;
-        ios.size = nBytes;
-        ios.socketIndex = rootSocketIndex; // [修正] 使用查找到的 Socket，而不是硬编码 0
-        network->readMany(1, &ios);
+    const NnLinkMatrix *links = network->getLinkMatrix();
+    const NnUint fanout = links != nullptr
+        ? planBroadcast(links, rankNodes, nBytes)
+        : getBroadcastFanout((NnUint)rankNodes.size(), nBytes);
+    broadcastInGroup(network, myNodeIndex, rankNodes, fanout, buffer, nBytes, nThreads, threadIndex);
+}
 
-        // [新增] Worker 发送确认 (ACK) 给 Root
-        network->writeAck(rootSocketIndex);
+static bool isLogitsNode(const NnUnevenPartitionPlan *plan, NnUint nodeIndex) {
+    // 流水线并行时只有最后一个 Stage 计算 logits
+    if (plan == nullptr || plan->nStages == 0)
+        return true;
+    const NnStageConfig &lastStage = plan->stages[plan->nStages - 1];
+    for (NnUint i = 0; i < lastStage.nNodes; ++i) {
+        if (lastStage.nodeIndices[i] == nodeIndex)
+            return true;
     }
+    return false;
+}
+
+static void syncNodeSlotsToRoot(
+    NnNetwork *network,
+    NnUint myNodeIndex,
+    NnUint nNodes,
+    NnByte *buffer,
+    NnSize nBytes,
+    NnUint nThreads,
+    NnUint threadIndex,
+    const NnUnevenPartitionPlan *plan
+) {
+    // Every node owns the same fixed slot, so there is no split matching like in syncNodeSlices
+    const NnSize slotBytes = nBytes / nNodes;
+
+    if (myNodeIndex != 0) {
+        if (threadIndex != 0 || !isLogitsNode(plan, myNodeIndex))
+            return;
+        network->sendToNode(0, myNodeIndex, &buffer[myNodeIndex * slotBytes], slotBytes);
+        return;
+    }
+
+    std::vector<NnSocketIo> ios;
+    NnUint nodeCount = 0;
+    for (NnUint nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        if (!isLogitsNode(plan, nodeIndex))
+            continue;
+        if (nodeCount++ % nThreads != threadIndex)
+            continue;
+        NnSocketIo io;
+        io.socketIndex = network->getSocketIndexForNode(nodeIndex, myNodeIndex);
+        io.data = &buffer[nodeIndex * slotBytes];
+        io.size = slotBytes;
+        ios.push_back(io);
+    }
+    if (!ios.empty())
+        network->readMany((NnUint)ios.size(), &ios[0]);
+}
+
+static void syncNodeExchange(
+    NnNetwork *network,
+    NnUint myNodeIndex,
+    NnUint nNodes,
+    NnByte *buffer,
+    NnSize nBytes,
+    NnUint nThreads,
+    NnUint threadIndex
+) {
+    // The slice of the node s is [chunk for node 0, chunk for node 1, ...], the node d gets the chunk d of every slice
+    const NnSize sliceBytes = nBytes / nNodes;
+    const NnSize chunkBytes = sliceBytes / nNodes;
+
+    std::vector<NnSocketIo> writes;
+    std::vector<NnSocketIo> reads;
+    NnUint peerCount = 0;
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        if (nodeIndex == myNodeIndex)
+            continue;
+        if (peerCount++ % nThreads != threadIndex)
+            continue;
+        NnSocketIo io;
+        io.socketIndex = network->getSocketIndexForNode(nodeIndex, myNodeIndex);
+        io.data = &buffer[myNodeIndex * sliceBytes + nodeIndex * chunkBytes];
+        io.size = chunkBytes;
+        writes.push_back(io);
+        io.data = &buffer[nodeIndex * sliceBytes + myNodeIndex * chunkBytes];
+        reads.push_back(io);
+    }
+    if (writes.empty())
+        return;
+    network->writeMany((NnUint)writes.size(), &writes[0]);
+    network->readMany((NnUint)reads.size(), &reads[0]);
 }
 
 static void syncNodeSlices(
@@ -1153,72 +1890,240 @@ static void syncNodeSlices(
     }
 }
 
-static void syncPpSend(NnNetwork *network, NnUint myNodeIndex, NnByte *buffer, NnSize nBytes, 
-                       const NnUnevenPartitionPlan *plan) {
-    // 1. 找到我所在的 Stage
-    const NnStageConfig* myStage = nullptr;
-    const NnStageConfig* nextStage = nullptr;
-    
-    for (NnUint s = 0; s < plan->nStages; ++s) {
-        // 检查我是否是该 Stage 的成员
-        for (NnUint i = 0; i < plan->stages[s].nNodes; ++i) {
-            if (plan->stages[s].nodeIndices[i] == myNodeIndex) {
-                myStage = &plan->stages[s];
-                // 如果还有下一个 Stage
-                if (s + 1 < plan->nStages) {
-                    nextStage = &plan->stages[s+1];
-                }
-                break;
-            }
-        }
-        if (myStage) break;
+NnSyncEncoder::NnSyncEncoder(NnSyncCodec codec, NnUint nElements, NnUint nRows) {
+    this->wireType = getSyncCodecFloatType(codec);
+    this->nElements = nElements;
+    if (nElements % getBlockSize(wireType) != 0)
+        throw std::invalid_argument(std::string("Sync codec ") + syncCodecToString(codec) + " needs rows divisible by " + std::to_string(getBlockSize(wireType)));
+    this->rowBytes = getBytes(wireType, nElements);
+    buffer.resize(nRows * rowBytes);
+}
+
+static void encodeSyncRow(NnFloatType wireType, const float *row, NnByte *output, NnUint n) {
+    if (wireType == F_32) {
+        std::memcpy(output, row, n * sizeof(float));
+    } else if (wireType == F_16) {
+        NnFp16 *out = (NnFp16 *)output;
+        for (NnUint i = 0; i < n; i++)
+            out[i] = CONVERT_F32_TO_F16(row[i]);
+    } else if (wireType == F_Q80) {
+        quantizeF32toQ80(row, (NnBlockQ80 *)output, n, 1, 0);
+    } else if (wireType == F_Q40) {
+        quantizeF32toQ40(row, (NnBlockQ40 *)output, n, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported sync wire type");
     }
+}
 
-    // 2. 只有当前 Stage 的 Root 负责发送
-    if (myStage && myStage->rootNodeIndex == myNodeIndex) {
-        if (nextStage) {
-            // 发送给下一阶段的 Root
-            // printf("🚀 [PP] Node %u sending %zu bytes to Node %u (Stage %u)\n", 
-            //        myNodeIndex, nBytes, nextStage->rootNodeIndex, nextStage->stageIndex);
-            
-            // 注意：这里需要 network 实现点对点 write
-            // 如果网络拓扑不支持直连，可能需要通过 Node 0 中转
-            network->sendToNode(nextStage->rootNodeIndex, myNodeIndex, buffer, nBytes);
+static void decodeSyncRow(NnFloatType wireType, const NnByte *input, float *row, NnUint n) {
+    if (wireType == F_32) {
+        std::memcpy(row, input, n * sizeof(float));
+    } else if (wireType == F_16) {
+        const NnFp16 *in = (const NnFp16 *)input;
+        for (NnUint i = 0; i < n; i++)
+            row[i] = CONVERT_F16_TO_F32(in[i]);
+    } else if (wireType == F_Q80) {
+        dequantizeQ80toF32((const NnBlockQ80 *)input, row, n, 1, 0);
+    } else if (wireType == F_Q40) {
+        dequantizeQ40toF32((const NnBlockQ40 *)input, row, n, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported sync wire type");
+    }
+}
+
+void NnSyncEncoder::encode(const float *row, NnByte *output) {
+    encodeSyncRow(wireType, row, output, nElements);
+}
+
+void NnSyncEncoder::decode(const NnByte *input, float *row) const {
+    decodeSyncRow(wireType, input, row, nElements);
+}
+
+NnPpAsyncSender::NnPpAsyncSender(NnNetwork *network, NnUint myNodeIndex) {
+    this->network = network;
+    this->myNodeIndex = myNodeIndex;
+    this->isRunning = true;
+    this->isSending = false;
+    int result = pthread_create(&handler, NULL, (PthreadFunc)threadHandler, (void *)this);
+    if (result != 0)
+        throw std::runtime_error("Failed to create PP sender thread");
+}
+
+NnPpAsyncSender::~NnPpAsyncSender() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isRunning = false;
+    }
+    cond.notify_all();
+    pthread_join(handler, NULL);
+}
+
+void *NnPpAsyncSender::threadHandler(void *arg) {
+    NnPpAsyncSender *sender = (NnPpAsyncSender *)arg;
+    std::unique_lock<std::mutex> lock(sender->mutex);
+    while (true) {
+        while (sender->isRunning && sender->queue.empty())
+            sender->cond.wait(lock);
+        if (sender->queue.empty())
+            break; // Stopped and drained
+
+        NnPpSendJob job = std::move(sender->queue.front());
+        sender->queue.pop_front();
+        sender->isSending = true;
+        lock.unlock();
+
+        std::string error;
+        try {
+            sender->network->sendToNode(job.targetNodeIndex, sender->myNodeIndex, job.data.data(), job.data.size());
+        } catch (const std::exception &e) {
+            error = e.what();
         }
+
+        lock.lock();
+        if (!error.empty() && sender->error.empty())
+            sender->error = error;
+        sender->freeBuffers.push_back(std::move(job.data));
+        sender->isSending = false;
+        sender->cond.notify_all();
     }
+    return nullptr;
 }
 
-static void syncPpRecv(NnNetwork *network, NnUint myNodeIndex, NnByte *buffer, NnSize nBytes, 
-                       const NnUnevenPartitionPlan *plan) {
-    const NnStageConfig* myStage = nullptr;
-    const NnStageConfig* prevStage = nullptr;
+void NnPpAsyncSender::send(NnUint targetNodeIndex, const NnByte *data, NnSize size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!error.empty())
+        throw NnTransferSocketException(0, "PP send failed: " + error);
 
-    for (NnUint s = 0; s < plan->nStages; ++s) {
-        for (NnUint i = 0; i < plan->stages[s].nNodes; ++i) {
-            if (plan->stages[s].nodeIndices[i] == myNodeIndex) {
-                myStage = &plan->stages[s];
-                if (s > 0) {
-                    prevStage = &plan->stages[s-1];
-                }
-                break;
+    NnPpSendJob job;
+    job.targetNodeIndex = targetNodeIndex;
+    if (!freeBuffers.empty()) {
+        job.data = std::move(freeBuffers.back());
+        freeBuffers.pop_back();
+    }
+    job.data.resize(size);
+    std::memcpy(job.data.data(), data, size);
+    queue.push_back(std::move(job));
+    lock.unlock();
+    cond.notify_all();
+}
+
+void NnPpAsyncSender::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!queue.empty() || isSending)
+        cond.wait(lock);
+    if (!error.empty())
+        throw NnTransferSocketException(0, "PP send failed: " + error);
+}
+
+NnSliceExchanger::NnSliceExchanger(NnNetwork *network, NnUint myNodeIndex, const std::vector<NnUint> &peerNodes) {
+    this->network = network;
+    this->myNodeIndex = myNodeIndex;
+    this->peerNodes = peerNodes;
+    this->isRunning = true;
+    this->hasJob = false;
+    int result = pthread_create(&handler, NULL, (PthreadFunc)threadHandler, (void *)this);
+    if (result != 0)
+        throw std::runtime_error("Failed to create slice exchanger thread");
+}
+
+NnSliceExchanger::~NnSliceExchanger() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isRunning = false;
+    }
+    cond.notify_all();
+    pthread_join(handler, NULL);
+}
+
+void NnSliceExchanger::exchange() {
+    std::vector<NnSocketIo> ios(peerNodes.size());
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        for (NnUint i = 0; i < peerNodes.size(); i++) {
+            ios[i].socketIndex = network->getSocketIndexForNode(peerNodes[i], myNodeIndex);
+            ios[i].data = &sendBuffer[batchIndex * wireSlotBytes];
+            ios[i].size = wireSlotBytes;
+        }
+        network->writeMany((NnUint)ios.size(), &ios[0]);
+
+        // The merge adds the slices in the node order, so they are received in the same order
+        NnByte *row = &pipe[batchIndex * rowBytes];
+        for (NnUint peerNode : peerNodes) {
+            const int socketIndex = network->getSocketIndexForNode(peerNode, myNodeIndex);
+            if (encoder == nullptr) {
+                network->read(socketIndex, &row[peerNode * slotBytes], slotBytes);
+            } else {
+                network->read(socketIndex, recvBuffer.data(), wireSlotBytes);
+                encoder->decode(recvBuffer.data(), (float *)&row[peerNode * slotBytes]);
             }
+            arrivals->markArrived(batchIndex, peerNode, epoch);
         }
-        if (myStage) break;
     }
+}
 
-    // 只有当前 Stage 的 Root 负责接收
-    if (myStage && myStage->rootNodeIndex == myNodeIndex) {
-        if (prevStage) {
-            // 从上一阶段的 Root 接收
-            // printf("📥 [PP] Node %u receiving %zu bytes from Node %u (Stage %u)\n", 
-            //        myNodeIndex, nBytes, prevStage->rootNodeIndex, prevStage->stageIndex);
-                   
-            network->recvFromNode(prevStage->rootNodeIndex, myNodeIndex, buffer, nBytes);
-        } else {
-            // 如果是 Stage 0 的第一层，数据应该来自 Embedding/Input，理论上不走 PP_RECV
-            // 除非我们在架构设计上把 Embedding 视为 "Stage -1"
+void *NnSliceExchanger::threadHandler(void *arg) {
+    NnSliceExchanger *exchanger = (NnSliceExchanger *)arg;
+    std::unique_lock<std::mutex> lock(exchanger->mutex);
+    while (true) {
+        while (exchanger->isRunning && !exchanger->hasJob)
+            exchanger->cond.wait(lock);
+        if (!exchanger->hasJob)
+            break;
+        lock.unlock();
+
+        std::string error;
+        try {
+            exchanger->exchange();
+        } catch (const std::exception &e) {
+            error = e.what();
+            exchanger->arrivals->markFailed();
         }
-    }
+
+        lock.lock();
+        if (!error.empty() && exchanger->error.empty())
+            exchanger->error = error;
+        exchanger->hasJob = false;
+        exchanger->cond.notify_all();
+    }
+    return nullptr;
+}
+
+void NnSliceExchanger::start(NnSliceArrivals *arrivals, NnByte *pipe, NnSize rowBytes, NnUint nNodes, NnUint batchSize, NnSyncEncoder *encoder) {
+    assert(rowBytes % nNodes == 0);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (hasJob)
+        cond.wait(lock);
+    if (!error.empty())
+        throw NnTransferSocketException(0, "Slice exchange failed: " + error);
+
+    this->arrivals = arrivals;
+    this->pipe = pipe;
+    this->rowBytes = rowBytes;
+    this->slotBytes = rowBytes / nNodes;
+    this->batchSize = batchSize;
+    this->encoder = encoder;
+    this->wireSlotBytes = encoder != nullptr ? encoder->getRowBytes() : slotBytes;
+    // The next op may overwrite the slice of this node before it is on the wire
+    sendBuffer.resize(batchSize * wireSlotBytes);
+    recvBuffer.resize(wireSlotBytes);
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnByte *slot = &pipe[batchIndex * rowBytes + myNodeIndex * slotBytes];
+        if (encoder == nullptr)
+            std::memcpy(&sendBuffer[batchIndex * wireSlotBytes], slot, slotBytes);
+        else
+            encoder->encode((const float *)slot, &sendBuffer[batchIndex * wireSlotBytes]);
+    }
+    this->epoch = arrivals->begin(batchSize, myNodeIndex);
+    hasJob = true;
+    lock.unlock();
+    cond.notify_all();
+}
+
+void NnSliceExchanger::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (hasJob)
+        cond.wait(lock);
+    if (!error.empty())
+        throw NnTransferSocketException(0, "Slice exchange failed: " + error);
 }
 
 NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, const NnUnevenPartitionPlan *plan) {
@@ -1234,16 +2139,69 @@ NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetEx
             for (NnUint i = 0; i < plan->stages[s].nNodes; ++i) {
                 if (plan->stages[s].nodeIndices[i] == nodeConfig->nodeIndex) {
                     this->myStage = &plan->stages[s];
+                    if (s > 0)
+                        this->prevStage = &plan->stages[s - 1];
+                    if (s + 1 < plan->nStages)
+                        this->nextStage = &plan->stages[s + 1];
                     goto stage_found; // 跳出双层循环
                 }
             }
         }
     }
 stage_found:;
+    // 只有 Stage Root 负责 PP 发送，启动后台发送线程
+    if (myStage != nullptr && nextStage != nullptr && myStage->rootNodeIndex == nodeConfig->nodeIndex)
+        ppSender.reset(new NnPpAsyncSender(network, nodeConfig->nodeIndex));
+
+    bool hasStreamedSync = false;
+    encoders.resize(nodeConfig->nSegments);
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        encoders[segmentIndex].resize(segmentConfig->nSyncs);
+        for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+            NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+            if (syncConfig->codec != SYNC_CODEC_NONE) {
+                NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
+                if (pipeConfig->size.floatType != F_32)
+                    throw std::invalid_argument(std::string("Sync codec needs a F32 pipe: ") + pipeConfig->name);
+                NnUint nElements;
+                if (syncConfig->syncType == SYNC_PP_SEND || syncConfig->syncType == SYNC_PP_RECV)
+                    nElements = pipeConfig->size.x;
+                else if (syncConfig->syncType == SYNC_NODE_SLICES_STREAMED)
+                    nElements = pipeConfig->size.x / netConfig->nNodes;
+                else
+                    throw std::invalid_argument("Sync codec is supported only by the PP hand-off and the streamed slice exchange");
+                encoders[segmentIndex][syncIndex].reset(new NnSyncEncoder(syncConfig->codec, nElements, pipeConfig->size.y));
+            }
+            if (syncConfig->syncType != SYNC_NODE_SLICES_STREAMED)
+                continue;
+            execution->enableSliceArrivals(segmentConfig->syncs[syncIndex].pipeIndex, netConfig->nNodes);
+            hasStreamedSync = true;
+        }
+    }
+    if (hasStreamedSync) {
+        std::vector<NnUint> peerNodes;
+        for (NnUint nodeIndex = 0; nodeIndex < netConfig->nNodes; nodeIndex++) {
+            if (nodeIndex != nodeConfig->nodeIndex)
+                peerNodes.push_back(nodeIndex);
+        }
+        sliceExchanger.reset(new NnSliceExchanger(network, nodeConfig->nodeIndex, peerNodes));
+    }
+}
+
+void NnNetworkNodeSynchronizer::getPeerBytes(std::vector<NnSize> &sentBytes, std::vector<NnSize> &recvBytes) {
+    sentBytes.assign(netConfig->nNodes, 0);
+    recvBytes.assign(netConfig->nNodes, 0);
+    for (NnUint nodeIndex = 0; nodeIndex < netConfig->nNodes; nodeIndex++) {
+        const int socketIndex = network->getSocketIndexForNode(nodeIndex, nodeConfig->nodeIndex);
+        if (socketIndex >= 0 && (NnUint)socketIndex < network->nSockets)
+            network->getPeerStats((NnUint)socketIndex, &sentBytes[nodeIndex], &recvBytes[nodeIndex]);
+    }
 }
 
 void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) {
     NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    const NnUint batchSize = (segmentConfig->flags & SEGMENT_LOGITS_ROWS) != 0u ? execution->nLogitsRows : execution->batchSize;
 
     for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
         NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
@@ -1251,6 +2209,7 @@ void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUin
         NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
         NnSize batchBytes = getBytes(pipeConfig->size.floatType, pipeConfig->size.x);
         NnUint totalElements = pipeConfig->size.x; // [New] Get total elements
+        NnSyncEncoder *encoder = encoders[segmentIndex][syncIndex].get();
 
         // (Debug) Uncomment if you need per-sync pipe size info
         // if (threadIndex == 0) {
@@ -1259,42 +2218,73 @@ void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUin
         //            pipeConfig->size.floatType, pipeConfig->size.x, (size_t)batchBytes);
         // }
 
-        auto start = std::chrono::high_resolution_clock::now();
-        const char* syncTypeStr = "UNKNOWN";
+        if (syncConfig->syncType == SYNC_NODE_SLICES_STREAMED) {
+            // Only starts the exchange, the consumer waits for the slices it reads
+            if (threadIndex == 0)
+                sliceExchanger->start(execution->getSliceArrivals(syncConfig->pipeIndex), pipe, batchBytes, netConfig->nNodes, batchSize, encoder);
+            continue;
+        }
+        // Other syncs use the sockets from the executor threads
+        if (sliceExchanger)
+            sliceExchanger->flush();
+
+        // PP 点对点传输: 整个 batch 一次发送/接收, 只由 Stage Root 的 thread 0 执行
+        if (syncConfig->syncType == SYNC_PP_SEND) {
+            if (threadIndex == 0 && ppSender) {
+                if (encoder == nullptr) {
+                    ppSender->send(nextStage->rootNodeIndex, pipe, batchBytes * batchSize);
+                } else {
+                    NnByte *wire = encoder->getBuffer();
+                    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+                        encoder->encode((const float *)&pipe[batchIndex * batchBytes], &wire[batchIndex * encoder->getRowBytes()]);
+                    ppSender->send(nextStage->rootNodeIndex, wire, encoder->getRowBytes() * batchSize);
+                }
+            }
+            continue;
+        }
+
+        if (syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT || syncConfig->syncType == SYNC_NODE_SLOTS_EXCEPT_ROOT) {
+            if (skipLogitsSync)
+                continue;
+            // 跨 Stage 收集 logits, 先等待后台 PP 发送完成 (Stage 内的同步不会用到下一 Stage 的 socket)
+            if (ppSender)
+                ppSender->flush();
+        }
+
+        if (syncConfig->syncType == SYNC_PP_RECV) {
+            if (threadIndex == 0 && prevStage != nullptr && myStage->rootNodeIndex == nodeConfig->nodeIndex) {
+                if (encoder == nullptr) {
+                    network->recvFromNode(prevStage->rootNodeIndex, nodeConfig->nodeIndex, pipe, batchBytes * batchSize);
+                } else {
+                    NnByte *wire = encoder->getBuffer();
+                    network->recvFromNode(prevStage->rootNodeIndex, nodeConfig->nodeIndex, wire, encoder->getRowBytes() * batchSize);
+                    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+                        encoder->decode(&wire[batchIndex * encoder->getRowBytes()], (float *)&pipe[batchIndex * batchBytes]);
+                }
+            }
+            continue;
+        }
 
-        for (NnUint batchIndex = 0; batchIndex < execution->batchSize; batchIndex++) {
+        if (syncConfig->syncType == SYNC_WITH_ROOT) {
+            // Rows of the batch are contiguous, the whole batch is one broadcast
+            syncWithRoot(network, nodeConfig->nodeIndex, netConfig->nNodes, pipe, batchBytes * batchSize, nThreads, threadIndex, this->myStage);
+            continue;
+        }
+
+        for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
             NnByte *pipeBatch = &pipe[batchIndex * batchBytes];
 
-            if (syncConfig->syncType == SYNC_WITH_ROOT) {
-                syncTypeStr = "SYNC_WITH_ROOT";
-                syncWithRoot(network, nodeConfig->nodeIndex, pipeBatch, batchBytes, nThreads, threadIndex, this->myStage);
-            } else if (syncConfig->syncType == SYNC_NODE_SLICES) {
-                syncTypeStr = "SYNC_NODE_SLICES";
+            if (syncConfig->syncType == SYNC_NODE_SLICES) {
                 syncNodeSlices(false, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, pipeConfig->size.floatType, nThreads, threadIndex, plan, this->myStage, totalElements);
             } else if (syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT) {
-                syncTypeStr = "SYNC_LOGITS";
                 syncNodeSlices(true, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, pipeConfig->size.floatType, nThreads, threadIndex, plan, nullptr, totalElements);
-            } 
-            else if (syncConfig->syncType == SYNC_PP_SEND) {
-                syncTypeStr = "PP_SEND";
-                // PP 只要单线程执行一次
-                if (threadIndex == 0) {
-                    syncPpSend(network, nodeConfig->nodeIndex, pipeBatch, batchBytes, plan);
-                }
-            }
-            else if (syncConfig->syncType == SYNC_PP_RECV) {
-                syncTypeStr = "PP_RECV";
-                // PP 只要单线程执行一次
-                if (threadIndex == 0) {
-                    syncPpRecv(network, nodeConfig->nodeIndex, pipeBatch, batchBytes, plan);
-                }
-            }else {
+            } else if (syncConfig->syncType == SYNC_NODE_SLOTS_EXCEPT_ROOT) {
+                syncNodeSlotsToRoot(network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, nThreads, threadIndex, plan);
+            } else if (syncConfig->syncType == SYNC_NODE_EXCHANGE) {
+                syncNodeExchange(network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, nThreads, threadIndex);
+            } else {
                 throw std::invalid_argument("Unknown sync type");
             }
-            if (threadIndex == 0) {
-            auto end = std::chrono::high_resolution_clock::now();
-            double elapsedMs = std::chrono::duration<double, std::milli>(end - start).count();
-        }
         }
     }
 }
@@ -1344,6 +2334,7 @@ void NnRootConfigWriter::writeNode(NnUint socketIndex, NnNodeConfig *config) {
     for (NnUint bufferIndex = 0; bufferIndex < config->nBuffers; bufferIndex++) {
         NnBufferConfig *bufferConfig = &config->buffers[bufferIndex];
         network->write(socketIndex, &bufferConfig->size, sizeof(bufferConfig->size));
+        network->write(socketIndex, &bufferConfig->flags, sizeof(bufferConfig->flags));
         writeString(network, socketIndex, bufferConfig->name);
     }
 
@@ -1351,11 +2342,13 @@ void NnRootConfigWriter::writeNode(NnUint socketIndex, NnNodeConfig *config) {
         NnSegmentConfig *segmentConfig = &config->segments[segmentIndex];
         network->write(socketIndex, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->write(socketIndex, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
+        network->write(socketIndex, &segmentConfig->flags, sizeof(segmentConfig->flags));
 
         for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
             NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
             network->write(socketIndex, &syncConfig->pipeIndex, sizeof(syncConfig->pipeIndex));
             network->write(socketIndex, &syncConfig->syncType, sizeof(syncConfig->syncType));
+            network->write(socketIndex, &syncConfig->codec, sizeof(syncConfig->codec));
         }
         for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
             NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
@@ -1421,6 +2414,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
     for (NnUint bufferIndex = 0; bufferIndex < config.nBuffers; bufferIndex++) {
         NnBufferConfig *bufferConfig = &config.buffers[bufferIndex];
         network->read(ROOT_SOCKET_INDEX, &bufferConfig->size, sizeof(bufferConfig->size));
+        network->read(ROOT_SOCKET_INDEX, &bufferConfig->flags, sizeof(bufferConfig->flags));
         bufferConfig->name = readString(network, ROOT_SOCKET_INDEX);
     }
 
@@ -1428,6 +2422,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
         NnSegmentConfig *segmentConfig = &config.segments[segmentIndex];
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
+        network->read(ROOT_SOCKET_INDEX, &segmentConfig->flags, sizeof(segmentConfig->flags));
 
         if (segmentConfig->nSyncs > 0) {
             segmentConfig->syncs = new NnSyncConfig[segmentConfig->nSyncs];
@@ -1436,6 +2431,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
                 NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
                 network->read(ROOT_SOCKET_INDEX, &syncConfig->pipeIndex, sizeof(syncConfig->pipeIndex));
                 network->read(ROOT_SOCKET_INDEX, &syncConfig->syncType, sizeof(syncConfig->syncType));
+                network->read(ROOT_SOCKET_INDEX, &syncConfig->codec, sizeof(syncConfig->codec));
             }
         }
 
@@ -1498,12 +2494,15 @@ void NnRootWeightLoader::allocate(NnSize size) {
 void NnRootWeightLoader::writeWeight(NnUint nodeIndex, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
     NnUint nameSize = std::strlen(opName) + 1;
     NnUint socketIndex = nodeIndex - 1;
-    network->write(socketIndex, &nameSize, sizeof(nameSize));
-    network->write(socketIndex, opName, nameSize);
-    network->write(socketIndex, &opIndex, sizeof(opIndex));
-    network->write(socketIndex, &offset, sizeof(offset));
-    network->write(socketIndex, &nBytes, sizeof(nBytes));
-    network->write(socketIndex, weight, nBytes);
+    const NnIoBuffer buffers[] = {
+        { &nameSize, sizeof(nameSize) },
+        { opName, nameSize },
+        { &opIndex, sizeof(opIndex) },
+        { &offset, sizeof(offset) },
+        { &nBytes, sizeof(nBytes) },
+        { weight, nBytes },
+    };
+    network->writeGather(socketIndex, 6, buffers);
 }
 
 NnSize NnRootWeightLoader::loadRoot(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight) {
@@ -1592,10 +2591,13 @@ void NnWorkerWeightReader::read() {
         }
         std::unique_ptr<char[]> opNamePtr(new char[nameSize]);
         char *opName = opNamePtr.get();
-        network->read(ROOT_SOCKET_INDEX, opName, nameSize);
-        network->read(ROOT_SOCKET_INDEX, &opIndex, sizeof(opIndex));
-        network->read(ROOT_SOCKET_INDEX, &offset, sizeof(offset));
-        network->read(ROOT_SOCKET_INDEX, &nBytes, sizeof(nBytes));
+        const NnIoBuffer header[] = {
+            { opName, nameSize },
+            { &opIndex, sizeof(opIndex) },
+            { &offset, sizeof(offset) },
+            { &nBytes, sizeof(nBytes) },
+        };
+        network->readScatter(ROOT_SOCKET_INDEX, 4, header);
         allocate(nBytes);
         network->read(0, temp, nBytes);
         executor->loadWeight(opName, opIndex, offset, nBytes, temp);
@@ -3,12 +3,16 @@
 
 #include "nn-executor.hpp"
 #include "nn-core.hpp"
+#include <deque>
 
 #define ROOT_SOCKET_INDEX 0
 
 void initSockets();
 void cleanupSockets();
 int acceptSocket(int serverSocket);
+// -1 if no connection is waiting on the non-blocking server socket
+int tryAcceptSocket(int serverSocket);
+void setSocketNonBlocking(int socket, bool enabled);
 void setReuseAddr(int socket);
 void writeSocket(int socket, const void* data, NnSize size);
 void readSocket(int socket, void* data, NnSize size);
@@ -42,31 +46,101 @@ struct NnSocketIo {
     NnSize size;
 };
 
+// Byte stream to one peer replacing its TCP socket after connect. NnNetwork keeps the socket
+// for the handshake and to notice a peer that went away.
+class NnTransport {
+public:
+    virtual ~NnTransport() {}
+    virtual const char *getName() const = 0;
+    // Move at most size bytes, 0 if it would block
+    virtual NnSize trySend(const void *data, NnSize size) = 0;
+    virtual NnSize tryRecv(void *data, NnSize size) = 0;
+};
+
+// One part of a message written with a single gather call
+struct NnIoBuffer {
+    const void *data;
+    NnSize size;
+};
+
+typedef struct {
+    NnSize nSendCalls;     // send/sendmsg system calls
+    NnSize zeroCopyBytes;  // bytes sent with MSG_ZEROCOPY
+} NnNetworkIoStats;
+
+// One way latency and throughput of the link between two nodes
+typedef struct {
+    float latencyUs;
+    float gbps;
+} NnLinkProfile;
+
+// Links between every pair of nodes measured by NnNetwork::probeLinks, a link is the same in both directions
+class NnLinkMatrix {
+public:
+    NnUint nNodes;
+    std::vector<NnLinkProfile> links; // [nNodes * nNodes]
+
+    NnLinkMatrix(NnUint nNodes);
+    const NnLinkProfile &get(NnUint a, NnUint b) const { return links[a * nNodes + b]; }
+    void set(NnUint a, NnUint b, NnLinkProfile profile);
+    // Predicted microseconds of one message from a to b, 0 within a node
+    double getTransferUs(NnUint a, NnUint b, double nBytes) const;
+};
+
 class NnNetwork {
 private:
     int *sockets;
     NnSize *sentBytes;
     NnSize *recvBytes;
+    NnSize *nSendCalls;
+    NnSize *zeroCopyBytes;
+    bool *isZeroCopy;
+    NnUint *nZeroCopyPending; // MSG_ZEROCOPY sends without a completion yet
+    std::vector<std::unique_ptr<NnTransport>> transports; // nullptr = TCP
+    std::unique_ptr<NnLinkMatrix> linkMatrix;
+    void checkPeer(NnUint socketIndex);
+    void writeTransport(NnUint socketIndex, const void *data, NnSize size);
+    bool readTransport(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts);
+    int getSendFlags(NnUint socketIndex, NnSize size);
+    void onSent(NnUint socketIndex, int flags, NnSize size);
+    void waitZeroCopy(NnUint socketIndex);
 
 public:
     static std::unique_ptr<NnNetwork> serve(int port);
     static std::unique_ptr<NnNetwork> connect(NnUint nSockets, char **hosts, NnUint *ports);
 
     NnUint nSockets;
+    NnUint nodeIndex; // 0 on the root
 
-    NnNetwork(std::vector<NnSocket> *sockets);
+    NnNetwork(std::vector<NnSocket> *sockets, NnUint nodeIndex);
     ~NnNetwork();
 
     void setTurbo(bool enabled);
+    // Must be called by all nodes at the same point. The root lets every pair of nodes probe its
+    // link, one pair at a time, and sends the matrix to the workers. The collectives use it later.
+    void probeLinks();
+    // nullptr if the links were not probed
+    const NnLinkMatrix *getLinkMatrix() const { return linkMatrix.get(); }
+    // Must be called by all nodes right after the network is created. Links between nodes on
+    // the same host move to shared memory rings if both sides enable it, the rest stays on TCP.
+    void negotiateTransports(bool enableShm, NnSize shmCapacity);
+    const char *getTransportName(NnUint socketIndex) const;
+    // Large sends skip the copy to the kernel (Linux MSG_ZEROCOPY), returns false if not supported
+    bool setZeroCopy(bool enabled);
     void write(const NnUint socketIndex, const void *data, const NnSize size);
     void read(const NnUint socketIndex, void *data, const NnSize size);
+    // All buffers in one writev-like call, the peer reads them as if they were written one by one
+    void writeGather(const NnUint socketIndex, NnUint nBuffers, const NnIoBuffer *buffers);
+    void readScatter(const NnUint socketIndex, NnUint nBuffers, const NnIoBuffer *buffers);
     void writeAck(const NnUint socketIndex);
     void readAck(const NnUint socketIndex);
     bool tryReadWithMaxAttempts(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts);
     void writeMany(NnUint n, NnSocketIo *ios);
     void writeAll(void *data, NnSize size);
     void readMany(NnUint n, NnSocketIo *ios);
-    void getStats(NnSize *sentBytes, NnSize *recvBytes);
+    void getStats(NnSize *sentBytes, NnSize *recvBytes, NnNetworkIoStats *ioStats = nullptr);
+    // Bytes of one socket since the last reset, does not reset them
+    void getPeerStats(NnUint socketIndex, NnSize *sentBytes, NnSize *recvBytes) const;
     void sendToNode(NnUint targetNodeIndex, NnUint myNodeIndex, const void* data, NnSize size);
     void recvFromNode(NnUint sourceNodeIndex, NnUint myNodeIndex, void* data, NnSize size);
     int getSocketIndexForNode(NnUint targetNodeIndex, NnUint myNodeIndex) const;
@@ -74,6 +148,86 @@ public:
     
 };
 
+// Encodes the F32 rows of a synced pipe to the float type of NnSyncCodec and back
+class NnSyncEncoder {
+private:
+    NnFloatType wireType;
+    NnUint nElements;
+    NnSize rowBytes;
+    std::vector<NnByte> buffer;
+public:
+    NnSyncEncoder(NnSyncCodec codec, NnUint nElements, NnUint nRows);
+    // Wire bytes of one row
+    NnSize getRowBytes() const { return rowBytes; }
+    // Room for nRows encoded rows
+    NnByte *getBuffer() { return buffer.data(); }
+    void encode(const float *row, NnByte *output);
+    void decode(const NnByte *input, float *row) const;
+};
+
+struct NnPpSendJob {
+    NnUint targetNodeIndex;
+    std::vector<NnByte> data;
+};
+
+// Dedicated communication thread for SYNC_PP_SEND. The stage root copies the activations
+// into the queue and continues, the bytes go out on the wire in the background.
+class NnPpAsyncSender {
+private:
+    NnNetwork *network;
+    NnUint myNodeIndex;
+    PthreadHandler handler;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<NnPpSendJob> queue;
+    std::vector<std::vector<NnByte>> freeBuffers;
+    bool isRunning;
+    bool isSending;
+    std::string error;
+    static void *threadHandler(void *arg);
+public:
+    NnPpAsyncSender(NnNetwork *network, NnUint myNodeIndex);
+    ~NnPpAsyncSender();
+    void send(NnUint targetNodeIndex, const NnByte *data, NnSize size);
+    // Blocks until the queue is drained, must be called before the sockets are used by anything else
+    void flush();
+};
+
+// Dedicated communication thread for SYNC_NODE_SLICES_STREAMED. The slice of this node is copied
+// out of the pipe, then the rows are exchanged one by one in the background and every received
+// (row, node) slice is published to NnSliceArrivals, so the merge starts on the first rows.
+class NnSliceExchanger {
+private:
+    NnNetwork *network;
+    NnUint myNodeIndex;
+    std::vector<NnUint> peerNodes;
+    PthreadHandler handler;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool isRunning;
+    bool hasJob;
+    NnSliceArrivals *arrivals;
+    NnByte *pipe;
+    NnSize rowBytes;
+    NnSize slotBytes;
+    NnSize wireSlotBytes;
+    NnUint batchSize;
+    NnUint epoch;
+    NnSyncEncoder *encoder;
+    std::vector<NnByte> sendBuffer;
+    std::vector<NnByte> recvBuffer;
+    std::string error;
+    static void *threadHandler(void *arg);
+    void exchange();
+public:
+    NnSliceExchanger(NnNetwork *network, NnUint myNodeIndex, const std::vector<NnUint> &peerNodes);
+    ~NnSliceExchanger();
+    // Every node owns the slot nodeIndex * rowBytes / nNodes of a row, the encoder (optional) sets the wire format of the slots
+    void start(NnSliceArrivals *arrivals, NnByte *pipe, NnSize rowBytes, NnUint nNodes, NnUint batchSize, NnSyncEncoder *encoder = nullptr);
+    // Blocks until the exchange is done, must be called before the sockets are used by anything else
+    void flush();
+};
+
 class NnNetworkNodeSynchronizer : public NnNodeSynchronizer {
 private:
     NnNetwork *network;
@@ -82,10 +236,21 @@ private:
     NnNodeConfig *nodeConfig;
     const NnUnevenPartitionPlan *plan;
     const NnStageConfig* myStage = nullptr;
+    const NnStageConfig* prevStage = nullptr;
+    const NnStageConfig* nextStage = nullptr;
+    std::unique_ptr<NnPpAsyncSender> ppSender;
+    std::unique_ptr<NnSliceExchanger> sliceExchanger;
+    std::vector<std::vector<std::unique_ptr<NnSyncEncoder>>> encoders; // [segment][sync], nullptr = sent as is
+    bool skipLogitsSync = false;
 public:
     NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, const NnUnevenPartitionPlan *plan = nullptr);
     ~NnNetworkNodeSynchronizer() override {};
+    // Micro-batches that are not the last of a prefill don't gather logits to the root
+    void setSkipLogitsSync(bool skip) { skipLogitsSync = skip; }
+    // Waits until the pending PP sends are on the wire
+    void flushPpSends() { if (ppSender) ppSender->flush(); }
     void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) override;
+    void getPeerBytes(std::vector<NnSize> &sentBytes, std::vector<NnSize> &recvBytes) override;
 };
 
 class NnRootConfigWriter {
@@ -4,11 +4,130 @@
 #include <cmath>
 #include <stdexcept>
 #include <cstdio>
+#include <algorithm>
+#if defined(NN_CPU_DISPATCH_X86)
+#include <cpuid.h>
+#elif defined(NN_CPU_DISPATCH_ARM) && defined(__linux__)
+#include <sys/auxv.h>
+#elif defined(NN_CPU_DISPATCH_ARM) && defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
 
 #if defined(CONVERT_F16_TO_F32_LOOKUP)
 float f16ToF32Lookup[65536];
 #endif
 
+#if defined(NN_CPU_DISPATCH_X86)
+static std::uint64_t readXcr0() {
+    std::uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((std::uint64_t)edx << 32) | eax;
+}
+#endif
+
+#if defined(NN_CPU_DISPATCH_ARM) && defined(__APPLE__)
+static bool hasSysctlFeature(const char *name) {
+    int value = 0;
+    size_t size = sizeof(value);
+    return sysctlbyname(name, &value, &size, nullptr, 0) == 0 && value != 0;
+}
+#endif
+
+static NnUint detectCpuFeatures() {
+    NnUint features = 0u;
+#if defined(NN_CPU_DISPATCH_X86)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE)) {
+        const std::uint64_t xcr0 = readXcr0();
+        const bool hasAvxState = (xcr0 & 0x06u) == 0x06u;
+        const bool hasAvx512State = (xcr0 & 0xE6u) == 0xE6u;
+        const bool hasFmaF16c = (ecx & bit_FMA) && (ecx & bit_F16C);
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            if (hasAvxState && hasFmaF16c && (ebx & bit_AVX2))
+                features |= CPU_FEATURE_AVX2;
+            if (hasAvx512State && (features & CPU_FEATURE_AVX2) &&
+                (ebx & bit_AVX512F) && (ebx & bit_AVX512BW) && (ebx & bit_AVX512VL)) {
+                features |= CPU_FEATURE_AVX512;
+                if (ecx & bit_AVX512VNNI)
+                    features |= CPU_FEATURE_AVX512_VNNI;
+            }
+        }
+    }
+#elif defined(NN_CPU_DISPATCH_ARM)
+    features |= CPU_FEATURE_NEON;
+#if defined(__linux__)
+    #ifndef HWCAP_ASIMDDP
+        #define HWCAP_ASIMDDP (1ul << 20)
+    #endif
+    #ifndef HWCAP2_I8MM
+        #define HWCAP2_I8MM (1ul << 13)
+    #endif
+    if (getauxval(AT_HWCAP) & HWCAP_ASIMDDP)
+        features |= CPU_FEATURE_DOTPROD;
+    if (getauxval(AT_HWCAP2) & HWCAP2_I8MM)
+        features |= CPU_FEATURE_I8MM;
+#elif defined(__APPLE__)
+    if (hasSysctlFeature("hw.optional.arm.FEAT_DotProd"))
+        features |= CPU_FEATURE_DOTPROD;
+    if (hasSysctlFeature("hw.optional.arm.FEAT_I8MM"))
+        features |= CPU_FEATURE_I8MM;
+#endif
+#endif
+
+    // The build already requires these
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    features |= CPU_FEATURE_AVX2;
+#endif
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+    features |= CPU_FEATURE_AVX512;
+#if defined(__AVX512VNNI__)
+    features |= CPU_FEATURE_AVX512_VNNI;
+#endif
+#endif
+#if defined(__ARM_FEATURE_DOTPROD)
+    features |= CPU_FEATURE_DOTPROD;
+#endif
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+    features |= CPU_FEATURE_I8MM;
+#endif
+    return features;
+}
+
+static NnUint cpuFeatureMask = ~0u;
+
+NnUint getDetectedCpuFeatures() {
+    static const NnUint features = detectCpuFeatures();
+    return features;
+}
+
+NnUint getCpuFeatures() {
+    return getDetectedCpuFeatures() & cpuFeatureMask;
+}
+
+void setCpuFeatureMask(NnUint mask) {
+    cpuFeatureMask = mask;
+}
+
+std::string cpuFeaturesToString(NnUint features) {
+    static const struct { NnCpuFeature feature; const char *name; } names[] = {
+        { CPU_FEATURE_NEON, "neon" },
+        { CPU_FEATURE_DOTPROD, "dotprod" },
+        { CPU_FEATURE_I8MM, "i8mm" },
+        { CPU_FEATURE_AVX2, "avx2" },
+        { CPU_FEATURE_AVX512, "avx512" },
+        { CPU_FEATURE_AVX512_VNNI, "avx512vnni" },
+    };
+    std::string result;
+    for (const auto &name : names) {
+        if ((features & name.feature) == 0u)
+            continue;
+        if (!result.empty())
+            result += ' ';
+        result += name.name;
+    }
+    return result;
+}
+
 void initQuants() {
 #if defined(CONVERT_F16_TO_F32_LOOKUP)
     for (NnUint i = 0; i < 65536; i++)
@@ -64,11 +183,42 @@ NnFp16 convertF32ToF16Impl(const float x) {
     return s | (e << 10) | (m >> 13);
 }
 
+#if defined(NN_CPU_DISPATCH_X86)
+// A block is two vectors, the rounding is the same as the AVX2 variant
+NN_TARGET_AVX512 static void quantizeF32toQ80_avx512(const float *input, NnBlockQ80 *output, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i++) {
+        const float *x = &input[i * Q80_BLOCK_SIZE];
+        NnBlockQ80 *y = &output[i];
+
+        const __m512 x0 = _mm512_loadu_ps(x);
+        const __m512 x1 = _mm512_loadu_ps(x + 16);
+        const float amax = _mm512_reduce_max_ps(_mm512_max_ps(_mm512_abs_ps(x0), _mm512_abs_ps(x1)));
+
+        const float d = amax / 127.0f;
+        const float id = (d != 0.0f) ? 1.0f / d : 0.0f;
+        y->d = CONVERT_F32_TO_F16(d);
+
+        const __m512 idVec = _mm512_set1_ps(id);
+        const __m128i q0 = _mm512_cvtsepi32_epi8(_mm512_cvtps_epi32(_mm512_mul_ps(x0, idVec)));
+        const __m128i q1 = _mm512_cvtsepi32_epi8(_mm512_cvtps_epi32(_mm512_mul_ps(x1, idVec)));
+        _mm_storeu_si128((__m128i *)y->qs, q0);
+        _mm_storeu_si128((__m128i *)(y->qs + 16), q1);
+    }
+}
+#endif
+
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
     assert(n % Q80_BLOCK_SIZE == 0);
     const NnUint nBlocks = n / Q80_BLOCK_SIZE;
     SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
 
+#if defined(NN_CPU_DISPATCH_X86)
+    if (getCpuFeatures() & CPU_FEATURE_AVX512) {
+        quantizeF32toQ80_avx512(input, output, start, end);
+        return;
+    }
+#endif
+
 #if defined(__ARM_NEON)
     for (NnUint i = start; i < end; i++) {
         const float *x = &input[i * Q80_BLOCK_SIZE];
@@ -245,11 +395,189 @@ void dequantizeQ40toF32(const NnBlockQ40 *x, float *output, const NnUint n, cons
     }
 }
 
+static inline int nearestInt(const float x) {
+    return (int)lroundf(x);
+}
+
+// The range of every sub-block is mapped to 0..15, the scales and the mins of the sub-blocks are
+// quantized to 6 bits against the largest of them
+void quantizeF32toQ4K(const float *x, NnBlockQ4K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q4K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    constexpr NnUint nSubBlocks = Q4K_BLOCK_SIZE / 32;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const float *xb = &x[i * Q4K_BLOCK_SIZE];
+        float scales[nSubBlocks];
+        float mins[nSubBlocks];
+        float maxScale = 0.0f;
+        float maxMin = 0.0f;
+        for (NnUint j = 0; j < nSubBlocks; j++) {
+            float min = 0.0f;
+            float max = 0.0f;
+            for (NnUint l = 0; l < 32; l++) {
+                min = std::fmin(min, xb[j * 32 + l]);
+                max = std::fmax(max, xb[j * 32 + l]);
+            }
+            scales[j] = (max - min) / 15.0f;
+            mins[j] = -min;
+            maxScale = std::fmax(maxScale, scales[j]);
+            maxMin = std::fmax(maxMin, mins[j]);
+        }
+
+        NnBlockQ4K *o = &output[i];
+        o->d = CONVERT_F32_TO_F16(maxScale / 63.0f);
+        o->dmin = CONVERT_F32_TO_F16(maxMin / 63.0f);
+        const float d = CONVERT_F16_TO_F32(o->d);
+        const float dmin = CONVERT_F16_TO_F32(o->dmin);
+        std::memset(o->scales, 0, sizeof(o->scales));
+        std::uint8_t q[Q4K_BLOCK_SIZE];
+        for (NnUint j = 0; j < nSubBlocks; j++) {
+            const std::uint8_t ls = (std::uint8_t)std::min(63, d > 0.0f ? nearestInt(scales[j] / d) : 0);
+            const std::uint8_t lm = (std::uint8_t)std::min(63, dmin > 0.0f ? nearestInt(mins[j] / dmin) : 0);
+            if (j < 4) {
+                o->scales[j] |= ls;
+                o->scales[j + 4] |= lm;
+            } else {
+                o->scales[j + 4] = (ls & 0xF) | ((lm & 0xF) << 4);
+                o->scales[j - 4] |= (ls >> 4) << 6;
+                o->scales[j] |= (lm >> 4) << 6;
+            }
+            const float scale = d * ls;
+            const float offset = dmin * lm;
+            const float id = scale > 0.0f ? 1.0f / scale : 0.0f;
+            for (NnUint l = 0; l < 32; l++) {
+                const int v = nearestInt((xb[j * 32 + l] + offset) * id);
+                q[j * 32 + l] = (std::uint8_t)std::max(0, std::min(15, v));
+            }
+        }
+        for (NnUint p = 0; p < nSubBlocks / 2; p++) {
+            for (NnUint l = 0; l < 32; l++)
+                o->qs[p * 32 + l] = q[p * 64 + l] | (q[p * 64 + 32 + l] << 4);
+        }
+    }
+}
+
+void dequantizeQ4KtoF32(const NnBlockQ4K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q4K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ4K *b = &x[i];
+        const float d = CONVERT_F16_TO_F32(b->d);
+        const float dmin = CONVERT_F16_TO_F32(b->dmin);
+        float *y = &output[i * Q4K_BLOCK_SIZE];
+        for (NnUint j = 0; j < Q4K_BLOCK_SIZE / 32; j++) {
+            std::uint8_t scale, min;
+            getScaleMinQ4K(j, b->scales, &scale, &min);
+            const std::uint8_t *qs = &b->qs[(j / 2) * 32];
+            const NnUint shift = (j % 2) * 4;
+            for (NnUint l = 0; l < 32; l++)
+                y[j * 32 + l] = d * scale * ((qs[l] >> shift) & 0xF) - dmin * min;
+        }
+    }
+}
+
+// Every sub-block maps its largest magnitude to -32, the sub-block scales are quantized to 8 bits
+// against the largest of them
+void quantizeF32toQ6K(const float *x, NnBlockQ6K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q6K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    constexpr NnUint nSubBlocks = Q6K_BLOCK_SIZE / 16;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const float *xb = &x[i * Q6K_BLOCK_SIZE];
+        float scales[nSubBlocks];
+        float maxScale = 0.0f;
+        for (NnUint j = 0; j < nSubBlocks; j++) {
+            float max = 0.0f;
+            for (NnUint l = 0; l < 16; l++) {
+                const float v = xb[j * 16 + l];
+                if (fabsf(v) > fabsf(max))
+                    max = v;
+            }
+            scales[j] = max / -32.0f;
+            if (fabsf(scales[j]) > fabsf(maxScale))
+                maxScale = scales[j];
+        }
+
+        NnBlockQ6K *o = &output[i];
+        o->d = CONVERT_F32_TO_F16(maxScale / -128.0f);
+        const float d = CONVERT_F16_TO_F32(o->d);
+        std::uint8_t q[Q6K_BLOCK_SIZE];
+        for (NnUint j = 0; j < nSubBlocks; j++) {
+            const int ls = d != 0.0f ? std::max(-128, std::min(127, nearestInt(scales[j] / d))) : 0;
+            o->scales[j] = (std::int8_t)ls;
+            const float scale = d * ls;
+            const float id = scale != 0.0f ? 1.0f / scale : 0.0f;
+            for (NnUint l = 0; l < 16; l++) {
+                const int v = nearestInt(xb[j * 16 + l] * id);
+                q[j * 16 + l] = (std::uint8_t)(std::max(-32, std::min(31, v)) + 32);
+            }
+        }
+        for (NnUint h = 0; h < 2; h++) {
+            const std::uint8_t *qh = &q[h * 128];
+            for (NnUint l = 0; l < 32; l++) {
+                o->ql[h * 64 + l] = (qh[l] & 0xF) | ((qh[l + 64] & 0xF) << 4);
+                o->ql[h * 64 + l + 32] = (qh[l + 32] & 0xF) | ((qh[l + 96] & 0xF) << 4);
+                o->qh[h * 32 + l] = (qh[l] >> 4) | ((qh[l + 32] >> 4) << 2) | ((qh[l + 64] >> 4) << 4) | ((qh[l + 96] >> 4) << 6);
+            }
+        }
+    }
+}
+
+void dequantizeQ6KtoF32(const NnBlockQ6K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q6K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ6K *b = &x[i];
+        const float d = CONVERT_F16_TO_F32(b->d);
+        for (NnUint h = 0; h < 2; h++) {
+            const std::uint8_t *ql = &b->ql[h * 64];
+            const std::uint8_t *qh = &b->qh[h * 32];
+            const std::int8_t *scales = &b->scales[h * 8];
+            float *y = &output[i * Q6K_BLOCK_SIZE + h * 128];
+            for (NnUint l = 0; l < 32; l++) {
+                const int q1 = (int)((ql[l] & 0xF) | (((qh[l] >> 0) & 3) << 4)) - 32;
+                const int q2 = (int)((ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4)) - 32;
+                const int q3 = (int)((ql[l] >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+                const int q4 = (int)((ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+                y[l] = d * scales[l / 16] * q1;
+                y[l + 32] = d * scales[2 + l / 16] * q2;
+                y[l + 64] = d * scales[4 + l / 16] * q3;
+                y[l + 96] = d * scales[6 + l / 16] * q4;
+            }
+        }
+    }
+}
+
+void repackQ40toQ40x4(const NnBlockQ40 *x, NnBlockQ40x4 *output, const NnUint nRows, const NnUint nBlocks) {
+    assert(nRows % Q40_REPACK_ROWS == 0);
+    static_assert(sizeof(NnBlockQ40x4) == Q40_REPACK_ROWS * sizeof(NnBlockQ40), "Unexpected layout of NnBlockQ40x4");
+    for (NnUint g = 0; g < nRows / Q40_REPACK_ROWS; g++) {
+        for (NnUint j = 0; j < nBlocks; j++) {
+            NnBlockQ40x4 *o = &output[g * nBlocks + j];
+            for (NnUint r = 0; r < Q40_REPACK_ROWS; r++) {
+                const NnBlockQ40 *b = &x[(g * Q40_REPACK_ROWS + r) * nBlocks + j];
+                o->d[r] = b->d;
+                std::memcpy(o->qs[r], b->qs, Q40_BLOCK_SIZE / 2);
+            }
+        }
+    }
+}
+
 const char *floatTypeToString(NnFloatType type) {
     if (type == F_UNK) return "F_UNK";
     if (type == F_32) return "F_32";
     if (type == F_16) return "F_16";
     if (type == F_Q40) return "F_Q40";
     if (type == F_Q80) return "F_Q80";
+    if (type == F_Q4K) return "F_Q4K";
+    if (type == F_Q6K) return "F_Q6K";
     throw std::invalid_argument("Unknown float type");
 }
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <string>
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
 #elif defined(__AVX2__) || defined(__F16C__)
@@ -52,6 +53,9 @@ NnFp16 convertF32ToF16Impl(const float x);
 
 #define Q40_BLOCK_SIZE 32
 #define Q80_BLOCK_SIZE 32
+// K-quants (the llama.cpp layout): super-blocks of 256 values with a scale per sub-block
+#define Q4K_BLOCK_SIZE 256
+#define Q6K_BLOCK_SIZE 256
 
 enum NnFloatType {
     F_UNK = -1,
@@ -59,6 +63,8 @@ enum NnFloatType {
     F_16 = 1,
     F_Q40 = 2,
     F_Q80 = 3,
+    F_Q4K = 4,
+    F_Q6K = 5,
 };
 
 typedef struct {
@@ -71,11 +77,89 @@ typedef struct {
     std::int8_t qs[Q80_BLOCK_SIZE];
 } NnBlockQ80;
 
+// 8 sub-blocks of 32 values, x = d * scale * q - dmin * min with 6-bit scales and mins packed in
+// scales[12] and 4-bit q, the low nibbles of qs[32 * p] are the sub-block 2p, the high ones 2p + 1
+typedef struct {
+    std::uint16_t d;
+    std::uint16_t dmin;
+    std::uint8_t scales[12];
+    std::uint8_t qs[Q4K_BLOCK_SIZE / 2];
+} NnBlockQ4K;
+
+// 16 sub-blocks of 16 values, x = d * scales[i / 16] * (q - 32) with 6-bit q split into 4 low bits
+// in ql and 2 high bits in qh, see dequantizeQ6KtoF32 for the order
+typedef struct {
+    std::uint8_t ql[Q6K_BLOCK_SIZE / 2];
+    std::uint8_t qh[Q6K_BLOCK_SIZE / 4];
+    std::int8_t scales[Q6K_BLOCK_SIZE / 16];
+    std::uint16_t d;
+} NnBlockQ6K;
+
+// The scale and the min of the sub-block j of NnBlockQ4K
+inline void getScaleMinQ4K(const NnUint j, const std::uint8_t *q, std::uint8_t *scale, std::uint8_t *min) {
+    if (j < 4) {
+        *scale = q[j] & 63;
+        *min = q[j + 4] & 63;
+    } else {
+        *scale = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+        *min = (q[j + 4] >> 4) | ((q[j] >> 6) << 4);
+    }
+}
+
+// Blocks of Q40_REPACK_ROWS consecutive rows interleaved, the CPU matmul dots one input block
+// against all of them. The same bytes as Q40_REPACK_ROWS blocks of NnBlockQ40.
+#define Q40_REPACK_ROWS 4
+
+typedef struct {
+    std::uint16_t d[Q40_REPACK_ROWS];
+    std::uint8_t qs[Q40_REPACK_ROWS][Q40_BLOCK_SIZE / 2];
+} NnBlockQ40x4;
+
+// Runtime dispatch: the kernels of newer instruction sets are compiled with target attributes, so
+// a build for the baseline ISA (make DLLAMA_PORTABLE=1) still uses them where the CPU has them
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__AVX2__)
+    #define NN_CPU_DISPATCH_X86 1
+    #define NN_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+    #define NN_TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512bw,avx512vl,avx512vnni")))
+#elif defined(__GNUC__) && defined(__aarch64__)
+    #define NN_CPU_DISPATCH_ARM 1
+    #if defined(__clang__)
+        #define NN_TARGET_DOTPROD __attribute__((target("dotprod")))
+        #define NN_TARGET_I8MM __attribute__((target("dotprod,i8mm")))
+    #else
+        #define NN_TARGET_DOTPROD __attribute__((target("+dotprod")))
+        #define NN_TARGET_I8MM __attribute__((target("+dotprod+i8mm")))
+    #endif
+#endif
+
+enum NnCpuFeature : NnUint {
+    CPU_FEATURE_AVX2 = 1u << 0,        // with FMA and F16C
+    CPU_FEATURE_AVX512 = 1u << 1,      // F, BW and VL
+    CPU_FEATURE_AVX512_VNNI = 1u << 2,
+    CPU_FEATURE_NEON = 1u << 3,
+    CPU_FEATURE_DOTPROD = 1u << 4,
+    CPU_FEATURE_I8MM = 1u << 5,
+};
+
+// Detected once by CPUID / HWCAP, the features the build requires are always present
+NnUint getDetectedCpuFeatures();
+// The detected features limited by setCpuFeatureMask, the kernels dispatch by them
+NnUint getCpuFeatures();
+// Disables dispatched kernels, for tests and benchmarks. Not thread-safe, call it before the inference
+void setCpuFeatureMask(NnUint mask);
+std::string cpuFeaturesToString(NnUint features);
+
 void initQuants();
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnUint k, const NnUint nThreads, const NnUint threadIndex);
 void dequantizeQ80toF32(const NnBlockQ80 *input, float* output, const NnUint k, const NnUint nThreads, const NnUint threadIndex);
 void quantizeF32toQ40(const float *x, NnBlockQ40 *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
 void dequantizeQ40toF32(const NnBlockQ40 *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void quantizeF32toQ4K(const float *x, NnBlockQ4K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void dequantizeQ4KtoF32(const NnBlockQ4K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void quantizeF32toQ6K(const float *x, NnBlockQ6K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void dequantizeQ6KtoF32(const NnBlockQ6K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+// nRows (a multiple of Q40_REPACK_ROWS) rows of nBlocks blocks -> groups of rows of NnBlockQ40x4
+void repackQ40toQ40x4(const NnBlockQ40 *x, NnBlockQ40x4 *output, const NnUint nRows, const NnUint nBlocks);
 
 const char *floatTypeToString(NnFloatType type);
 
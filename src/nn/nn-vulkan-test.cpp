@@ -20,7 +20,9 @@ void assertFloat(NnUint position, const float value, const float expectedValue,
 
 void execute(
     void (*build)(NnNetConfigBuilder *netBuilder, NnNodeConfigBuilder *nodeBuilder, NnSegmentConfigBuilder *segmentBuilder),
-    void (*execute)(NnExecutor *executor, NnNetExecution *execution, NnVulkanDevice *device)
+    void (*execute)(NnExecutor *executor, NnNetExecution *execution, NnVulkanDevice *device),
+    // Called before the segments are created, false skips the test
+    bool (*configure)(NnVulkanDevice *device) = nullptr
 ) {
     NnUint nNodes = 1;
     NnNetConfigBuilder netBuilder(nNodes, N_BATCHES);
@@ -39,6 +41,10 @@ void execute(
     NnUint gpuIndex = 0;
     std::vector<NnExecutorDevice> devices;
     NnVulkanDevice *device = new NnVulkanDevice(gpuIndex, &netConfig, &nodeConfig, &execution);
+    if (configure != nullptr && !configure(device)) {
+        delete device;
+        return;
+    }
     devices.push_back(NnExecutorDevice(device, -1, -1));
     NnFakeNodeSynchronizer synchronizer;
     NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
@@ -742,6 +748,55 @@ void testMatmul_Q80_Q40_F32() {
         });
 }
 
+template <NnUint N, NnUint D, NnVulkanMatmulKernel kernel>
+void benchMatmul_Q80_Q40_F32() {
+    #define BENCH_MATMUL_N_FORWARDS 32
+    execute(
+        [](NnNetConfigBuilder *netBuilder, NnNodeConfigBuilder *nodeBuilder, NnSegmentConfigBuilder *segmentBuilder) {
+            NnUint xPipeIndex = netBuilder->addPipe("X", size2D(F_Q80, N_BATCHES, N));
+            NnUint yPipeIndex = netBuilder->addPipe("Y", size2D(F_32, N_BATCHES, D));
+            NnUint nullBufferIndex = nodeBuilder->addBuffer("null", size1D(F_32, 1u));
+            segmentBuilder->addOp(
+                OP_MATMUL, "matmul", 0,
+                pointerBatchConfig(SRC_PIPE, xPipeIndex),
+                pointerBatchConfig(SRC_PIPE, yPipeIndex),
+                size2D(F_Q40, N, D),
+                NnMatmulOpConfig{0u, 0u, nullBufferIndex});
+        },
+        [](NnExecutor *executor, NnNetExecution *execution, NnVulkanDevice *device) {
+            execution->setBatchSize(N_BATCHES);
+            NnBlockQ80 *xPipe = (NnBlockQ80 *)execution->pipes[0];
+
+            constexpr NnUint xSize = N_BATCHES * N;
+            constexpr NnUint weightBlocks = (N * D) / Q40_BLOCK_SIZE;
+            std::unique_ptr<float[]> x(new float[xSize]);
+            std::unique_ptr<NnBlockQ40[]> weightQ40(new NnBlockQ40[weightBlocks]);
+            for (NnUint i = 0; i < xSize; i++)
+                x[i] = 0.1f + (i / (float)N - 0.5f) * 0.0005f;
+            quantizeF32toQ80(x.get(), xPipe, xSize, 1, 0);
+            for (NnUint i = 0; i < weightBlocks; i++) {
+                weightQ40[i].d = CONVERT_F32_TO_F16(0.01f);
+                for (NnUint j = 0; j < Q40_BLOCK_SIZE / 2; j++)
+                    weightQ40[i].qs[j] = (NnByte)((i + j) * 37u);
+            }
+            executor->loadWeight("matmul", 0u, 0u, weightBlocks * sizeof(NnBlockQ40), (NnByte *)weightQ40.get());
+
+            executor->forward(); // Records the command buffer
+            Timer timer;
+            for (NnUint i = 0; i < BENCH_MATMUL_N_FORWARDS; i++)
+                executor->forward();
+            const NnUint us = timer.elapsedMicroseconds() / BENCH_MATMUL_N_FORWARDS;
+            printf("⏱️ benchMatmul_Q80_Q40_F32 %5ux%5u batch=%u %s: %6u us\n",
+                N, D, N_BATCHES, kernel == MATMUL_KERNEL_TILED_SUBGROUP ? "tiled" : "rows ", us);
+        },
+        [](NnVulkanDevice *device) {
+            if (device->setBatchMatmulKernel(kernel))
+                return true;
+            printf("⏩ benchMatmul_Q80_Q40_F32 skipped, the device does not support the kernel\n");
+            return false;
+        });
+}
+
 void testMultiheadAtt_F32_F32() {
     #define MULTIHEAD_ATT_DIM 128
     execute(
@@ -985,5 +1040,10 @@ int main() {
     testScale_F32_F32();
 
     testMoeGate_F32_F32();
+
+    benchMatmul_Q80_Q40_F32<4096, 4096, MATMUL_KERNEL_ROWS>();
+    benchMatmul_Q80_Q40_F32<4096, 4096, MATMUL_KERNEL_TILED_SUBGROUP>();
+    benchMatmul_Q80_Q40_F32<4096, 14336, MATMUL_KERNEL_ROWS>();
+    benchMatmul_Q80_Q40_F32<4096, 14336, MATMUL_KERNEL_TILED_SUBGROUP>();
     return 0;
 }
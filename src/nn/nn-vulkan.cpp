@@ -92,6 +92,23 @@ NnVulkanContext::NnVulkanContext(const NnUint gpuIndex) {
     printf("🌋 MaxComputeSharedMemory: %d kB\n", deviceProps.limits.maxComputeSharedMemorySize / 1024);
     printf("🌋 NonCoherentAtomSize: %lu bytes\n", (NnSize)deviceProps.limits.nonCoherentAtomSize);
 
+    VkPhysicalDeviceSubgroupProperties subgroupProps;
+    subgroupProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    subgroupProps.pNext = nullptr;
+    VkPhysicalDeviceProperties2 deviceProps2;
+    deviceProps2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    deviceProps2.pNext = &subgroupProps;
+    vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProps2);
+    subgroupSize = subgroupProps.subgroupSize;
+    maxWorkGroupInvocations = deviceProps.limits.maxComputeWorkGroupInvocations;
+    hasSubgroupArithmetic =
+        (subgroupProps.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
+        (subgroupProps.supportedOperations & VK_SUBGROUP_FEATURE_BASIC_BIT) != 0 &&
+        (subgroupProps.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT) != 0;
+    q40BatchMatmulKernel = hasSubgroupArithmetic ? MATMUL_KERNEL_TILED_SUBGROUP : MATMUL_KERNEL_ROWS;
+    printf("🌋 Subgroup: %u, arithmetic: %s, batch matmul: %s\n", subgroupSize, hasSubgroupArithmetic ? "yes" : "no",
+        q40BatchMatmulKernel == MATMUL_KERNEL_TILED_SUBGROUP ? "tiled" : "rows");
+
     vk::PhysicalDeviceMemoryProperties memoryProperties = physicalDevice.getMemoryProperties();
     for (unsigned int h = 0; h < memoryProperties.memoryHeapCount; h++) {
         if (memoryProperties.memoryHeaps[h].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
@@ -114,6 +131,8 @@ NnVulkanContext::NnVulkanContext(const NnUint gpuIndex) {
     vk12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
     vk11Features.pNext = &vk12Features;
     vkGetPhysicalDeviceFeatures2(physicalDevice, &deviceFeatures2);
+    if (!vk12Features.timelineSemaphore)
+        throw std::runtime_error("The device does not support timeline semaphores");
 
     std::vector<vk::QueueFamilyProperties> queueFamilyProps = physicalDevice.getQueueFamilyProperties();
     auto propIt = std::find_if(queueFamilyProps.begin(), queueFamilyProps.end(), [](const vk::QueueFamilyProperties& Prop) {
@@ -134,10 +153,18 @@ NnVulkanContext::NnVulkanContext(const NnUint gpuIndex) {
     commandPool = device.createCommandPool(commandPoolCreateInfo);
     queue = device.getQueue(queueFamilyIndex, 0);
     nonCoherentAtomSize = deviceProps.limits.nonCoherentAtomSize;
+
+    vk::SemaphoreTypeCreateInfo semaphoreTypeCreateInfo(vk::SemaphoreType::eTimeline, 0);
+    vk::SemaphoreCreateInfo semaphoreCreateInfo;
+    semaphoreCreateInfo.setPNext(&semaphoreTypeCreateInfo);
+    timeline = device.createSemaphore(semaphoreCreateInfo);
+    lastSubmitValue = 0;
     VULKAN_TRACE("Context created");
 }
 
 NnVulkanContext::~NnVulkanContext() {
+    wait(lastSubmitValue);
+    device.destroySemaphore(timeline);
     device.destroyCommandPool(commandPool);
     device.destroy();
     instance.destroy();
@@ -163,10 +190,31 @@ std::pair<vk::Buffer, vk::DeviceMemory> NnVulkanContext::createRawBuffer(const u
     return std::make_pair(buffer, bufferMemory);
 }
 
+uint64_t NnVulkanContext::submit(const vk::CommandBuffer &commandBuffer) {
+    const uint64_t waitValue = lastSubmitValue;
+    const uint64_t signalValue = lastSubmitValue + 1;
+    const vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eAllCommands;
+    vk::TimelineSemaphoreSubmitInfo timelineSubmitInfo(1, &waitValue, 1, &signalValue);
+    vk::SubmitInfo submitInfo(1, &timeline, &waitStage, 1, &commandBuffer, 1, &timeline);
+    submitInfo.setPNext(&timelineSubmitInfo);
+    queue.submit({ submitInfo }, nullptr);
+    lastSubmitValue = signalValue;
+    return signalValue;
+}
+
+void NnVulkanContext::wait(const uint64_t value) {
+    if (value == 0)
+        return;
+    vk::SemaphoreWaitInfo waitInfo(vk::SemaphoreWaitFlags(), 1, &timeline, &value);
+    if (device.waitSemaphores(waitInfo, UINT64_MAX) != vk::Result::eSuccess)
+        throw std::runtime_error("Cannot wait for the timeline semaphore");
+}
+
 NnVulkanStagingCopier::NnVulkanStagingCopier(NnVulkanContext *context) :
     context(context)
 {
     allocatedSize = 0u;
+    lastCopyValue = 0u;
 
     memoryTypeIndex = findMemoryTypeIndex(&context->physicalDevice, vk::MemoryPropertyFlagBits::eHostVisible);
     if (memoryTypeIndex == MEMORY_TYPE_INDEX_NOT_FOUND)
@@ -175,10 +223,13 @@ NnVulkanStagingCopier::NnVulkanStagingCopier(NnVulkanContext *context) :
 
 NnVulkanStagingCopier::~NnVulkanStagingCopier() {
     tryRelease();
+    if (commandBuffer)
+        context->device.freeCommandBuffers(context->commandPool, 1, &commandBuffer);
 }
 
 void NnVulkanStagingCopier::tryRelease() {
     if (allocatedSize > 0u) {
+        context->wait(lastCopyValue);
         context->device.unmapMemory(hostMemory);
         context->device.freeMemory(hostMemory);
         context->device.destroyBuffer(hostBuffer);
@@ -200,6 +251,8 @@ void NnVulkanStagingCopier::allocate(const NnSize size) {
 
 void NnVulkanStagingCopier::copy(NnByte *data, const NnSize size, const NnVulkanStagingCopierDirection direction) {
     assert(size == allocatedSize);
+    // The previous copy to the device may still read the host buffer, a copy from the device must be done
+    context->wait(lastCopyValue);
 
     switch (direction) {
     case COPY_TO_DEVICE:
@@ -229,20 +282,19 @@ void NnVulkanStagingCopier::addCopyCommand(vk::CommandBuffer& commandBuffer, vk:
 }
 
 void NnVulkanStagingCopier::executeCopyCommand(vk::Buffer& target, const NnSize offset, const NnSize size, const NnVulkanStagingCopierDirection direction) {
-    vk::CommandBufferAllocateInfo allocInfo(context->commandPool, vk::CommandBufferLevel::ePrimary, 1);
-    const std::vector<vk::CommandBuffer> cmdBuffers = context->device.allocateCommandBuffers(allocInfo);
-    vk::CommandBuffer commandBuffer = cmdBuffers.front();
+    if (!commandBuffer) {
+        vk::CommandBufferAllocateInfo allocInfo(context->commandPool, vk::CommandBufferLevel::ePrimary, 1);
+        commandBuffer = context->device.allocateCommandBuffers(allocInfo).front();
+    }
+    // The command buffer of the previous copy may be pending (a staged write is not waited for), and
+    // a copy from the device must not overwrite the host buffer the previous copy still reads
+    context->wait(lastCopyValue);
     commandBuffer.begin({ vk::CommandBufferUsageFlags{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit } });
     addCopyCommand(commandBuffer, target, offset, size, direction);
     commandBuffer.end();
 
-    vk::Fence fence = context->device.createFence(vk::FenceCreateInfo());
-    vk::SubmitInfo submitInfo(0, nullptr, nullptr, 1, &commandBuffer);
-    context->queue.submit({ submitInfo }, fence);
-    assert(context->device.waitForFences({ fence }, true, uint64_t(-1)) == vk::Result::eSuccess);
-
-    context->device.destroyFence(fence);
-    context->device.freeCommandBuffers(context->commandPool, 1, &commandBuffer);
+    // No host wait, the timeline orders the copy with the submits around it
+    lastCopyValue = context->submit(commandBuffer);
 }
 
 NnVulkanBuffer::NnVulkanBuffer(NnVulkanContext *context, NnVulkanStagingCopier *copier, const char *name, const NnSize bufferSize, const bool isSliceable, vk::BufferUsageFlags usageFlags, bool fastAccess) :
@@ -254,6 +306,7 @@ NnVulkanBuffer::NnVulkanBuffer(NnVulkanContext *context, NnVulkanStagingCopier *
     usageFlags(usageFlags)
 {
     this->hostPointer = nullptr;
+    this->lastGpuUse = 0;
 
     isHostVisible = false;
 
@@ -309,6 +362,7 @@ void NnVulkanBuffer::write(const NnByte *data, const NnSize offset, const NnSize
     assert(offset + size <= bufferSize);
 
     if (isHostVisible && hostPointer != nullptr) {
+        context->wait(lastGpuUse);
         std::memcpy(&hostPointer[offset], data, size);
         context->device.flushMappedMemoryRanges({ { deviceMemory, offset, (vk::DeviceSize)size } });
         VULKAN_TRACE("Wrote %zu bytes to host visible buffer", size);
@@ -328,6 +382,7 @@ void NnVulkanBuffer::read(NnByte *data, const NnSize offset, const NnSize size)
     assert(offset + size <= bufferSize);
 
     if (isHostVisible && hostPointer != nullptr) {
+        context->wait(lastGpuUse);
         context->device.invalidateMappedMemoryRanges({ {deviceMemory, offset, (vk::DeviceSize)size} });
         std::memcpy(data, hostPointer, size);
 
@@ -486,6 +541,13 @@ NnVulkanDevice::NnVulkanDevice(NnUint gpuIndex, NnNetConfig *netConfig, NnNodeCo
 
 NnVulkanDevice::~NnVulkanDevice() {}
 
+bool NnVulkanDevice::setBatchMatmulKernel(NnVulkanMatmulKernel kernel) {
+    if (kernel == MATMUL_KERNEL_TILED_SUBGROUP && !context.hasSubgroupArithmetic)
+        return false;
+    context.q40BatchMatmulKernel = kernel;
+    return true;
+}
+
 NnUint NnVulkanDevice::maxNThreads() {
     return 1;
 }
@@ -515,6 +577,8 @@ static const char *getShaderFileName(const NnOpCode opCode, const NnOpQuantType
     if (opCode == OP_MATMUL) {
         if (quantType == F32_F32_F32) return "matmul-forward-f32-f32-f32.spv";
         if (quantType == Q80_Q40_F32) return "matmul-forward-q80-q40-f32.spv";
+        if (quantType == Q80_Q4K_F32) return "matmul-forward-q80-q4k-f32.spv";
+        if (quantType == Q80_Q6K_F32) return "matmul-forward-q80-q6k-f32.spv";
     }
     if (opCode == OP_MULTIHEAD_ATT) {
         if (quantType == F32_F32_F32) return "multi-head-att-forward-f32-f32.spv";
@@ -544,6 +608,9 @@ static const char *getShaderFileName(const NnOpCode opCode, const NnOpQuantType
     if (opCode == OP_SOFTMAX) {
         if (quantType == F32_F32_F32) return "softmax-forward-f32-f32.spv";
     }
+    if (opCode == OP_KV_EVICT) {
+        if (quantType == F32_F32_F32) return "kv-evict-forward-f32-f32.spv";
+    }
     if (opCode == OP_MOE_GATE) {
         if (quantType == F32_F32_F32) return "moe-gate-forward-f32-f32.spv";
     }
@@ -583,7 +650,12 @@ static void buildShaderLayout(std::vector<NnOpBufferAccess> &a, NnVulkanDeviceDa
         } break;
         case OP_SHIFT: {
             const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)opConfig->config;
+            if (config->blockSize > 0)
+                throw std::invalid_argument("Vulkan does not support the paged KV cache");
+            if (config->nSeqShards > 1)
+                throw std::invalid_argument("Vulkan does not support the sequence parallel KV cache");
             a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->indexPipeIndex)});
+            a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->slotPipeIndex)});
         } break;
         case OP_ROPE: {
             const NnRopeOpConfig *config = (NnRopeOpConfig *)opConfig->config;
@@ -592,16 +664,28 @@ static void buildShaderLayout(std::vector<NnOpBufferAccess> &a, NnVulkanDeviceDa
         } break;
         case OP_MULTIHEAD_ATT: {
             const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)opConfig->config;
+            if (config->kvBlockSize > 0)
+                throw std::invalid_argument("Vulkan does not support the paged KV cache");
+            if (config->kvCacheType != F_32)
+                throw std::invalid_argument("Vulkan supports only the F32 KV cache");
+            if (config->nSeqShards > 1)
+                throw std::invalid_argument("Vulkan does not support the sequence parallel KV cache");
             a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->positionPipeIndex)});
             a.push_back({ACCESS_READONLY, data->resolveBufferByIndex(config->queryBufferIndex)});
             a.push_back({ACCESS_READONLY, data->resolveBufferByIndex(config->keyCacheBufferIndex)});
             a.push_back({ACCESS_READONLY, data->resolveBufferByIndex(config->valueCacheBufferIndex)});
             a.push_back({ACCESS_READ_WRITE, data->resolveBufferByIndex(config->attBufferIndex)});
+            a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->slotPipeIndex)});
         } break;
         case OP_MOE_GATE: {
             const NnMoeGateOpCodeConfig *config = (NnMoeGateOpCodeConfig *)opConfig->config;
             a.push_back({ACCESS_READ_WRITE, data->resolveBufferByIndex(config->indexesBufferIndex)});
         } break;
+        case OP_KV_EVICT: {
+            const NnKvEvictOpCodeConfig *config = (NnKvEvictOpCodeConfig *)opConfig->config;
+            a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->evictPipeIndex)});
+            a.push_back({ACCESS_IMMUTABLE, data->resolveBufferByIndex(config->ropeCacheBufferIndex)});
+        } break;
         default:
             break;
         }
@@ -684,6 +768,10 @@ static std::vector<NnUint> resolveShaderConstants(const NnOpConfig *opConfig, co
             constexpr NnUint tileSizeX = 2; // Shader constant
             assert(inputSize.x % (Q40_BLOCK_SIZE * tileSizeX) == 0);
             consts.push_back(inputSize.x / (Q40_BLOCK_SIZE * tileSizeX));
+        } else if (opConfig->weightSize.floatType == F_Q4K || opConfig->weightSize.floatType == F_Q6K) {
+            // One invocation per super-block of a row
+            assert(inputSize.x % Q4K_BLOCK_SIZE == 0);
+            consts.push_back(inputSize.x / Q4K_BLOCK_SIZE);
         }
     }
     if (opConfig->code == OP_MOE_GATE) {
@@ -714,7 +802,7 @@ static NnUint resolveShaderNumberOfWorkGroupsX(const NnOpConfig *opConfig, const
         }
     }
     if (opConfig->code == OP_MATMUL) {
-        if (opConfig->weightSize.floatType == F_Q40) {
+        if (opConfig->weightSize.floatType == F_Q40 || opConfig->weightSize.floatType == F_Q4K || opConfig->weightSize.floatType == F_Q6K) {
             constexpr NnUint tileSizeD = 8u; // Shader constant
             assert(opConfig->weightSize.x % tileSizeD == 0u);
             return opConfig->weightSize.x / tileSizeD;
@@ -753,6 +841,22 @@ static NnUint resolveShaderNumberOfWorkGroupsZ(const NnOpConfig *opConfig, const
     return resolveNumberOfBatchInfoZ(inputSize, outputSize);
 }
 
+#define TILED_MATMUL_TILE_SIZE_B 4u // Shader constant
+#define TILED_MATMUL_MAX_SUBGROUPS 64u // Shader constant
+
+static bool hasTiledMatmul(const NnVulkanContext *context, const NnOpConfig *opConfig, const NnOpQuantType opQuant, const std::vector<NnUint> &constants) {
+    if (opConfig->code != OP_MATMUL || opQuant != Q80_Q40_F32)
+        return false;
+    const NnUint nThreads = constants[2]; // N_THREADS
+    if (context->q40BatchMatmulKernel != MATMUL_KERNEL_TILED_SUBGROUP)
+        return false;
+    // The rows of a tile share the weights, so experts use the rows kernel
+    if (((NnMatmulOpConfig *)opConfig->config)->nExperts > 0u)
+        return false;
+    return nThreads <= context->maxWorkGroupInvocations &&
+        (nThreads + context->subgroupSize - 1) / context->subgroupSize <= TILED_MATMUL_MAX_SUBGROUPS;
+}
+
 static std::vector<uint32_t> readShader(const char *fileName) {
     std::vector<uint32_t> code;
     std::string path = std::string("./src/nn/vulkan/") + fileName;
@@ -846,12 +950,16 @@ NnVulkanDeviceSegment::NnVulkanDeviceSegment(NnVulkanContext *context, NnVulkanS
     descriptorSetLayouts(segmentConfig->nOps),
     pipelineLayouts(segmentConfig->nOps),
     pipelines(segmentConfig->nOps),
+    tiledShaderModules(segmentConfig->nOps),
+    tiledPipelines(segmentConfig->nOps),
+    commandBuffers(netExecution->nBatches),
+    commandBufferSubmits(netExecution->nBatches, 0),
     buffersToSync(segmentConfig->nOps)
 {
     this->segmentData.reset(new NnVulkanDeviceSegmentData(bufferFactory, data, segmentConfig, netExecution->nBatches));
-    this->lastBatchSize = 0;
 
     std::vector<vk::PipelineShaderStageCreateInfo> shaderCreateInfos(segmentConfig->nOps);
+    std::vector<vk::PipelineShaderStageCreateInfo> tiledShaderCreateInfos(segmentConfig->nOps);
     std::vector<std::vector<NnOpBufferAccess>> opBufferAccesses(segmentConfig->nOps);
 
     std::vector<vk::SpecializationInfo> specInfos(segmentConfig->nOps);
@@ -909,6 +1017,24 @@ NnVulkanDeviceSegment::NnVulkanDeviceSegment(NnVulkanContext *context, NnVulkanS
 
         shaderModules[opIndex] = shaderModule;
         shaderCreateInfos[opIndex] = shaderCreateInfo;
+
+        if (hasTiledMatmul(context, opConfig, opQuant, *opConstants)) {
+            std::vector<uint32_t> tiledCode = readShader("matmul-forward-q80-q40-f32-tiled.spv");
+            vk::ShaderModuleCreateInfo tiledShaderModuleCreateInfo(
+                vk::ShaderModuleCreateFlags(),
+                tiledCode.size(),
+                tiledCode.data()
+            );
+            tiledShaderModules[opIndex] = context->device.createShaderModule(tiledShaderModuleCreateInfo);
+            tiledShaderCreateInfos[opIndex] = vk::PipelineShaderStageCreateInfo(
+                vk::PipelineShaderStageCreateFlags(),
+                vk::ShaderStageFlagBits::eCompute,
+                tiledShaderModules[opIndex],
+                "main",
+                &specInfos[opIndex]
+            );
+            VULKAN_TRACE("Op %d has the tiled matmul", opIndex);
+        }
         VULKAN_TRACE("Segment %d, opIndex: %d, buffers: %zu", segmentIndex, opIndex, opBufferAccesses.size());
     }
 
@@ -990,35 +1116,53 @@ NnVulkanDeviceSegment::NnVulkanDeviceSegment(NnVulkanContext *context, NnVulkanS
     pipelineCache = context->device.createPipelineCache(vk::PipelineCacheCreateInfo());
 
     for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+        // Both matmul variants share the layout, the rows kernel ignores the batch size
+        const vk::PushConstantRange batchSizeRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(NnUint));
         vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo(vk::PipelineLayoutCreateFlags(), 1, &descriptorSetLayouts[opIndex]);
+        if (tiledShaderModules[opIndex]) {
+            pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+            pipelineLayoutCreateInfo.pPushConstantRanges = &batchSizeRange;
+        }
         pipelineLayouts[opIndex] = context->device.createPipelineLayout(pipelineLayoutCreateInfo);
 
         vk::ComputePipelineCreateInfo pipelineInfo(vk::PipelineCreateFlags(), shaderCreateInfos[opIndex], pipelineLayouts[opIndex], vk::Pipeline(), 0);
         pipelines[opIndex] = context->device.createComputePipelines(pipelineCache, pipelineInfo).value.front();
+        if (tiledShaderModules[opIndex]) {
+            vk::ComputePipelineCreateInfo tiledPipelineInfo(vk::PipelineCreateFlags(), tiledShaderCreateInfos[opIndex], pipelineLayouts[opIndex], vk::Pipeline(), 0);
+            tiledPipelines[opIndex] = context->device.createComputePipelines(pipelineCache, tiledPipelineInfo).value.front();
+        }
     }
 
-    fence = context->device.createFence(vk::FenceCreateInfo());
-
-    vk::CommandBufferAllocateInfo commandBufferAllocInfo(context->commandPool, vk::CommandBufferLevel::ePrimary, 1);
-    const std::vector<vk::CommandBuffer> cmdBuffers = context->device.allocateCommandBuffers(commandBufferAllocInfo);
-    commandBuffer = cmdBuffers.front();
+    for (std::vector<NnOpBufferAccess> &accesses : opBufferAccesses) {
+        for (NnOpBufferAccess &access : accesses) {
+            if (std::find(usedBuffers.begin(), usedBuffers.end(), access.buffer) == usedBuffers.end())
+                usedBuffers.push_back(access.buffer);
+        }
+    }
 
     resolveBuffersToSync(buffersToSync, opBufferAccesses);
 }
 
 NnVulkanDeviceSegment::~NnVulkanDeviceSegment() {
-    context->device.freeCommandBuffers(context->commandPool, 1, &commandBuffer);
+    context->wait(context->lastSubmitValue);
+    for (vk::CommandBuffer &commandBuffer : commandBuffers) {
+        if (commandBuffer)
+            context->device.freeCommandBuffers(context->commandPool, 1, &commandBuffer);
+    }
     context->device.destroyDescriptorPool(descriptorPool);
 
     for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
         context->device.destroyPipeline(pipelines[opIndex]);
+        if (tiledPipelines[opIndex])
+            context->device.destroyPipeline(tiledPipelines[opIndex]);
         context->device.destroyPipelineLayout(pipelineLayouts[opIndex]);
     }
-    context->device.destroyFence(fence);
     context->device.destroyPipelineCache(pipelineCache);
     for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
         context->device.destroyDescriptorSetLayout(descriptorSetLayouts[opIndex]);
         context->device.destroyShaderModule(shaderModules[opIndex]);
+        if (tiledShaderModules[opIndex])
+            context->device.destroyShaderModule(tiledShaderModules[opIndex]);
     }
     VULKAN_TRACE("Destroyed segment");
 }
@@ -1030,6 +1174,66 @@ void NnVulkanDeviceSegment::loadWeight(NnUint opIndex, NnSize offset, NnSize nBy
     buffer->write(weight, offset, nBytes);
 }
 
+void NnVulkanDeviceSegment::recordCommandBuffer(vk::CommandBuffer &commandBuffer, NnUint batchSize) {
+    commandBuffer.begin({ vk::CommandBufferUsageFlags{} });
+
+    for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+        std::vector<vk::BufferMemoryBarrier> memoryBarriers;
+        for (NnVulkanBuffer *buffer : buffersToSync[opIndex]) {
+            vk::BufferMemoryBarrier barrier(
+                vk::AccessFlagBits::eShaderWrite,
+                vk::AccessFlagBits::eShaderRead,
+                context->queueFamilyIndex,
+                context->queueFamilyIndex,
+                buffer->deviceBuffer,
+                0,
+                buffer->calcSliceSize(batchSize, netConfig->nBatches)
+            );
+            memoryBarriers.push_back(barrier);
+        }
+        if (!memoryBarriers.empty()) {
+            commandBuffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::DependencyFlags(),
+                nullptr,
+                memoryBarriers,
+                nullptr
+            );
+            VULKAN_TRACE("Created memory barrier for %zu buffers", memoryBarriers.size());
+        }
+
+        const bool isTiled = batchSize > 1u && tiledPipelines[opIndex];
+        commandBuffer.bindPipeline(
+            vk::PipelineBindPoint::eCompute,
+            isTiled ? tiledPipelines[opIndex] : pipelines[opIndex]
+        );
+        if (tiledPipelines[opIndex])
+            commandBuffer.pushConstants(pipelineLayouts[opIndex], vk::ShaderStageFlagBits::eCompute, 0, sizeof(NnUint), &batchSize);
+        commandBuffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute,
+            pipelineLayouts[opIndex],
+            0,
+            { descriptorSets[opIndex] },
+            {}
+        );
+
+        NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+        const NnSize3D inputSize = data->resolveBufferSize(&opConfig->input);
+        const NnSize3D outputSize = data->resolveBufferSize(&opConfig->output);
+
+        const NnUint groupCountX = resolveShaderNumberOfWorkGroupsX(opConfig, inputSize, outputSize);
+        const NnUint groupCountY = isTiled
+            ? (batchSize + TILED_MATMUL_TILE_SIZE_B - 1) / TILED_MATMUL_TILE_SIZE_B
+            : batchSize;
+        const NnUint groupCountZ = resolveShaderNumberOfWorkGroupsZ(opConfig, inputSize, outputSize);
+        commandBuffer.dispatch(groupCountX, groupCountY, groupCountZ);
+        VULKAN_TRACE("Dispatched %s (%d, %d, %d)", opCodeToString(opConfig->code), groupCountX, groupCountY, groupCountZ);
+    }
+    commandBuffer.end();
+    VULKAN_TRACE("Recorded command buffer for batch size %u", batchSize);
+}
+
 void NnVulkanDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize)  {
     assert(threadIndex == 0);
 
@@ -1055,6 +1259,10 @@ void NnVulkanDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint thre
         for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
             NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
             if (opConfig->input.source == SRC_PIPE) {
+                // The GPU copy needs the whole pipe, a streamed exchange must be complete
+                const NnSliceArrivals *arrivals = netExecution->getSliceArrivals(opConfig->input.pointerIndex);
+                if (arrivals != nullptr)
+                    arrivals->waitAll(batchSize);
                 NnByte *pipeData = netExecution->pipes[opConfig->input.pointerIndex];
                 NnVulkanBuffer *buffer = data->pipes[opConfig->input.pointerIndex].get();
                 buffer->write(pipeData, 0u, buffer->calcSliceSize(batchSize, netConfig->nBatches));
@@ -1062,66 +1270,21 @@ void NnVulkanDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint thre
         }
     }
 
-    if (lastBatchSize != batchSize) {
-        lastBatchSize = batchSize;
-        commandBuffer.begin({ vk::CommandBufferUsageFlags{} });
-
-        for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
-            std::vector<vk::BufferMemoryBarrier> memoryBarriers;
-            for (NnVulkanBuffer *buffer : buffersToSync[opIndex]) {
-                vk::BufferMemoryBarrier barrier(
-                    vk::AccessFlagBits::eShaderWrite,
-                    vk::AccessFlagBits::eShaderRead,
-                    context->queueFamilyIndex,
-                    context->queueFamilyIndex,
-                    buffer->deviceBuffer,
-                    0,
-                    buffer->calcSliceSize(batchSize, netConfig->nBatches)
-                );
-                memoryBarriers.push_back(barrier);
-            }
-            if (!memoryBarriers.empty()) {
-                commandBuffer.pipelineBarrier(
-                    vk::PipelineStageFlagBits::eComputeShader,
-                    vk::PipelineStageFlagBits::eComputeShader,
-                    vk::DependencyFlags(),
-                    nullptr,
-                    memoryBarriers,
-                    nullptr
-                );
-                VULKAN_TRACE("Created memory barrier for %zu buffers", memoryBarriers.size());
-            }
-
-            commandBuffer.bindPipeline(
-                vk::PipelineBindPoint::eCompute,
-                pipelines[opIndex]
-            );
-            commandBuffer.bindDescriptorSets(
-                vk::PipelineBindPoint::eCompute,
-                pipelineLayouts[opIndex],
-                0,
-                { descriptorSets[opIndex] },
-                {}
-            );
-
-            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
-            const NnSize3D inputSize = data->resolveBufferSize(&opConfig->input);
-            const NnSize3D outputSize = data->resolveBufferSize(&opConfig->output);
-
-            const NnUint groupCountX = resolveShaderNumberOfWorkGroupsX(opConfig, inputSize, outputSize);
-            const NnUint groupCountY = batchSize;
-            const NnUint groupCountZ = resolveShaderNumberOfWorkGroupsZ(opConfig, inputSize, outputSize);
-            commandBuffer.dispatch(groupCountX, groupCountY, groupCountZ);
-            VULKAN_TRACE("Dispatched %s (%d, %d, %d)", opCodeToString(opConfig->code), groupCountX, groupCountY, groupCountZ);
-        }
-        commandBuffer.end();
+    const NnUint batchIndex = batchSize - 1;
+    vk::CommandBuffer &commandBuffer = commandBuffers[batchIndex];
+    if (!commandBuffer) {
+        vk::CommandBufferAllocateInfo commandBufferAllocInfo(context->commandPool, vk::CommandBufferLevel::ePrimary, 1);
+        commandBuffer = context->device.allocateCommandBuffers(commandBufferAllocInfo).front();
+        recordCommandBuffer(commandBuffer, batchSize);
+    } else {
+        // A command buffer without the simultaneous use flag cannot be pending twice
+        context->wait(commandBufferSubmits[batchIndex]);
     }
 
-    vk::SubmitInfo submitInfo(0, nullptr, nullptr, 1, &commandBuffer);
-    context->queue.submit({ submitInfo }, fence);
-    assert(context->device.waitForFences({ fence }, true, uint64_t(-1)) == vk::Result::eSuccess);
-
-    context->device.resetFences({ fence });
+    const uint64_t submitValue = context->submit(commandBuffer);
+    commandBufferSubmits[batchIndex] = submitValue;
+    for (NnVulkanBuffer *buffer : usedBuffers)
+        buffer->markGpuUse(submitValue);
     VULKAN_TRACE("Forwarded");
 
     // TODO: refactor this block
@@ -6,6 +6,11 @@
 #include "nn-executor.hpp"
 #include "nn-cpu-ops.hpp"
 
+enum NnVulkanMatmulKernel {
+    MATMUL_KERNEL_ROWS,            // a work group per batch row, any device
+    MATMUL_KERNEL_TILED_SUBGROUP,  // batch rows tiled per work group, needs subgroup arithmetic
+};
+
 class NnVulkanContext {
 public:
     vk::Instance instance;
@@ -15,9 +20,21 @@ public:
     vk::CommandPool commandPool;
     vk::Queue queue;
     NnSize nonCoherentAtomSize;
+    // Every submit waits on the GPU for the previous one and signals the next value,
+    // so the host waits only when it touches memory used by a pending submit
+    vk::Semaphore timeline;
+    uint64_t lastSubmitValue;
+    uint32_t subgroupSize;
+    bool hasSubgroupArithmetic;
+    uint32_t maxWorkGroupInvocations;
+    // Q80 x Q40 matmuls with more than one batch row, selected from the device features
+    NnVulkanMatmulKernel q40BatchMatmulKernel;
     NnVulkanContext(const NnUint gpuIndex);
     ~NnVulkanContext();
     std::pair<vk::Buffer, vk::DeviceMemory> createRawBuffer(const uint32_t memoryTypeIndex, const vk::DeviceSize bufferSize, const vk::BufferUsageFlags usageFlags);
+    // Returns the timeline value signaled when the command buffer is done
+    uint64_t submit(const vk::CommandBuffer &commandBuffer);
+    void wait(const uint64_t value);
 };
 
 enum NnVulkanStagingCopierDirection {
@@ -34,6 +51,8 @@ private:
     vk::Buffer hostBuffer;
     vk::DeviceMemory hostMemory;
     void *hostPointer;
+    vk::CommandBuffer commandBuffer; // re-recorded for every copy
+    uint64_t lastCopyValue;          // the host buffer is in use until the timeline reaches it
 public:
     NnVulkanStagingCopier(NnVulkanContext *context);
     ~NnVulkanStagingCopier();
@@ -51,6 +70,7 @@ private:
     NnVulkanStagingCopier *copier;
     vk::DeviceMemory deviceMemory;
     NnByte *hostPointer;
+    uint64_t lastGpuUse; // timeline value of the last submit accessing the buffer
 public:
     const char *name;
     NnSize bufferSize;
@@ -64,6 +84,7 @@ public:
     void read(NnByte *data);
     void read(NnByte *data, const NnSize offset, const NnSize size);
     NnSize calcSliceSize(const NnSize nominator, const NnSize denominator);
+    void markGpuUse(const uint64_t value) { lastGpuUse = value; }
 };
 
 class NnVulkanBufferFactory {
@@ -113,6 +134,9 @@ public:
     NnVulkanDeviceData data;
     NnVulkanDevice(NnUint gpuIndex, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution);
     ~NnVulkanDevice() override;
+    // Overrides the selected kernel for the segments created later (benchmarks),
+    // false if the device does not support the kernel
+    bool setBatchMatmulKernel(NnVulkanMatmulKernel kernel);
     NnUint maxNThreads() override;
     NnDeviceSegment *createSegment(NnUint segmentIndex) override;
 };
@@ -156,13 +180,18 @@ private:
     std::vector<vk::DescriptorSetLayout> descriptorSetLayouts;
     vk::DescriptorPool descriptorPool;
     std::vector<vk::DescriptorSet> descriptorSets;
-    vk::Fence fence;
     std::vector<vk::PipelineLayout> pipelineLayouts;
     std::vector<vk::Pipeline> pipelines;
+    // The tiled matmul of the op for batch sizes > 1, null if the op has no tiled variant
+    std::vector<vk::ShaderModule> tiledShaderModules;
+    std::vector<vk::Pipeline> tiledPipelines;
     vk::PipelineCache pipelineCache;
-    vk::CommandBuffer commandBuffer;
+    // Recorded once per batch size and reused, the index is batchSize - 1
+    std::vector<vk::CommandBuffer> commandBuffers;
+    std::vector<uint64_t> commandBufferSubmits;
     std::vector<std::vector<NnVulkanBuffer *>> buffersToSync;
-    NnUint lastBatchSize;
+    std::vector<NnVulkanBuffer *> usedBuffers;
+    void recordCommandBuffer(vk::CommandBuffer &commandBuffer, NnUint batchSize);
 public:
     NnVulkanDeviceSegment(NnVulkanContext *context, NnVulkanStagingCopier *copier, NnVulkanBufferFactory *bufferFactory, NnVulkanDeviceData *data, NnNetConfig *netConfig, NnUint segmentIndex, NnSegmentConfig *segmentConfig, NnNetExecution *netExecution);
     ~NnVulkanDeviceSegment() override;
@@ -1,6 +1,13 @@
 #include <cassert>
 #include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <set>
+#include <stdexcept>
 #include "tokenizer.hpp"
+#include "nn/nn-core.hpp"
+#include "nn/nn-cpu-ops.hpp"
 
 #define DEV_TESTS false
 
@@ -119,6 +126,179 @@ void dev_testDecoderEmojiWithEos(Tokenizer *tokenizer) {
     printOk("decoderEmojiWithEos");
 }
 
+static unsigned int nextRandom(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+// A BPE-like vocabulary: the printable bytes, nMerges concatenations of two tokens and two special tokens
+void writeTestTokenizer(const char *path, const unsigned int nMerges, unsigned long long seed) {
+    std::vector<std::string> tokens;
+    std::set<std::string> known;
+    for (int c = 32; c < 127; c++)
+        tokens.push_back(std::string(1, (char)c));
+    tokens.push_back("\n");
+    known.insert(tokens.begin(), tokens.end());
+    std::vector<float> scores(tokens.size(), -1000.0f);
+    while (tokens.size() - 96 < nMerges) {
+        // Half of the parts are single bytes, so most tokens are short like in a real vocabulary
+        const std::string &a = tokens[nextRandom(&seed) % (nextRandom(&seed) % 2 == 0 ? 96 : tokens.size())];
+        const std::string &b = tokens[nextRandom(&seed) % (nextRandom(&seed) % 2 == 0 ? 96 : tokens.size())];
+        const std::string piece = a + b;
+        if (piece.size() > 16 || !known.insert(piece).second)
+            continue;
+        tokens.push_back(piece);
+        scores.push_back((float)(nextRandom(&seed) % 64)); // Many ties
+    }
+    const int bosId = (int)tokens.size();
+    tokens.push_back("<|bos|>");
+    tokens.push_back("<|eot|>");
+    scores.push_back(0.0f);
+    scores.push_back(0.0f);
+
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr)
+        throw std::runtime_error("Cannot create the test tokenizer");
+    const int header[] = {
+        TOK_VERSION, 1,
+        TOK_VOCAB_SIZE, (int)tokens.size(),
+        MAX_TOKEN_LENGTH, 16,
+        BOS_ID, bosId,
+        N_EOS_TOKENS, 1,
+        ADD_BOS, 1,
+    };
+    const int magic = 0x567124;
+    const int headerSize = (int)(sizeof(header) + 2 * sizeof(int));
+    const int eosId = bosId + 1;
+    fwrite(&magic, sizeof(int), 1, file);
+    fwrite(&headerSize, sizeof(int), 1, file);
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&eosId, sizeof(int), 1, file);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const int length = (int)tokens[i].size();
+        fwrite(&scores[i], sizeof(float), 1, file);
+        fwrite(&length, sizeof(int), 1, file);
+        fwrite(tokens[i].data(), length, 1, file);
+    }
+    fclose(file);
+}
+
+std::string randomText(const unsigned int length, unsigned long long seed) {
+    static const char *words[] = { "the ", "hello ", "world", "ab", "<|eot|>", "\n", "x", "  ", "qu", "!?" };
+    std::string text;
+    while (text.size() < length) {
+        if (nextRandom(&seed) % 3 == 0)
+            text += (char)(32 + nextRandom(&seed) % 95);
+        else
+            text += words[nextRandom(&seed) % (sizeof(words) / sizeof(words[0]))];
+    }
+    return text;
+}
+
+// The quadratic encoder: the best pair of all is merged and the array is shifted, one merge per scan
+std::vector<int> referenceEncode(Tokenizer *tokenizer, const char *text, bool isStart, bool addSpecialTokens) {
+    std::vector<int> tokens;
+    if (isStart && tokenizer->addBos && tokenizer->bosId >= 0)
+        tokens.push_back(tokenizer->bosId);
+    std::string piece;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (addSpecialTokens) {
+            const int specialTokenId = tokenizer->findSpecialTokenStartWith((char *)c);
+            if (specialTokenId >= 0) {
+                tokens.push_back(specialTokenId);
+                c += strlen(tokenizer->vocab[specialTokenId]) - 1;
+                continue;
+            }
+        }
+        piece += *c;
+        const int id = tokenizer->findRegularToken((char *)piece.c_str());
+        if (id != -1) {
+            tokens.push_back(id);
+            piece.clear();
+        }
+    }
+    while (true) {
+        float bestScore = -1e10f;
+        int bestId = -1;
+        int bestIndex = -1;
+        for (int i = 0; i + 1 < (int)tokens.size(); i++) {
+            const std::string pair = std::string(tokenizer->vocab[tokens[i]]) + tokenizer->vocab[tokens[i + 1]];
+            const int id = tokenizer->findRegularToken((char *)pair.c_str());
+            if (id != -1 && tokenizer->getTokenScore(id) > bestScore) {
+                bestScore = tokenizer->getTokenScore(id);
+                bestId = id;
+                bestIndex = i;
+            }
+        }
+        if (bestIndex == -1)
+            break;
+        tokens[bestIndex] = bestId;
+        tokens.erase(tokens.begin() + bestIndex + 1);
+    }
+    return tokens;
+}
+
+#define TEST_TOKENIZER_PATH "tokenizer-test.t"
+
+void testEncode() {
+    writeTestTokenizer(TEST_TOKENIZER_PATH, 2000, 1);
+    Tokenizer tokenizer(TEST_TOKENIZER_PATH);
+    remove(TEST_TOKENIZER_PATH);
+
+    std::vector<int> tokens(4096);
+    for (unsigned int t = 0; t < 8; t++) {
+        const std::string text = randomText(16 + t * 151, t + 1);
+        const bool addSpecialTokens = t % 2 == 0;
+        int nTokens;
+        tokenizer.encode((char *)text.c_str(), tokens.data(), &nTokens, t % 4 == 0, addSpecialTokens);
+        const std::vector<int> expected = referenceEncode(&tokenizer, text.c_str(), t % 4 == 0, addSpecialTokens);
+        compare("encode", expected.data(), tokens.data(), expected.size(), nTokens);
+    }
+}
+
+// tokenizer-test benchmark [tokenizer.t] [text file]
+void benchmarkEncode(const char *tokenizerPath, const char *textPath) {
+    if (tokenizerPath == nullptr) {
+        writeTestTokenizer(TEST_TOKENIZER_PATH, 60000, 1);
+        tokenizerPath = TEST_TOKENIZER_PATH;
+    }
+    Timer loadTimer;
+    Tokenizer tokenizer(tokenizerPath);
+    const NnUint loadMs = loadTimer.elapsedMiliseconds();
+    if (tokenizerPath == TEST_TOKENIZER_PATH)
+        remove(TEST_TOKENIZER_PATH);
+
+    std::string text;
+    if (textPath != nullptr) {
+        FILE *file = fopen(textPath, "rb");
+        if (file == nullptr)
+            throw std::runtime_error("Cannot open the text file");
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            text.append(buffer, n);
+        fclose(file);
+    } else {
+        text = randomText(30000, 7);
+    }
+
+    std::vector<int> tokens(text.size() + 2);
+    int nTokens;
+    Timer encodeTimer;
+    tokenizer.encode((char *)text.c_str(), tokens.data(), &nTokens, true, true);
+    const NnUint encodeUs = encodeTimer.elapsedMicroseconds();
+    Timer referenceTimer;
+    const std::vector<int> expected = referenceEncode(&tokenizer, text.c_str(), true, true);
+    const NnUint referenceUs = referenceTimer.elapsedMicroseconds();
+
+    printf("📄 Tokenizer: %u tokens, loaded in %u ms\n", tokenizer.vocabSize, loadMs);
+    printf("📄 Text: %zu bytes -> %d tokens\n", text.size(), nTokens);
+    printf("🕒 encode: %u μs, quadratic encoder: %u μs\n", encodeUs, referenceUs);
+    compare("benchmarkEncode", expected.data(), tokens.data(), expected.size(), nTokens);
+}
+
 void testChatTemplateDetection() {
     ChatTemplateGenerator t0(TEMPLATE_UNKNOWN, "{\% set loop_messages = messages \%}{\% for message in loop_messages \%}{\% set content = '<|start_header_id|>' + message['role'] + '<|end_header_id|>\n\n'+ message['content'] | trim + '<|eot_id|>' \%}{\% if loop.index0 == 0 \%}{\% set content = bos_token + content \%}{\% endif \%}{{ content }}{\% endfor \%}{\% if add_generation_prompt \%}{{ '<|start_header_id|>assistant<|end_header_id|>\n\n' }}{\% endif \%}", "<eos>");
     assert(t0.type == TEMPLATE_LLAMA3);
@@ -302,7 +482,110 @@ void testEosDetectorWithoutPadding() {
     printOk("eosDetectorWithLongPadding");
 }
 
-int main() {
+static int compareProbIndex(const void *a, const void *b) {
+    const ProbIndex *a_ = (const ProbIndex *)a;
+    const ProbIndex *b_ = (const ProbIndex *)b;
+    if (a_->prob > b_->prob) return -1;
+    if (a_->prob < b_->prob) return 1;
+    return 0;
+}
+
+static int referenceSampleTopp(float *logits, int n, float temperature, float topp, ProbIndex *probindex, float coin) {
+    // the previous implementation: a full qsort of the candidates
+    for (int i = 0; i < n; i++)
+        logits[i] /= temperature;
+    softmax_F32(logits, n);
+    const float cutoff = (1.0f - topp) / (n - 1);
+    int n0 = 0;
+    for (int i = 0; i < n; i++) {
+        if (logits[i] >= cutoff) {
+            probindex[n0].index = i;
+            probindex[n0].prob = logits[i];
+            n0++;
+        }
+    }
+    qsort(probindex, n0, sizeof(ProbIndex), compareProbIndex);
+    float cumulativeProb = 0.0f;
+    int lastIdx = n0 - 1;
+    for (int i = 0; i < n0; i++) {
+        cumulativeProb += probindex[i].prob;
+        if (cumulativeProb > topp) {
+            lastIdx = i;
+            break;
+        }
+    }
+    float r = coin * cumulativeProb;
+    float cdf = 0.0f;
+    for (int i = 0; i <= lastIdx; i++) {
+        cdf += probindex[i].prob;
+        if (r < cdf)
+            return probindex[i].index;
+    }
+    return probindex[lastIdx].index;
+}
+
+static void fillLogits(float *logits, int n, unsigned int seed, float peak) {
+    unsigned long long state = seed * 2654435761ull + 1ull;
+    for (int i = 0; i < n; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const float u = (float)((state >> 40) & 0xFFFFFF) / (float)0x1000000;
+        logits[i] = powf(u, peak) * 4.0f * peak;
+    }
+}
+
+void testSamplerTopp() {
+    const int n = 151936;
+    const float topp = 0.9f;
+    const unsigned long long seed = 12345ull;
+    const float temperatures[] = {0.3f, 0.7f, 1.0f};
+    const float peaks[] = {3.0f, 32.0f}; // a flat distribution and one with few likely tokens
+    std::vector<float> logits(n);
+    std::vector<float> copy(n);
+    std::vector<ProbIndex> probindex(n);
+
+    for (float peak : peaks)
+    for (float temperature : temperatures) {
+        Sampler sampler(n, temperature, topp, seed);
+        Sampler coins(n, temperature, topp, seed);
+        NnUint sampleUs = 0;
+        NnUint referenceUs = 0;
+        const int nSteps = 16;
+        for (int step = 0; step < nSteps; step++) {
+            fillLogits(logits.data(), n, step, peak);
+            std::memcpy(copy.data(), logits.data(), n * sizeof(float));
+
+            Timer timer;
+            const int token = sampler.sample(logits.data());
+            sampleUs += timer.elapsedMicroseconds();
+
+            timer.reset();
+            const int expected = referenceSampleTopp(copy.data(), n, temperature, topp, probindex.data(), coins.randomCoin());
+            referenceUs += timer.elapsedMicroseconds();
+            ASSERT_EQ(token, expected);
+        }
+        printf("🕒 sampler peak=%2.0f T=%.1f top-p=%.1f vocab=%d: %5u μs/token, qsort: %5u μs/token\n",
+            peak, temperature, topp, n, sampleUs / nSteps, referenceUs / nSteps);
+    }
+
+    // min-p keeps only tokens with p >= minp * pMax
+    float probs[] = {0.5f, 0.3f, 0.04f, 0.16f};
+    Sampler minpSampler(4, 1.0f, 0.0f, seed);
+    minpSampler.setMinP(0.2f);
+    float logits4[4];
+    for (int i = 0; i < 4; i++)
+        logits4[i] = logf(probs[i]);
+    minpSampler.toProbabilities(logits4);
+    assert(logits4[2] == 0.0f);
+    assert(fabsf(logits4[0] - 0.5f / 0.96f) < 1e-5f);
+    assert(fabsf(logits4[3] - 0.16f / 0.96f) < 1e-5f);
+    printOk("samplerTopp");
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "benchmark") == 0) {
+        benchmarkEncode(argc > 2 ? argv[2] : nullptr, argc > 3 ? argv[3] : nullptr);
+        return 0;
+    }
 #if DEV_TESTS
     Tokenizer tokenizer("models/llama3_2_1b_instruct_q40/dllama_tokenizer_llama3_2_1b_instruct_q40.t");
     dev_testEncode(&tokenizer);
@@ -311,9 +594,11 @@ int main() {
     dev_testDecoderEmojiStreamRecover(&tokenizer);
 #endif
 
+    testEncode();
     testChatTemplateDetection();
     testEosDetectorWithPadding();
     testEosDetectorWithLongPadding();
     testEosDetectorWithoutPadding();
+    testSamplerTopp();
     return 0;
 }
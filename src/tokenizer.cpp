@@ -10,6 +10,8 @@
 #include <stdexcept>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <queue>
 #include "nn/nn-core.hpp"
 #include "nn/nn-cpu-ops.hpp"
 #include "tokenizer.hpp"
@@ -147,9 +149,33 @@ Tokenizer::Tokenizer(const char* tokenizerPath)
     qsort(regularVocab, regularVocabSize, sizeof(TokenIndex), compareTokens);
 
     specialVocab = new TokenIndex[specialVocabSize];
+    std::memset(isSpecialTokenStart, 0, sizeof(isSpecialTokenStart));
     for (int i = 0; i < specialVocabSize; i++) {
         specialVocab[i].str = vocab[i + regularVocabSize];
         specialVocab[i].id = i + regularVocabSize;
+        isSpecialTokenStart[(unsigned char)vocab[i + regularVocabSize][0]] = true;
+    }
+
+    // Every split of a regular token into two regular tokens is a merge of the encoder. The ids are
+    // the ones findRegularToken returns, so the merges are the same as concatenating and searching
+    std::unordered_map<std::string, int> regularIds;
+    regularIds.reserve(regularVocabSize);
+    for (int i = 0; i < regularVocabSize; i++)
+        regularIds.emplace(vocab[i], findRegularToken(vocab[i]));
+    for (int i = 0; i < regularVocabSize; i++) {
+        const int mergedId = regularIds[vocab[i]];
+        if (mergedId != i)
+            continue; // A duplicate string
+        const std::string piece(vocab[i]);
+        for (size_t k = 1; k < piece.size(); k++) {
+            auto left = regularIds.find(piece.substr(0, k));
+            if (left == regularIds.end())
+                continue;
+            auto right = regularIds.find(piece.substr(k));
+            if (right == regularIds.end())
+                continue;
+            mergeIds[((std::uint64_t)left->second << 32) | (std::uint32_t)right->second] = mergedId;
+        }
     }
 
     strBufferSize = maxTokenLength * 2;
@@ -209,6 +235,16 @@ int Tokenizer::findRegularToken(char *piece) {
     return res != NULL ? res->id : -1;
 }
 
+int Tokenizer::findMerge(int left, int right) {
+    if ((unsigned int)left >= regularVocabSize || (unsigned int)right >= regularVocabSize) {
+        // Special tokens are not in the merge table, there are only a few of them in a prompt
+        snprintf(strBuffer, strBufferSize, "%s%s", vocab[left], vocab[right]);
+        return findRegularToken(strBuffer);
+    }
+    auto merge = mergeIds.find(((std::uint64_t)left << 32) | (std::uint32_t)right);
+    return merge != mergeIds.end() ? merge->second : -1;
+}
+
 bool Tokenizer::isEos(int token) {
     for (unsigned int i = 0; i < eosTokenIds.size(); i++) {
         if (token == eosTokenIds[i])
@@ -221,6 +257,17 @@ void Tokenizer::resetDecoder() {
     strBufferPos = 0;
 }
 
+std::string Tokenizer::getDecoderState() {
+    return std::string(strBuffer, strBufferPos);
+}
+
+void Tokenizer::setDecoderState(const std::string &state) {
+    assert(state.size() + 1 < strBufferSize);
+    std::memcpy(strBuffer, state.data(), state.size());
+    strBufferPos = state.size();
+    strBuffer[strBufferPos] = '\0';
+}
+
 char *Tokenizer::detokUtf8() {
     char* src = strBuffer;
     char* dst = utf8Buffer;
@@ -308,6 +355,21 @@ char *Tokenizer::decode(int token) {
     return detokUtf8();
 }
 
+typedef struct {
+    float score;
+    int left;
+    int right;
+    int leftId;
+    int rightId;
+    int mergedId;
+} TokenMerge;
+
+struct TokenMergeOrder {
+    bool operator()(const TokenMerge &a, const TokenMerge &b) const {
+        return a.score != b.score ? a.score < b.score : a.left > b.left;
+    }
+};
+
 void Tokenizer::encode(char *text, int *tokens, int *nTokens, bool isStart, bool addSpecialTokens) {
 #if DEBUG_TOKENIZER_BENCHMARK
     Timer startTime;
@@ -323,7 +385,7 @@ void Tokenizer::encode(char *text, int *tokens, int *nTokens, bool isStart, bool
         tokens[(*nTokens)++] = bosId;
 
     for (char *c = text; *c != '\0'; c++) {
-        if (addSpecialTokens) {
+        if (addSpecialTokens && isSpecialTokenStart[(unsigned char)*c]) {
             int specialTokenId = findSpecialTokenStartWith(c);
             if (specialTokenId >= 0) {
                 tokens[(*nTokens)++] = specialTokenId;
@@ -346,36 +408,49 @@ void Tokenizer::encode(char *text, int *tokens, int *nTokens, bool isStart, bool
 
     assert(strLen == 0);
 
-    // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1) {
-        float best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
-
-        for (int i=0; i < (*nTokens-1); i++) {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            snprintf(strBuffer, strBufferSize, "%s%s", vocab[tokens[i]], vocab[tokens[i+1]]);
-            int id = findRegularToken(strBuffer);
-            if (id != -1 && vocabScores[id] > best_score) {
-                // this merge pair exists in vocab! record its score and position
-                best_score = vocabScores[id];
-                best_id = id;
-                best_idx = i;
-            }
-        }
-
-        if (best_idx == -1) {
-            break; // we couldn't find any more pairs to merge, so we're done
-        }
+    // merge the best consecutive pair each time, according the scores in vocab_scores. The tokens
+    // are a linked list and the candidate pairs a heap: the best score first, then the leftmost pair
+    const int n = *nTokens;
+    std::vector<int> prev(n);
+    std::vector<int> next(n);
+    std::priority_queue<TokenMerge, std::vector<TokenMerge>, TokenMergeOrder> merges;
+    auto pushMerge = [&](int left, int right) {
+        const int id = findMerge(tokens[left], tokens[right]);
+        if (id != -1 && vocabScores[id] > -1e10f)
+            merges.push({ vocabScores[id], left, right, tokens[left], tokens[right], id });
+    };
+    for (int i = 0; i < n; i++) {
+        prev[i] = i - 1;
+        next[i] = i + 1 < n ? i + 1 : -1;
+    }
+    for (int i = 0; i + 1 < n; i++)
+        pushMerge(i, i + 1);
+
+    while (!merges.empty()) {
+        const TokenMerge merge = merges.top();
+        merges.pop();
+        // A merge of a neighbour changed the pair
+        if (next[merge.left] != merge.right || tokens[merge.left] != merge.leftId || tokens[merge.right] != merge.rightId)
+            continue;
+
+        tokens[merge.left] = merge.mergedId;
+        tokens[merge.right] = -1;
+        next[merge.left] = next[merge.right];
+        if (next[merge.right] != -1)
+            prev[next[merge.right]] = merge.left;
+        next[merge.right] = -1;
+        if (prev[merge.left] != -1)
+            pushMerge(prev[merge.left], merge.left);
+        if (next[merge.left] != -1)
+            pushMerge(merge.left, next[merge.left]);
+    }
 
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx+1; i < (*nTokens-1); i++) {
-            tokens[i] = tokens[i+1];
-        }
-        (*nTokens)--; // token length decreased
+    int nMerged = 0;
+    for (int i = 0; i < n; i++) {
+        if (tokens[i] != -1)
+            tokens[nMerged++] = tokens[i];
     }
+    *nTokens = nMerged;
 
 #if DEBUG_TOKENIZER_BENCHMARK
     NnUint duration = startTime.elapsedMicroseconds();
@@ -415,61 +490,98 @@ int sample_mult(float* probabilities, int n, float coin) {
     return n - 1; // in case of rounding errors
 }
 
-int compare(const void* a, const void* b) {
-    ProbIndex* a_ = (ProbIndex*) a;
-    ProbIndex* b_ = (ProbIndex*) b;
-    if (a_->prob > b_->prob) return -1;
-    if (a_->prob < b_->prob) return 1;
-    return 0;
+static bool isMoreProbable(const ProbIndex &a, const ProbIndex &b) {
+    return a.prob > b.prob;
 }
 
-int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex, float coin) {
-    // top-p sampling (or "nucleus sampling") samples from the smallest set of
-    // tokens that exceed probability topp. This way we never sample tokens that
-    // have very low probabilities and are less likely to go "off the rails".
-    // coin is a random number in [0, 1), usually from random_f32()
-
-    int n0 = 0;
-    // quicksort indices in descending order of probabilities
+static int selectNucleus(const float *probabilities, int n, float topp, float minp, ProbIndex *probindex, float *mass) {
+    // moves the smallest set of the most likely tokens that exceed probability topp to the front
+    // of probindex in descending order and returns its length
     // values smaller than (1 - topp) / (n - 1) cannot be part of the result
-    // so for efficiency we crop these out as candidates before sorting
-    const float cutoff = (1.0f - topp) / (n - 1);
+    float cutoff = (1.0f - topp) / (n - 1);
+    if (minp > 0.0f) {
+        // min-p: tokens less likely than minp * p(most likely token) are dropped
+        float maxProb = 0.0f;
+        for (int i = 0; i < n; i++)
+            maxProb = std::max(maxProb, probabilities[i]);
+        cutoff = std::max(cutoff, minp * maxProb);
+    }
+    int n0 = 0;
     for (int i = 0; i < n; i++) {
-        if (probabilities[i] >= cutoff) {
-            probindex[n0].index = i;
-            probindex[n0].prob = probabilities[i];
-            n0++;
+        // branchless, the outcome is hard to predict when many tokens are close to the cutoff
+        probindex[n0].index = i;
+        probindex[n0].prob = probabilities[i];
+        n0 += probabilities[i] >= cutoff ? 1 : 0;
+    }
+
+    float cumulativeProb = 0.0f;
+    if (topp >= 1.0f) {
+        // no nucleus, the order of the candidates doesn't matter
+        for (int i = 0; i < n0; i++)
+            cumulativeProb += probindex[i].prob;
+        *mass = cumulativeProb;
+        return n0;
+    }
+
+    // quickselect on the probability mass: [0, lo) are more likely than [lo, hi), hold massAbove
+    // and don't exceed topp, the nucleus ends in [lo, hi)
+    int lo = 0;
+    int hi = n0;
+    float massAbove = 0.0f;
+    while (hi - lo > 32) {
+        const int mid = lo + (hi - lo) / 2;
+        std::nth_element(probindex + lo, probindex + mid, probindex + hi, isMoreProbable);
+        float mass = 0.0f;
+        for (int i = lo; i < mid; i++)
+            mass += probindex[i].prob;
+        if (massAbove + mass > topp) {
+            hi = mid;
+        } else {
+            massAbove += mass;
+            lo = mid;
         }
     }
-    qsort(probindex, n0, sizeof(ProbIndex), compare);
 
-    // truncate the list where cumulative probability exceeds topp
-    float cumulative_prob = 0.0f;
-    int last_idx = n0 - 1; // in case of rounding errors consider all elements
-    for (int i = 0; i < n0; i++) {
-        cumulative_prob += probindex[i].prob;
-        if (cumulative_prob > topp) {
-            last_idx = i;
-            break; // we've exceeded topp by including last_idx
+    // only the nucleus is sorted, the result is the same as after sorting all candidates
+    std::sort(probindex, probindex + hi, isMoreProbable);
+    for (int i = 0; i < hi; i++) {
+        cumulativeProb += probindex[i].prob;
+        if (cumulativeProb > topp) {
+            *mass = cumulativeProb;
+            return i + 1; // we've exceeded topp by including i
         }
     }
+    *mass = cumulativeProb; // in case of rounding errors consider all elements
+    return hi;
+}
+
+int sample_topp(float* probabilities, int n, float topp, float minp, ProbIndex* probindex, float coin) {
+    // top-p sampling (or "nucleus sampling") samples from the smallest set of
+    // tokens that exceed probability topp. This way we never sample tokens that
+    // have very low probabilities and are less likely to go "off the rails".
+    // coin is a random number in [0, 1), usually from random_f32()
+    float cumulativeProb;
+    const int n0 = selectNucleus(probabilities, n, topp, minp, probindex, &cumulativeProb);
+    if (n0 == 0)
+        return sample_argmax(probabilities, n);
 
     // sample from the truncated list
-    float r = coin * cumulative_prob;
+    float r = coin * cumulativeProb;
     float cdf = 0.0f;
-    for (int i = 0; i <= last_idx; i++) {
+    for (int i = 0; i < n0; i++) {
         cdf += probindex[i].prob;
         if (r < cdf) {
             return probindex[i].index;
         }
     }
-    return probindex[last_idx].index; // in case of rounding errors
+    return probindex[n0 - 1].index; // in case of rounding errors
 }
 
 Sampler::Sampler(int vocab_size, float temperature, float topp, unsigned long long rngSeed) {
     this->vocab_size = vocab_size;
     this->temperature = temperature;
     this->topp = topp;
+    this->minp = 0.0f;
     this->rngState = rngSeed;
     // buffer only used with nucleus sampling; may not need but it's ~small
     probindex = new ProbIndex[vocab_size];
@@ -490,18 +602,19 @@ int Sampler::sample(float* logits) {
         next = sample_argmax(logits, vocab_size);
     } else {
         // apply the temperature to the logits
-        for (int q=0; q < vocab_size; q++) { logits[q] /= temperature; }
+        const float invTemperature = 1.0f / temperature;
+        for (int q=0; q < vocab_size; q++) { logits[q] *= invTemperature; }
         // apply softmax to the logits to get the probabilities for next token
         softmax_F32(logits, vocab_size);
         // flip a (float) coin (this is our source of entropy for sampling)
         float coin = randomF32(&rngState);
         // we sample from this distribution to get the next token
-        if (topp <= 0 || topp >= 1) {
+        if ((topp <= 0 || topp >= 1) && minp <= 0) {
             // simply sample from the predicted probability distribution
             next = sample_mult(logits, vocab_size, coin);
         } else {
-            // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, vocab_size, topp, probindex, coin);
+            // top-p (nucleus) / min-p sampling, clamping the least likely tokens to zero
+            next = sample_topp(logits, vocab_size, getNucleusTopp(), minp, probindex, coin);
         }
     }
 #if DEBUG_SAMPLER_BENCHMARK
@@ -511,10 +624,40 @@ int Sampler::sample(float* logits) {
     return next;
 }
 
+void Sampler::toProbabilities(float *logits) {
+    assert(temperature > 0.0f);
+    const float invTemperature = 1.0f / temperature;
+    for (int q = 0; q < vocab_size; q++) { logits[q] *= invTemperature; }
+    softmax_F32(logits, vocab_size);
+    if ((topp <= 0 || topp >= 1) && minp <= 0)
+        return;
+
+    // the same candidates as sample_topp, other tokens get zero probability
+    float cumulativeProb;
+    const int n0 = selectNucleus(logits, vocab_size, getNucleusTopp(), minp, probindex, &cumulativeProb);
+    if (n0 == 0)
+        return;
+    std::memset(logits, 0, vocab_size * sizeof(float));
+    for (int i = 0; i < n0; i++)
+        logits[probindex[i].index] = probindex[i].prob / cumulativeProb;
+}
+
+int Sampler::sampleProbabilities(float *probs) {
+    return sample_mult(probs, vocab_size, randomF32(&rngState));
+}
+
+float Sampler::randomCoin() {
+    return randomF32(&rngState);
+}
+
 void Sampler::setTemp(float temp) {
     this->temperature = temp;
 }
 
+void Sampler::setMinP(float minp) {
+    this->minp = minp;
+}
+
 void Sampler::setSeed(unsigned long long seed) {
     this->rngState = seed;
 }
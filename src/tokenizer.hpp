@@ -2,7 +2,9 @@
 #define TOKENIZER_HPP
 
 #include <cstdio>
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 typedef struct {
@@ -45,7 +47,9 @@ private:
     char *strBuffer;
     char *utf8Buffer;
     size_t strBufferPos;
-
+    // (left << 32 | right) -> the regular token of the concatenated pair, built once for the encoder
+    std::unordered_map<std::uint64_t, int> mergeIds;
+    bool isSpecialTokenStart[256];
 
 public:
     std::vector<int> eosTokenIds;
@@ -60,10 +64,16 @@ public:
     void printHeader();
     int findSpecialTokenStartWith(char *piece);
     int findRegularToken(char *piece);
+    // The token of the concatenation of two tokens or -1
+    int findMerge(int left, int right);
+    float getTokenScore(int tokenId) const { return vocabScores[tokenId]; }
     void encode(char *text, int *tokens, int *nTokens, bool isStart, bool addSpecialTokens);
     bool isEos(int token);
     char *decode(int token);
     void resetDecoder();
+    // Pending bytes of the decoder, lets several sequences share one tokenizer
+    std::string getDecoderState();
+    void setDecoderState(const std::string &state);
 
 private:
     char *detokUtf8();
@@ -80,13 +90,23 @@ private:
     ProbIndex *probindex;
     float temperature;
     float topp;
+    float minp;
     unsigned long long rngState;
+    float getNucleusTopp() const { return (topp <= 0 || topp >= 1) ? 1.0f : topp; }
 
 public:
     Sampler(int vocab_size, float temperature, float topp, unsigned long long rngSeed);
     ~Sampler();
     int sample(float *logits);
+    bool isGreedy() const { return temperature == 0.0f; }
+    // Converts logits to the distribution sample() draws from (temperature, softmax, top-p, min-p)
+    void toProbabilities(float *logits);
+    // Samples from probabilities that sum to 1
+    int sampleProbabilities(float *probs);
+    float randomCoin();
     void setTemp(float temp);
+    // 0 disables min-p, otherwise tokens less likely than minp * p(most likely token) are dropped
+    void setMinP(float minp);
     void setSeed(unsigned long long rngSeed);
 };
 